@@ -23,7 +23,52 @@ PLEASE FILL OUT THIS SECTION PRIOR TO SUBMISSION
 #include <iostream>
 #include <vector>
 #include <fstream>
+#include <sstream>
+#include <string>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <thread>
 #include <cmath>
+#include <cctype>
+#include <cerrno>
+#include <climits>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define IMGPROC_POSIX
+#include <dirent.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <signal.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#endif
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define IMGPROC_X86_SIMD
+#include <immintrin.h>
+#define SIMD_TARGET_SSE41 __attribute__((target("sse4.1")))
+#define SIMD_TARGET_AVX2 __attribute__((target("avx2")))
+#define SIMD_TARGET_AVX512 __attribute__((target("avx512f,avx512bw")))
+#endif
+
 using namespace std;
 
 //***************************************************************************************************//
@@ -239,905 +284,13007 @@ bool write_image(string filename, const vector<vector<Pixel>> &image)
 // --------------------------------------------------------------------------------------------------//
 
 //***************************************************************************************************//
-// PROCESSES 1 - 10
+// IMAGE BUFFER
 //***************************************************************************************************//
 
-// ________________________________________________________ PROCESS 1 Vignette
+// ________________________________________________________ Image structure
+
+// Channel layouts an Image can store
+enum PixelLayout
+{
+    LAYOUT_BGR,   // interleaved blue, green, red (BMP order, used by the process functions)
+    LAYOUT_RGB,   // interleaved red, green, blue
+    LAYOUT_PLANAR // three separate planes in blue, green, red order
+};
+
+// Rows (and planes) start on a multiple of this many bytes
+const int IMAGE_ALIGNMENT = 64;
+
+// ________________________________________________________ Allocation counters
+
+// Pixel buffers allocated by Image, whether the buffer pool reused one or not. A batch that reuses
+// its buffers allocates a fixed number of them however many images it processes.
+struct AllocationCounters
+{
+    atomic<long long> buffers;
+    atomic<long long> bytes;
+};
 
 /**
- * Description: Adds vignette effect to image (dark corners)
- * @param 2d vector of type Pixel
- * @return a new 2d vector of type pixel modified
+ * Description: Gets the process wide allocation counters
+ * @return reference to the AllocationCounters
  */
 
-vector<vector<Pixel>> process_1(const vector<vector<Pixel>> &image)
+AllocationCounters &image_allocations()
 {
-    int height = image.size();
-    int width = image[0].size();
+    static AllocationCounters counters; // zero initialized as a static
+    return counters;
+}
 
-    vector<vector<Pixel>> new_img(height, vector<Pixel>(width));
+// ________________________________________________________ Buffer pool
 
-    Pixel this_pixel;
-    int red;
-    int green;
-    int blue;
+// Buffers at least this big get their own mapping, aligned to and advised for huge pages (Linux)
+const size_t HUGE_PAGE_BYTES = 2 * 1024 * 1024;
 
-    double distance;
-    double scaling_factor;
+// Free bytes the pool keeps for reuse unless IMGPROC_POOL_MB says otherwise
+const size_t DEFAULT_POOL_BYTES = size_t(512) * 1024 * 1024;
 
-    for (int row = 0; row < height; row++)
-    {
-        for (int col = 0; col < width; col++)
-        {
-            distance = sqrt(pow(col - width / 2, 2) + pow(row - height / 2, 2));
-            scaling_factor = (height - distance) / height;
-            this_pixel = image[row][col];
-            red = this_pixel.red * scaling_factor;
-            green = this_pixel.green * scaling_factor;
-            blue = this_pixel.blue * scaling_factor;
+// What the buffer pool has done since the program started
+struct BufferPoolStats
+{
+    long long requests;        // buffers handed out
+    long long hits;            // of those, buffers reused from the pool
+    long long live_bytes;      // bytes handed out and not yet returned
+    long long peak_live_bytes; // most bytes handed out at once
+    long long cached_bytes;    // free bytes held for reuse
+    long long system_bytes;    // bytes taken from the system
+};
 
-            new_img[row][col].red = red;
-            new_img[row][col].green = green;
-            new_img[row][col].blue = blue;
-        }
+/**
+ * Description: Rounds a buffer size up to its size class. Classes are four per power of two (at
+ * most 25% waste) and at least a page, so an image a few rows taller or shorter than the last
+ * one reuses its buffer. Huge page buffers are whole huge pages.
+ * @param size_t bytes wanted
+ * @return size_t class size
+ */
+
+size_t buffer_size_class(size_t bytes)
+{
+    size_t step = 4096;
+    while (step * 8 <= bytes)
+    {
+        step *= 2;
     }
-    return new_img;
+    size_t size = (max<size_t>(bytes, 1) + step - 1) / step * step;
+    if (size >= HUGE_PAGE_BYTES)
+    {
+        size = (size + HUGE_PAGE_BYTES - 1) / HUGE_PAGE_BYTES * HUGE_PAGE_BYTES;
+    }
+    return size;
 }
-// ________________________________________________________ PROCESS 2 Clarendon
 
 /**
- * Description: Adds Clarendon effect to image (darks darker and lights lighter) by a scaling factor
- * @param 2d vector of type Pixel
- * @param floating point scaling factor number
- * @return a new 2d vector of type pixel modified
+ * Description: Keeps freed pixel buffers, by size class, for the next Image that needs one, so a
+ * run that keeps making images of similar sizes stops going to the allocator (and the kernel,
+ * which zeroes every fresh page) after the first few. Thread safe.
  */
 
-vector<vector<Pixel>> process_2(const vector<vector<Pixel>> &image, double scaling_factor)
+class BufferPool
 {
-    int height = image.size();
-    int width = image[0].size();
-
-    vector<vector<Pixel>> new_img(height, vector<Pixel>(width));
+public:
+    BufferPool()
+        : limit(DEFAULT_POOL_BYTES)
+    {
+        memset(&counts, 0, sizeof(counts));
+        const char *value = getenv("IMGPROC_POOL_MB");
+        if (value != NULL && value[0] >= '0' && value[0] <= '9')
+        {
+            limit = size_t(atol(value)) * 1024 * 1024;
+        }
+    }
 
-    Pixel this_pixel;
-    int red;
-    int green;
-    int blue;
+    ~BufferPool()
+    {
+        for (size_t i = 0; i < free_blocks.size(); i++)
+        {
+            release_to_system(free_blocks[i]);
+        }
+    }
 
-    double avg_val;
+    /**
+     * Description: Gets a zero filled buffer of at least `bytes`, aligned to IMAGE_ALIGNMENT
+     * @param size_t bytes wanted
+     * @param pointer that receives the address to hand back to release()
+     * @param pointer that receives the usable, aligned address
+     * @param size_t that receives the usable size (the size class)
+     * @return nothing
+     */
 
-    for (int row = 0; row < height; row++)
+    void acquire(size_t bytes, unsigned char *&storage, unsigned char *&data, size_t &capacity)
     {
-        for (int col = 0; col < width; col++)
+        capacity = buffer_size_class(bytes);
+        Block block = {NULL, NULL, capacity};
+        {
+            lock_guard<mutex> lock(state);
+            counts.requests++;
+            for (size_t i = free_blocks.size(); i-- > 0;)
+            {
+                if (free_blocks[i].capacity == capacity)
+                {
+                    block = free_blocks[i];
+                    free_blocks.erase(free_blocks.begin() + i);
+                    counts.hits++;
+                    counts.cached_bytes -= capacity;
+                    break;
+                }
+            }
+            counts.live_bytes += capacity;
+            counts.peak_live_bytes = max(counts.peak_live_bytes, counts.live_bytes);
+        }
+
+        if (block.storage != NULL)
+        {
+            // Callers count on a new buffer reading as zero, as a fresh one does
+            memset(block.data, 0, capacity);
+        }
+        else
         {
-            this_pixel = image[row][col];
-            red = this_pixel.red;
-            green = this_pixel.green;
-            blue = this_pixel.blue;
-            avg_val = (red + green + blue) / 3;
+            block = allocate_from_system(capacity);
+            lock_guard<mutex> lock(state);
+            counts.system_bytes += capacity;
+        }
+        storage = block.storage;
+        data = block.data;
+    }
+
+    /**
+     * Description: Takes back a buffer from acquire(). It is kept for reuse while the pool holds
+     * less than its limit; the oldest free buffers go back to the system to make room.
+     * @param address received as `storage`, NULL does nothing
+     * @param usable address received as `data`
+     * @param size_t usable size received as `capacity`
+     * @return nothing
+     */
 
-            if (avg_val > 169)
+    void release(unsigned char *storage, unsigned char *data, size_t capacity)
+    {
+        if (storage == NULL)
+        {
+            return;
+        }
+        Block block = {storage, data, capacity};
+        vector<Block> evicted;
+        {
+            lock_guard<mutex> lock(state);
+            counts.live_bytes -= capacity;
+            if (capacity > limit)
             {
-                red = (255 - (255 - red) * scaling_factor);
-                green = (255 - (255 - green) * scaling_factor);
-                blue = (255 - (255 - blue) * scaling_factor);
+                evicted.push_back(block);
             }
-            if (avg_val < 90)
+            else
             {
-                red = red * scaling_factor;
-                green = green * scaling_factor;
-                blue = blue * scaling_factor;
+                free_blocks.push_back(block);
+                counts.cached_bytes += capacity;
+                while (size_t(counts.cached_bytes) > limit)
+                {
+                    evicted.push_back(free_blocks.front());
+                    counts.cached_bytes -= free_blocks.front().capacity;
+                    free_blocks.erase(free_blocks.begin());
+                }
             }
-
-            new_img[row][col].red = red;
-            new_img[row][col].green = green;
-            new_img[row][col].blue = blue;
+        }
+        for (size_t i = 0; i < evicted.size(); i++)
+        {
+            release_to_system(evicted[i]);
         }
     }
-    return new_img;
-}
-// ________________________________________________________ PROCESS 3 Grayscale
 
-/**
- * Description: Grayscale image.
- * @param 2d vector of type Pixel
- * @return a new 2d vector of type pixel modified
- */
+    BufferPoolStats stats()
+    {
+        lock_guard<mutex> lock(state);
+        return counts;
+    }
 
-vector<vector<Pixel>> process_3(const vector<vector<Pixel>> &image)
-{
-    int height = image.size();
-    int width = image[0].size();
+private:
+    struct Block
+    {
+        unsigned char *storage;
+        unsigned char *data;
+        size_t capacity;
+    };
 
-    vector<vector<Pixel>> new_img(height, vector<Pixel>(width));
+    mutex state; // guards everything below
+    vector<Block> free_blocks; // oldest first
+    BufferPoolStats counts;
+    size_t limit;
 
-    Pixel this_pixel;
-    int red;
-    int green;
-    int blue;
-    int gray_val;
+    BufferPool(const BufferPool &);
+    BufferPool &operator=(const BufferPool &);
 
-    for (int row = 0; row < height; row++)
+    static Block allocate_from_system(size_t capacity)
     {
-        for (int col = 0; col < width; col++)
+        Block block = {NULL, NULL, capacity};
+#if defined(IMGPROC_POSIX) && defined(__linux__)
+        if (capacity >= HUGE_PAGE_BYTES)
         {
-            this_pixel = image[row][col];
-            red = this_pixel.red;
-            green = this_pixel.green;
-            blue = this_pixel.blue;
-
-            gray_val = (red + green + blue) / 3;
+            // Map an extra huge page so the buffer can start on a huge page boundary, then
+            // return the unused head and tail
+            size_t mapped = capacity + HUGE_PAGE_BYTES;
+            void *address = mmap(nullptr, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (address == MAP_FAILED)
+            {
+                throw bad_alloc();
+            }
+            size_t start = reinterpret_cast<size_t>(address);
+            size_t head = (HUGE_PAGE_BYTES - start % HUGE_PAGE_BYTES) % HUGE_PAGE_BYTES;
+            unsigned char *aligned = static_cast<unsigned char *>(address) + head;
+            if (head > 0)
+            {
+                munmap(address, head);
+            }
+            munmap(aligned + capacity, mapped - head - capacity);
+            madvise(aligned, capacity, MADV_HUGEPAGE);
+            block.storage = aligned;
+            block.data = aligned;
+            return block;
+        }
+#endif
+        // Over-allocate so the first row can be moved up to an aligned address
+        block.storage = new unsigned char[capacity + IMAGE_ALIGNMENT]();
+        size_t misalignment = reinterpret_cast<size_t>(block.storage) % IMAGE_ALIGNMENT;
+        block.data = block.storage + (misalignment == 0 ? 0 : IMAGE_ALIGNMENT - misalignment);
+        return block;
+    }
 
-            new_img[row][col].red = gray_val;
-            new_img[row][col].green = gray_val;
-            new_img[row][col].blue = gray_val;
+    static void release_to_system(const Block &block)
+    {
+#if defined(IMGPROC_POSIX) && defined(__linux__)
+        // Every buffer of a huge page or more is a mapping of exactly its capacity
+        if (block.capacity >= HUGE_PAGE_BYTES)
+        {
+            munmap(block.storage, block.capacity);
+            return;
         }
+#endif
+        delete[] block.storage;
     }
-    return new_img;
-}
-// ________________________________________________________ PROCESS 4 Rotate 90 degrees
+};
 
 /**
- * Description: Rotate image 90 degrees clockwise
- * @param 2d vector of type Pixel
- * @return a new 2d vector of type pixel modified
+ * Description: Gets the pool every Image takes its pixel buffer from
+ * @return reference to the BufferPool
  */
 
-vector<vector<Pixel>> process_4(const vector<vector<Pixel>> &image)
+BufferPool &buffer_pool()
 {
-    int height = image.size();
-    int width = image[0].size();
+    static BufferPool pool;
+    return pool;
+}
 
-    vector<vector<Pixel>> new_img(width, vector<Pixel>(height));
+/**
+ * Description: An image stored as one aligned allocation of 8-bit channels. Each row starts
+ * `stride` bytes after the previous one, so rows are contiguous and cache line aligned.
+ * Planar images store the blue, green and red planes one after another, each `height` rows.
+ * reshape() and copy assignment keep the allocation when it is big enough, so an Image can be
+ * reused as a buffer for images of different sizes. Buffers come from and go back to the
+ * buffer pool.
+ */
 
-    Pixel this_pixel;
+class Image
+{
+public:
+    int width;
+    int height;
+    PixelLayout layout;
+    size_t stride;
+
+    Image()
+        : width(0), height(0), layout(LAYOUT_BGR), stride(0), storage(nullptr), data(nullptr), bytes(0), capacity(0)
+    {
+    }
 
-    for (int row = 0; row < height; row++)
+    Image(int width_pixels, int height_pixels, PixelLayout pixel_layout = LAYOUT_BGR)
+        : width(0), height(0), layout(pixel_layout), stride(0), storage(nullptr), data(nullptr), bytes(0), capacity(0)
     {
-        for (int col = 0; col < width; col++)
-        {
-            this_pixel = image[row][col];
-            new_img[col][(height - 1) - row] = this_pixel;
-        }
+        reshape(width_pixels, height_pixels, pixel_layout);
     }
-    return new_img;
-}
 
-// ________________________________________________________ PROCESS 5 Rotate multiple 90 degrees
+    Image(const Image &other)
+        : width(0), height(0), layout(other.layout), stride(0), storage(nullptr), data(nullptr), bytes(0), capacity(0)
+    {
+        reshape(other.width, other.height, other.layout);
+        copy(other.data, other.data + bytes, data);
+    }
 
-/**
- * Description: Rotate image by 90 degrees.
- * @param 2d vector of type Pixel
- * @return a new 2d vector of type pixel modified
- */
+    Image(Image &&other)
+        : width(other.width), height(other.height), layout(other.layout), stride(other.stride),
+          storage(other.storage), data(other.data), bytes(other.bytes), capacity(other.capacity)
+    {
+        other.release_ownership();
+    }
 
-vector<vector<Pixel>> rotate_by_90(const vector<vector<Pixel>> &image)
-{
-    int height = image.size();
-    int width = image[0].size();
+    Image &operator=(const Image &other)
+    {
+        if (this != &other)
+        {
+            reshape(other.width, other.height, other.layout);
+            copy(other.data, other.data + bytes, data);
+        }
+        return *this;
+    }
 
-    vector<vector<Pixel>> new_img(width, vector<Pixel>(height));
+    Image &operator=(Image &&other)
+    {
+        if (this != &other)
+        {
+            buffer_pool().release(storage, data, capacity);
+            width = other.width;
+            height = other.height;
+            layout = other.layout;
+            stride = other.stride;
+            storage = other.storage;
+            data = other.data;
+            bytes = other.bytes;
+            capacity = other.capacity;
+            other.release_ownership();
+        }
+        return *this;
+    }
 
-    Pixel this_pixel;
+    void swap(Image &other)
+    {
+        swap_with(other);
+    }
 
-    for (int row = 0; row < height; row++)
+    /**
+     * Description: Changes the size and layout. The pixel buffer is kept when it is big enough and
+     * replaced (zero filled) otherwise, so the pixel values are only meaningful after the caller
+     * writes them.
+     * @param int width in pixels
+     * @param int height in pixels
+     * @param PixelLayout
+     * @return nothing
+     */
+
+    void reshape(int width_pixels, int height_pixels, PixelLayout pixel_layout = LAYOUT_BGR)
     {
-        for (int col = 0; col < width; col++)
+        width = width_pixels;
+        height = height_pixels;
+        layout = pixel_layout;
+        size_t row_bytes = size_t(width) * pixel_bytes();
+        stride = (row_bytes + IMAGE_ALIGNMENT - 1) / IMAGE_ALIGNMENT * IMAGE_ALIGNMENT;
+        size_t rows = layout == LAYOUT_PLANAR ? size_t(height) * 3 : size_t(height);
+        bytes = stride * rows;
+        if (bytes > capacity)
         {
-            this_pixel = image[row][col];
-            new_img[col][(height - 1) - row] = this_pixel;
+            allocate(bytes);
         }
     }
-    return new_img;
-}
 
-/**
- * Description: Rotates image by a specified number of multiples of 90 degrees clockwise
- * @param 2d vector of type Pixel
- * @param integer multiple
- * @return a new 2d vector of type pixel modified
- */
+    ~Image()
+    {
+        buffer_pool().release(storage, data, capacity);
+    }
 
-vector<vector<Pixel>> process_5(const vector<vector<Pixel>> &image, int num)
-{
+    bool empty() const
+    {
+        return width == 0 || height == 0;
+    }
 
-    int angle = num * 90;
+    // Number of bytes per pixel in one row (3 interleaved, 1 per plane)
+    int pixel_bytes() const
+    {
+        return layout == LAYOUT_PLANAR ? 1 : 3;
+    }
 
-    if (angle % 360 == 0)
+    // Total size of the pixel allocation in bytes
+    size_t size_bytes() const
     {
-        return image;
+        return bytes;
     }
 
-    if (angle % 360 == 90)
+    unsigned char *row(int r)
     {
-        // rotate by 90
-        return rotate_by_90(image);
+        return data + r * stride;
     }
-    if (angle % 360 == 180)
+
+    const unsigned char *row(int r) const
     {
-        // rotate by 180
-        return rotate_by_90(rotate_by_90(image));
+        return data + r * stride;
     }
-    else
+
+    // Row r of plane `channel` (0 blue, 1 green, 2 red) of a planar image
+    unsigned char *plane_row(int channel, int r)
     {
-        return rotate_by_90(rotate_by_90(rotate_by_90(image)));
+        return data + (size_t(channel) * height + r) * stride;
     }
-}
 
-// ________________________________________________________ PROCESS 6 Enlarge
+    const unsigned char *plane_row(int channel, int r) const
+    {
+        return data + (size_t(channel) * height + r) * stride;
+    }
 
-/**
- * Description: Enlarges the image in the x and y direction
- * @param 2d vector of type Pixel
- * @param integer number to scale width (x)
- * @param integer number to scale height (y)
- * @return a new 2d vector of type pixel modified
- */
+private:
+    unsigned char *storage;
+    unsigned char *data;
+    size_t bytes;
+    size_t capacity; // usable bytes at data, the buffer's size class
 
-vector<vector<Pixel>> process_6(const vector<vector<Pixel>> &image, int x_scale, int y_scale)
-{
-    int height = image.size();
-    int new_height = height * y_scale;
-    int width = image[0].size();
-    int new_width = width * x_scale;
-    Pixel this_pixel;
-    int reduced_col;
-    int reduced_row;
-    vector<vector<Pixel>> new_img(new_height, vector<Pixel>(new_width));
-    for (int row = 0; row < new_height; row++)
+    void allocate(size_t buffer_bytes)
     {
-        for (int col = 0; col < new_width * x_scale; col++)
-        {
-            reduced_col = col / x_scale;
-            reduced_row = row / y_scale;
-            this_pixel = image[reduced_row][reduced_col];
-            new_img[row][col] = this_pixel;
-        }
+        buffer_pool().release(storage, data, capacity);
+        storage = nullptr;
+        data = nullptr;
+        capacity = 0;
+        buffer_pool().acquire(buffer_bytes, storage, data, capacity);
+        image_allocations().buffers++;
+        image_allocations().bytes += buffer_bytes;
     }
-    return new_img;
-}
 
-// ________________________________________________________ PROCESS 7 High contrast
+    void release_ownership()
+    {
+        width = 0;
+        height = 0;
+        stride = 0;
+        storage = nullptr;
+        data = nullptr;
+        bytes = 0;
+        capacity = 0;
+    }
+
+    void swap_with(Image &other)
+    {
+        std::swap(width, other.width);
+        std::swap(height, other.height);
+        std::swap(layout, other.layout);
+        std::swap(stride, other.stride);
+        std::swap(storage, other.storage);
+        std::swap(data, other.data);
+        std::swap(bytes, other.bytes);
+        std::swap(capacity, other.capacity);
+    }
+};
+
+// ________________________________________________________ Layout conversion
 
 /**
- * Description: Convert image to high contrast (black and white only)
- * @param 2d vector of type Pixel
- * @return a new 2d vector of type pixel modified
+ * Description: Copies an image into a new buffer with a different channel layout
+ * @param Image to convert
+ * @param PixelLayout for the new image
+ * @return a new Image holding the same pixels in the requested layout
  */
 
-vector<vector<Pixel>> process_7(const vector<vector<Pixel>> &image)
+Image convert_layout(const Image &image, PixelLayout layout)
 {
-    int height = image.size();
-    int width = image[0].size();
+    if (image.layout == layout)
+    {
+        return image;
+    }
 
-    vector<vector<Pixel>> new_img(height, vector<Pixel>(width));
+    int height = image.height;
+    int width = image.width;
+    Image new_img(width, height, layout);
 
-    Pixel this_pixel;
-    int red;
-    int green;
     int blue;
-    int gray_val;
+    int green;
+    int red;
 
     for (int row = 0; row < height; row++)
     {
         for (int col = 0; col < width; col++)
         {
-            this_pixel = image[row][col];
-            red = this_pixel.red;
-            green = this_pixel.green;
-            blue = this_pixel.blue;
-
-            gray_val = (red + green + blue) / 3;
+            if (image.layout == LAYOUT_PLANAR)
+            {
+                blue = image.plane_row(0, row)[col];
+                green = image.plane_row(1, row)[col];
+                red = image.plane_row(2, row)[col];
+            }
+            else
+            {
+                const unsigned char *pixel = image.row(row) + col * 3;
+                blue = image.layout == LAYOUT_BGR ? pixel[0] : pixel[2];
+                green = pixel[1];
+                red = image.layout == LAYOUT_BGR ? pixel[2] : pixel[0];
+            }
 
-            if (gray_val < 128)
+            if (layout == LAYOUT_PLANAR)
             {
-                new_img[row][col].red = 0;
-                new_img[row][col].green = 0;
-                new_img[row][col].blue = 0;
+                new_img.plane_row(0, row)[col] = blue;
+                new_img.plane_row(1, row)[col] = green;
+                new_img.plane_row(2, row)[col] = red;
             }
-            if (gray_val > 127)
+            else
             {
-                new_img[row][col].red = 255;
-                new_img[row][col].green = 255;
-                new_img[row][col].blue = 255;
+                unsigned char *pixel = new_img.row(row) + col * 3;
+                pixel[0] = layout == LAYOUT_BGR ? blue : red;
+                pixel[1] = green;
+                pixel[2] = layout == LAYOUT_BGR ? red : blue;
             }
         }
     }
     return new_img;
 }
-// ________________________________________________________ PROCESS 8 Lighten
 
 /**
- * Description: Lightens image by a scaling factor
- * @param 2d vector of type Pixel
- * @param floating point scaling factor for lightening image
- * @return a new 2d vector of type pixel modified
+ * Description: Returns the image itself when it is already BGR interleaved, otherwise converts it
+ * into the scratch image and returns that. Used at the top of every process function.
+ * @param Image to look at
+ * @param Image that receives the converted copy if one is needed
+ * @return reference to a BGR interleaved image with the same pixels
  */
 
-vector<vector<Pixel>> process_8(const vector<vector<Pixel>> &image, double scaling_factor)
+const Image &as_bgr(const Image &image, Image &scratch)
 {
-    int height = image.size();
-    int width = image[0].size();
-
-    vector<vector<Pixel>> new_img(height, vector<Pixel>(width));
-
-    Pixel this_pixel;
-    int red;
-    int green;
-    int blue;
-
-    for (int row = 0; row < height; row++)
+    if (image.layout == LAYOUT_BGR)
     {
-        for (int col = 0; col < width; col++)
-        {
-            this_pixel = image[row][col];
-            red = 255 - (255 - this_pixel.red) * scaling_factor;
-            green = 255 - (255 - this_pixel.green) * scaling_factor;
-            blue = 255 - (255 - this_pixel.blue) * scaling_factor;
-
-            new_img[row][col].red = red;
-            new_img[row][col].green = green;
-            new_img[row][col].blue = blue;
-        }
+        return image;
     }
-    return new_img;
+    scratch = convert_layout(image, LAYOUT_BGR);
+    return scratch;
 }
 
-// ________________________________________________________ PROCESS 9 Darken
+// ________________________________________________________ Vector of vectors adapter
 
 /**
- * Description: Darkens image by a scaling factor
+ * Description: Copies a 2d vector of Pixels into a BGR Image. Color values are truncated to
+ * 8 bits the same way write_image() does.
  * @param 2d vector of type Pixel
- * @param floating point scaling factor for darkening image
- * @return a new 2d vector of type pixel modified
+ * @return a new Image with the same pixels
  */
 
-vector<vector<Pixel>> process_9(const vector<vector<Pixel>> &image, double scaling_factor)
+Image to_image(const vector<vector<Pixel>> &image)
 {
+    if (image.empty())
+    {
+        return Image();
+    }
+
     int height = image.size();
     int width = image[0].size();
-
-    vector<vector<Pixel>> new_img(height, vector<Pixel>(width));
-
-    Pixel this_pixel;
-    int red;
-    int green;
-    int blue;
+    Image new_img(width, height);
 
     for (int row = 0; row < height; row++)
     {
+        unsigned char *pixel = new_img.row(row);
         for (int col = 0; col < width; col++)
         {
-            this_pixel = image[row][col];
-            red = this_pixel.red * scaling_factor;
-            green = this_pixel.green * scaling_factor;
-            blue = this_pixel.blue * scaling_factor;
-
-            new_img[row][col].red = red;
-            new_img[row][col].green = green;
-            new_img[row][col].blue = blue;
+            pixel[0] = image[row][col].blue;
+            pixel[1] = image[row][col].green;
+            pixel[2] = image[row][col].red;
+            pixel += 3;
         }
     }
     return new_img;
 }
 
+/**
+ * Description: Copies an Image of any layout into a 2d vector of Pixels
+ * @param Image to copy
+ * @return a new 2d vector of type Pixel
+ */
+
+vector<vector<Pixel>> to_pixels(const Image &image)
+{
+    Image scratch;
+    const Image &src = as_bgr(image, scratch);
+
+    int height = src.height;
+    int width = src.width;
+    vector<vector<Pixel>> new_img(height, vector<Pixel>(width));
+
+    for (int row = 0; row < height; row++)
+    {
+        const unsigned char *pixel = src.row(row);
+        for (int col = 0; col < width; col++)
+        {
+            new_img[row][col].blue = pixel[0];
+            new_img[row][col].green = pixel[1];
+            new_img[row][col].red = pixel[2];
+            pixel += 3;
+        }
+    }
+    return new_img;
+}
+
+//***************************************************************************************************//
+// TRACING
+//***************************************************************************************************//
+
+// ________________________________________________________ Trace state
+
+// One finished span, or one counter sample when duration is TRACE_COUNTER. Times are nanoseconds
+// since tracing started.
+struct TraceEvent
+{
+    const char *name; // string literal, never copied
+    long long start;
+    long long duration;
+    long long value; // bytes, rows or the counter value; -1 if the span has none
+};
+
+const long long TRACE_COUNTER = -1;
+
+// Events recorded by one thread. Only that thread appends to it, so recording takes no lock.
+struct TraceBuffer
+{
+    int thread_id;
+    const char *thread_name;
+    vector<TraceEvent> events;
+};
+
+// Process-wide trace state. While tracing is off a span costs one relaxed load.
+struct TraceState
+{
+    atomic<bool> enabled;
+    chrono::steady_clock::time_point origin;
+    mutex buffers_lock; // guards buffers
+    vector<unique_ptr<TraceBuffer>> buffers;
+    atomic<long long> bytes_read;
+    atomic<long long> bytes_written;
+    long long start_buffers; // image_allocations() when tracing started
+    long long start_bytes;
+
+    TraceState()
+        : enabled(false), bytes_read(0), bytes_written(0), start_buffers(0), start_bytes(0)
+    {
+    }
+};
+
+/**
+ * Description: Holds the trace state
+ * @return reference to the TraceState
+ */
+
+TraceState &trace_state()
+{
+    static TraceState state;
+    return state;
+}
+
+/**
+ * Description: Checks whether spans are being recorded
+ * @return true while tracing
+ */
+
+inline bool tracing()
+{
+    return trace_state().enabled.load(memory_order_relaxed);
+}
+
+/**
+ * Description: Holds the name the calling thread gets in a trace. Threads set it when they start,
+ * whether or not tracing is on, since they may outlive the moment it is turned on.
+ * @return reference to the calling thread's name, NULL for the default "thread N"
+ */
+
+const char *&trace_thread_name()
+{
+    static thread_local const char *name = NULL;
+    return name;
+}
+
+/**
+ * Description: Gets the calling thread's event buffer, registering it on first use
+ * @return reference to the TraceBuffer
+ */
+
+TraceBuffer &trace_buffer()
+{
+    static thread_local TraceBuffer *buffer = NULL;
+    if (buffer == NULL)
+    {
+        TraceState &state = trace_state();
+        lock_guard<mutex> lock(state.buffers_lock);
+        state.buffers.push_back(unique_ptr<TraceBuffer>(new TraceBuffer()));
+        buffer = state.buffers.back().get();
+        buffer->thread_id = int(state.buffers.size());
+        buffer->thread_name = trace_thread_name();
+        buffer->events.reserve(4096);
+    }
+    return *buffer;
+}
+
+/**
+ * Description: Gets the time since tracing started
+ * @return long long nanoseconds
+ */
+
+inline long long trace_now()
+{
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - trace_state().origin).count();
+}
+
+/**
+ * Description: Samples the byte and allocation counters into the calling thread's trace
+ * @return nothing
+ */
+
+void record_trace_counters()
+{
+    TraceState &state = trace_state();
+    vector<TraceEvent> &events = trace_buffer().events;
+    long long now = trace_now();
+    TraceEvent read = {"bytes read", now, TRACE_COUNTER, state.bytes_read};
+    TraceEvent written = {"bytes written", now, TRACE_COUNTER, state.bytes_written};
+    TraceEvent allocated = {"image buffer bytes", now, TRACE_COUNTER, image_allocations().bytes - state.start_bytes};
+    events.push_back(read);
+    events.push_back(written);
+    events.push_back(allocated);
+}
+
+/**
+ * Description: Counts bytes read from files, while tracing
+ * @param size_t byte count
+ * @return nothing
+ */
+
+inline void trace_bytes_read(size_t bytes)
+{
+    if (tracing())
+    {
+        trace_state().bytes_read += bytes;
+    }
+}
+
+/**
+ * Description: Counts bytes written to files, while tracing
+ * @param size_t byte count
+ * @return nothing
+ */
+
+inline void trace_bytes_written(size_t bytes)
+{
+    if (tracing())
+    {
+        trace_state().bytes_written += bytes;
+    }
+}
+
+/**
+ * Description: Starts recording spans, dropping anything recorded before. Must not be called
+ * while other threads are recording.
+ * @return nothing
+ */
+
+void start_tracing()
+{
+    TraceState &state = trace_state();
+    {
+        lock_guard<mutex> lock(state.buffers_lock);
+        for (size_t i = 0; i < state.buffers.size(); i++)
+        {
+            state.buffers[i]->events.clear();
+        }
+    }
+    state.bytes_read = 0;
+    state.bytes_written = 0;
+    state.start_buffers = image_allocations().buffers;
+    state.start_bytes = image_allocations().bytes;
+    state.origin = chrono::steady_clock::now();
+    state.enabled = true;
+}
+
+/**
+ * Description: Stops recording spans; what was recorded stays for the reports
+ * @return nothing
+ */
+
+void stop_tracing()
+{
+    trace_state().enabled = false;
+}
+
+// ________________________________________________________ Spans
+
+/**
+ * Description: Records the time from its construction to the end of its scope as a span of the
+ * calling thread. Nested spans show up nested in the trace viewer.
+ */
+
+class TraceSpan
+{
+public:
+    /**
+     * @param string literal naming the span
+     * @param long long size the span handles (bytes or rows), -1 for none
+     * @param bool true to also sample the byte and allocation counters when the span ends
+     */
+    explicit TraceSpan(const char *span_name, long long span_value = -1, bool sample_counters = false)
+        : name(tracing() ? span_name : NULL), value(span_value), counters(sample_counters),
+          start(name != NULL ? trace_now() : 0)
+    {
+    }
+
+    ~TraceSpan()
+    {
+        if (name != NULL)
+        {
+            TraceEvent event = {name, start, trace_now() - start, value};
+            trace_buffer().events.push_back(event);
+            if (counters)
+            {
+                record_trace_counters();
+            }
+        }
+    }
+
+    void set_value(long long span_value)
+    {
+        value = span_value;
+    }
+
+private:
+    const char *name; // NULL when tracing was off at construction
+    long long value;
+    bool counters;
+    long long start;
+
+    TraceSpan(const TraceSpan &);
+    TraceSpan &operator=(const TraceSpan &);
+};
+
+// ________________________________________________________ Reports
+
+/**
+ * Description: Writes the recorded spans and counters as a Chrome trace (JSON), which
+ * chrome://tracing and Perfetto open. Call after the traced work has finished.
+ * @param string file name
+ * @return true if the file was written
+ */
+
+bool write_chrome_trace(const string &filename)
+{
+    TraceState &state = trace_state();
+    lock_guard<mutex> lock(state.buffers_lock);
+    ofstream out(filename.c_str());
+    out << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+    out << "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 1, \"args\": {\"name\": \"imgproc\"}}";
+    out << fixed << setprecision(3);
+    for (size_t b = 0; b < state.buffers.size(); b++)
+    {
+        const TraceBuffer &buffer = *state.buffers[b];
+        out << ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": " << buffer.thread_id
+            << ", \"args\": {\"name\": \"";
+        if (buffer.thread_name != NULL)
+        {
+            out << buffer.thread_name << " ";
+        }
+        out << "thread " << buffer.thread_id << "\"}}";
+        for (size_t i = 0; i < buffer.events.size(); i++)
+        {
+            const TraceEvent &event = buffer.events[i];
+            out << ",\n{\"name\": \"" << event.name << "\", \"pid\": 1, \"tid\": " << buffer.thread_id
+                << ", \"ts\": " << event.start / 1000.0;
+            if (event.duration == TRACE_COUNTER)
+            {
+                out << ", \"ph\": \"C\", \"args\": {\"bytes\": " << event.value << "}}";
+                continue;
+            }
+            out << ", \"ph\": \"X\", \"cat\": \"imgproc\", \"dur\": " << event.duration / 1000.0;
+            if (event.value >= 0)
+            {
+                out << ", \"args\": {\"value\": " << event.value << "}";
+            }
+            out << "}";
+        }
+    }
+    out << "\n]}\n";
+    out.close();
+    return bool(out);
+}
+
+/**
+ * Description: Prints a table of the recorded spans, totalled by name, followed by the bytes read,
+ * written and allocated while tracing
+ * @param ostream to print to
+ * @return nothing
+ */
+
+void print_trace_summary(ostream &out)
+{
+    struct SpanTotals
+    {
+        string name;
+        long long count;
+        long long total;
+        long long longest;
+        long long value;
+    };
+    vector<SpanTotals> totals;
+
+    TraceState &state = trace_state();
+    {
+        lock_guard<mutex> lock(state.buffers_lock);
+        for (size_t b = 0; b < state.buffers.size(); b++)
+        {
+            const vector<TraceEvent> &events = state.buffers[b]->events;
+            for (size_t i = 0; i < events.size(); i++)
+            {
+                if (events[i].duration == TRACE_COUNTER)
+                {
+                    continue;
+                }
+                size_t t = 0;
+                while (t < totals.size() && totals[t].name != events[i].name)
+                {
+                    t++;
+                }
+                if (t == totals.size())
+                {
+                    SpanTotals entry = {events[i].name, 0, 0, 0, 0};
+                    totals.push_back(entry);
+                }
+                totals[t].count++;
+                totals[t].total += events[i].duration;
+                totals[t].longest = max(totals[t].longest, events[i].duration);
+                totals[t].value += max(events[i].value, 0LL);
+            }
+        }
+    }
+    sort(totals.begin(), totals.end(),
+         [](const SpanTotals &a, const SpanTotals &b) { return a.total > b.total; });
+
+    // Spans on different threads overlap, so the totals can add up to more than the run took
+    out << left << setw(20) << "span" << right << setw(8) << "count" << setw(12) << "total ms" << setw(11)
+        << "mean ms" << setw(11) << "max ms" << setw(16) << "value" << endl;
+    out << fixed << setprecision(3);
+    for (size_t t = 0; t < totals.size(); t++)
+    {
+        out << left << setw(20) << totals[t].name << right << setw(8) << totals[t].count << setw(12)
+            << totals[t].total / 1e6 << setw(11) << totals[t].total / 1e6 / totals[t].count << setw(11)
+            << totals[t].longest / 1e6 << setw(16) << totals[t].value << endl;
+    }
+    out.unsetf(ios::floatfield);
+    out << setprecision(6);
+    out << "bytes read: " << state.bytes_read << ", bytes written: " << state.bytes_written
+        << ", image buffers allocated: " << image_allocations().buffers - state.start_buffers << " ("
+        << image_allocations().bytes - state.start_bytes << " bytes)" << endl;
+}
+
+//***************************************************************************************************//
+// BMP DECODER
+//***************************************************************************************************//
+
+// ________________________________________________________ Decoder status
+
+// Result of reading a BMP file
+enum BmpStatus
+{
+    BMP_OK,
+    BMP_OPEN_FAILED,        // file could not be opened or mapped
+    BMP_BAD_SIGNATURE,      // file does not start with "BM"
+    BMP_BAD_HEADER,         // header fields are missing or inconsistent
+    BMP_UNSUPPORTED_FORMAT, // valid BMP, but a bit depth or compression we do not decode
+    BMP_TRUNCATED,          // pixel array runs past the end of the file
+    BMP_WRITE_FAILED,       // output file could not be created or written
+    BMP_SIZE_MISMATCH,      // inputs that must match differ in size or row order
+    BMP_TOO_LARGE,          // decoded image would not fit in memory_budget()
+    BMP_RESULT_TOO_LARGE    // a pipeline would make an image larger than a BMP file can hold
+};
+
+/**
+ * Description: Describes a BmpStatus for error messages
+ * @param BmpStatus to describe
+ * @return string, short human readable message
+ */
+
+string bmp_status_message(BmpStatus status)
+{
+    switch (status)
+    {
+    case BMP_OK:
+        return "ok";
+    case BMP_OPEN_FAILED:
+        return "could not open file";
+    case BMP_BAD_SIGNATURE:
+        return "not a BMP file";
+    case BMP_BAD_HEADER:
+        return "corrupt BMP header";
+    case BMP_UNSUPPORTED_FORMAT:
+        return "unsupported BMP format (1, 4, 8, 24 and 32 bits per pixel only)";
+    case BMP_TRUNCATED:
+        return "BMP file is truncated";
+    case BMP_WRITE_FAILED:
+        return "could not write output file";
+    case BMP_SIZE_MISMATCH:
+        return "size differs from the first input";
+    case BMP_TOO_LARGE:
+        return "image too large for the memory budget (see --memory)";
+    case BMP_RESULT_TOO_LARGE:
+        return "pipeline result too large for a BMP file";
+    }
+    return "unknown error";
+}
+
+// ________________________________________________________ Mapped file
+
+/**
+ * Description: Read-only view of a whole file. Uses mmap where available and falls back to one
+ * large read into memory otherwise.
+ */
+
+class MappedFile
+{
+public:
+    MappedFile()
+        : data(nullptr), size(0), mapped(false)
+    {
+    }
+
+    ~MappedFile()
+    {
+        close();
+    }
+
+    bool open(const string &filename)
+    {
+        close();
+#ifdef IMGPROC_POSIX
+        int fd = ::open(filename.c_str(), O_RDONLY);
+        if (fd < 0)
+        {
+            return false;
+        }
+        struct stat file_stat;
+        if (fstat(fd, &file_stat) != 0)
+        {
+            ::close(fd);
+            return false;
+        }
+        size = file_stat.st_size;
+        if (size > 0)
+        {
+            void *address = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (address != MAP_FAILED)
+            {
+                // The decoder walks the file front to back exactly once
+                madvise(address, size, MADV_SEQUENTIAL);
+                data = static_cast<const unsigned char *>(address);
+                mapped = true;
+                ::close(fd);
+                return true;
+            }
+        }
+        ::close(fd);
+#endif
+        ifstream stream(filename, ios::in | ios::binary);
+        if (!stream.is_open())
+        {
+            return false;
+        }
+        stream.seekg(0, ios::end);
+        size = stream.tellg();
+        stream.seekg(0, ios::beg);
+        buffer.resize(size);
+        if (size > 0 && !stream.read((char *)buffer.data(), size))
+        {
+            buffer.clear();
+            size = 0;
+            return false;
+        }
+        data = buffer.data();
+        return true;
+    }
+
+    void close()
+    {
+#ifdef IMGPROC_POSIX
+        if (mapped)
+        {
+            munmap((void *)data, size);
+        }
+#endif
+        buffer.clear();
+        data = nullptr;
+        size = 0;
+        mapped = false;
+    }
+
+    const unsigned char *bytes() const
+    {
+        return data;
+    }
+
+    size_t length() const
+    {
+        return size;
+    }
+
+private:
+    const unsigned char *data;
+    size_t size;
+    bool mapped;
+    vector<unsigned char> buffer;
+
+    MappedFile(const MappedFile &);
+    MappedFile &operator=(const MappedFile &);
+};
+
+// ________________________________________________________ Header parsing
+
+// Little endian field readers for BMP headers
+uint16_t read_u16(const unsigned char *bytes)
+{
+    return bytes[0] | (bytes[1] << 8);
+}
+
+uint32_t read_u32(const unsigned char *bytes)
+{
+    return uint32_t(bytes[0]) | (uint32_t(bytes[1]) << 8) | (uint32_t(bytes[2]) << 16) | (uint32_t(bytes[3]) << 24);
+}
+
+// Header fields the decoder needs
+struct BmpInfo
+{
+    int width;
+    int height;             // always positive, see top_down
+    bool top_down;          // negative height in the file: first stored row is the top row
+    int bits_per_pixel;
+    uint32_t compression;
+    uint64_t pixel_offset;  // 64-bit so large files cannot overflow
+    uint64_t row_bytes;     // stored bytes per row including padding
+    int palette_size;       // colours in the table of a 1, 4 or 8 bit file, 0 otherwise
+    unsigned char palette[256 * 3]; // BGR colour table; entries past palette_size are black
+};
+
+const int BMP_FILE_HEADER_SIZE = 14;
+// The largest DIB header (BITMAPV5HEADER) followed by a full 256 colour table
+const int BMP_MAX_HEADER_BYTES = BMP_FILE_HEADER_SIZE + 124 + 256 * 4;
+const uint32_t BMP_BI_RGB = 0;
+const uint32_t BMP_BI_RLE8 = 1;
+const uint32_t BMP_BI_RLE4 = 2;
+const uint32_t BMP_BI_BITFIELDS = 3;
+
+/**
+ * Description: Checks whether a BMP file's pixels are run length encoded
+ * @param BmpInfo of the file
+ * @return true for BI_RLE8 and BI_RLE4
+ */
+
+inline bool is_rle(const BmpInfo &info)
+{
+    return info.compression == BMP_BI_RLE8 || info.compression == BMP_BI_RLE4;
+}
+
+size_t &memory_budget();
+
+/**
+ * Description: Parses and validates the BMP file and DIB headers
+ * @param pointer to the start of the file
+ * @param size of the file in bytes
+ * @param BmpInfo to fill in
+ * @return BMP_OK if the pixel array can be decoded, otherwise the reason it cannot
+ */
+
+BmpStatus parse_bmp_header(const unsigned char *file, uint64_t file_size, BmpInfo &info)
+{
+    if (file_size < 2 || file[0] != 'B' || file[1] != 'M')
+    {
+        return BMP_BAD_SIGNATURE;
+    }
+    if (file_size < BMP_FILE_HEADER_SIZE + 40)
+    {
+        return BMP_BAD_HEADER;
+    }
+
+    uint32_t dib_size = read_u32(file + 14);
+    int32_t width = (int32_t)read_u32(file + 18);
+    int32_t height = (int32_t)read_u32(file + 22);
+    uint16_t planes = read_u16(file + 26);
+    if (dib_size < 40 || width <= 0 || height == 0 || height == INT32_MIN || planes != 1)
+    {
+        return BMP_BAD_HEADER;
+    }
+
+    info.width = width;
+    info.height = height < 0 ? -height : height;
+    info.top_down = height < 0;
+    info.bits_per_pixel = read_u16(file + 28);
+    info.compression = read_u32(file + 30);
+    info.pixel_offset = read_u32(file + 10);
+
+    bool indexed = info.bits_per_pixel == 1 || info.bits_per_pixel == 4 || info.bits_per_pixel == 8;
+    if (!indexed && info.bits_per_pixel != 24 && info.bits_per_pixel != 32)
+    {
+        return BMP_UNSUPPORTED_FORMAT;
+    }
+    if (info.compression == BMP_BI_BITFIELDS && info.bits_per_pixel == 32)
+    {
+        // Only the standard BGRA masks, which decode exactly like BI_RGB
+        const unsigned char *masks = file + BMP_FILE_HEADER_SIZE + 40;
+        if (BMP_FILE_HEADER_SIZE + 40 + 12 > file_size || read_u32(masks) != 0x00FF0000 ||
+            read_u32(masks + 4) != 0x0000FF00 || read_u32(masks + 8) != 0x000000FF)
+        {
+            return BMP_UNSUPPORTED_FORMAT;
+        }
+    }
+    else if (info.compression == BMP_BI_RLE8 || info.compression == BMP_BI_RLE4)
+    {
+        // Run length data is always stored bottom-up
+        if (info.bits_per_pixel != (info.compression == BMP_BI_RLE8 ? 8 : 4) || info.top_down)
+        {
+            return BMP_BAD_HEADER;
+        }
+    }
+    else if (info.compression != BMP_BI_RGB)
+    {
+        return BMP_UNSUPPORTED_FORMAT;
+    }
+
+    info.row_bytes = (uint64_t(info.width) * info.bits_per_pixel + 31) / 32 * 4;
+    if (info.pixel_offset < BMP_FILE_HEADER_SIZE + dib_size)
+    {
+        return BMP_BAD_HEADER;
+    }
+
+    // The colour table follows the DIB header; a count of 0 means the full 2^bits entries
+    memset(info.palette, 0, sizeof(info.palette));
+    info.palette_size = 0;
+    if (indexed)
+    {
+        uint32_t colors = read_u32(file + 46);
+        uint32_t max_colors = 1u << info.bits_per_pixel;
+        colors = colors == 0 ? max_colors : min(colors, max_colors);
+        uint64_t table = BMP_FILE_HEADER_SIZE + uint64_t(dib_size);
+        if (table + colors * 4 > min<uint64_t>(info.pixel_offset, file_size))
+        {
+            return BMP_BAD_HEADER;
+        }
+        if (table + colors * 4 > BMP_MAX_HEADER_BYTES)
+        {
+            return BMP_UNSUPPORTED_FORMAT;
+        }
+        for (uint32_t i = 0; i < colors; i++)
+        {
+            memcpy(info.palette + i * 3, file + table + i * 4, 3);
+        }
+        info.palette_size = colors;
+    }
+    // Run length data has no fixed size; its decoder checks the bounds as it goes
+    uint64_t pixel_bytes = is_rle(info) ? 0 : info.row_bytes * info.height;
+    if (info.pixel_offset + pixel_bytes > file_size)
+    {
+        return BMP_TRUNCATED;
+    }
+    return BMP_OK;
+}
+
+/**
+ * Description: Reads and validates only the headers of a BMP file
+ * @param string filename
+ * @param BmpInfo to fill in
+ * @return BMP_OK if the file's pixels can be decoded, otherwise the reason they cannot
+ */
+
+BmpStatus read_bmp_info(const string &filename, BmpInfo &info)
+{
+    ifstream stream(filename, ios::in | ios::binary);
+    if (!stream.is_open())
+    {
+        return BMP_OPEN_FAILED;
+    }
+    unsigned char header[BMP_MAX_HEADER_BYTES] = {0};
+    stream.read((char *)header, sizeof(header));
+    stream.clear();
+    stream.seekg(0, ios::end);
+    return parse_bmp_header(header, stream.tellg(), info);
+}
+
+// ________________________________________________________ Run length decoding
+
+// Outcome of decoding one stored row of BI_RLE8 / BI_RLE4 data
+enum RleRowStatus
+{
+    RLE_ROW_DONE, // the row is complete
+    RLE_NEED_MORE // the data ended inside the row; nothing was consumed
+};
+
+/**
+ * Description: Expands BI_RLE8 and BI_RLE4 pixel data one stored (bottom-up) row at a time, to
+ * one colour table index per pixel. Pixels the data skips over (with a delta, an early end of
+ * line or the end of the bitmap) get index 0. A row is only consumed once it is complete, so a
+ * reader that runs out of data can fetch more and ask for the same row again.
+ */
+
+class RleDecoder
+{
+public:
+    RleDecoder()
+        : width(0), bits(8), blank_rows(0), start_x(0), finished(false)
+    {
+    }
+
+    void reset(int width_pixels, int bits_per_pixel)
+    {
+        width = width_pixels;
+        bits = bits_per_pixel;
+        blank_rows = 0;
+        start_x = 0;
+        finished = false;
+    }
+
+    /**
+     * Description: Decodes the next stored row
+     * @param pointer to the unread RLE data
+     * @param size_t bytes available there
+     * @param size_t that receives the bytes the row used
+     * @param pointer to width index bytes
+     * @return RLE_ROW_DONE, or RLE_NEED_MORE if the available bytes end inside the row
+     */
+
+    RleRowStatus next_row(const unsigned char *data, size_t size, size_t &consumed, unsigned char *indices)
+    {
+        memset(indices, 0, width);
+        consumed = 0;
+        if (finished || blank_rows > 0)
+        {
+            blank_rows -= blank_rows > 0 ? 1 : 0;
+            return RLE_ROW_DONE;
+        }
+
+        size_t pos = 0;
+        int x = start_x;
+        while (true)
+        {
+            if (pos + 2 > size)
+            {
+                return RLE_NEED_MORE;
+            }
+            int count = data[pos];
+            int value = data[pos + 1];
+            if (count > 0)
+            {
+                // Encoded run; RLE4 alternates the high and low nibble
+                int colors[2] = {bits == 8 ? value : value >> 4, bits == 8 ? value : value & 15};
+                int length = min(count, width - x);
+                if (colors[0] == colors[1])
+                {
+                    memset(indices + x, colors[0], length);
+                }
+                else
+                {
+                    for (int i = 0; i < length; i++)
+                    {
+                        indices[x + i] = (unsigned char)colors[i & 1];
+                    }
+                }
+                x += length;
+                pos += 2;
+                continue;
+            }
+            if (value == 0 || value == 1)
+            {
+                // End of line, or end of bitmap
+                finished = value == 1;
+                consumed = pos + 2;
+                start_x = 0;
+                return RLE_ROW_DONE;
+            }
+            if (value == 2)
+            {
+                if (pos + 4 > size)
+                {
+                    return RLE_NEED_MORE;
+                }
+                int dx = data[pos + 2];
+                int dy = data[pos + 3];
+                pos += 4;
+                if (dy > 0)
+                {
+                    // The rest of this row and dy - 1 whole rows stay blank
+                    blank_rows = dy - 1;
+                    start_x = min(x + dx, width);
+                    consumed = pos;
+                    return RLE_ROW_DONE;
+                }
+                x = min(x + dx, width);
+                continue;
+            }
+
+            // Absolute run of `value` indices, padded to a whole 16-bit word
+            size_t stored = bits == 8 ? value : (value + 1) / 2;
+            size_t padded = (stored + 1) / 2 * 2;
+            if (pos + 2 + padded > size)
+            {
+                return RLE_NEED_MORE;
+            }
+            const unsigned char *literal = data + pos + 2;
+            for (int i = 0; i < value && x < width; i++, x++)
+            {
+                indices[x] = bits == 8 ? literal[i] : (unsigned char)((literal[i / 2] >> ((i & 1) ? 0 : 4)) & 15);
+            }
+            pos += 2 + padded;
+        }
+    }
+
+    // True once the end of bitmap marker was read; every later row is blank
+    bool done() const
+    {
+        return finished;
+    }
+
+private:
+    int width;
+    int bits;
+    int blank_rows; // rows a delta skipped that are still to be returned
+    int start_x;    // column the next row starts at after a delta
+    bool finished;
+};
+
+/**
+ * Description: Converts a row of colour table indices to BGR
+ * @param pointer to the indices
+ * @param pointer to the destination row
+ * @param BmpInfo with the colour table
+ * @return nothing
+ */
+
+void expand_palette_row(const unsigned char *indices, unsigned char *dst, const BmpInfo &info)
+{
+    for (int col = 0; col < info.width; col++)
+    {
+        memcpy(dst + col * 3, info.palette + indices[col] * 3, 3);
+    }
+}
+
+// ________________________________________________________ Read BMP into an Image
+
+/**
+ * Description: Converts one stored BMP scanline to a BGR row of an Image
+ * @param pointer to the stored scanline
+ * @param pointer to the destination row
+ * @param BmpInfo of the file: width, bits per pixel and colour table
+ * @return nothing
+ */
+
+void decode_bmp_row(const unsigned char *src, unsigned char *dst, const BmpInfo &info)
+{
+    int width = info.width;
+    switch (info.bits_per_pixel)
+    {
+    case 24:
+        // Stored order already matches the in-memory BGR layout
+        memcpy(dst, src, size_t(width) * 3);
+        return;
+    case 32:
+        for (int col = 0; col < width; col++)
+        {
+            // We are ignoring the alpha channel
+            dst[0] = src[0];
+            dst[1] = src[1];
+            dst[2] = src[2];
+            src += 4;
+            dst += 3;
+        }
+        return;
+    case 8:
+        for (int col = 0; col < width; col++)
+        {
+            memcpy(dst + col * 3, info.palette + src[col] * 3, 3);
+        }
+        return;
+    case 4:
+        // Two pixels a byte, the first in the high nibble
+        for (int col = 0; col < width; col++)
+        {
+            int index = (src[col >> 1] >> ((col & 1) ? 0 : 4)) & 15;
+            memcpy(dst + col * 3, info.palette + index * 3, 3);
+        }
+        return;
+    case 1:
+        // Eight pixels a byte, the first in the high bit
+        for (int col = 0; col < width; col++)
+        {
+            int index = (src[col >> 3] >> (7 - (col & 7))) & 1;
+            memcpy(dst + col * 3, info.palette + index * 3, 3);
+        }
+        return;
+    }
+}
+
+/**
+ * Description: Decodes run length encoded pixel data into an Image
+ * @param pointer to the pixel data
+ * @param size_t bytes from there to the end of the file
+ * @param BmpInfo of the file
+ * @param Image of the file's size that receives the pixels
+ * @return BMP_OK, or BMP_TRUNCATED if the data ends before the last row
+ */
+
+BmpStatus read_rle_pixels(const unsigned char *data, size_t size, const BmpInfo &info, Image &image)
+{
+    RleDecoder decoder;
+    decoder.reset(info.width, info.bits_per_pixel);
+    vector<unsigned char> indices(info.width);
+    size_t pos = 0;
+    for (int i = 0; i < info.height; i++)
+    {
+        size_t consumed;
+        if (decoder.next_row(data + pos, size - pos, consumed, indices.data()) != RLE_ROW_DONE)
+        {
+            image.reshape(0, 0);
+            return BMP_TRUNCATED;
+        }
+        pos += consumed;
+        expand_palette_row(indices.data(), image.row(info.height - 1 - i), info);
+    }
+    return BMP_OK;
+}
+
+/**
+ * Description: Reads the BMP image specified into a BGR Image. The file is mapped (or read in
+ * one block) and each scanline is converted with a single tight loop. Supports 24 and 32 bits
+ * per pixel, 1, 4 and 8 bit indexed colour (also BI_RLE8 and BI_RLE4 compressed), bottom-up and
+ * top-down files.
+ * @param string BMP image filename
+ * @param Image that receives the pixels, left empty on failure
+ * @return BMP_OK on success, otherwise the reason the file could not be read
+ */
+
+BmpStatus read_bmp(const string &filename, Image &image)
+{
+    TraceSpan span("read_bmp", -1, true);
+    image.reshape(0, 0);
+
+    MappedFile file;
+    if (!file.open(filename))
+    {
+        return BMP_OPEN_FAILED;
+    }
+    span.set_value(file.length());
+    trace_bytes_read(file.length());
+
+    BmpInfo info;
+    BmpStatus status = parse_bmp_header(file.bytes(), file.length(), info);
+    if (status != BMP_OK)
+    {
+        return status;
+    }
+    // Run length data has no fixed size, so a file of a few bytes can claim any dimensions; it is
+    // only decoded whole when its pixels fit memory_budget() (streaming it needs a row at a time)
+    if (is_rle(info) && uint64_t(info.width) * info.height * 3 > memory_budget())
+    {
+        return BMP_TOO_LARGE;
+    }
+
+    // Decode into the caller's buffer, which is reused when it is big enough
+    TraceSpan decode("decode", info.height);
+    image.reshape(info.width, info.height);
+    if (is_rle(info))
+    {
+        return read_rle_pixels(file.bytes() + info.pixel_offset, file.length() - info.pixel_offset, info, image);
+    }
+    const unsigned char *stored_row = file.bytes() + info.pixel_offset;
+    for (int i = 0; i < info.height; i++)
+    {
+        // BMP files normally store rows bottom to top
+        int row = info.top_down ? i : info.height - 1 - i;
+        decode_bmp_row(stored_row, image.row(row), info);
+        stored_row += info.row_bytes;
+    }
+    return BMP_OK;
+}
+
+//***************************************************************************************************//
+// BMP ENCODER
+//***************************************************************************************************//
+
+// ________________________________________________________ Encoder options
+
+// Whether write_bmp() may store pixels as indices into a colour table
+enum BmpIndexing
+{
+    BMP_INDEX_NEVER,  // always 24 bits per pixel, byte-identical to write_image()
+    BMP_INDEX_AUTO,   // 1, 4 or 8 bit indexed when the image has at most 256 colours
+    BMP_INDEX_GRAY,   // the caller expects R = G = B everywhere: 8 bit gray ramp, no colour scan
+    BMP_INDEX_PALETTE // the caller expects only the colours in BmpWriteOptions::palette
+};
+
+// How write_bmp() gets bytes to disk
+struct BmpWriteOptions
+{
+    bool preallocate;   // reserve the full file size up front (fallocate where available)
+    bool use_mmap;      // copy rows into a shared mapping of the output file instead of writing
+    size_t chunk_bytes; // bytes gathered into one write call
+    BmpIndexing indexing;
+    vector<uint32_t> palette; // 0xRRGGBB colours for BMP_INDEX_PALETTE, at most 256
+    bool rle;                 // store indexed pixels as BI_RLE4 / BI_RLE8 when that is smaller
+
+    BmpWriteOptions()
+        : preallocate(false), use_mmap(false), chunk_bytes(1 << 20), indexing(BMP_INDEX_NEVER), rle(false)
+    {
+    }
+};
+
+const int BMP_HEADER_BYTES = 54;
+
+/**
+ * Description: Fills in the BMP and DIB headers, with the same field values write_image() uses
+ * for a 24 bit image. An indexed image's colour table goes right after the headers.
+ * @param array of at least BMP_HEADER_BYTES bytes
+ * @param int width in pixels
+ * @param int height in pixels
+ * @param bool true to store rows top to bottom (negative height field)
+ * @param int bits per pixel: 24, or 1, 4 or 8 for an indexed image
+ * @param int number of colour table entries of an indexed image
+ * @return total file size in bytes
+ */
+
+uint64_t build_bmp_header(unsigned char header[], int width_pixels, int height_pixels, bool top_down = false,
+                          int bits_per_pixel = 24, int palette_size = 0)
+{
+    const int BMP_HEADER_SIZE = 14;
+    const int DIB_HEADER_SIZE = 40;
+    uint64_t width_bytes = (uint64_t(width_pixels) * bits_per_pixel + 31) / 32 * 4;
+    uint64_t array_bytes = width_bytes * height_pixels;
+    uint64_t pixel_offset = BMP_HEADER_SIZE + DIB_HEADER_SIZE + uint64_t(palette_size) * 4;
+    unsigned char *dib_header = header + BMP_HEADER_SIZE;
+
+    memset(header, 0, BMP_HEADER_BYTES);
+    set_bytes(header, 0, 1, 'B');
+    set_bytes(header, 1, 1, 'M');
+    set_bytes(header, 2, 4, pixel_offset + array_bytes);
+    set_bytes(header, 10, 4, pixel_offset);
+
+    set_bytes(dib_header, 0, 4, DIB_HEADER_SIZE);
+    set_bytes(dib_header, 4, 4, width_pixels);
+    set_bytes(dib_header, 8, 4, top_down ? -height_pixels : height_pixels);
+    set_bytes(dib_header, 12, 2, 1);
+    set_bytes(dib_header, 14, 2, bits_per_pixel);
+    set_bytes(dib_header, 20, 4, array_bytes);
+    set_bytes(dib_header, 24, 4, 2835);
+    set_bytes(dib_header, 28, 4, 2835);
+    set_bytes(dib_header, 32, 4, palette_size);
+
+    return pixel_offset + array_bytes;
+}
+
+// ________________________________________________________ Output file
+
+#ifdef IMGPROC_POSIX
+/**
+ * Description: Creates a new, uniquely named file in TMPDIR (or /tmp) that no other process can
+ * have opened first
+ * @param string start of the file name
+ * @param string that receives the file's path
+ * @return file descriptor, or -1 on failure
+ */
+
+int create_temporary_file(const string &name, string &path)
+{
+    const char *directory = getenv("TMPDIR");
+    string pattern = string(directory != NULL && directory[0] != '\0' ? directory : "/tmp") + "/" + name + ".XXXXXX";
+    vector<char> buffer(pattern.begin(), pattern.end());
+    buffer.push_back('\0');
+    int fd = mkstemp(buffer.data());
+    path = fd >= 0 ? buffer.data() : string();
+    return fd;
+}
+#endif
+
+/**
+ * Description: Tells whether two names refer to the same existing file
+ * @param string file name
+ * @param string file name
+ * @return true if writing the second would overwrite the first
+ */
+
+bool same_file(const string &first, const string &second)
+{
+#ifdef IMGPROC_POSIX
+    struct stat first_stat;
+    struct stat second_stat;
+    return stat(first.c_str(), &first_stat) == 0 && stat(second.c_str(), &second_stat) == 0 &&
+           first_stat.st_dev == second_stat.st_dev && first_stat.st_ino == second_stat.st_ino;
+#else
+    return first == second;
+#endif
+}
+
+/**
+ * Description: Picks the file a result streamed from input is written to. Opening the input
+ * itself for writing would truncate it before it is read, so such a result goes to a temporary
+ * file next to it; finish_staged_output() then puts it in place.
+ * @param string input BMP filename
+ * @param string output BMP filename
+ * @return file name to write
+ */
+
+string staged_output_name(const string &input, const string &output)
+{
+    return same_file(input, output) ? output + ".part.bmp" : output;
+}
+
+/**
+ * Description: Moves a result written to staged_output_name() over the output once it is
+ * complete, or removes it if writing failed. The input must be closed by then.
+ * @param string file name that was written
+ * @param string output BMP filename
+ * @param BmpStatus of writing it
+ * @return the status, or BMP_WRITE_FAILED if the result could not be moved
+ */
+
+BmpStatus finish_staged_output(const string &staged, const string &output, BmpStatus status)
+{
+    if (staged == output)
+    {
+        return status;
+    }
+#ifndef IMGPROC_POSIX
+    if (status == BMP_OK)
+    {
+        remove(output.c_str()); // rename() does not replace files here
+    }
+#endif
+    if (status == BMP_OK && rename(staged.c_str(), output.c_str()) != 0)
+    {
+        status = BMP_WRITE_FAILED;
+    }
+    if (status != BMP_OK)
+    {
+        remove(staged.c_str());
+    }
+    return status;
+}
+
+/**
+ * Description: Write-only output file used by the encoders. Gathers many small pieces into one
+ * writev call on POSIX systems and falls back to a buffered ofstream elsewhere.
+ */
+
+class OutputFile
+{
+public:
+    OutputFile()
+        : fd(-1), pending(0)
+    {
+    }
+
+    ~OutputFile()
+    {
+        close();
+    }
+
+    bool open(const string &filename)
+    {
+#ifdef IMGPROC_POSIX
+        fd = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        return fd >= 0;
+#else
+        stream.open(filename, ios::out | ios::binary);
+        return stream.is_open();
+#endif
+    }
+
+    // Reserves disk space for the whole file so the writes never have to extend it
+    void preallocate(uint64_t total_bytes)
+    {
+#if defined(IMGPROC_POSIX) && defined(__linux__)
+        posix_fallocate(fd, 0, total_bytes);
+#else
+        (void)total_bytes;
+#endif
+    }
+
+    // Queues a piece to write; the bytes must stay valid until flush()
+    bool append(const void *bytes, size_t length)
+    {
+        if (length == 0)
+        {
+            return true;
+        }
+        pieces.push_back(Piece(static_cast<const char *>(bytes), length));
+        pending += length;
+        return true;
+    }
+
+    size_t pending_bytes() const
+    {
+        return pending;
+    }
+
+    bool flush()
+    {
+        bool ok = true;
+        trace_bytes_written(pending);
+#ifdef IMGPROC_POSIX
+        size_t next = 0;
+        while (ok && next < pieces.size())
+        {
+            // IOV_MAX is at least 1024 on every system we build on
+            size_t count = min(pieces.size() - next, size_t(1024));
+            vector<struct iovec> iov(count);
+            for (size_t i = 0; i < count; i++)
+            {
+                iov[i].iov_base = (void *)pieces[next + i].first;
+                iov[i].iov_len = pieces[next + i].second;
+            }
+            ok = write_all(iov.data(), count);
+            next += count;
+        }
+#else
+        for (size_t i = 0; ok && i < pieces.size(); i++)
+        {
+            ok = bool(stream.write(pieces[i].first, pieces[i].second));
+        }
+#endif
+        pieces.clear();
+        pending = 0;
+        return ok;
+    }
+
+    bool close()
+    {
+        bool ok = flush();
+#ifdef IMGPROC_POSIX
+        if (fd >= 0)
+        {
+            ok = ::close(fd) == 0 && ok;
+            fd = -1;
+        }
+#else
+        if (stream.is_open())
+        {
+            stream.close();
+            ok = ok && !stream.fail();
+        }
+#endif
+        return ok;
+    }
+
+private:
+    typedef pair<const char *, size_t> Piece;
+
+    int fd;
+    vector<Piece> pieces;
+    size_t pending;
+#ifndef IMGPROC_POSIX
+    ofstream stream;
+#endif
+
+#ifdef IMGPROC_POSIX
+    // writev may write less than asked for, so keep going until every piece is out
+    bool write_all(struct iovec *iov, size_t count)
+    {
+        while (count > 0)
+        {
+            ssize_t written = writev(fd, iov, count);
+            if (written < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                return false;
+            }
+            size_t remaining = written;
+            while (count > 0 && remaining >= iov->iov_len)
+            {
+                remaining -= iov->iov_len;
+                iov++;
+                count--;
+            }
+            if (count > 0)
+            {
+                iov->iov_base = (char *)iov->iov_base + remaining;
+                iov->iov_len -= remaining;
+            }
+        }
+        return true;
+    }
+#endif
+
+    OutputFile(const OutputFile &);
+    OutputFile &operator=(const OutputFile &);
+};
+
+// ________________________________________________________ Indexed output
+
+/**
+ * Description: Packs a BGR pixel into the 0xRRGGBB form colour tables are kept in
+ * @param pointer to the pixel
+ * @return uint32_t colour
+ */
+
+inline uint32_t pixel_color(const unsigned char *pixel)
+{
+    return uint32_t(pixel[0]) | (uint32_t(pixel[1]) << 8) | (uint32_t(pixel[2]) << 16);
+}
+
+/**
+ * Description: Maps up to 256 colours to their colour table index through a small open
+ * addressing hash table
+ */
+
+class ColorIndex
+{
+public:
+    ColorIndex()
+        : count(0)
+    {
+        memset(keys, 0, sizeof(keys));
+    }
+
+    int size() const
+    {
+        return count;
+    }
+
+    // Adds a colour with the next index; false once the table holds 256 colours
+    bool insert(uint32_t color)
+    {
+        int slot = find_slot(color);
+        if (keys[slot] != 0)
+        {
+            return true;
+        }
+        if (count == 256)
+        {
+            return false;
+        }
+        keys[slot] = color + 1;
+        values[slot] = (unsigned char)count++;
+        return true;
+    }
+
+    // Index of a colour, or -1 if it is not in the table
+    int lookup(uint32_t color) const
+    {
+        int slot = find_slot(color);
+        return keys[slot] != 0 ? values[slot] : -1;
+    }
+
+private:
+    static const int SLOTS = 1024; // at most a quarter full, so probes stay short
+    uint32_t keys[SLOTS];          // colour + 1, 0 for an empty slot
+    unsigned char values[SLOTS];
+    int count;
+
+    int find_slot(uint32_t color) const
+    {
+        int slot = int((color * 2654435761u) >> 22);
+        while (keys[slot] != 0 && keys[slot] != color + 1)
+        {
+            slot = (slot + 1) & (SLOTS - 1);
+        }
+        return slot;
+    }
+};
+
+/**
+ * Description: Collects the distinct colours of an image, giving up past 256. Gray images are
+ * common (every gray and high contrast result) and are handled without hashing.
+ * @param BGR Image
+ * @param vector that receives the colours, sorted
+ * @param bool set to whether every pixel is a gray (R = G = B)
+ * @return true if the image has at most 256 colours
+ */
+
+bool collect_palette(const Image &src, vector<uint32_t> &colors, bool &gray)
+{
+    colors.clear();
+    bool seen[256] = {false};
+    gray = true;
+    for (int r = 0; gray && r < src.height; r++)
+    {
+        const unsigned char *pixel = src.row(r);
+        int differences = 0;
+        for (int col = 0; col < src.width; col++, pixel += 3)
+        {
+            differences |= (pixel[0] ^ pixel[1]) | (pixel[1] ^ pixel[2]);
+            seen[pixel[0]] = true;
+        }
+        gray = differences == 0;
+    }
+    if (gray)
+    {
+        for (int value = 0; value < 256; value++)
+        {
+            if (seen[value])
+            {
+                colors.push_back(uint32_t(value) * 0x010101);
+            }
+        }
+        return true;
+    }
+
+    ColorIndex index;
+    uint32_t last = 0xFFFFFFFF;
+    for (int r = 0; r < src.height; r++)
+    {
+        const unsigned char *pixel = src.row(r);
+        for (int col = 0; col < src.width; col++, pixel += 3)
+        {
+            uint32_t color = pixel_color(pixel);
+            if (color == last)
+            {
+                continue;
+            }
+            last = color;
+            if (index.lookup(color) < 0)
+            {
+                if (!index.insert(color))
+                {
+                    return false;
+                }
+                colors.push_back(color);
+            }
+        }
+    }
+    sort(colors.begin(), colors.end());
+    return true;
+}
+
+/**
+ * Description: Finds the colour table index of each pixel of a row
+ * @param pointer to a BGR row
+ * @param pointer to one index byte per pixel
+ * @param int width in pixels
+ * @param ColorIndex of the table, or NULL when every table colour is a gray
+ * @param array of 256 indices by gray value (-1 for grays not in the table), used when index is NULL
+ * @return false if a pixel is not in the table
+ */
+
+bool color_indices(const unsigned char *pixel, unsigned char *indices, int width, const ColorIndex *index,
+                   const short gray_index[])
+{
+    if (index == NULL)
+    {
+        int differences = 0;
+        int missing = 0; // sign bit set by a gray that is not in the table
+        for (int col = 0; col < width; col++, pixel += 3)
+        {
+            int value = gray_index[pixel[0]];
+            differences |= (pixel[0] ^ pixel[1]) | (pixel[1] ^ pixel[2]);
+            missing |= value;
+            indices[col] = (unsigned char)value;
+        }
+        return differences == 0 && missing >= 0;
+    }
+
+    uint32_t last = 0xFFFFFFFF;
+    int last_index = 0;
+    for (int col = 0; col < width; col++, pixel += 3)
+    {
+        uint32_t color = pixel_color(pixel);
+        if (color != last)
+        {
+            last = color;
+            last_index = index->lookup(color);
+            if (last_index < 0)
+            {
+                return false;
+            }
+        }
+        indices[col] = (unsigned char)last_index;
+    }
+    return true;
+}
+
+/**
+ * Description: Packs one index byte per pixel into a stored row of 1 or 4 bit pixels, the first
+ * pixel in the high bits of each byte
+ * @param pointer to the indices
+ * @param pointer to the stored row
+ * @param int width in pixels
+ * @param int bits per pixel, 1 or 4
+ * @return nothing
+ */
+
+void pack_index_row(const unsigned char *indices, unsigned char *stored, int width, int bits)
+{
+    int col = 0;
+    if (bits == 4)
+    {
+        for (; col + 2 <= width; col += 2)
+        {
+            *stored++ = (unsigned char)((indices[col] << 4) | indices[col + 1]);
+        }
+        if (col < width)
+        {
+            *stored = (unsigned char)(indices[col] << 4);
+        }
+        return;
+    }
+    for (; col + 8 <= width; col += 8)
+    {
+        const unsigned char *bit = indices + col;
+        *stored++ = (unsigned char)((bit[0] << 7) | (bit[1] << 6) | (bit[2] << 5) | (bit[3] << 4) | (bit[4] << 3) |
+                                    (bit[5] << 2) | (bit[6] << 1) | bit[7]);
+    }
+    unsigned char last = 0;
+    for (int shift = 7; col < width; col++, shift--)
+    {
+        last |= (unsigned char)(indices[col] << shift);
+    }
+    if (width % 8 != 0)
+    {
+        *stored = last;
+    }
+}
+
+// ________________________________________________________ Run length encoding
+
+/**
+ * Description: Measures the run of equal bytes starting at a position. Compares eight bytes at a
+ * time where the byte order allows, since thresholded rows are mostly long runs.
+ * @param pointer to the bytes
+ * @param int position of the run's first byte
+ * @param int position the run may not reach
+ * @return int run length, at least 1
+ */
+
+inline int run_length(const unsigned char *bytes, int start, int end)
+{
+    unsigned char value = bytes[start];
+    int pos = start + 1;
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    uint64_t pattern = value * 0x0101010101010101ULL;
+    for (; pos + 8 <= end; pos += 8)
+    {
+        uint64_t word;
+        memcpy(&word, bytes + pos, 8);
+        uint64_t difference = word ^ pattern;
+        if (difference != 0)
+        {
+            // The lowest set bit is in the first byte that differs
+            return pos + (__builtin_ctzll(difference) >> 3) - start;
+        }
+    }
+#endif
+    while (pos < end && bytes[pos] == value)
+    {
+        pos++;
+    }
+    return pos - start;
+}
+
+/**
+ * Description: Appends one row of colour table indices as BI_RLE8 or BI_RLE4 data, ending with
+ * an end of line marker. Runs of 3 or more become encoded runs; the pixels between them go into
+ * absolute segments.
+ * @param pointer to one index per pixel
+ * @param int width in pixels
+ * @param int bits per pixel, 8 or 4
+ * @param vector the data is appended to
+ * @return nothing
+ */
+
+void encode_rle_row(const unsigned char *indices, int width, int bits, vector<unsigned char> &out)
+{
+    const int MIN_RUN = 3; // shorter runs cost more as encoded runs than inside an absolute segment
+    int x = 0;
+    while (x < width)
+    {
+        int run = min(run_length(indices, x, width), 255);
+        if (run >= MIN_RUN)
+        {
+            out.push_back((unsigned char)run);
+            out.push_back(bits == 8 ? indices[x] : (unsigned char)(indices[x] * 0x11));
+            x += run;
+            continue;
+        }
+
+        // Gather pixels up to the next run worth encoding
+        int end = x + run;
+        while (end < width && end - x < 255)
+        {
+            int next = run_length(indices, end, width);
+            if (next >= MIN_RUN)
+            {
+                break;
+            }
+            end = min(end + next, x + 255);
+        }
+
+        if (end - x < 3)
+        {
+            // Absolute segments need at least 3 pixels, so a short gap is stored as runs
+            for (; x < end; x++)
+            {
+                out.push_back(1);
+                out.push_back(bits == 8 ? indices[x] : (unsigned char)(indices[x] << 4));
+            }
+            continue;
+        }
+
+        int count = end - x;
+        out.push_back(0);
+        out.push_back((unsigned char)count);
+        size_t stored = bits == 8 ? count : (count + 1) / 2;
+        if (bits == 8)
+        {
+            out.insert(out.end(), indices + x, indices + end);
+        }
+        else
+        {
+            for (int i = x; i < end; i += 2)
+            {
+                out.push_back((unsigned char)((indices[i] << 4) | (i + 1 < end ? indices[i + 1] : 0)));
+            }
+        }
+        if (stored % 2 != 0)
+        {
+            out.push_back(0); // segments are padded to a 16-bit word
+        }
+        x = end;
+    }
+    out.push_back(0);
+    out.push_back(0);
+}
+
+// ________________________________________________________ Indexed files
+
+/**
+ * Description: Builds a whole indexed BMP file in memory: headers, colour table and pixel
+ * indices packed 1, 4 or 8 to the byte, or run length encoded. With gray_ramp the table is the
+ * 256 grays and a pixel's index is its value. Run length encoding uses 4 bits for up to 16
+ * colours and 8 above, and gives way to plain packing when it comes out bigger.
+ * @param BGR Image
+ * @param vector of colours (ignored with gray_ramp)
+ * @param bool true for the 8 bit gray ramp
+ * @param bool true to try BI_RLE4 / BI_RLE8
+ * @param vector that receives the file bytes
+ * @return false if a pixel has a colour the table lacks
+ */
+
+bool pack_indexed_bmp(const Image &src, const vector<uint32_t> &colors, bool gray_ramp, bool rle,
+                      vector<unsigned char> &file)
+{
+    int palette_size = gray_ramp ? 256 : int(colors.size());
+    int bits = gray_ramp || palette_size > 16 ? 8 : rle || palette_size > 2 ? 4 : 1;
+    ColorIndex index;
+    short gray_index[256];
+    bool all_gray = true;
+    for (int value = 0; value < 256; value++)
+    {
+        gray_index[value] = gray_ramp ? value : -1;
+    }
+    for (int i = 0; !gray_ramp && i < palette_size; i++)
+    {
+        index.insert(colors[i]);
+        all_gray = all_gray && colors[i] % 0x010101 == 0 && colors[i] / 0x010101 < 256;
+        gray_index[colors[i] & 0xFF] = short(i);
+    }
+
+    unsigned char header[BMP_HEADER_BYTES];
+    uint64_t file_size = build_bmp_header(header, src.width, src.height, false, bits, palette_size);
+    size_t row_bytes = (size_t(src.width) * bits + 31) / 32 * 4;
+    size_t pixel_offset = BMP_HEADER_BYTES + palette_size * 4;
+    file.assign(rle ? pixel_offset : file_size, 0);
+    memcpy(file.data(), header, BMP_HEADER_BYTES);
+    unsigned char *table = file.data() + BMP_HEADER_BYTES;
+    for (int i = 0; i < palette_size; i++)
+    {
+        uint32_t color = gray_ramp ? uint32_t(i) * 0x010101 : colors[i];
+        table[i * 4] = color & 0xFF;
+        table[i * 4 + 1] = (color >> 8) & 0xFF;
+        table[i * 4 + 2] = (color >> 16) & 0xFF;
+    }
+
+    vector<unsigned char> indices(src.width);
+    if (rle)
+    {
+        for (int h = src.height - 1; h >= 0; h--)
+        {
+            if (!color_indices(src.row(h), indices.data(), src.width, all_gray ? NULL : &index, gray_index))
+            {
+                return false;
+            }
+            encode_rle_row(indices.data(), src.width, bits, file);
+            if (file.size() > file_size)
+            {
+                return pack_indexed_bmp(src, colors, gray_ramp, false, file);
+            }
+        }
+        // The last end of line becomes the end of bitmap
+        file.back() = 1;
+        unsigned char *dib_header = file.data() + BMP_FILE_HEADER_SIZE;
+        set_bytes(file.data(), 2, 4, file.size());
+        set_bytes(dib_header, 16, 4, bits == 8 ? BMP_BI_RLE8 : BMP_BI_RLE4);
+        set_bytes(dib_header, 20, 4, file.size() - pixel_offset);
+        return true;
+    }
+
+    // Pixel Array (bottom to top); the padding bytes are already zero
+    unsigned char *stored_row = file.data() + pixel_offset;
+    for (int h = src.height - 1; h >= 0; h--, stored_row += row_bytes)
+    {
+        unsigned char *row_indices = bits == 8 ? stored_row : indices.data();
+        if (!color_indices(src.row(h), row_indices, src.width, all_gray ? NULL : &index, gray_index))
+        {
+            return false;
+        }
+        if (bits != 8)
+        {
+            pack_index_row(row_indices, stored_row, src.width, bits);
+        }
+    }
+    return true;
+}
+
+/**
+ * Description: Encodes an image as an indexed BMP if its colours allow. A palette the caller
+ * vouched for (BMP_INDEX_GRAY, BMP_INDEX_PALETTE) skips the colour scan; if the image does not
+ * actually fit it, the colours are scanned as for BMP_INDEX_AUTO. Up to 2 colours give a 1 bit
+ * file, up to 16 a 4 bit file, and more an 8 bit file (a gray ramp when they are all grays);
+ * with options.rle, 4 and 8 bit run length encoded files when those are smaller.
+ * @param BGR Image
+ * @param BmpWriteOptions with indexing other than BMP_INDEX_NEVER
+ * @param vector that receives the file bytes
+ * @return false if the image has more than 256 colours
+ */
+
+bool encode_indexed_bmp(const Image &src, const BmpWriteOptions &options, vector<unsigned char> &file)
+{
+    if (options.indexing == BMP_INDEX_GRAY && pack_indexed_bmp(src, options.palette, true, options.rle, file))
+    {
+        return true;
+    }
+    if (options.indexing == BMP_INDEX_PALETTE && !options.palette.empty() && options.palette.size() <= 256 &&
+        pack_indexed_bmp(src, options.palette, false, options.rle, file))
+    {
+        return true;
+    }
+
+    vector<uint32_t> colors;
+    bool gray;
+    if (!collect_palette(src, colors, gray))
+    {
+        return false;
+    }
+    return pack_indexed_bmp(src, colors, gray && colors.size() > 16, options.rle, file);
+}
+
+// ________________________________________________________ Write an Image to BMP
+
+/**
+ * Description: Writes rows straight from the Image through a shared mapping of the output file
+ * @param string BMP file name
+ * @param BGR Image to save
+ * @param BMP header bytes
+ * @param uint64_t total file size
+ * @param BmpWriteOptions
+ * @return True if successful and false otherwise
+ */
+
+bool write_bmp_mapped(const string &filename, const Image &src, const unsigned char header[], uint64_t file_size,
+                      const BmpWriteOptions &options)
+{
+#ifdef IMGPROC_POSIX
+    int fd = ::open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        return false;
+    }
+    bool ok = ftruncate(fd, file_size) == 0;
+#ifdef __linux__
+    if (ok && options.preallocate)
+    {
+        posix_fallocate(fd, 0, file_size);
+    }
+#endif
+    void *address = ok ? mmap(nullptr, file_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+    if (address == MAP_FAILED)
+    {
+        ::close(fd);
+        return false;
+    }
+
+    unsigned char *out = static_cast<unsigned char *>(address);
+    size_t row_bytes = size_t(src.width) * 3;
+    size_t padded_bytes = (row_bytes + 3) / 4 * 4;
+    memcpy(out, header, BMP_HEADER_BYTES);
+    out += BMP_HEADER_BYTES;
+    // ftruncate zero fills, so the padding bytes are already correct
+    for (int h = src.height - 1; h >= 0; h--)
+    {
+        memcpy(out, src.row(h), row_bytes);
+        out += padded_bytes;
+    }
+
+    ok = munmap(address, file_size) == 0;
+    trace_bytes_written(file_size);
+    return ::close(fd) == 0 && ok;
+#else
+    (void)filename;
+    (void)src;
+    (void)header;
+    (void)file_size;
+    (void)options;
+    return false;
+#endif
+}
+
+/**
+ * Description: Writes an Image of any layout to a 24 bit BMP file. Rows are gathered straight
+ * from the Image buffer, together with their padding, into large write calls. Output is
+ * byte-identical to write_image() for the same pixels. When the options allow it, an image with
+ * at most 256 colours is written as a 1, 4 or 8 bit indexed file instead.
+ * @param string BMP file name to save the image to
+ * @param Image to save
+ * @param BmpWriteOptions controlling indexing, preallocation, mmap output and write size
+ * @return True if successful and false otherwise
+ */
+
+bool write_bmp(const string &filename, const Image &image, const BmpWriteOptions &options = BmpWriteOptions())
+{
+    TraceSpan span("write_bmp", -1, true);
+    Image scratch;
+    const Image &src = as_bgr(image, scratch);
+
+    vector<unsigned char> indexed;
+    if (options.indexing != BMP_INDEX_NEVER && encode_indexed_bmp(src, options, indexed))
+    {
+        span.set_value(indexed.size());
+        OutputFile file;
+        return file.open(filename) && file.append(indexed.data(), indexed.size()) && file.close();
+    }
+
+    unsigned char header[BMP_HEADER_BYTES];
+    uint64_t file_size = build_bmp_header(header, src.width, src.height);
+    span.set_value(file_size);
+
+    if (options.use_mmap && write_bmp_mapped(filename, src, header, file_size, options))
+    {
+        return true;
+    }
+
+    OutputFile file;
+    if (!file.open(filename))
+    {
+        return false;
+    }
+    if (options.preallocate)
+    {
+        file.preallocate(file_size);
+    }
+
+    static const unsigned char padding[3] = {0};
+    size_t row_bytes = size_t(src.width) * 3;
+    size_t padding_bytes = (4 - row_bytes % 4) % 4;
+
+    // Pixel Array (Left to right, bottom to top, with padding)
+    file.append(header, BMP_HEADER_BYTES);
+    for (int h = src.height - 1; h >= 0; h--)
+    {
+        file.append(src.row(h), row_bytes);
+        file.append(padding, padding_bytes);
+        if (file.pending_bytes() >= options.chunk_bytes && !file.flush())
+        {
+            return false;
+        }
+    }
+    return file.close();
+}
+
+// ________________________________________________________ Row kernel dispatch
+
+// Instruction sets the row kernels can use, from slowest to fastest
+enum SimdLevel
+{
+    SIMD_SCALAR,
+    SIMD_SSE41,
+    SIMD_AVX2,
+    SIMD_AVX512
+};
+
+typedef void (*RowKernel)(const unsigned char *src, unsigned char *dst, int width);
+typedef void (*ScaledRowKernel)(const unsigned char *src, unsigned char *dst, int width, double scaling_factor);
+typedef void (*BlendRowKernel)(const unsigned char *src_A, const unsigned char *src_B, unsigned char *dst,
+                               int width);
+typedef void (*WeightedBlendRowKernel)(const unsigned char *src_A, const unsigned char *src_B, unsigned char *dst,
+                                       int width, double weight_A, double weight_B);
+typedef void (*ReplicateRowKernel)(const unsigned char *src, unsigned char *dst, int width, int x_scale);
+typedef void (*VignetteRowKernel)(const unsigned char *src, unsigned char *dst, int width, const double *falloff,
+                                  int centre_x);
+typedef void (*TransposeKernel)(const unsigned char *const *src_rows, int src_count, unsigned char *const *dst_rows,
+                                int dst_count);
+typedef void (*AccumulateRowKernel)(const unsigned char *src, uint32_t *sums, int width, uint32_t weight);
+typedef void (*MedianRowKernel)(const unsigned char *const *rows, int frames, size_t offset, unsigned char *dst,
+                                int width);
+typedef void (*HalveRowKernel)(const unsigned char *top, const unsigned char *bottom, unsigned char *dst, int width);
+
+/**
+ * Description: The row kernels picked for one SimdLevel. Every entry gives bit-exact results with
+ * the scalar reference kernel of the same process; the scalar entries are the references.
+ */
+
+struct SimdKernels
+{
+    SimdLevel level;
+    RowKernel grayscale;
+    RowKernel high_contrast;
+    RowKernel quantize;
+    RowKernel mirror; // src and dst must not overlap
+    ScaledRowKernel lighten;
+    ScaledRowKernel darken;
+    BlendRowKernel blend;
+    WeightedBlendRowKernel weighted_blend;
+    TransposeKernel transpose; // see transpose_tile
+    ReplicateRowKernel replicate;
+    VignetteRowKernel vignette; // see vignette_row
+    AccumulateRowKernel accumulate; // see accumulate_row
+    RowKernel minimum;              // dst = min(dst, src), see min_row
+    RowKernel maximum;              // dst = max(dst, src), see max_row
+    MedianRowKernel median;         // see median_row
+    HalveRowKernel halve;           // see halve_row
+};
+
+const SimdKernels &simd_kernels();
+
+//***************************************************************************************************//
+// THREAD POOL
+//***************************************************************************************************//
+
+// ________________________________________________________ Pool
+
+/**
+ * Description: A fixed set of worker threads that run parallel_for jobs. The calling thread works
+ * on each job too, so a pool of N threads starts N - 1 workers. One job runs at a time; a
+ * parallel_for issued while another is running (from a body or from another thread) runs on the
+ * calling thread alone.
+ */
+
+class ThreadPool
+{
+public:
+    explicit ThreadPool(int threads)
+        : job(NULL), job_count(0), job_grain(1), next_chunk(0), busy(0), generation(0), stopping(false)
+    {
+        for (int i = 1; i < threads; i++)
+        {
+            workers.push_back(thread(&ThreadPool::work, this));
+        }
+    }
+
+    ~ThreadPool()
+    {
+        {
+            lock_guard<mutex> lock(state);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (size_t i = 0; i < workers.size(); i++)
+        {
+            workers[i].join();
+        }
+    }
+
+    int size() const
+    {
+        return int(workers.size()) + 1;
+    }
+
+    /**
+     * Description: Runs body(first, last) over [0, count) in chunks of `grain` items and returns
+     * when every chunk is done. Chunks may run on any thread in any order, so a body must only
+     * write data that belongs to its own chunk.
+     * @param int number of items
+     * @param int items per chunk
+     * @param function taking the first item and one past the last item of a chunk
+     * @return nothing
+     */
+
+    void parallel_for(int count, int grain, const function<void(int, int)> &body)
+    {
+        grain = max(grain, 1);
+        unique_lock<mutex> running(job_running, try_to_lock);
+        if (workers.empty() || count <= grain || !running.owns_lock())
+        {
+            for (int first = 0; first < count; first += grain)
+            {
+                TraceSpan span("band", min(count, first + grain) - first);
+                body(first, min(count, first + grain));
+            }
+            return;
+        }
+
+        {
+            lock_guard<mutex> lock(state);
+            job = &body;
+            job_count = count;
+            job_grain = grain;
+            next_chunk = 0;
+            busy = int(workers.size());
+            generation++;
+        }
+        wake.notify_all();
+        run_chunks();
+
+        unique_lock<mutex> lock(state);
+        done.wait(lock, [this] { return busy == 0; });
+        job = NULL;
+    }
+
+private:
+    vector<thread> workers;
+    mutex job_running; // held by the thread that owns the current job
+    mutex state;       // guards everything below except next_chunk
+    condition_variable wake;
+    condition_variable done;
+    const function<void(int, int)> *job;
+    int job_count;
+    int job_grain;
+    atomic<int> next_chunk;
+    int busy; // workers that have not finished the current job
+    unsigned generation;
+    bool stopping;
+
+    ThreadPool(const ThreadPool &);
+    ThreadPool &operator=(const ThreadPool &);
+
+    // Takes chunks of the current job until none are left
+    void run_chunks()
+    {
+        int chunks = (job_count + job_grain - 1) / job_grain;
+        for (int chunk = next_chunk++; chunk < chunks; chunk = next_chunk++)
+        {
+            int first = chunk * job_grain;
+            TraceSpan span("band", min(job_count, first + job_grain) - first);
+            (*job)(first, min(job_count, first + job_grain));
+        }
+    }
+
+    void work()
+    {
+        trace_thread_name() = "pool worker";
+        unsigned seen = 0;
+        while (true)
+        {
+            {
+                unique_lock<mutex> lock(state);
+                wake.wait(lock, [&] { return stopping || generation != seen; });
+                if (stopping)
+                {
+                    return;
+                }
+                seen = generation;
+            }
+            run_chunks();
+
+            lock_guard<mutex> lock(state);
+            if (--busy == 0)
+            {
+                done.notify_one();
+            }
+        }
+    }
+};
+
+// ________________________________________________________ Shared pool
+
+/**
+ * Description: Picks the default thread count: the IMGPROC_THREADS environment variable if it
+ * holds a positive number, otherwise one thread per hardware thread
+ * @return int thread count
+ */
+
+int default_thread_count()
+{
+    const char *value = getenv("IMGPROC_THREADS");
+    if (value != NULL && atoi(value) > 0)
+    {
+        return atoi(value);
+    }
+    return max(1, int(thread::hardware_concurrency()));
+}
+
+/**
+ * Description: Holds the shared pool, created on first use
+ * @return reference to the pointer holding the pool
+ */
+
+unique_ptr<ThreadPool> &shared_thread_pool()
+{
+    static unique_ptr<ThreadPool> pool(new ThreadPool(default_thread_count()));
+    return pool;
+}
+
+/**
+ * Description: Gets the shared pool that runs the process functions
+ * @return reference to the ThreadPool
+ */
+
+ThreadPool &thread_pool()
+{
+    return *shared_thread_pool();
+}
+
+/**
+ * Description: Replaces the shared pool with one of a new size. Must not be called while the
+ * pool is running a job.
+ * @param int thread count, 1 runs everything on the calling thread
+ * @return nothing
+ */
+
+void set_thread_count(int threads)
+{
+    unique_ptr<ThreadPool> &pool = shared_thread_pool();
+    pool.reset();
+    pool.reset(new ThreadPool(max(1, threads)));
+}
+
+// ________________________________________________________ Row bands
+
+// Fallback L2 cache size when the system does not report one
+const long DEFAULT_L2_BYTES = 256 * 1024;
+
+/**
+ * Description: Picks how many rows go in one band so the rows a band reads and writes stay in
+ * half of the L2 cache
+ * @param size of the data one output row touches (its source and destination bytes)
+ * @return int rows per band, at least 1
+ */
+
+int band_rows(size_t row_bytes)
+{
+    static long l2_bytes = 0;
+    if (l2_bytes == 0)
+    {
+        long reported = 0;
+#if defined(IMGPROC_POSIX) && defined(_SC_LEVEL2_CACHE_SIZE)
+        reported = sysconf(_SC_LEVEL2_CACHE_SIZE);
+#endif
+        l2_bytes = reported > 0 ? reported : DEFAULT_L2_BYTES;
+    }
+    return int(max<size_t>(1, size_t(l2_bytes / 2) / max<size_t>(row_bytes, 1)));
+}
+
+/**
+ * Description: Runs body(first, last) over the rows [0, height) in L2-sized bands on the shared
+ * pool. Image rows start on their own 64 byte cache lines, so bands that write disjoint rows
+ * never share a cache line; each row is computed the same way on any thread, so results do not
+ * depend on the thread count.
+ * @param int number of rows
+ * @param size of the data one output row touches (its source and destination bytes)
+ * @param function taking the first row and one past the last row of a band
+ * @return nothing
+ */
+
+void parallel_rows(int height, size_t row_bytes, const function<void(int, int)> &body)
+{
+    thread_pool().parallel_for(height, band_rows(row_bytes), body);
+}
+
+// ________________________________________________________ Bounded queue
+
+/**
+ * Description: Waits a little longer on each call: spins first, then yields, then sleeps, so a
+ * stage waiting on a slow neighbour does not take the CPU from it
+ * @param int number of times the caller has waited so far, incremented here
+ * @return nothing
+ */
+
+inline void queue_backoff(int &attempts)
+{
+    attempts++;
+    if (attempts < 16)
+    {
+        return;
+    }
+    if (attempts < 64)
+    {
+        this_thread::yield();
+        return;
+    }
+    this_thread::sleep_for(chrono::microseconds(100));
+}
+
+/**
+ * Description: A fixed size multi-producer multi-consumer queue without locks. Each cell carries
+ * a sequence number that tells producers and consumers whose turn it is, so a push or pop is one
+ * compare-and-swap on the shared position plus the copy. push() waits while the queue is full,
+ * which holds back a stage that runs ahead of the next one; pop() waits while it is empty, until
+ * close() says no more items are coming.
+ */
+
+template <typename T>
+class BoundedQueue
+{
+public:
+    // The capacity is rounded up to a power of two, at least 2 (with one cell the sequence numbers
+    // of "full" and "free for the next push" would be the same)
+    explicit BoundedQueue(size_t min_capacity)
+        : capacity(2), enqueue_pos(0), dequeue_pos(0), closed(false)
+    {
+        while (capacity < min_capacity)
+        {
+            capacity *= 2;
+        }
+        cells.reset(new Cell[capacity]);
+        for (size_t i = 0; i < capacity; i++)
+        {
+            cells[i].sequence.store(i, memory_order_relaxed);
+        }
+    }
+
+    bool try_push(const T &value)
+    {
+        size_t pos = enqueue_pos.load(memory_order_relaxed);
+        while (true)
+        {
+            Cell &cell = cells[pos & (capacity - 1)];
+            ptrdiff_t turn = ptrdiff_t(cell.sequence.load(memory_order_acquire) - pos);
+            if (turn == 0)
+            {
+                if (enqueue_pos.compare_exchange_weak(pos, pos + 1, memory_order_relaxed))
+                {
+                    cell.value = value;
+                    cell.sequence.store(pos + 1, memory_order_release);
+                    return true;
+                }
+            }
+            else if (turn < 0)
+            {
+                return false; // full
+            }
+            else
+            {
+                pos = enqueue_pos.load(memory_order_relaxed);
+            }
+        }
+    }
+
+    bool try_pop(T &value)
+    {
+        size_t pos = dequeue_pos.load(memory_order_relaxed);
+        while (true)
+        {
+            Cell &cell = cells[pos & (capacity - 1)];
+            ptrdiff_t turn = ptrdiff_t(cell.sequence.load(memory_order_acquire) - (pos + 1));
+            if (turn == 0)
+            {
+                if (dequeue_pos.compare_exchange_weak(pos, pos + 1, memory_order_relaxed))
+                {
+                    value = cell.value;
+                    cell.sequence.store(pos + capacity, memory_order_release);
+                    return true;
+                }
+            }
+            else if (turn < 0)
+            {
+                return false; // empty
+            }
+            else
+            {
+                pos = dequeue_pos.load(memory_order_relaxed);
+            }
+        }
+    }
+
+    void push(const T &value)
+    {
+        int attempts = 0;
+        while (!try_push(value))
+        {
+            queue_backoff(attempts);
+        }
+    }
+
+    // Returns false once the queue is closed and empty
+    bool pop(T &value)
+    {
+        int attempts = 0;
+        while (true)
+        {
+            bool was_closed = closed.load(memory_order_acquire);
+            if (try_pop(value))
+            {
+                return true;
+            }
+            if (was_closed)
+            {
+                return false;
+            }
+            queue_backoff(attempts);
+        }
+    }
+
+    // Called after the last push
+    void close()
+    {
+        closed.store(true, memory_order_release);
+    }
+
+private:
+    struct Cell
+    {
+        atomic<size_t> sequence;
+        T value;
+    };
+
+    size_t capacity;
+    unique_ptr<Cell[]> cells;
+    // Producers and consumers update different positions; keep them on separate cache lines
+    alignas(64) atomic<size_t> enqueue_pos;
+    alignas(64) atomic<size_t> dequeue_pos;
+    atomic<bool> closed;
+};
+
+//***************************************************************************************************//
+// D4 TRANSFORMS
+//***************************************************************************************************//
+
+// ________________________________________________________ Orientation
+
+/**
+ * Description: One of the 8 rotations and mirrors of a rectangle. The image is first transposed
+ * (if `transpose`), then mirrored left to right (`flip_x`) and top to bottom (`flip_y`).
+ */
+
+struct Orientation
+{
+    bool transpose;
+    bool flip_x;
+    bool flip_y;
+
+    Orientation(bool transposed = false, bool mirrored_x = false, bool mirrored_y = false)
+        : transpose(transposed), flip_x(mirrored_x), flip_y(mirrored_y)
+    {
+    }
+
+    bool is_identity() const
+    {
+        return !transpose && !flip_x && !flip_y;
+    }
+};
+
+/**
+ * Description: Orientation for a number of 90 degree clockwise rotations
+ * @param int number of rotations (any integer)
+ * @return the matching Orientation
+ */
+
+Orientation rotation_orientation(int num)
+{
+    int turns = ((num % 4) + 4) % 4;
+    if (turns == 1)
+    {
+        return Orientation(true, true, false);
+    }
+    if (turns == 2)
+    {
+        return Orientation(false, true, true);
+    }
+    if (turns == 3)
+    {
+        return Orientation(true, false, true);
+    }
+    return Orientation();
+}
+
+/**
+ * Description: Combines two orientations into the single one that applies `first` then `second`
+ * @param Orientation applied first
+ * @param Orientation applied second
+ * @return the combined Orientation
+ */
+
+Orientation compose_orientation(const Orientation &first, const Orientation &second)
+{
+    // Transposing swaps which axis the first orientation's mirrors end up on
+    if (second.transpose)
+    {
+        return Orientation(first.transpose != second.transpose, second.flip_x != first.flip_y,
+                           second.flip_y != first.flip_x);
+    }
+    return Orientation(first.transpose, second.flip_x != first.flip_x, second.flip_y != first.flip_y);
+}
+
+// ________________________________________________________ Transpose tiles
+
+/**
+ * Description: Copies pixel k of source row j to pixel j of destination row k for
+ * j in [first_src, last_src) and k in [first_dst, last_dst)
+ * @param array of source row pointers
+ * @param array of destination row pointers
+ * @param int first source row
+ * @param int one past the last source row
+ * @param int first destination row
+ * @param int one past the last destination row
+ * @return nothing
+ */
+
+void transpose_pixels(const unsigned char *const *src_rows, unsigned char *const *dst_rows, int first_src,
+                      int last_src, int first_dst, int last_dst)
+{
+    for (int k = first_dst; k < last_dst; k++)
+    {
+        unsigned char *new_pixel = dst_rows[k] + first_src * 3;
+        for (int j = first_src; j < last_src; j++)
+        {
+            const unsigned char *this_pixel = src_rows[j] + k * 3;
+            new_pixel[0] = this_pixel[0];
+            new_pixel[1] = this_pixel[1];
+            new_pixel[2] = this_pixel[2];
+            new_pixel += 3;
+        }
+    }
+}
+
+/**
+ * Description: Transposes one tile: pixel k of source row j goes to pixel j of destination row k.
+ * The rows are passed as pointers, so the caller mirrors a tile by ordering them.
+ * @param array of src_count source row pointers, each with dst_count pixels
+ * @param int number of source rows
+ * @param array of dst_count destination row pointers, each with room for src_count pixels
+ * @param int number of destination rows
+ * @return nothing
+ */
+
+void transpose_tile(const unsigned char *const *src_rows, int src_count, unsigned char *const *dst_rows,
+                    int dst_count)
+{
+    transpose_pixels(src_rows, dst_rows, 0, src_count, 0, dst_count);
+}
+
+// ________________________________________________________ Views
+
+/**
+ * Description: A lazy rotation, mirror and crop of an Image. A view only records where its pixels
+ * come from: a window of the source image and the Orientation applied to that window. Rotating,
+ * mirroring or cropping a view composes into a new view without touching a pixel, so a chain of
+ * them costs one pass when materialize_view() or write_bmp() finally produces the pixels. The
+ * source must outlive its views and must not change while they are used.
+ */
+
+class ImageView
+{
+public:
+    explicit ImageView(const Image &image, const Orientation &orientation = Orientation())
+        : image(&image), left(0), top(0), window_width(image.width), window_height(image.height),
+          orient(orientation)
+    {
+    }
+
+    int width() const
+    {
+        return orient.transpose ? window_height : window_width;
+    }
+
+    int height() const
+    {
+        return orient.transpose ? window_width : window_height;
+    }
+
+    const Image &source() const
+    {
+        return *image;
+    }
+
+    const Orientation &orientation() const
+    {
+        return orient;
+    }
+
+    // Columns [window_left(), window_left() + window width) of the source are in the view
+    int window_left() const
+    {
+        return left;
+    }
+
+    // Rows [window_top(), window_top() + window height) of the source are in the view
+    int window_top() const
+    {
+        return top;
+    }
+
+    // True when the view shows its whole source as it is
+    bool is_source() const
+    {
+        return orient.is_identity() && window_width == image->width && window_height == image->height;
+    }
+
+    // The same view of another image of the source's size, such as the source in another layout
+    ImageView rebased(const Image &other) const
+    {
+        ImageView view = *this;
+        view.image = &other;
+        return view;
+    }
+
+    // The view with `step` applied after its own orientation
+    ImageView transformed(const Orientation &step) const
+    {
+        ImageView view = *this;
+        view.orient = compose_orientation(orient, step);
+        return view;
+    }
+
+    // The view turned clockwise by num quarter turns
+    ImageView rotated(int num) const
+    {
+        return transformed(rotation_orientation(num));
+    }
+
+    /**
+     * Description: Crops the view to a rectangle, clipped to the view. The rectangle is in view
+     * coordinates; undoing the flips and then the transpose finds the window it shows.
+     * @param int left column
+     * @param int top row
+     * @param int width in pixels
+     * @param int height in pixels
+     * @return the cropped view
+     */
+
+    ImageView cropped(int x, int y, int crop_width, int crop_height) const
+    {
+        int x0 = max(0, x);
+        int y0 = max(0, y);
+        int x1 = max(x0, min(width(), x + crop_width));
+        int y1 = max(y0, min(height(), y + crop_height));
+        if (orient.flip_x)
+        {
+            swap(x0, x1);
+            x0 = width() - x0;
+            x1 = width() - x1;
+        }
+        if (orient.flip_y)
+        {
+            swap(y0, y1);
+            y0 = height() - y0;
+            y1 = height() - y1;
+        }
+        if (orient.transpose)
+        {
+            swap(x0, y0);
+            swap(x1, y1);
+        }
+        ImageView view = *this;
+        view.left += x0;
+        view.top += y0;
+        view.window_width = x1 - x0;
+        view.window_height = y1 - y0;
+        return view;
+    }
+
+private:
+    const Image *image;
+    int left;
+    int top;
+    int window_width;
+    int window_height;
+    Orientation orient;
+};
+
+// ________________________________________________________ Engine
+
+// Tile edge in pixels: one tile's source and destination (2 x 64 x 64 x 3 bytes) fit in L1
+const int TRANSFORM_TILE = 64;
+
+/**
+ * Description: Produces the pixels of a view in a single pass. Orientations without a transpose
+ * copy or mirror whole rows; the others run in 64 x 64 pixel tiles through the transpose kernel,
+ * one band of 64 output rows per thread pool chunk.
+ * @param ImageView
+ * @param Image that receives the result, reusing its buffer (must not be the view's source)
+ * @return nothing
+ */
+
+void materialize_view(const ImageView &view, Image &new_img)
+{
+    Image scratch;
+    const Image &src = as_bgr(view.source(), scratch);
+    const Orientation &orientation = view.orientation();
+    int width = view.width();
+    int height = view.height();
+    new_img.reshape(width, height);
+    const SimdKernels &kernels = simd_kernels();
+    // Row r of the window the view shows
+    auto window_row = [&](int r)
+    {
+        return src.row(view.window_top() + r) + size_t(view.window_left()) * 3;
+    };
+
+    if (!orientation.transpose)
+    {
+        parallel_rows(height, size_t(width) * 6, [&](int first, int last)
+        {
+            for (int row = first; row < last; row++)
+            {
+                const unsigned char *src_row = window_row(orientation.flip_y ? height - 1 - row : row);
+                if (orientation.flip_x)
+                {
+                    kernels.mirror(src_row, new_img.row(row), width);
+                }
+                else
+                {
+                    memcpy(new_img.row(row), src_row, size_t(width) * 3);
+                }
+            }
+        });
+        return;
+    }
+
+    // Output pixel (x, y) is window pixel (row x, column y) after the flips, so the window rows
+    // of a tile are its output columns and its window columns are its output rows
+    thread_pool().parallel_for(height, TRANSFORM_TILE, [&](int first, int last)
+    {
+        const unsigned char *src_rows[TRANSFORM_TILE];
+        unsigned char *dst_rows[TRANSFORM_TILE];
+        int count = last - first;
+        int first_col = orientation.flip_y ? height - last : first;
+
+        for (int x = 0; x < width; x += TRANSFORM_TILE)
+        {
+            int tile_width = min(TRANSFORM_TILE, width - x);
+            for (int j = 0; j < tile_width; j++)
+            {
+                int src_row = orientation.flip_x ? width - 1 - (x + j) : x + j;
+                src_rows[j] = window_row(src_row) + first_col * 3;
+            }
+            for (int k = 0; k < count; k++)
+            {
+                int dst_row = orientation.flip_y ? height - 1 - (first_col + k) : first_col + k;
+                dst_rows[k] = new_img.row(dst_row) + x * 3;
+            }
+            kernels.transpose(src_rows, tile_width, dst_rows, count);
+        }
+    });
+}
+
+/**
+ * Description: Produces the pixels of a view into a new image
+ * @param ImageView
+ * @return a new Image with the view's pixels
+ */
+
+Image materialize_view(const ImageView &view)
+{
+    Image new_img;
+    materialize_view(view, new_img);
+    return new_img;
+}
+
+/**
+ * Description: Applies one of the 8 rotations and mirrors in a single pass
+ * @param Image
+ * @param Orientation to apply
+ * @param Image that receives the result, reusing its buffer (must not be the source)
+ * @return nothing
+ */
+
+void transform_image(const Image &image, const Orientation &orientation, Image &new_img)
+{
+    materialize_view(ImageView(image, orientation), new_img);
+}
+
+/**
+ * Description: Applies one of the 8 rotations and mirrors into a new image
+ * @param Image
+ * @param Orientation to apply
+ * @return a new Image modified
+ */
+
+Image transform_image(const Image &image, const Orientation &orientation)
+{
+    Image new_img;
+    transform_image(image, orientation, new_img);
+    return new_img;
+}
+
+// ________________________________________________________ Writing views
+
+/**
+ * Description: Writes a view to a 24 bit BMP file in one pass, without materializing the whole
+ * view. Views that only reorder rows append the source rows themselves; the others are produced
+ * a band of rows at a time, bottom band first, into a buffer of about one write call. An indexed
+ * output needs the whole image to count its colours, so with indexing allowed the view is
+ * materialized and written by write_bmp(). Output is byte-identical to writing the materialized
+ * view.
+ * @param string BMP file name to save the view to
+ * @param ImageView to save
+ * @param BmpWriteOptions; use_mmap is not used for views
+ * @return True if successful and false otherwise
+ */
+
+bool write_bmp(const string &filename, const ImageView &view, const BmpWriteOptions &options = BmpWriteOptions())
+{
+    if (view.is_source() || options.indexing != BMP_INDEX_NEVER)
+    {
+        Image pixels;
+        if (!view.is_source())
+        {
+            materialize_view(view, pixels);
+        }
+        return write_bmp(filename, view.is_source() ? view.source() : pixels, options);
+    }
+
+    TraceSpan span("write_bmp", -1, true);
+    Image scratch;
+    const Image &src = as_bgr(view.source(), scratch);
+    ImageView bgr_view = view.rebased(src);
+    const Orientation &orientation = view.orientation();
+    int width = view.width();
+    int height = view.height();
+
+    unsigned char header[BMP_HEADER_BYTES];
+    uint64_t file_size = build_bmp_header(header, width, height);
+    span.set_value(file_size);
+    OutputFile file;
+    if (!file.open(filename))
+    {
+        return false;
+    }
+    if (options.preallocate)
+    {
+        file.preallocate(file_size);
+    }
+
+    static const unsigned char padding[3] = {0};
+    size_t row_bytes = size_t(width) * 3;
+    size_t padding_bytes = (4 - row_bytes % 4) % 4;
+    file.append(header, BMP_HEADER_BYTES);
+
+    if (!orientation.transpose && !orientation.flip_x)
+    {
+        for (int h = height - 1; h >= 0; h--)
+        {
+            int r = orientation.flip_y ? height - 1 - h : h;
+            file.append(src.row(view.window_top() + r) + size_t(view.window_left()) * 3, row_bytes);
+            file.append(padding, padding_bytes);
+            if (file.pending_bytes() >= options.chunk_bytes && !file.flush())
+            {
+                return false;
+            }
+        }
+        return file.close();
+    }
+
+    // Whole transpose tiles per band
+    int band_rows = int(min<size_t>(height, max<size_t>(1, options.chunk_bytes / max<size_t>(row_bytes, 1))));
+    band_rows = (band_rows + TRANSFORM_TILE - 1) / TRANSFORM_TILE * TRANSFORM_TILE;
+    Image band;
+    for (int last = height; last > 0; last -= band_rows)
+    {
+        int first = max(0, last - band_rows);
+        materialize_view(bgr_view.cropped(0, first, width, last - first), band);
+        for (int h = band.height - 1; h >= 0; h--)
+        {
+            file.append(band.row(h), row_bytes);
+            file.append(padding, padding_bytes);
+        }
+        // The band buffer is reused, so its rows must be out before the next band
+        if (!file.flush())
+        {
+            return false;
+        }
+    }
+    return file.close();
+}
+
+//***************************************************************************************************//
+// RESAMPLING
+//***************************************************************************************************//
+
+// ________________________________________________________ Integer enlarge
+
+/**
+ * Description: Repeats every pixel of one row x_scale times
+ * @param pointer to the BGR source row
+ * @param pointer to the BGR destination row, width * x_scale pixels
+ * @param int source width in pixels
+ * @param int number of copies of each pixel
+ * @return nothing
+ */
+
+void replicate_row(const unsigned char *this_pixel, unsigned char *new_pixel, int width, int x_scale)
+{
+    for (int col = 0; col < width; col++)
+    {
+        for (int copy = 0; copy < x_scale; copy++)
+        {
+            new_pixel[0] = this_pixel[0];
+            new_pixel[1] = this_pixel[1];
+            new_pixel[2] = this_pixel[2];
+            new_pixel += 3;
+        }
+        this_pixel += 3;
+    }
+}
+
+/**
+ * Description: Nearest neighbour enlarge by whole factors. Each source row is widened once by the
+ * replicate kernel and then copied to its other y_scale - 1 output rows with memcpy.
+ * @param Image
+ * @param int number to scale width (x), at least 1
+ * @param int number to scale height (y), at least 1
+ * @param Image that receives the result, reusing its buffer (must not be the source)
+ * @return nothing
+ */
+
+void enlarge_image(const Image &image, int x_scale, int y_scale, Image &new_img)
+{
+    Image scratch;
+    const Image &src = as_bgr(image, scratch);
+    int width = src.width;
+    new_img.reshape(width * x_scale, src.height * y_scale);
+    size_t new_row_bytes = size_t(new_img.width) * 3;
+    const SimdKernels &kernels = simd_kernels();
+
+    parallel_rows(src.height, new_row_bytes * y_scale, [&](int first, int last)
+    {
+        for (int row = first; row < last; row++)
+        {
+            unsigned char *first_copy = new_img.row(row * y_scale);
+            if (x_scale == 1)
+            {
+                memcpy(first_copy, src.row(row), new_row_bytes);
+            }
+            else
+            {
+                kernels.replicate(src.row(row), first_copy, width, x_scale);
+            }
+            for (int copy = 1; copy < y_scale; copy++)
+            {
+                memcpy(new_img.row(row * y_scale + copy), first_copy, new_row_bytes);
+            }
+        }
+    });
+}
+
+/**
+ * Description: Nearest neighbour enlarge by whole factors into a new image
+ * @param Image
+ * @param int number to scale width (x), at least 1
+ * @param int number to scale height (y), at least 1
+ * @return a new Image modified
+ */
+
+Image enlarge_image(const Image &image, int x_scale, int y_scale)
+{
+    Image new_img;
+    enlarge_image(image, x_scale, y_scale, new_img);
+    return new_img;
+}
+
+// ________________________________________________________ Filters
+
+// Interpolation filters for fractional resizing
+enum ResizeFilter
+{
+    FILTER_BILINEAR,
+    FILTER_BICUBIC,
+    FILTER_LANCZOS, // Lanczos with 3 lobes
+    FILTER_BOX      // area average: each source pixel weighs what it covers of the output pixel
+};
+
+/**
+ * Description: Gets the name of a ResizeFilter, as accepted by parse_resize_filter
+ * @param ResizeFilter
+ * @return name string
+ */
+
+string resize_filter_name(ResizeFilter filter)
+{
+    switch (filter)
+    {
+    case FILTER_BICUBIC:
+        return "bicubic";
+    case FILTER_LANCZOS:
+        return "lanczos";
+    case FILTER_BOX:
+        return "box";
+    default:
+        return "bilinear";
+    }
+}
+
+/**
+ * Description: Parses the name of a ResizeFilter
+ * @param string name (bilinear, bicubic, lanczos or box)
+ * @param ResizeFilter set when the name is known
+ * @return true if the name is known
+ */
+
+bool parse_resize_filter(const string &name, ResizeFilter &filter)
+{
+    for (int i = FILTER_BILINEAR; i <= FILTER_BOX; i++)
+    {
+        if (name == resize_filter_name(ResizeFilter(i)))
+        {
+            filter = ResizeFilter(i);
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Description: Gets how far a filter reaches from its center, in source pixels at scale 1
+ * @param ResizeFilter
+ * @return support radius
+ */
+
+double filter_support(ResizeFilter filter)
+{
+    return filter == FILTER_BOX ? 0.5 : filter == FILTER_BILINEAR ? 1.0 : filter == FILTER_BICUBIC ? 2.0 : 3.0;
+}
+
+/**
+ * Description: Evaluates a filter kernel
+ * @param ResizeFilter
+ * @param double distance from the center
+ * @return the unnormalized weight
+ */
+
+double filter_weight(ResizeFilter filter, double x)
+{
+    x = fabs(x);
+    if (filter == FILTER_BILINEAR)
+    {
+        return x < 1.0 ? 1.0 - x : 0.0;
+    }
+    if (filter == FILTER_BICUBIC)
+    {
+        // Keys cubic with a = -0.5
+        const double a = -0.5;
+        if (x < 1.0)
+        {
+            return ((a + 2.0) * x - (a + 3.0)) * x * x + 1.0;
+        }
+        if (x < 2.0)
+        {
+            return (((x - 5.0) * x + 8.0) * x - 4.0) * a;
+        }
+        return 0.0;
+    }
+    if (x >= 3.0)
+    {
+        return 0.0;
+    }
+    if (x < 1e-8)
+    {
+        return 1.0;
+    }
+    const double pi = 3.14159265358979323846;
+    return 3.0 * sin(pi * x) * sin(pi * x / 3.0) / (pi * pi * x * x);
+}
+
+// ________________________________________________________ Weight tables
+
+// Fixed point weights: 22 fraction bits leave room for 255 times a weight sum above 1
+const int RESAMPLE_BITS = 22;
+
+/**
+ * Description: Precomputed filter taps for one axis. Output position i reads `count[i]` source
+ * positions starting at `first[i]`, with weights at `weights[i * taps]`.
+ */
+
+struct ResampleWeights
+{
+    int taps;
+    vector<int> first;
+    vector<int> count;
+    vector<int> weights;
+};
+
+/**
+ * Description: Builds the filter taps for resampling one axis. Downscaling widens the filter by
+ * the scale so every source pixel contributes (antialiasing). Weights are normalized and stored
+ * in fixed point.
+ * @param int source size
+ * @param int output size
+ * @param ResizeFilter
+ * @return ResampleWeights
+ */
+
+ResampleWeights compute_resample_weights(int in_size, int out_size, ResizeFilter filter)
+{
+    double scale = double(in_size) / out_size;
+    double filter_scale = max(scale, 1.0);
+    double support = filter_support(filter) * filter_scale;
+
+    ResampleWeights table;
+    table.taps = int(ceil(support)) * 2 + 1;
+    table.first.resize(out_size);
+    table.count.resize(out_size);
+    table.weights.assign(size_t(out_size) * table.taps, 0);
+    vector<double> taps(table.taps);
+
+    for (int i = 0; i < out_size; i++)
+    {
+        double center = (i + 0.5) * scale;
+        // Pixels whose center is in reach; for the box filter, every pixel the output pixel overlaps
+        int first = filter == FILTER_BOX ? int(floor(center - support + 1e-9)) : int(center - support + 0.5);
+        int last = filter == FILTER_BOX ? int(ceil(center + support - 1e-9)) : int(center + support + 0.5);
+        first = max(0, first);
+        last = min(in_size, last);
+        int count = min(last - first, table.taps);
+
+        double total = 0.0;
+        for (int t = 0; t < count; t++)
+        {
+            if (filter == FILTER_BOX)
+            {
+                // How much of source pixel [first + t, first + t + 1) the output pixel covers
+                double left = max(double(first + t), center - support);
+                double right = min(double(first + t + 1), center + support);
+                taps[t] = max(0.0, right - left);
+            }
+            else
+            {
+                taps[t] = filter_weight(filter, (first + t - center + 0.5) / filter_scale);
+            }
+            total += taps[t];
+        }
+        table.first[i] = first;
+        table.count[i] = count;
+        for (int t = 0; t < count; t++)
+        {
+            double weight = total != 0.0 ? taps[t] / total : 0.0;
+            table.weights[size_t(i) * table.taps + t] = int(lround(weight * (1 << RESAMPLE_BITS)));
+        }
+    }
+    return table;
+}
+
+/**
+ * Description: Rounds a fixed point sum back to a channel value
+ * @param int sum in RESAMPLE_BITS fixed point, rounding offset included
+ * @return value clamped to 0 - 255
+ */
+
+inline unsigned char clamp_resampled(int sum)
+{
+    int value = sum >> RESAMPLE_BITS;
+    return value < 0 ? 0 : value > 255 ? 255 : value;
+}
+
+// ________________________________________________________ Resize
+
+/**
+ * Description: Resamples one row horizontally
+ * @param pointer to the BGR source row
+ * @param pointer to the BGR destination row
+ * @param ResampleWeights for the x axis
+ * @return nothing
+ */
+
+void resample_row(const unsigned char *src, unsigned char *dst, const ResampleWeights &table)
+{
+    int out_width = int(table.first.size());
+    for (int x = 0; x < out_width; x++)
+    {
+        const int *weight = &table.weights[size_t(x) * table.taps];
+        const unsigned char *this_pixel = src + table.first[x] * 3;
+        int blue = 1 << (RESAMPLE_BITS - 1);
+        int green = blue;
+        int red = blue;
+        for (int t = 0; t < table.count[x]; t++)
+        {
+            blue += this_pixel[0] * weight[t];
+            green += this_pixel[1] * weight[t];
+            red += this_pixel[2] * weight[t];
+            this_pixel += 3;
+        }
+        dst[0] = clamp_resampled(blue);
+        dst[1] = clamp_resampled(green);
+        dst[2] = clamp_resampled(red);
+        dst += 3;
+    }
+}
+
+/**
+ * Description: Resamples one row vertically
+ * @param Image holding the source rows the table refers to
+ * @param ResampleWeights for the y axis
+ * @param int output row index
+ * @param pointer to the destination row
+ * @param vector of one sum per destination byte, used as scratch
+ * @return nothing
+ */
+
+void resample_column_row(const Image &source, const ResampleWeights &table, int row, unsigned char *new_row,
+                         vector<int> &sums)
+{
+    int row_bytes = int(sums.size());
+    const int *weight = &table.weights[size_t(row) * table.taps];
+    fill(sums.begin(), sums.end(), 1 << (RESAMPLE_BITS - 1));
+    for (int t = 0; t < table.count[row]; t++)
+    {
+        const unsigned char *this_row = source.row(table.first[row] + t);
+        for (int i = 0; i < row_bytes; i++)
+        {
+            sums[i] += this_row[i] * weight[t];
+        }
+    }
+    for (int i = 0; i < row_bytes; i++)
+    {
+        new_row[i] = clamp_resampled(sums[i]);
+    }
+}
+
+/**
+ * Description: Resamples an image to a new size with a separable filter: a horizontal pass into
+ * an intermediate image, then a vertical pass. Axes that keep their size are skipped.
+ * @param Image
+ * @param int new width in pixels, at least 1
+ * @param int new height in pixels, at least 1
+ * @param ResizeFilter
+ * @param Image that receives the result, reusing its buffer (must not be the source)
+ * @param Image used as the intermediate when both axes change, reusing its buffer
+ * @return nothing
+ */
+
+void resize_image(const Image &image, int new_width, int new_height, ResizeFilter filter, Image &new_img,
+                  Image &widened)
+{
+    Image scratch;
+    const Image &src = as_bgr(image, scratch);
+
+    if (new_width == src.width && new_height == src.height)
+    {
+        new_img = src;
+        return;
+    }
+
+    const Image *rows = &src;
+    if (new_width != src.width)
+    {
+        // Only the horizontal pass: it writes the result directly
+        Image &target = new_height == src.height ? new_img : widened;
+        ResampleWeights table = compute_resample_weights(src.width, new_width, filter);
+        target.reshape(new_width, src.height);
+        parallel_rows(src.height, size_t(src.width + new_width) * 3, [&](int first, int last)
+        {
+            for (int row = first; row < last; row++)
+            {
+                resample_row(src.row(row), target.row(row), table);
+            }
+        });
+        if (new_height == src.height)
+        {
+            return;
+        }
+        rows = &widened;
+    }
+
+    const Image &source = *rows;
+    ResampleWeights table = compute_resample_weights(source.height, new_height, filter);
+    new_img.reshape(new_width, new_height);
+    int row_bytes = new_width * 3;
+    parallel_rows(new_height, size_t(row_bytes) * table.taps, [&](int first, int last)
+    {
+        vector<int> sums(row_bytes);
+        for (int row = first; row < last; row++)
+        {
+            resample_column_row(source, table, row, new_img.row(row), sums);
+        }
+    });
+}
+
+/**
+ * Description: Resamples an image to a new size into a new image
+ * @param Image
+ * @param int new width in pixels, at least 1
+ * @param int new height in pixels, at least 1
+ * @param ResizeFilter
+ * @return a new Image modified
+ */
+
+Image resize_image(const Image &image, int new_width, int new_height, ResizeFilter filter)
+{
+    Image new_img;
+    Image widened;
+    resize_image(image, new_width, new_height, filter, new_img, widened);
+    return new_img;
+}
+
+/**
+ * Description: Resizes an image by scale factors, rounding the new size to whole pixels
+ * @param Image
+ * @param double factor for the width, above 0
+ * @param double factor for the height, above 0
+ * @param ResizeFilter
+ * @param Image that receives the result, reusing its buffer (must not be the source)
+ * @param Image used as the intermediate, reusing its buffer
+ * @return nothing
+ */
+
+void scale_image(const Image &image, double x_factor, double y_factor, ResizeFilter filter, Image &new_img,
+                 Image &widened)
+{
+    int new_width = max(1, int(lround(image.width * x_factor)));
+    int new_height = max(1, int(lround(image.height * y_factor)));
+    resize_image(image, new_width, new_height, filter, new_img, widened);
+}
+
+/**
+ * Description: Resizes an image by scale factors into a new image
+ * @param Image
+ * @param double factor for the width, above 0
+ * @param double factor for the height, above 0
+ * @param ResizeFilter
+ * @return a new Image modified
+ */
+
+Image scale_image(const Image &image, double x_factor, double y_factor, ResizeFilter filter)
+{
+    Image new_img;
+    Image widened;
+    scale_image(image, x_factor, y_factor, filter, new_img, widened);
+    return new_img;
+}
+
+// ________________________________________________________ Box downscale
+
+/**
+ * Description: Halves a pair of rows in both directions: each output pixel is the rounded mean of
+ * a 2 x 2 block, (a + b + c + d + 2) >> 2. An odd last column is paired with itself.
+ * @param pointer to the upper BGR source row
+ * @param pointer to the lower BGR source row (the upper one again for an odd last row)
+ * @param pointer to the BGR destination row, (width + 1) / 2 pixels
+ * @param int source width in pixels
+ * @return nothing
+ */
+
+void halve_row(const unsigned char *top, const unsigned char *bottom, unsigned char *dst, int width)
+{
+    for (int x = 0; x < (width + 1) / 2; x++)
+    {
+        int left = x * 6;
+        int right = 2 * x + 1 < width ? left + 3 : left;
+        for (int c = 0; c < 3; c++)
+        {
+            dst[c] = (top[left + c] + top[right + c] + bottom[left + c] + bottom[right + c] + 2) >> 2;
+        }
+        dst += 3;
+    }
+}
+
+/**
+ * Description: Halves an image in both directions by averaging 2 x 2 blocks. Odd sizes round up,
+ * with the last row or column averaged with itself.
+ * @param Image
+ * @param Image that receives the result, reusing its buffer (must not be the source)
+ * @return nothing
+ */
+
+void halve_image(const Image &image, Image &new_img)
+{
+    Image scratch;
+    const Image &src = as_bgr(image, scratch);
+    int height = (src.height + 1) / 2;
+    new_img.reshape((src.width + 1) / 2, height);
+    const SimdKernels &kernels = simd_kernels();
+    parallel_rows(height, size_t(src.width) * 9, [&](int first, int last)
+    {
+        for (int row = first; row < last; row++)
+        {
+            kernels.halve(src.row(2 * row), src.row(min(2 * row + 1, src.height - 1)), new_img.row(row), src.width);
+        }
+    });
+}
+
+/**
+ * Description: Halves an image in both directions into a new image
+ * @param Image
+ * @return a new Image half the size, rounded up
+ */
+
+Image halve_image(const Image &image)
+{
+    Image new_img;
+    halve_image(image, new_img);
+    return new_img;
+}
+
+//***************************************************************************************************//
+// PROCESSES 1 - 10
+//***************************************************************************************************//
+
+// ________________________________________________________ PROCESS 1 Vignette
+
+/**
+ * Description: Where the vignette is centred and how fast it darkens, relative to the image size.
+ * The defaults give the classic effect: centred, and reaching black one image height away.
+ */
+
+struct VignetteShape
+{
+    double centre_x; // fraction of the width
+    double centre_y; // fraction of the height
+    double radius;   // fraction of the height
+
+    VignetteShape(double x = 0.5, double y = 0.5, double r = 1.0)
+        : centre_x(x), centre_y(y), radius(r)
+    {
+    }
+
+    bool operator==(const VignetteShape &other) const
+    {
+        return centre_x == other.centre_x && centre_y == other.centre_y && radius == other.radius;
+    }
+};
+
+/**
+ * Description: The scale factor of every pixel of one image size and VignetteShape. The falloff
+ * only depends on the distance to the centre along each axis, so one quadrant is stored:
+ * factors[dy * span + dx] for dy = |row - centre_y| and dx = |col - centre_x|.
+ */
+
+struct VignetteFalloff
+{
+    int width;
+    int height;
+    VignetteShape shape;
+    int centre_x;
+    int centre_y;
+    int span;
+    vector<double> factors;
+
+    const double *row(int row) const
+    {
+        return &factors[size_t(abs(row - centre_y)) * span];
+    }
+};
+
+/**
+ * Description: Computes the falloff table. Each factor is (radius - distance) / radius with the
+ * distance evaluated as in the original per-pixel formula, so results do not change; the squared
+ * offsets are separable and each factor is computed once for all four quadrants.
+ * @param int image width
+ * @param int image height
+ * @param VignetteShape
+ * @return the table
+ */
+
+shared_ptr<const VignetteFalloff> build_vignette_falloff(int width, int height, const VignetteShape &shape)
+{
+    shared_ptr<VignetteFalloff> falloff(new VignetteFalloff());
+    falloff->width = width;
+    falloff->height = height;
+    falloff->shape = shape;
+    falloff->centre_x = int(floor(shape.centre_x * width));
+    falloff->centre_y = int(floor(shape.centre_y * height));
+    falloff->span = max(falloff->centre_x, width - 1 - falloff->centre_x) + 1;
+    int rows = max(falloff->centre_y, height - 1 - falloff->centre_y) + 1;
+    falloff->factors.resize(size_t(rows) * falloff->span);
+
+    double radius = shape.radius * height;
+    vector<double> dx_squared(falloff->span);
+    for (int dx = 0; dx < falloff->span; dx++)
+    {
+        dx_squared[dx] = double(dx) * dx;
+    }
+
+    VignetteFalloff &table = *falloff;
+    thread_pool().parallel_for(rows, 16, [&](int first, int last)
+    {
+        for (int dy = first; dy < last; dy++)
+        {
+            double dy_squared = double(dy) * dy;
+            double *factor = &table.factors[size_t(dy) * table.span];
+            for (int dx = 0; dx < table.span; dx++)
+            {
+                factor[dx] = (radius - sqrt(dx_squared[dx] + dy_squared)) / radius;
+            }
+        }
+    });
+    return falloff;
+}
+
+// Falloff tables kept for reuse, so a batch of same-sized images computes the table once
+const size_t VIGNETTE_CACHE_SIZE = 4;
+
+// Larger falloff tables, or ones above a quarter of memory_budget(), are not built; each row's
+// factors are computed when the row is processed
+const size_t VIGNETTE_TABLE_MAX_BYTES = 256 << 20;
+
+/**
+ * Description: Checks whether the falloff table of an image size is small enough to build
+ * @param int image width
+ * @param int image height
+ * @param VignetteShape
+ * @return true if vignette_falloff() may be used
+ */
+
+bool vignette_table_fits(int width, int height, const VignetteShape &shape)
+{
+    int centre_x = int(floor(shape.centre_x * width));
+    int centre_y = int(floor(shape.centre_y * height));
+    size_t span = max(centre_x, width - 1 - centre_x) + 1;
+    size_t rows = max(centre_y, height - 1 - centre_y) + 1;
+    return rows * span * sizeof(double) <= min(VIGNETTE_TABLE_MAX_BYTES, memory_budget() / 4);
+}
+
+/**
+ * Description: Computes one row of the falloff table, with the same arithmetic as the table
+ * @param int image width
+ * @param int image height
+ * @param VignetteShape
+ * @param int row index
+ * @param vector that receives the factors, indexed by the distance from the centre column
+ * @return int centre column
+ */
+
+int vignette_falloff_row(int width, int height, const VignetteShape &shape, int row, vector<double> &factors)
+{
+    int centre_x = int(floor(shape.centre_x * width));
+    int centre_y = int(floor(shape.centre_y * height));
+    int span = max(centre_x, width - 1 - centre_x) + 1;
+    double radius = shape.radius * height;
+    double dy = abs(row - centre_y);
+    double dy_squared = dy * dy;
+    factors.resize(span);
+    for (int dx = 0; dx < span; dx++)
+    {
+        factors[dx] = (radius - sqrt(double(dx) * dx + dy_squared)) / radius;
+    }
+    return centre_x;
+}
+
+/**
+ * Description: Gets the falloff table for an image size and VignetteShape, from the cache of the
+ * most recently used tables when possible
+ * @param int image width
+ * @param int image height
+ * @param VignetteShape
+ * @return the table
+ */
+
+shared_ptr<const VignetteFalloff> vignette_falloff(int width, int height, const VignetteShape &shape)
+{
+    static mutex cache_mutex;
+    static vector<shared_ptr<const VignetteFalloff>> cache; // most recently used first
+
+    lock_guard<mutex> lock(cache_mutex);
+    for (size_t i = 0; i < cache.size(); i++)
+    {
+        if (cache[i]->width == width && cache[i]->height == height && cache[i]->shape == shape)
+        {
+            rotate(cache.begin(), cache.begin() + i, cache.begin() + i + 1);
+            return cache[0];
+        }
+    }
+    cache.insert(cache.begin(), build_vignette_falloff(width, height, shape));
+    if (cache.size() > VIGNETTE_CACHE_SIZE)
+    {
+        cache.pop_back();
+    }
+    return cache[0];
+}
+
+/**
+ * Description: Applies the vignette effect to one row
+ * @param pointer to the BGR source row
+ * @param pointer to the BGR destination row (may be the source row)
+ * @param int width in pixels
+ * @param pointer to the falloff row: the factor for a pixel d columns from the centre is at [d]
+ * @param int column of the centre (may be outside the row)
+ * @return nothing
+ */
+
+void vignette_row(const unsigned char *this_pixel, unsigned char *new_pixel, int width, const double *falloff,
+                  int centre_x)
+{
+    int red;
+    int green;
+    int blue;
+
+    double scaling_factor;
+
+    for (int col = 0; col < width; col++)
+    {
+        scaling_factor = falloff[abs(col - centre_x)];
+        blue = this_pixel[0] * scaling_factor;
+        green = this_pixel[1] * scaling_factor;
+        red = this_pixel[2] * scaling_factor;
+
+        new_pixel[0] = blue;
+        new_pixel[1] = green;
+        new_pixel[2] = red;
+        this_pixel += 3;
+        new_pixel += 3;
+    }
+}
+
+/**
+ * Description: Applies a vignette to one row of an image, looking its falloff table up
+ * @param VignetteShape
+ * @param pointer to the BGR source row
+ * @param pointer to the BGR destination row (may be the source row)
+ * @param int width in pixels
+ * @param int index of the row in the image
+ * @param int image height in pixels
+ * @return nothing
+ */
+
+void apply_vignette_row(const VignetteShape &shape, const unsigned char *src, unsigned char *dst, int width,
+                        int row, int height)
+{
+    if (!vignette_table_fits(width, height, shape))
+    {
+        static thread_local vector<double> factors;
+        int centre_x = vignette_falloff_row(width, height, shape, row, factors);
+        simd_kernels().vignette(src, dst, width, factors.data(), centre_x);
+        return;
+    }
+    shared_ptr<const VignetteFalloff> falloff = vignette_falloff(width, height, shape);
+    simd_kernels().vignette(src, dst, width, falloff->row(row), falloff->centre_x);
+}
+
+/**
+ * Description: Darkens an image away from a centre point
+ * @param Image
+ * @param VignetteShape
+ * @return a new Image modified
+ */
+
+Image vignette_image(const Image &image, const VignetteShape &shape)
+{
+    Image scratch;
+    const Image &src = as_bgr(image, scratch);
+    Image new_img(src.width, src.height);
+    if (!vignette_table_fits(src.width, src.height, shape))
+    {
+        parallel_rows(src.height, size_t(src.width) * 6, [&](int first, int last)
+        {
+            for (int row = first; row < last; row++)
+            {
+                apply_vignette_row(shape, src.row(row), new_img.row(row), src.width, row, src.height);
+            }
+        });
+        return new_img;
+    }
+    shared_ptr<const VignetteFalloff> falloff = vignette_falloff(src.width, src.height, shape);
+    VignetteRowKernel kernel = simd_kernels().vignette;
+
+    parallel_rows(src.height, size_t(src.width) * 6, [&](int first, int last)
+    {
+        for (int row = first; row < last; row++)
+        {
+            kernel(src.row(row), new_img.row(row), src.width, falloff->row(row), falloff->centre_x);
+        }
+    });
+    return new_img;
+}
+
+/**
+ * Description: Adds vignette effect to image (dark corners)
+ * @param Image
+ * @return a new Image modified
+ */
+
+Image process_1(const Image &image)
+{
+    TraceSpan span("process_1");
+    return vignette_image(image, VignetteShape());
+}
+
+// ________________________________________________________ PROCESS 2 Clarendon
+
+/**
+ * Description: Applies the Clarendon effect to one row
+ * @param pointer to the BGR source row
+ * @param pointer to the BGR destination row (may be the source row)
+ * @param int width in pixels
+ * @param floating point scaling factor number
+ * @return nothing
+ */
+
+void clarendon_row(const unsigned char *this_pixel, unsigned char *new_pixel, int width, double scaling_factor)
+{
+    int red;
+    int green;
+    int blue;
+
+    double avg_val;
+
+    for (int col = 0; col < width; col++)
+    {
+        blue = this_pixel[0];
+        green = this_pixel[1];
+        red = this_pixel[2];
+        avg_val = (red + green + blue) / 3;
+
+        if (avg_val > 169)
+        {
+            red = (255 - (255 - red) * scaling_factor);
+            green = (255 - (255 - green) * scaling_factor);
+            blue = (255 - (255 - blue) * scaling_factor);
+        }
+        if (avg_val < 90)
+        {
+            red = red * scaling_factor;
+            green = green * scaling_factor;
+            blue = blue * scaling_factor;
+        }
+
+        new_pixel[0] = blue;
+        new_pixel[1] = green;
+        new_pixel[2] = red;
+        this_pixel += 3;
+        new_pixel += 3;
+    }
+}
+
+/**
+ * Description: Adds Clarendon effect to image (darks darker and lights lighter) by a scaling factor
+ * @param Image
+ * @param floating point scaling factor number
+ * @return a new Image modified
+ */
+
+Image process_2(const Image &image, double scaling_factor)
+{
+    TraceSpan span("process_2");
+    Image scratch;
+    const Image &src = as_bgr(image, scratch);
+    Image new_img(src.width, src.height);
+
+    parallel_rows(src.height, size_t(src.width) * 6, [&](int first, int last)
+    {
+        for (int row = first; row < last; row++)
+        {
+            clarendon_row(src.row(row), new_img.row(row), src.width, scaling_factor);
+        }
+    });
+    return new_img;
+}
+// ________________________________________________________ PROCESS 3 Grayscale
+
+/**
+ * Description: Converts one row to grayscale
+ * @param pointer to the BGR source row
+ * @param pointer to the BGR destination row (may be the source row)
+ * @param int width in pixels
+ * @return nothing
+ */
+
+void grayscale_row(const unsigned char *this_pixel, unsigned char *new_pixel, int width)
+{
+    int gray_val;
+
+    for (int col = 0; col < width; col++)
+    {
+        gray_val = (this_pixel[0] + this_pixel[1] + this_pixel[2]) / 3;
+
+        new_pixel[0] = gray_val;
+        new_pixel[1] = gray_val;
+        new_pixel[2] = gray_val;
+        this_pixel += 3;
+        new_pixel += 3;
+    }
+}
+
+/**
+ * Description: Grayscale image.
+ * @param Image
+ * @return a new Image modified
+ */
+
+Image process_3(const Image &image)
+{
+    TraceSpan span("process_3");
+    Image scratch;
+    const Image &src = as_bgr(image, scratch);
+    Image new_img(src.width, src.height);
+    const SimdKernels &kernels = simd_kernels();
+
+    parallel_rows(src.height, size_t(src.width) * 6, [&](int first, int last)
+    {
+        for (int row = first; row < last; row++)
+        {
+            kernels.grayscale(src.row(row), new_img.row(row), src.width);
+        }
+    });
+    return new_img;
+}
+// ________________________________________________________ PROCESS 4 Rotate 90 degrees
+
+/**
+ * Description: Rotate image 90 degrees clockwise
+ * @param Image
+ * @return a new Image modified
+ */
+
+Image process_4(const Image &image)
+{
+    TraceSpan span("process_4");
+    return transform_image(image, rotation_orientation(1));
+}
+
+/**
+ * Description: Rotates a view 90 degrees clockwise without copying pixels
+ * @param ImageView
+ * @return the rotated ImageView
+ */
+
+ImageView process_4(const ImageView &view)
+{
+    return view.rotated(1);
+}
+
+// ________________________________________________________ PROCESS 5 Rotate multiple 90 degrees
+
+/**
+ * Description: Rotate image by 90 degrees.
+ * @param Image
+ * @return a new Image modified
+ */
+
+Image rotate_by_90(const Image &image)
+{
+    return transform_image(image, rotation_orientation(1));
+}
+
+/**
+ * Description: Finds the rotation process_5 applies for a number of quarter turns. As with the
+ * original chain of rotate_by_90 calls, any angle whose % 360 is not 0, 90 or 180 (which includes
+ * most negative angles) turns 270 degrees.
+ * @param integer multiple
+ * @return the Orientation to apply
+ */
+
+Orientation process_5_orientation(int num)
+{
+    int angle = num * 90;
+    if (angle % 360 == 0)
+    {
+        return Orientation();
+    }
+    if (angle % 360 == 90)
+    {
+        return rotation_orientation(1);
+    }
+    if (angle % 360 == 180)
+    {
+        return rotation_orientation(2);
+    }
+    return rotation_orientation(3);
+}
+
+/**
+ * Description: Rotates image by a specified number of multiples of 90 degrees clockwise
+ * @param Image
+ * @param integer multiple
+ * @return a new Image modified
+ */
+
+Image process_5(const Image &image, int num)
+{
+    TraceSpan span("process_5");
+    Orientation orientation = process_5_orientation(num);
+    if (orientation.is_identity())
+    {
+        return image;
+    }
+    // One direct pass per angle
+    return transform_image(image, orientation);
+}
+
+/**
+ * Description: Rotates a view by multiples of 90 degrees clockwise without copying pixels
+ * @param ImageView
+ * @param integer multiple
+ * @return the rotated ImageView
+ */
+
+ImageView process_5(const ImageView &view, int num)
+{
+    return view.transformed(process_5_orientation(num));
+}
+
+// ________________________________________________________ PROCESS 6 Enlarge
+
+/**
+ * Description: Enlarges the image in the x and y direction
+ * @param Image
+ * @param integer number to scale width (x)
+ * @param integer number to scale height (y)
+ * @return a new Image modified
+ */
+
+Image process_6(const Image &image, int x_scale, int y_scale)
+{
+    TraceSpan span("process_6");
+    return enlarge_image(image, x_scale, y_scale);
+}
+
+// ________________________________________________________ PROCESS 7 High contrast
+
+/**
+ * Description: Converts one row to high contrast (black and white only)
+ * @param pointer to the BGR source row
+ * @param pointer to the BGR destination row (may be the source row)
+ * @param int width in pixels
+ * @return nothing
+ */
+
+void high_contrast_row(const unsigned char *this_pixel, unsigned char *new_pixel, int width)
+{
+    int gray_val;
+
+    for (int col = 0; col < width; col++)
+    {
+        gray_val = (this_pixel[0] + this_pixel[1] + this_pixel[2]) / 3;
+
+        if (gray_val < 128)
+        {
+            new_pixel[0] = 0;
+            new_pixel[1] = 0;
+            new_pixel[2] = 0;
+        }
+        if (gray_val > 127)
+        {
+            new_pixel[0] = 255;
+            new_pixel[1] = 255;
+            new_pixel[2] = 255;
+        }
+        this_pixel += 3;
+        new_pixel += 3;
+    }
+}
+
+/**
+ * Description: Convert image to high contrast (black and white only)
+ * @param Image
+ * @return a new Image modified
+ */
+
+Image process_7(const Image &image)
+{
+    TraceSpan span("process_7");
+    Image scratch;
+    const Image &src = as_bgr(image, scratch);
+    Image new_img(src.width, src.height);
+    const SimdKernels &kernels = simd_kernels();
+
+    parallel_rows(src.height, size_t(src.width) * 6, [&](int first, int last)
+    {
+        for (int row = first; row < last; row++)
+        {
+            kernels.high_contrast(src.row(row), new_img.row(row), src.width);
+        }
+    });
+    return new_img;
+}
+// ________________________________________________________ PROCESS 8 Lighten
+
+/**
+ * Description: Lightens one row by a scaling factor
+ * @param pointer to the BGR source row
+ * @param pointer to the BGR destination row (may be the source row)
+ * @param int width in pixels
+ * @param floating point scaling factor for lightening image
+ * @return nothing
+ */
+
+void lighten_row(const unsigned char *this_pixel, unsigned char *new_pixel, int width, double scaling_factor)
+{
+    int value;
+
+    for (int i = 0; i < width * 3; i++)
+    {
+        value = 255 - (255 - this_pixel[i]) * scaling_factor;
+        new_pixel[i] = value;
+    }
+}
+
+/**
+ * Description: Lightens image by a scaling factor
+ * @param Image
+ * @param floating point scaling factor for lightening image
+ * @return a new Image modified
+ */
+
+Image process_8(const Image &image, double scaling_factor)
+{
+    TraceSpan span("process_8");
+    Image scratch;
+    const Image &src = as_bgr(image, scratch);
+    Image new_img(src.width, src.height);
+    const SimdKernels &kernels = simd_kernels();
+
+    parallel_rows(src.height, size_t(src.width) * 6, [&](int first, int last)
+    {
+        for (int row = first; row < last; row++)
+        {
+            kernels.lighten(src.row(row), new_img.row(row), src.width, scaling_factor);
+        }
+    });
+    return new_img;
+}
+
+// ________________________________________________________ PROCESS 9 Darken
+
+/**
+ * Description: Darkens one row by a scaling factor
+ * @param pointer to the BGR source row
+ * @param pointer to the BGR destination row (may be the source row)
+ * @param int width in pixels
+ * @param floating point scaling factor for darkening image
+ * @return nothing
+ */
+
+void darken_row(const unsigned char *this_pixel, unsigned char *new_pixel, int width, double scaling_factor)
+{
+    int value;
+
+    for (int i = 0; i < width * 3; i++)
+    {
+        value = this_pixel[i] * scaling_factor;
+        new_pixel[i] = value;
+    }
+}
+
+/**
+ * Description: Darkens image by a scaling factor
+ * @param Image
+ * @param floating point scaling factor for darkening image
+ * @return a new Image modified
+ */
+
+Image process_9(const Image &image, double scaling_factor)
+{
+    TraceSpan span("process_9");
+    Image scratch;
+    const Image &src = as_bgr(image, scratch);
+    Image new_img(src.width, src.height);
+    const SimdKernels &kernels = simd_kernels();
+
+    parallel_rows(src.height, size_t(src.width) * 6, [&](int first, int last)
+    {
+        for (int row = first; row < last; row++)
+        {
+            kernels.darken(src.row(row), new_img.row(row), src.width, scaling_factor);
+        }
+    });
+    return new_img;
+}
+
 // ________________________________________________________ PROCESS 10 Black, white, red, green, blue
 
 /**
- * Description: Selects the max value from a pixel, red, green or blue.
- * @param int red
- * @param int green
- * @param int blue
- * @return max value of the three rgb values
+ * Description: Selects the max value from a pixel, red, green or blue.
+ * @param int red
+ * @param int green
+ * @param int blue
+ * @return max value of the three rgb values
+ */
+
+int rgb_max(int red, int green, int blue)
+{
+    if (red >= green && red >= blue)
+    {
+        return red;
+    }
+    else if (green >= red && green >= blue)
+    {
+        return green;
+    }
+    else if (blue >= red && blue >= green)
+    {
+        return blue;
+    }
+    else if (red == green && green == blue)
+    {
+        return red;
+    }
+    return 0;
+}
+
+/**
+ * Description: Converts one row to only black, white, red, blue, and green
+ * @param pointer to the BGR source row
+ * @param pointer to the BGR destination row (may be the source row)
+ * @param int width in pixels
+ * @return nothing
+ */
+
+void quantize_row(const unsigned char *this_pixel, unsigned char *new_pixel, int width)
+{
+    int red;
+    int green;
+    int blue;
+    int max_color;
+    int sum_color;
+    int new_red;
+    int new_green;
+    int new_blue;
+
+    for (int col = 0; col < width; col++)
+    {
+        blue = this_pixel[0];
+        green = this_pixel[1];
+        red = this_pixel[2];
+
+        max_color = rgb_max(red, green, blue);
+        sum_color = red + green + blue;
+
+        if (sum_color > 549)
+        {
+            new_red = 255;
+            new_green = 255;
+            new_blue = 255;
+        }
+        else if (sum_color < 151)
+        {
+            new_red = 0;
+            new_green = 0;
+            new_blue = 0;
+        }
+        else if (max_color == red)
+        {
+            new_red = 255;
+            new_green = 0;
+            new_blue = 0;
+        }
+        else if (max_color == green)
+        {
+            new_red = 0;
+            new_green = 255;
+            new_blue = 0;
+        }
+        else
+        {
+            new_red = 0;
+            new_green = 0;
+            new_blue = 255;
+        }
+        new_pixel[0] = new_blue;
+        new_pixel[1] = new_green;
+        new_pixel[2] = new_red;
+        this_pixel += 3;
+        new_pixel += 3;
+    }
+}
+
+/**
+ * Description: Converts image to only black, white, red, blue, and green
+ * @param Image
+ * @return a new Image modified
+ */
+
+Image process_10(const Image &image)
+{
+    TraceSpan span("process_10");
+    Image scratch;
+    const Image &src = as_bgr(image, scratch);
+    Image new_img(src.width, src.height);
+    const SimdKernels &kernels = simd_kernels();
+
+    parallel_rows(src.height, size_t(src.width) * 6, [&](int first, int last)
+    {
+        for (int row = first; row < last; row++)
+        {
+            kernels.quantize(src.row(row), new_img.row(row), src.width);
+        }
+    });
+    return new_img;
+}
+
+// ________________________________________________________ Process 11 Mirror Horizontally
+
+/**
+ * Description: Mirrors one row horizontally
+ * @param pointer to the BGR source row
+ * @param pointer to the BGR destination row (must not overlap the source row)
+ * @param int width in pixels
+ * @return nothing
+ */
+
+void mirror_row(const unsigned char *this_pixel, unsigned char *new_pixel, int width)
+{
+    new_pixel += (width - 1) * 3;
+    for (int col = 0; col < width; col++)
+    {
+        new_pixel[0] = this_pixel[0];
+        new_pixel[1] = this_pixel[1];
+        new_pixel[2] = this_pixel[2];
+        this_pixel += 3;
+        new_pixel -= 3;
+    }
+}
+
+/**
+ * Description: Flips the image horizontally to make a mirrored image
+ * @param Image
+ * @return a new Image modified
+ */
+
+Image process_11(const Image &image)
+{
+    TraceSpan span("process_11");
+    return transform_image(image, Orientation(false, true, false));
+}
+
+/**
+ * Description: Mirrors a view horizontally without copying pixels
+ * @param ImageView
+ * @return the mirrored ImageView
+ */
+
+ImageView process_11(const ImageView &view)
+{
+    return view.transformed(Orientation(false, true, false));
+}
+
+// ________________________________________________________ Process 12 Mirror Vertically
+
+/**
+ * Description: Flips the image vertically to make a mirrored image
+ * @param Image
+ * @return a new Image modified
+ */
+
+Image process_12(const Image &image)
+{
+    TraceSpan span("process_12");
+    return transform_image(image, Orientation(false, false, true));
+}
+
+/**
+ * Description: Mirrors a view vertically without copying pixels
+ * @param ImageView
+ * @return the mirrored ImageView
+ */
+
+ImageView process_12(const ImageView &view)
+{
+    return view.transformed(Orientation(false, false, true));
+}
+
+// ________________________________________________________ Process 13 Mix 2 images
+
+/**
+ * Description: Blends two rows by averaging the pixels
+ * @param pointer to the BGR row of image A
+ * @param pointer to the BGR row of image B
+ * @param pointer to the BGR destination row (may be either source row)
+ * @param int width in pixels
+ * @return nothing
+ */
+
+void blend_row(const unsigned char *pixel_A, const unsigned char *pixel_B, unsigned char *new_pixel, int width)
+{
+    for (int i = 0; i < width * 3; i++)
+    {
+        new_pixel[i] = (pixel_A[i] + pixel_B[i]) / 2;
+    }
+}
+
+/**
+ * Description: Blends two images together by averaging the pixels
+ * @param Image
+ * @param Image for image B
+ * @return a new Image modified
+ */
+
+Image process_13(const Image &image, const Image &image_B)
+{
+    TraceSpan span("process_13");
+    Image scratch;
+    Image scratch_B;
+    const Image &src = as_bgr(image, scratch);
+    const Image &src_B = as_bgr(image_B, scratch_B);
+    int height = src.height;
+    int width = src.width;
+    Image new_img(width, height);
+
+    if (height != src_B.height || width != src_B.width)
+    {
+        return new_img;
+    }
+
+    const SimdKernels &kernels = simd_kernels();
+    parallel_rows(height, size_t(width) * 9, [&](int first, int last)
+    {
+        for (int row = first; row < last; row++)
+        {
+            kernels.blend(src.row(row), src_B.row(row), new_img.row(row), width);
+        }
+    });
+    return new_img;
+}
+
+// ________________________________________________________ Process 14 Weighted Mix 2 images
+
+/**
+ * Description: Blends two rows by computing weights and averaging the pixels
+ * @param pointer to the BGR row of image A
+ * @param pointer to the BGR row of image B
+ * @param pointer to the BGR destination row (may be either source row)
+ * @param int width in pixels
+ * @param floating point weight, between 0 and 1.
+ * @param floating point weight, between 0 and 1.
+ * @return nothing
+ */
+
+void weighted_blend_row(const unsigned char *pixel_A, const unsigned char *pixel_B, unsigned char *new_pixel,
+                        int width, double weight_A, double weight_B)
+{
+    int value_A;
+    int value_B;
+
+    for (int i = 0; i < width * 3; i++)
+    {
+        value_A = pixel_A[i] * weight_A;
+        value_B = pixel_B[i] * weight_B;
+        new_pixel[i] = (value_A + value_B) / 2;
+    }
+}
+
+/**
+ * Description: Blends two images together by computing weights and averaging the pixels
+ * @param Image
+ * @param Image for image B
+ * @param floating point weight, between 0 and 1.
+ * @param floating point weight, between 0 and 1.
+ * @return a new Image modified
+ */
+
+Image process_14(const Image &image, const Image &image_B, double weight_A, double weight_B)
+{
+    TraceSpan span("process_14");
+    Image scratch;
+    Image scratch_B;
+    const Image &src = as_bgr(image, scratch);
+    const Image &src_B = as_bgr(image_B, scratch_B);
+    int height = src.height;
+    int width = src.width;
+    Image new_img(width, height);
+
+    if (height != src_B.height || width != src_B.width)
+    {
+        return new_img;
+    }
+
+    const SimdKernels &kernels = simd_kernels();
+    parallel_rows(height, size_t(width) * 9, [&](int first, int last)
+    {
+        for (int row = first; row < last; row++)
+        {
+            kernels.weighted_blend(src.row(row), src_B.row(row), new_img.row(row), width, weight_A, weight_B);
+        }
+    });
+    return new_img;
+}
+
+// ________________________________________________________ Frame stacking kernels
+
+/**
+ * Description: Adds a weighted row of one frame to a row of running sums
+ * @param pointer to the BGR row of the frame
+ * @param pointer to width * 3 sums
+ * @param int width in pixels
+ * @param weight of the frame; the sums must not overflow 32 bits
+ * @return nothing
+ */
+
+void accumulate_row(const unsigned char *src, uint32_t *sums, int width, uint32_t weight)
+{
+    for (int i = 0; i < width * 3; i++)
+    {
+        sums[i] += src[i] * weight;
+    }
+}
+
+/**
+ * Description: Keeps the darker value of each channel of two rows
+ * @param pointer to the BGR row of the frame
+ * @param pointer to the BGR row of running minimums
+ * @param int width in pixels
+ * @return nothing
+ */
+
+void min_row(const unsigned char *src, unsigned char *dst, int width)
+{
+    for (int i = 0; i < width * 3; i++)
+    {
+        dst[i] = min(dst[i], src[i]);
+    }
+}
+
+/**
+ * Description: Keeps the lighter value of each channel of two rows
+ * @param pointer to the BGR row of the frame
+ * @param pointer to the BGR row of running maximums
+ * @param int width in pixels
+ * @return nothing
+ */
+
+void max_row(const unsigned char *src, unsigned char *dst, int width)
+{
+    for (int i = 0; i < width * 3; i++)
+    {
+        dst[i] = max(dst[i], src[i]);
+    }
+}
+
+/**
+ * Description: Finds the median of each channel over the rows of several frames, one bit at a time
+ * from the top: a bit is kept when enough frames reach the value with it set. Each of the 8 passes
+ * only compares and counts, so the work grows linearly with the frame count. For an even count
+ * this is the lower of the two middle values.
+ * @param array of pointers to the BGR rows of the frames
+ * @param int number of frames, at most 65535
+ * @param byte offset of the first channel within each row
+ * @param pointer to the destination bytes
+ * @param int width in pixels
+ * @return nothing
+ */
+
+void median_row(const unsigned char *const *rows, int frames, size_t offset, unsigned char *dst, int width)
+{
+    // The value of rank (frames - 1) / 2 is the largest one that at least this many frames reach
+    const int needed = frames - (frames - 1) / 2;
+    for (int i = 0; i < width * 3; i++)
+    {
+        int value = 0;
+        for (int bit = 128; bit > 0; bit >>= 1)
+        {
+            int threshold = value | bit;
+            int reached = 0;
+            for (int f = 0; f < frames; f++)
+            {
+                reached += rows[f][offset + i] >= threshold;
+            }
+            value = reached >= needed ? threshold : value;
+        }
+        dst[i] = (unsigned char)value;
+    }
+}
+
+//***************************************************************************************************//
+// SIMD ROW KERNELS
+//***************************************************************************************************//
+
+// ________________________________________________________ Shared helpers
+
+// Kernels that map each pixel on its own through the channel sum
+enum PixelKernelKind
+{
+    PIXEL_GRAY,     // process 3
+    PIXEL_CONTRAST, // process 7
+    PIXEL_QUANTIZE  // process 10
+};
+
+/**
+ * Description: Runs the scalar reference kernel of a PixelKernelKind, used for row tails
+ * @param PixelKernelKind
+ * @param pointer to the BGR source row
+ * @param pointer to the BGR destination row (may be the source row)
+ * @param int width in pixels
+ * @return nothing
+ */
+
+void scalar_pixel_kernel(PixelKernelKind kind, const unsigned char *src, unsigned char *dst, int width)
+{
+    if (kind == PIXEL_GRAY)
+    {
+        grayscale_row(src, dst, width);
+    }
+    else if (kind == PIXEL_CONTRAST)
+    {
+        high_contrast_row(src, dst, width);
+    }
+    else
+    {
+        quantize_row(src, dst, width);
+    }
+}
+
+#ifdef IMGPROC_X86_SIMD
+
+// The 32-bit lane layouts below hold one pixel each: B, G, R in bytes 0-2 and byte 3 unused.
+// The channel sum is at most 765, so sum * 0xAAAB >> 17 is exactly sum / 3; the sum fits the low
+// 16 bits of its lane, so the multiply runs on 16-bit halves (the high half stays 0).
+const short DIV3_MULTIPLIER = short(0xAAAB);
+const int DIV3_SHIFT = 17;
+
+// ________________________________________________________ SSE4.1
+
+/**
+ * Description: Loads exactly 4 packed BGR pixels (12 bytes) into the low bytes of a register
+ * @param pointer to the first pixel
+ * @return register holding the 12 bytes
+ */
+
+SIMD_TARGET_SSE41 inline __m128i load_4_pixels_sse41(const unsigned char *src)
+{
+    int tail;
+    memcpy(&tail, src + 8, 4);
+    return _mm_insert_epi32(_mm_loadl_epi64((const __m128i *)src), tail, 2);
+}
+
+/**
+ * Description: Stores the low 12 bytes of a register (4 packed BGR pixels), touching nothing else
+ * @param pointer to the first pixel
+ * @param register to store
+ * @return nothing
+ */
+
+SIMD_TARGET_SSE41 inline void store_4_pixels_sse41(unsigned char *dst, __m128i pixels)
+{
+    int tail = _mm_extract_epi32(pixels, 2);
+    _mm_storel_epi64((__m128i *)dst, pixels);
+    memcpy(dst + 8, &tail, 4);
+}
+
+/**
+ * Description: Maps 4 pixels held one per 32-bit lane
+ * @param pixels as B, G, R, 0 lanes
+ * @return the new pixels as B, G, R, x lanes
+ */
+
+template <int KIND>
+SIMD_TARGET_SSE41 inline __m128i map_pixels_sse41(__m128i pixels)
+{
+    __m128i sum = _mm_madd_epi16(_mm_maddubs_epi16(pixels, _mm_set1_epi32(0x00010101)), _mm_set1_epi16(1));
+    if (KIND == PIXEL_GRAY)
+    {
+        __m128i gray = _mm_srli_epi16(_mm_mulhi_epu16(sum, _mm_set1_epi16(DIV3_MULTIPLIER)), DIV3_SHIFT - 16);
+        return _mm_or_si128(gray, _mm_or_si128(_mm_slli_epi32(gray, 8), _mm_slli_epi32(gray, 16)));
+    }
+    if (KIND == PIXEL_CONTRAST)
+    {
+        return _mm_cmpgt_epi32(sum, _mm_set1_epi32(383));
+    }
+    __m128i byte_mask = _mm_set1_epi32(0xFF);
+    __m128i blue = _mm_and_si128(pixels, byte_mask);
+    __m128i green = _mm_and_si128(_mm_srli_epi32(pixels, 8), byte_mask);
+    __m128i red = _mm_srli_epi32(pixels, 16);
+
+    // Same priority as rgb_max: red, then green, then blue
+    __m128i color = _mm_blendv_epi8(_mm_set1_epi32(0xFF00), _mm_set1_epi32(0xFF), _mm_cmpgt_epi32(blue, green));
+    __m128i not_red = _mm_or_si128(_mm_cmpgt_epi32(green, red), _mm_cmpgt_epi32(blue, red));
+    color = _mm_blendv_epi8(_mm_set1_epi32(0xFF0000), color, not_red);
+    color = _mm_andnot_si128(_mm_cmpgt_epi32(_mm_set1_epi32(151), sum), color);
+    return _mm_or_si128(color, _mm_cmpgt_epi32(sum, _mm_set1_epi32(549)));
+}
+
+/**
+ * Description: Maps one row 4 pixels at a time. Each step loads 16 bytes and stores exactly 12,
+ * so the destination may be the source row.
+ * @param pointer to the BGR source row
+ * @param pointer to the BGR destination row (may be the source row)
+ * @param int width in pixels
+ * @return nothing
+ */
+
+template <int KIND>
+SIMD_TARGET_SSE41 void pixel_kernel_sse41(const unsigned char *src, unsigned char *dst, int width)
+{
+    const __m128i spread = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+    const __m128i pack = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+    int col = 0;
+
+    for (; col + 6 <= width; col += 4)
+    {
+        __m128i pixels = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(src + col * 3)), spread);
+        store_4_pixels_sse41(dst + col * 3, _mm_shuffle_epi8(map_pixels_sse41<KIND>(pixels), pack));
+    }
+    scalar_pixel_kernel(PixelKernelKind(KIND), src + col * 3, dst + col * 3, width - col);
+}
+
+/**
+ * Description: Lightens or darkens 4 bytes through doubles, exactly as lighten_row / darken_row
+ * @param pointer to 4 source bytes
+ * @param scaling factor in both lanes
+ * @return 4 results as 32-bit integers (only the low byte is stored)
+ */
+
+template <bool LIGHTEN>
+SIMD_TARGET_SSE41 inline __m128i scale_4_sse41(const unsigned char *src, __m128d factor)
+{
+    int bytes;
+    memcpy(&bytes, src, 4);
+    __m128i values = _mm_cvtepu8_epi32(_mm_cvtsi32_si128(bytes));
+    if (LIGHTEN)
+    {
+        values = _mm_sub_epi32(_mm_set1_epi32(255), values);
+    }
+    __m128d low = _mm_mul_pd(_mm_cvtepi32_pd(values), factor);
+    __m128d high = _mm_mul_pd(_mm_cvtepi32_pd(_mm_shuffle_epi32(values, _MM_SHUFFLE(1, 0, 3, 2))), factor);
+    if (LIGHTEN)
+    {
+        low = _mm_sub_pd(_mm_set1_pd(255), low);
+        high = _mm_sub_pd(_mm_set1_pd(255), high);
+    }
+    return _mm_unpacklo_epi64(_mm_cvttpd_epi32(low), _mm_cvttpd_epi32(high));
+}
+
+/**
+ * Description: Keeps the low byte of 16 32-bit integers, as the int to unsigned char stores do
+ * @param 4 vectors of 4 integers, in order
+ * @return 16 bytes
+ */
+
+SIMD_TARGET_SSE41 inline __m128i low_bytes_sse41(__m128i a, __m128i b, __m128i c, __m128i d)
+{
+    __m128i byte_mask = _mm_set1_epi32(0xFF);
+    __m128i ab = _mm_packus_epi32(_mm_and_si128(a, byte_mask), _mm_and_si128(b, byte_mask));
+    __m128i cd = _mm_packus_epi32(_mm_and_si128(c, byte_mask), _mm_and_si128(d, byte_mask));
+    return _mm_packus_epi16(ab, cd);
+}
+
+template <bool LIGHTEN>
+SIMD_TARGET_SSE41 void scale_row_sse41(const unsigned char *src, unsigned char *dst, int width, double scaling_factor)
+{
+    __m128d factor = _mm_set1_pd(scaling_factor);
+    // Whole 16 pixel blocks, so the scalar tail starts on a pixel
+    int count = (width - width % 16) * 3;
+    int i = 0;
+
+    for (; i + 16 <= count; i += 16)
+    {
+        __m128i out = low_bytes_sse41(scale_4_sse41<LIGHTEN>(src + i, factor),
+                                      scale_4_sse41<LIGHTEN>(src + i + 4, factor),
+                                      scale_4_sse41<LIGHTEN>(src + i + 8, factor),
+                                      scale_4_sse41<LIGHTEN>(src + i + 12, factor));
+        _mm_storeu_si128((__m128i *)(dst + i), out);
+    }
+    if (LIGHTEN)
+    {
+        lighten_row(src + i, dst + i, width - i / 3, scaling_factor);
+    }
+    else
+    {
+        darken_row(src + i, dst + i, width - i / 3, scaling_factor);
+    }
+}
+
+/**
+ * Description: Runs a vignette row as two spans with the given span kernels: left of the centre
+ * the distance falls towards the centre, so the falloff row is read backwards. The span kernels
+ * do whole groups of pixels and the scalar reference finishes each span.
+ * @param pointer to the BGR source row
+ * @param pointer to the BGR destination row (may be the source row)
+ * @param int width in pixels
+ * @param pointer to the falloff row
+ * @param int column of the centre
+ * @param span kernel reading the falloff backwards
+ * @param span kernel reading the falloff forwards
+ * @return nothing
+ */
+
+typedef int (*VignetteSpanKernel)(const unsigned char *src, unsigned char *dst, int count, const double *falloff);
+
+inline void vignette_row_spans(const unsigned char *src, unsigned char *dst, int width, const double *falloff,
+                               int centre_x, VignetteSpanKernel backward, VignetteSpanKernel forward)
+{
+    int left = min(max(centre_x, 0), width);
+    int done = 0;
+    if (left > 0)
+    {
+        done = backward(src, dst, left, falloff + centre_x);
+    }
+    vignette_row(src + done * 3, dst + done * 3, left - done, falloff, centre_x - done);
+    done = left;
+    if (left < width)
+    {
+        done += forward(src + left * 3, dst + left * 3, width - left, falloff + (left - centre_x));
+    }
+    vignette_row(src + done * 3, dst + done * 3, width - done, falloff, centre_x - done);
+}
+
+/**
+ * Description: Scales 4 bytes by per-byte factors through doubles, exactly as vignette_row
+ * @param pointer to 4 source bytes
+ * @param factors of the first two bytes
+ * @param factors of the last two bytes
+ * @return 4 results as 32-bit integers (only the low byte is stored)
+ */
+
+SIMD_TARGET_SSE41 inline __m128i falloff_4_sse41(const unsigned char *src, __m128d low_factor, __m128d high_factor)
+{
+    int bytes;
+    memcpy(&bytes, src, 4);
+    __m128i values = _mm_cvtepu8_epi32(_mm_cvtsi32_si128(bytes));
+    __m128d low = _mm_mul_pd(_mm_cvtepi32_pd(values), low_factor);
+    __m128d high = _mm_mul_pd(_mm_cvtepi32_pd(_mm_shuffle_epi32(values, _MM_SHUFFLE(1, 0, 3, 2))), high_factor);
+    return _mm_unpacklo_epi64(_mm_cvttpd_epi32(low), _mm_cvttpd_epi32(high));
+}
+
+/**
+ * Description: Vignettes 4 pixels at a time from the start of a span
+ * @param pointer to the BGR source span
+ * @param pointer to the BGR destination span (may be the source span)
+ * @param int pixels in the span
+ * @param pointer to the factor of the first pixel; REVERSED spans read the factors downwards
+ * @return int pixels done
+ */
+
+template <bool REVERSED>
+SIMD_TARGET_SSE41 int vignette_span_sse41(const unsigned char *src, unsigned char *dst, int count,
+                                          const double *falloff)
+{
+    int col = 0;
+    for (; col + 4 <= count; col += 4)
+    {
+        __m128d f01;
+        __m128d f23;
+        if (REVERSED)
+        {
+            f01 = _mm_loadu_pd(falloff - col - 1);
+            f23 = _mm_loadu_pd(falloff - col - 3);
+            f01 = _mm_shuffle_pd(f01, f01, 1);
+            f23 = _mm_shuffle_pd(f23, f23, 1);
+        }
+        else
+        {
+            f01 = _mm_loadu_pd(falloff + col);
+            f23 = _mm_loadu_pd(falloff + col + 2);
+        }
+        // 12 bytes take the factors f0 f0 f0 f1 | f1 f1 f2 f2 | f2 f3 f3 f3
+        const unsigned char *in = src + col * 3;
+        __m128i out = low_bytes_sse41(falloff_4_sse41(in, _mm_unpacklo_pd(f01, f01), f01),
+                                      falloff_4_sse41(in + 4, _mm_unpackhi_pd(f01, f01), _mm_unpacklo_pd(f23, f23)),
+                                      falloff_4_sse41(in + 8, f23, _mm_unpackhi_pd(f23, f23)), _mm_setzero_si128());
+        store_4_pixels_sse41(dst + col * 3, out);
+    }
+    return col;
+}
+
+SIMD_TARGET_SSE41 void vignette_row_sse41(const unsigned char *src, unsigned char *dst, int width,
+                                          const double *falloff, int centre_x)
+{
+    vignette_row_spans(src, dst, width, falloff, centre_x, vignette_span_sse41<true>, vignette_span_sse41<false>);
+}
+
+SIMD_TARGET_SSE41 void grayscale_row_sse41(const unsigned char *src, unsigned char *dst, int width)
+{
+    pixel_kernel_sse41<PIXEL_GRAY>(src, dst, width);
+}
+
+SIMD_TARGET_SSE41 void high_contrast_row_sse41(const unsigned char *src, unsigned char *dst, int width)
+{
+    pixel_kernel_sse41<PIXEL_CONTRAST>(src, dst, width);
+}
+
+SIMD_TARGET_SSE41 void quantize_row_sse41(const unsigned char *src, unsigned char *dst, int width)
+{
+    pixel_kernel_sse41<PIXEL_QUANTIZE>(src, dst, width);
+}
+
+SIMD_TARGET_SSE41 void lighten_row_sse41(const unsigned char *src, unsigned char *dst, int width,
+                                         double scaling_factor)
+{
+    scale_row_sse41<true>(src, dst, width, scaling_factor);
+}
+
+SIMD_TARGET_SSE41 void darken_row_sse41(const unsigned char *src, unsigned char *dst, int width,
+                                        double scaling_factor)
+{
+    scale_row_sse41<false>(src, dst, width, scaling_factor);
+}
+
+/**
+ * Description: Mirrors one row 4 pixels at a time. Each block of 4 pixels is reversed in a
+ * register and stored as 16 bytes ending at its mirrored position; the 4 extra bytes at the front
+ * land on pixels the next block overwrites.
+ * @param pointer to the BGR source row
+ * @param pointer to the BGR destination row (must not overlap the source row)
+ * @param int width in pixels
+ * @return nothing
+ */
+
+SIMD_TARGET_SSE41 void mirror_row_sse41(const unsigned char *src, unsigned char *dst, int width)
+{
+    const __m128i reverse = _mm_setr_epi8(-1, -1, -1, -1, 9, 10, 11, 6, 7, 8, 3, 4, 5, 0, 1, 2);
+    int col = 0;
+
+    // Block col..col+3 ends at byte (width - col) * 3 of the destination
+    for (; col + 6 <= width && (width - col) * 3 >= 16; col += 4)
+    {
+        __m128i pixels = _mm_loadu_si128((const __m128i *)(src + col * 3));
+        _mm_storeu_si128((__m128i *)(dst + (width - col) * 3 - 16), _mm_shuffle_epi8(pixels, reverse));
+    }
+    mirror_row(src + col * 3, dst, width - col);
+}
+
+SIMD_TARGET_SSE41 void blend_row_sse41(const unsigned char *src_A, const unsigned char *src_B, unsigned char *dst,
+                                       int width)
+{
+    const __m128i one = _mm_set1_epi8(1);
+    // Whole 16 pixel blocks, so the scalar tail starts on a pixel
+    int count = (width - width % 16) * 3;
+    int i = 0;
+
+    // avg_epu8 rounds up; subtracting the odd bit of a + b rounds down like the integer division
+    for (; i + 16 <= count; i += 16)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i *)(src_A + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(src_B + i));
+        __m128i odd = _mm_and_si128(_mm_xor_si128(a, b), one);
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_sub_epi8(_mm_avg_epu8(a, b), odd));
+    }
+    blend_row(src_A + i, src_B + i, dst + i, width - i / 3);
+}
+
+/**
+ * Description: Weighted blend of 4 bytes, exactly as weighted_blend_row
+ * @param pointer to 4 bytes of image A
+ * @param pointer to 4 bytes of image B
+ * @param weight A in both lanes
+ * @param weight B in both lanes
+ * @return 4 results as 32-bit integers (only the low byte is stored)
+ */
+
+SIMD_TARGET_SSE41 inline __m128i weighted_blend_4_sse41(const unsigned char *src_A, const unsigned char *src_B,
+                                                        __m128d weight_A, __m128d weight_B)
+{
+    int bytes_A;
+    int bytes_B;
+    memcpy(&bytes_A, src_A, 4);
+    memcpy(&bytes_B, src_B, 4);
+    __m128i a = _mm_cvtepu8_epi32(_mm_cvtsi32_si128(bytes_A));
+    __m128i b = _mm_cvtepu8_epi32(_mm_cvtsi32_si128(bytes_B));
+    __m128i a_high = _mm_shuffle_epi32(a, _MM_SHUFFLE(1, 0, 3, 2));
+    __m128i b_high = _mm_shuffle_epi32(b, _MM_SHUFFLE(1, 0, 3, 2));
+
+    __m128i value_A = _mm_unpacklo_epi64(_mm_cvttpd_epi32(_mm_mul_pd(_mm_cvtepi32_pd(a), weight_A)),
+                                         _mm_cvttpd_epi32(_mm_mul_pd(_mm_cvtepi32_pd(a_high), weight_A)));
+    __m128i value_B = _mm_unpacklo_epi64(_mm_cvttpd_epi32(_mm_mul_pd(_mm_cvtepi32_pd(b), weight_B)),
+                                         _mm_cvttpd_epi32(_mm_mul_pd(_mm_cvtepi32_pd(b_high), weight_B)));
+    // Integer division by 2 rounds toward zero, so negative sums get 1 added before the shift
+    __m128i sum = _mm_add_epi32(value_A, value_B);
+    return _mm_srai_epi32(_mm_add_epi32(sum, _mm_srli_epi32(sum, 31)), 1);
+}
+
+SIMD_TARGET_SSE41 void weighted_blend_row_sse41(const unsigned char *src_A, const unsigned char *src_B,
+                                                unsigned char *dst, int width, double weight_A, double weight_B)
+{
+    __m128d factor_A = _mm_set1_pd(weight_A);
+    __m128d factor_B = _mm_set1_pd(weight_B);
+    // Whole 16 pixel blocks, so the scalar tail starts on a pixel
+    int count = (width - width % 16) * 3;
+    int i = 0;
+
+    for (; i + 16 <= count; i += 16)
+    {
+        __m128i out = low_bytes_sse41(weighted_blend_4_sse41(src_A + i, src_B + i, factor_A, factor_B),
+                                      weighted_blend_4_sse41(src_A + i + 4, src_B + i + 4, factor_A, factor_B),
+                                      weighted_blend_4_sse41(src_A + i + 8, src_B + i + 8, factor_A, factor_B),
+                                      weighted_blend_4_sse41(src_A + i + 12, src_B + i + 12, factor_A, factor_B));
+        _mm_storeu_si128((__m128i *)(dst + i), out);
+    }
+    weighted_blend_row(src_A + i, src_B + i, dst + i, width - i / 3, weight_A, weight_B);
+}
+
+/**
+ * Description: transpose_tile in 4 x 4 pixel blocks. Each block spreads its 4 source rows to
+ * one pixel per 32-bit lane, transposes them in registers and packs them back.
+ * @param array of src_count source row pointers
+ * @param int number of source rows
+ * @param array of dst_count destination row pointers
+ * @param int number of destination rows
+ * @return nothing
+ */
+
+SIMD_TARGET_SSE41 void transpose_tile_sse41(const unsigned char *const *src_rows, int src_count,
+                                            unsigned char *const *dst_rows, int dst_count)
+{
+    const __m128i spread = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+    const __m128i pack = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+    int k = 0;
+
+    for (; k + 4 <= dst_count; k += 4)
+    {
+        int j = 0;
+        for (; j + 4 <= src_count; j += 4)
+        {
+            __m128i row_0 = _mm_shuffle_epi8(load_4_pixels_sse41(src_rows[j] + k * 3), spread);
+            __m128i row_1 = _mm_shuffle_epi8(load_4_pixels_sse41(src_rows[j + 1] + k * 3), spread);
+            __m128i row_2 = _mm_shuffle_epi8(load_4_pixels_sse41(src_rows[j + 2] + k * 3), spread);
+            __m128i row_3 = _mm_shuffle_epi8(load_4_pixels_sse41(src_rows[j + 3] + k * 3), spread);
+            __m128i low_01 = _mm_unpacklo_epi32(row_0, row_1);
+            __m128i low_23 = _mm_unpacklo_epi32(row_2, row_3);
+            __m128i high_01 = _mm_unpackhi_epi32(row_0, row_1);
+            __m128i high_23 = _mm_unpackhi_epi32(row_2, row_3);
+            store_4_pixels_sse41(dst_rows[k] + j * 3, _mm_shuffle_epi8(_mm_unpacklo_epi64(low_01, low_23), pack));
+            store_4_pixels_sse41(dst_rows[k + 1] + j * 3, _mm_shuffle_epi8(_mm_unpackhi_epi64(low_01, low_23), pack));
+            store_4_pixels_sse41(dst_rows[k + 2] + j * 3, _mm_shuffle_epi8(_mm_unpacklo_epi64(high_01, high_23), pack));
+            store_4_pixels_sse41(dst_rows[k + 3] + j * 3, _mm_shuffle_epi8(_mm_unpackhi_epi64(high_01, high_23), pack));
+        }
+        transpose_pixels(src_rows, dst_rows, j, src_count, k, k + 4);
+    }
+    transpose_pixels(src_rows, dst_rows, 0, src_count, k, dst_count);
+}
+
+/**
+ * Description: replicate_row with byte shuffles. A block of source pixels is chosen so its output
+ * is a whole number of 16 byte vectors; each output vector is one shuffle of a 16 byte load.
+ * Scales above 16 (where a memcpy-like loop is as fast) use the scalar kernel.
+ * @param pointer to the BGR source row
+ * @param pointer to the BGR destination row, width * x_scale pixels
+ * @param int source width in pixels
+ * @param int number of copies of each pixel
+ * @return nothing
+ */
+
+SIMD_TARGET_SSE41 void replicate_row_sse41(const unsigned char *src, unsigned char *dst, int width, int x_scale)
+{
+    if (x_scale < 2 || x_scale > 16)
+    {
+        replicate_row(src, dst, width, x_scale);
+        return;
+    }
+
+    int block = 16;
+    while (block % 2 == 0 && 3 * (block / 2) * x_scale % 16 == 0)
+    {
+        block /= 2;
+    }
+    int vectors = 3 * block * x_scale / 16;
+    __m128i shuffles[48];
+    int offsets[48];
+    for (int v = 0; v < vectors; v++)
+    {
+        // Output byte o copies channel o % 3 of source pixel o / 3 / x_scale
+        offsets[v] = 16 * v / 3 / x_scale * 3;
+        unsigned char mask[16];
+        for (int b = 0; b < 16; b++)
+        {
+            int o = 16 * v + b;
+            mask[b] = o / 3 / x_scale * 3 + o % 3 - offsets[v];
+        }
+        shuffles[v] = _mm_loadu_si128((const __m128i *)mask);
+    }
+
+    int col = 0;
+    for (; col + block <= width && (col * 3 + offsets[vectors - 1] + 16) <= width * 3; col += block)
+    {
+        const unsigned char *this_pixel = src + col * 3;
+        unsigned char *new_pixel = dst + size_t(col) * 3 * x_scale;
+        for (int v = 0; v < vectors; v++)
+        {
+            __m128i bytes = _mm_loadu_si128((const __m128i *)(this_pixel + offsets[v]));
+            _mm_storeu_si128((__m128i *)(new_pixel + 16 * v), _mm_shuffle_epi8(bytes, shuffles[v]));
+        }
+    }
+    replicate_row(src + col * 3, dst + size_t(col) * 3 * x_scale, width - col, x_scale);
+}
+
+/**
+ * Description: Adds weight times 4 bytes to 4 sums
+ * @param 4 bytes in the low 32 bits
+ * @param pointer to 4 sums
+ * @param weight in every lane
+ * @return nothing
+ */
+
+SIMD_TARGET_SSE41 inline void accumulate_4_sse41(__m128i bytes, uint32_t *sums, __m128i weight)
+{
+    __m128i products = _mm_mullo_epi32(_mm_cvtepu8_epi32(bytes), weight);
+    _mm_storeu_si128((__m128i *)sums, _mm_add_epi32(_mm_loadu_si128((const __m128i *)sums), products));
+}
+
+SIMD_TARGET_SSE41 void accumulate_row_sse41(const unsigned char *src, uint32_t *sums, int width, uint32_t weight)
+{
+    const __m128i factor = _mm_set1_epi32(weight);
+    // Whole 16 pixel blocks, so the scalar tail starts on a pixel
+    int count = (width - width % 16) * 3;
+    int i = 0;
+
+    for (; i + 16 <= count; i += 16)
+    {
+        __m128i bytes = _mm_loadu_si128((const __m128i *)(src + i));
+        accumulate_4_sse41(bytes, sums + i, factor);
+        accumulate_4_sse41(_mm_srli_si128(bytes, 4), sums + i + 4, factor);
+        accumulate_4_sse41(_mm_srli_si128(bytes, 8), sums + i + 8, factor);
+        accumulate_4_sse41(_mm_srli_si128(bytes, 12), sums + i + 12, factor);
+    }
+    accumulate_row(src + i, sums + i, width - i / 3, weight);
+}
+
+SIMD_TARGET_SSE41 void min_row_sse41(const unsigned char *src, unsigned char *dst, int width)
+{
+    int count = (width - width % 16) * 3;
+    int i = 0;
+
+    for (; i + 16 <= count; i += 16)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(dst + i));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_min_epu8(a, b));
+    }
+    min_row(src + i, dst + i, width - i / 3);
+}
+
+SIMD_TARGET_SSE41 void max_row_sse41(const unsigned char *src, unsigned char *dst, int width)
+{
+    int count = (width - width % 16) * 3;
+    int i = 0;
+
+    for (; i + 16 <= count; i += 16)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(dst + i));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_max_epu8(a, b));
+    }
+    max_row(src + i, dst + i, width - i / 3);
+}
+
+/**
+ * Description: median_row, 16 channels at a time. Frames that reach the threshold are counted in
+ * bytes, which are added to 16-bit totals every 255 frames.
+ */
+
+SIMD_TARGET_SSE41 void median_row_sse41(const unsigned char *const *rows, int frames, size_t offset,
+                                        unsigned char *dst, int width)
+{
+    const __m128i needed = _mm_set1_epi16(frames - (frames - 1) / 2);
+    const __m128i zero = _mm_setzero_si128();
+    int count = (width - width % 16) * 3;
+    int i = 0;
+
+    for (; i + 16 <= count; i += 16)
+    {
+        __m128i value = zero;
+        for (int bit = 128; bit > 0; bit >>= 1)
+        {
+            __m128i threshold = _mm_or_si128(value, _mm_set1_epi8(char(bit)));
+            __m128i low = zero;
+            __m128i high = zero;
+            for (int first = 0; first < frames; first += 255)
+            {
+                // a >= t exactly when max(a, t) == a; subtracting the 0xFF mask counts one
+                __m128i reached = zero;
+                for (int f = first; f < min(frames, first + 255); f++)
+                {
+                    __m128i a = _mm_loadu_si128((const __m128i *)(rows[f] + offset + i));
+                    reached = _mm_sub_epi8(reached, _mm_cmpeq_epi8(_mm_max_epu8(a, threshold), a));
+                }
+                low = _mm_add_epi16(low, _mm_unpacklo_epi8(reached, zero));
+                high = _mm_add_epi16(high, _mm_unpackhi_epi8(reached, zero));
+            }
+            __m128i keep_low = _mm_cmpeq_epi16(_mm_max_epu16(low, needed), low);
+            __m128i keep_high = _mm_cmpeq_epi16(_mm_max_epu16(high, needed), high);
+            value = _mm_blendv_epi8(value, threshold, _mm_packs_epi16(keep_low, keep_high));
+        }
+        _mm_storeu_si128((__m128i *)(dst + i), value);
+    }
+    median_row(rows, frames, offset + i, dst + i, width - i / 3);
+}
+
+/**
+ * Description: halve_row, 4 output pixels at a time. Each 16 byte load holds 4 source pixels;
+ * a shuffle puts the two pixels of every output channel next to each other, so one maddubs adds
+ * them into a 16-bit lane.
+ */
+
+SIMD_TARGET_SSE41 void halve_row_sse41(const unsigned char *top, const unsigned char *bottom, unsigned char *dst,
+                                       int width)
+{
+    const __m128i pairs = _mm_setr_epi8(0, 3, 1, 4, 2, 5, 6, 9, 7, 10, 8, 11, -1, -1, -1, -1);
+    const __m128i packed = _mm_setr_epi8(0, 1, 2, 3, 4, 5, 8, 9, 10, 11, 12, 13, -1, -1, -1, -1);
+    const __m128i ones = _mm_set1_epi8(1);
+    const __m128i two = _mm_set1_epi16(2);
+    int x = 0;
+
+    // The second load of a block reads 4 bytes past its 8 pixels
+    for (; 6 * x + 28 <= width * 3; x += 4)
+    {
+        __m128i sums[2];
+        for (int half = 0; half < 2; half++)
+        {
+            size_t offset = 6 * x + 12 * half;
+            __m128i a = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(top + offset)), pairs);
+            __m128i b = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(bottom + offset)), pairs);
+            __m128i sum = _mm_add_epi16(_mm_maddubs_epi16(a, ones), _mm_maddubs_epi16(b, ones));
+            sums[half] = _mm_srli_epi16(_mm_add_epi16(sum, two), 2);
+        }
+        __m128i result = _mm_shuffle_epi8(_mm_packus_epi16(sums[0], sums[1]), packed);
+        _mm_storel_epi64((__m128i *)(dst + 3 * x), result);
+        uint32_t last = _mm_extract_epi32(result, 2);
+        memcpy(dst + 3 * x + 8, &last, 4);
+    }
+    halve_row(top + 6 * x, bottom + 6 * x, dst + 3 * x, width - 2 * x);
+}
+
+// ________________________________________________________ AVX2
+
+/**
+ * Description: Stores 8 BGR pixels, given as 12 packed bytes at the bottom of each 128-bit half,
+ * as exactly 24 contiguous bytes
+ * @param pointer to the first pixel
+ * @param register to store
+ * @return nothing
+ */
+
+SIMD_TARGET_AVX2 inline void store_8_pixels_avx2(unsigned char *dst, __m256i halves)
+{
+    __m256i pixels = _mm256_permutevar8x32_epi32(halves, _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 7, 7));
+    _mm_storeu_si128((__m128i *)dst, _mm256_castsi256_si128(pixels));
+    _mm_storel_epi64((__m128i *)(dst + 16), _mm256_extracti128_si256(pixels, 1));
+}
+
+template <int KIND>
+SIMD_TARGET_AVX2 inline __m256i map_pixels_avx2(__m256i pixels)
+{
+    __m256i sum = _mm256_madd_epi16(_mm256_maddubs_epi16(pixels, _mm256_set1_epi32(0x00010101)),
+                                    _mm256_set1_epi16(1));
+    if (KIND == PIXEL_GRAY)
+    {
+        __m256i gray = _mm256_srli_epi16(_mm256_mulhi_epu16(sum, _mm256_set1_epi16(DIV3_MULTIPLIER)), DIV3_SHIFT - 16);
+        return _mm256_or_si256(gray, _mm256_or_si256(_mm256_slli_epi32(gray, 8), _mm256_slli_epi32(gray, 16)));
+    }
+    if (KIND == PIXEL_CONTRAST)
+    {
+        return _mm256_cmpgt_epi32(sum, _mm256_set1_epi32(383));
+    }
+    __m256i byte_mask = _mm256_set1_epi32(0xFF);
+    __m256i blue = _mm256_and_si256(pixels, byte_mask);
+    __m256i green = _mm256_and_si256(_mm256_srli_epi32(pixels, 8), byte_mask);
+    __m256i red = _mm256_srli_epi32(pixels, 16);
+
+    __m256i color = _mm256_blendv_epi8(_mm256_set1_epi32(0xFF00), _mm256_set1_epi32(0xFF),
+                                       _mm256_cmpgt_epi32(blue, green));
+    __m256i not_red = _mm256_or_si256(_mm256_cmpgt_epi32(green, red), _mm256_cmpgt_epi32(blue, red));
+    color = _mm256_blendv_epi8(_mm256_set1_epi32(0xFF0000), color, not_red);
+    color = _mm256_andnot_si256(_mm256_cmpgt_epi32(_mm256_set1_epi32(151), sum), color);
+    return _mm256_or_si256(color, _mm256_cmpgt_epi32(sum, _mm256_set1_epi32(549)));
+}
+
+/**
+ * Description: Maps one row 8 pixels at a time. Each 128-bit half takes 4 pixels (the load is
+ * split with a dword permute) and exactly 24 bytes are stored per step.
+ * @param pointer to the BGR source row
+ * @param pointer to the BGR destination row (may be the source row)
+ * @param int width in pixels
+ * @return nothing
+ */
+
+template <int KIND>
+SIMD_TARGET_AVX2 void pixel_kernel_avx2(const unsigned char *src, unsigned char *dst, int width)
+{
+    const __m256i split = _mm256_setr_epi32(0, 1, 2, 3, 3, 4, 5, 6);
+    const __m256i spread = _mm256_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1,
+                                            0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+    const __m256i pack = _mm256_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+                                          0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+    int col = 0;
+
+    for (; col + 11 <= width; col += 8)
+    {
+        __m256i bytes = _mm256_loadu_si256((const __m256i *)(src + col * 3));
+        __m256i pixels = _mm256_shuffle_epi8(_mm256_permutevar8x32_epi32(bytes, split), spread);
+        store_8_pixels_avx2(dst + col * 3, _mm256_shuffle_epi8(map_pixels_avx2<KIND>(pixels), pack));
+    }
+    scalar_pixel_kernel(PixelKernelKind(KIND), src + col * 3, dst + col * 3, width - col);
+}
+
+template <bool LIGHTEN>
+SIMD_TARGET_AVX2 inline __m128i scale_4_avx2(const unsigned char *src, __m256d factor)
+{
+    int bytes;
+    memcpy(&bytes, src, 4);
+    __m128i values = _mm_cvtepu8_epi32(_mm_cvtsi32_si128(bytes));
+    if (LIGHTEN)
+    {
+        values = _mm_sub_epi32(_mm_set1_epi32(255), values);
+    }
+    __m256d scaled = _mm256_mul_pd(_mm256_cvtepi32_pd(values), factor);
+    if (LIGHTEN)
+    {
+        scaled = _mm256_sub_pd(_mm256_set1_pd(255), scaled);
+    }
+    return _mm256_cvttpd_epi32(scaled);
+}
+
+template <bool LIGHTEN>
+SIMD_TARGET_AVX2 void scale_row_avx2(const unsigned char *src, unsigned char *dst, int width, double scaling_factor)
+{
+    __m256d factor = _mm256_set1_pd(scaling_factor);
+    // Whole 16 pixel blocks, so the scalar tail starts on a pixel
+    int count = (width - width % 16) * 3;
+    int i = 0;
+
+    for (; i + 16 <= count; i += 16)
+    {
+        __m128i out = low_bytes_sse41(scale_4_avx2<LIGHTEN>(src + i, factor),
+                                      scale_4_avx2<LIGHTEN>(src + i + 4, factor),
+                                      scale_4_avx2<LIGHTEN>(src + i + 8, factor),
+                                      scale_4_avx2<LIGHTEN>(src + i + 12, factor));
+        _mm_storeu_si128((__m128i *)(dst + i), out);
+    }
+    if (LIGHTEN)
+    {
+        lighten_row(src + i, dst + i, width - i / 3, scaling_factor);
+    }
+    else
+    {
+        darken_row(src + i, dst + i, width - i / 3, scaling_factor);
+    }
+}
+
+template <bool REVERSED>
+SIMD_TARGET_AVX2 int vignette_span_avx2(const unsigned char *src, unsigned char *dst, int count, const double *falloff)
+{
+    int col = 0;
+    for (; col + 4 <= count; col += 4)
+    {
+        __m256d factors;
+        if (REVERSED)
+        {
+            factors = _mm256_permute4x64_pd(_mm256_loadu_pd(falloff - col - 3), _MM_SHUFFLE(0, 1, 2, 3));
+        }
+        else
+        {
+            factors = _mm256_loadu_pd(falloff + col);
+        }
+        // 12 bytes take the factors f0 f0 f0 f1 | f1 f1 f2 f2 | f2 f3 f3 f3
+        __m256d first = _mm256_permute4x64_pd(factors, _MM_SHUFFLE(1, 0, 0, 0));
+        __m256d second = _mm256_permute4x64_pd(factors, _MM_SHUFFLE(2, 2, 1, 1));
+        __m256d third = _mm256_permute4x64_pd(factors, _MM_SHUFFLE(3, 3, 3, 2));
+        const unsigned char *in = src + col * 3;
+        __m128i out = low_bytes_sse41(scale_4_avx2<false>(in, first), scale_4_avx2<false>(in + 4, second),
+                                      scale_4_avx2<false>(in + 8, third), _mm_setzero_si128());
+        store_4_pixels_sse41(dst + col * 3, out);
+    }
+    return col;
+}
+
+SIMD_TARGET_AVX2 void vignette_row_avx2(const unsigned char *src, unsigned char *dst, int width, const double *falloff,
+                                        int centre_x)
+{
+    vignette_row_spans(src, dst, width, falloff, centre_x, vignette_span_avx2<true>, vignette_span_avx2<false>);
+}
+
+SIMD_TARGET_AVX2 void grayscale_row_avx2(const unsigned char *src, unsigned char *dst, int width)
+{
+    pixel_kernel_avx2<PIXEL_GRAY>(src, dst, width);
+}
+
+SIMD_TARGET_AVX2 void high_contrast_row_avx2(const unsigned char *src, unsigned char *dst, int width)
+{
+    pixel_kernel_avx2<PIXEL_CONTRAST>(src, dst, width);
+}
+
+SIMD_TARGET_AVX2 void quantize_row_avx2(const unsigned char *src, unsigned char *dst, int width)
+{
+    pixel_kernel_avx2<PIXEL_QUANTIZE>(src, dst, width);
+}
+
+SIMD_TARGET_AVX2 void lighten_row_avx2(const unsigned char *src, unsigned char *dst, int width,
+                                       double scaling_factor)
+{
+    scale_row_avx2<true>(src, dst, width, scaling_factor);
+}
+
+SIMD_TARGET_AVX2 void darken_row_avx2(const unsigned char *src, unsigned char *dst, int width,
+                                      double scaling_factor)
+{
+    scale_row_avx2<false>(src, dst, width, scaling_factor);
+}
+
+SIMD_TARGET_AVX2 void blend_row_avx2(const unsigned char *src_A, const unsigned char *src_B, unsigned char *dst,
+                                     int width)
+{
+    const __m256i one = _mm256_set1_epi8(1);
+    // Whole 32 pixel blocks, so the scalar tail starts on a pixel
+    int count = (width - width % 32) * 3;
+    int i = 0;
+
+    for (; i + 32 <= count; i += 32)
+    {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(src_A + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(src_B + i));
+        __m256i odd = _mm256_and_si256(_mm256_xor_si256(a, b), one);
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_sub_epi8(_mm256_avg_epu8(a, b), odd));
+    }
+    blend_row(src_A + i, src_B + i, dst + i, width - i / 3);
+}
+
+SIMD_TARGET_AVX2 inline __m128i weighted_blend_4_avx2(const unsigned char *src_A, const unsigned char *src_B,
+                                                     __m256d weight_A, __m256d weight_B)
+{
+    int bytes_A;
+    int bytes_B;
+    memcpy(&bytes_A, src_A, 4);
+    memcpy(&bytes_B, src_B, 4);
+    __m128i a = _mm_cvtepu8_epi32(_mm_cvtsi32_si128(bytes_A));
+    __m128i b = _mm_cvtepu8_epi32(_mm_cvtsi32_si128(bytes_B));
+    __m128i value_A = _mm256_cvttpd_epi32(_mm256_mul_pd(_mm256_cvtepi32_pd(a), weight_A));
+    __m128i value_B = _mm256_cvttpd_epi32(_mm256_mul_pd(_mm256_cvtepi32_pd(b), weight_B));
+    __m128i sum = _mm_add_epi32(value_A, value_B);
+    return _mm_srai_epi32(_mm_add_epi32(sum, _mm_srli_epi32(sum, 31)), 1);
+}
+
+SIMD_TARGET_AVX2 void weighted_blend_row_avx2(const unsigned char *src_A, const unsigned char *src_B,
+                                              unsigned char *dst, int width, double weight_A, double weight_B)
+{
+    __m256d factor_A = _mm256_set1_pd(weight_A);
+    __m256d factor_B = _mm256_set1_pd(weight_B);
+    // Whole 16 pixel blocks, so the scalar tail starts on a pixel
+    int count = (width - width % 16) * 3;
+    int i = 0;
+
+    for (; i + 16 <= count; i += 16)
+    {
+        __m128i out = low_bytes_sse41(weighted_blend_4_avx2(src_A + i, src_B + i, factor_A, factor_B),
+                                      weighted_blend_4_avx2(src_A + i + 4, src_B + i + 4, factor_A, factor_B),
+                                      weighted_blend_4_avx2(src_A + i + 8, src_B + i + 8, factor_A, factor_B),
+                                      weighted_blend_4_avx2(src_A + i + 12, src_B + i + 12, factor_A, factor_B));
+        _mm_storeu_si128((__m128i *)(dst + i), out);
+    }
+    weighted_blend_row(src_A + i, src_B + i, dst + i, width - i / 3, weight_A, weight_B);
+}
+
+/**
+ * Description: transpose_tile in 8 x 8 pixel blocks, transposed in registers as 8 x 8 32-bit
+ * lanes
+ * @param array of src_count source row pointers
+ * @param int number of source rows
+ * @param array of dst_count destination row pointers
+ * @param int number of destination rows
+ * @return nothing
+ */
+
+SIMD_TARGET_AVX2 void transpose_tile_avx2(const unsigned char *const *src_rows, int src_count,
+                                          unsigned char *const *dst_rows, int dst_count)
+{
+    const __m256i split = _mm256_setr_epi32(0, 1, 2, 3, 3, 4, 5, 6);
+    const __m256i spread = _mm256_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1,
+                                            0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+    const __m256i pack = _mm256_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+                                          0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+    __m256i rows[8];
+    __m256i pairs[8];
+    __m256i quads[8];
+    int k = 0;
+
+    for (; k + 8 <= dst_count; k += 8)
+    {
+        int j = 0;
+        for (; j + 8 <= src_count; j += 8)
+        {
+            // 8 pixels (exactly 24 bytes) per source row, one pixel per lane
+            for (int i = 0; i < 8; i++)
+            {
+                const unsigned char *pixel = src_rows[j + i] + k * 3;
+                __m256i bytes = _mm256_inserti128_si256(
+                    _mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)pixel)),
+                    _mm_loadl_epi64((const __m128i *)(pixel + 16)), 1);
+                rows[i] = _mm256_shuffle_epi8(_mm256_permutevar8x32_epi32(bytes, split), spread);
+            }
+            for (int i = 0; i < 8; i += 2)
+            {
+                pairs[i] = _mm256_unpacklo_epi32(rows[i], rows[i + 1]);
+                pairs[i + 1] = _mm256_unpackhi_epi32(rows[i], rows[i + 1]);
+            }
+            // quads[4 * h + c]: column c (lane 0) and column c + 4 (lane 1) of source rows 4h..4h+3
+            for (int h = 0; h < 2; h++)
+            {
+                quads[4 * h] = _mm256_unpacklo_epi64(pairs[4 * h], pairs[4 * h + 2]);
+                quads[4 * h + 1] = _mm256_unpackhi_epi64(pairs[4 * h], pairs[4 * h + 2]);
+                quads[4 * h + 2] = _mm256_unpacklo_epi64(pairs[4 * h + 1], pairs[4 * h + 3]);
+                quads[4 * h + 3] = _mm256_unpackhi_epi64(pairs[4 * h + 1], pairs[4 * h + 3]);
+            }
+            for (int c = 0; c < 4; c++)
+            {
+                __m256i low = _mm256_permute2x128_si256(quads[c], quads[c + 4], 0x20);
+                __m256i high = _mm256_permute2x128_si256(quads[c], quads[c + 4], 0x31);
+                store_8_pixels_avx2(dst_rows[k + c] + j * 3, _mm256_shuffle_epi8(low, pack));
+                store_8_pixels_avx2(dst_rows[k + c + 4] + j * 3, _mm256_shuffle_epi8(high, pack));
+            }
+        }
+        transpose_pixels(src_rows, dst_rows, j, src_count, k, k + 8);
+    }
+    transpose_pixels(src_rows, dst_rows, 0, src_count, k, dst_count);
+}
+
+SIMD_TARGET_AVX2 inline void accumulate_8_avx2(const unsigned char *src, uint32_t *sums, __m256i weight)
+{
+    __m256i products = _mm256_mullo_epi32(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)src)), weight);
+    _mm256_storeu_si256((__m256i *)sums, _mm256_add_epi32(_mm256_loadu_si256((const __m256i *)sums), products));
+}
+
+SIMD_TARGET_AVX2 void accumulate_row_avx2(const unsigned char *src, uint32_t *sums, int width, uint32_t weight)
+{
+    const __m256i factor = _mm256_set1_epi32(weight);
+    // Whole 32 pixel blocks, so the scalar tail starts on a pixel
+    int count = (width - width % 32) * 3;
+    int i = 0;
+
+    for (; i + 32 <= count; i += 32)
+    {
+        accumulate_8_avx2(src + i, sums + i, factor);
+        accumulate_8_avx2(src + i + 8, sums + i + 8, factor);
+        accumulate_8_avx2(src + i + 16, sums + i + 16, factor);
+        accumulate_8_avx2(src + i + 24, sums + i + 24, factor);
+    }
+    accumulate_row(src + i, sums + i, width - i / 3, weight);
+}
+
+SIMD_TARGET_AVX2 void min_row_avx2(const unsigned char *src, unsigned char *dst, int width)
+{
+    int count = (width - width % 32) * 3;
+    int i = 0;
+
+    for (; i + 32 <= count; i += 32)
+    {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(src + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(dst + i));
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_min_epu8(a, b));
+    }
+    min_row(src + i, dst + i, width - i / 3);
+}
+
+SIMD_TARGET_AVX2 void max_row_avx2(const unsigned char *src, unsigned char *dst, int width)
+{
+    int count = (width - width % 32) * 3;
+    int i = 0;
+
+    for (; i + 32 <= count; i += 32)
+    {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(src + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(dst + i));
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_max_epu8(a, b));
+    }
+    max_row(src + i, dst + i, width - i / 3);
+}
+
+SIMD_TARGET_AVX2 void median_row_avx2(const unsigned char *const *rows, int frames, size_t offset,
+                                      unsigned char *dst, int width)
+{
+    const __m256i needed = _mm256_set1_epi16(frames - (frames - 1) / 2);
+    const __m256i zero = _mm256_setzero_si256();
+    int count = (width - width % 32) * 3;
+    int i = 0;
+
+    // As median_row_sse41; packs works within 128-bit halves, so its quarters are put back in order
+    for (; i + 32 <= count; i += 32)
+    {
+        __m256i value = zero;
+        for (int bit = 128; bit > 0; bit >>= 1)
+        {
+            __m256i threshold = _mm256_or_si256(value, _mm256_set1_epi8(char(bit)));
+            __m256i low = zero;
+            __m256i high = zero;
+            for (int first = 0; first < frames; first += 255)
+            {
+                __m256i reached = zero;
+                for (int f = first; f < min(frames, first + 255); f++)
+                {
+                    __m256i a = _mm256_loadu_si256((const __m256i *)(rows[f] + offset + i));
+                    reached = _mm256_sub_epi8(reached, _mm256_cmpeq_epi8(_mm256_max_epu8(a, threshold), a));
+                }
+                low = _mm256_add_epi16(low, _mm256_cvtepu8_epi16(_mm256_castsi256_si128(reached)));
+                high = _mm256_add_epi16(high, _mm256_cvtepu8_epi16(_mm256_extracti128_si256(reached, 1)));
+            }
+            __m256i keep_low = _mm256_cmpeq_epi16(_mm256_max_epu16(low, needed), low);
+            __m256i keep_high = _mm256_cmpeq_epi16(_mm256_max_epu16(high, needed), high);
+            __m256i keep = _mm256_permute4x64_epi64(_mm256_packs_epi16(keep_low, keep_high), _MM_SHUFFLE(3, 1, 2, 0));
+            value = _mm256_blendv_epi8(value, threshold, keep);
+        }
+        _mm256_storeu_si256((__m256i *)(dst + i), value);
+    }
+    median_row(rows, frames, offset + i, dst + i, width - i / 3);
+}
+
+/**
+ * Description: halve_row_sse41 with each 128-bit half taking its own 4 output pixels
+ */
+
+SIMD_TARGET_AVX2 void halve_row_avx2(const unsigned char *top, const unsigned char *bottom, unsigned char *dst,
+                                     int width)
+{
+    const __m256i pairs = _mm256_setr_epi8(0, 3, 1, 4, 2, 5, 6, 9, 7, 10, 8, 11, -1, -1, -1, -1, 0, 3, 1, 4, 2, 5,
+                                           6, 9, 7, 10, 8, 11, -1, -1, -1, -1);
+    const __m256i packed = _mm256_setr_epi8(0, 1, 2, 3, 4, 5, 8, 9, 10, 11, 12, 13, -1, -1, -1, -1, 0, 1, 2, 3, 4,
+                                            5, 8, 9, 10, 11, 12, 13, -1, -1, -1, -1);
+    const __m256i ones = _mm256_set1_epi8(1);
+    const __m256i two = _mm256_set1_epi16(2);
+    int x = 0;
+
+    for (; 6 * x + 52 <= width * 3; x += 8)
+    {
+        __m256i sums[2];
+        for (int half = 0; half < 2; half++)
+        {
+            size_t offset = 6 * x + 12 * half;
+            __m256i a = _mm256_inserti128_si256(
+                _mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)(top + offset))),
+                _mm_loadu_si128((const __m128i *)(top + offset + 24)), 1);
+            __m256i b = _mm256_inserti128_si256(
+                _mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)(bottom + offset))),
+                _mm_loadu_si128((const __m128i *)(bottom + offset + 24)), 1);
+            __m256i sum = _mm256_add_epi16(_mm256_maddubs_epi16(_mm256_shuffle_epi8(a, pairs), ones),
+                                           _mm256_maddubs_epi16(_mm256_shuffle_epi8(b, pairs), ones));
+            sums[half] = _mm256_srli_epi16(_mm256_add_epi16(sum, two), 2);
+        }
+        __m256i result = _mm256_shuffle_epi8(_mm256_packus_epi16(sums[0], sums[1]), packed);
+        for (int lane = 0; lane < 2; lane++)
+        {
+            __m128i pixels = lane == 0 ? _mm256_castsi256_si128(result) : _mm256_extracti128_si256(result, 1);
+            _mm_storel_epi64((__m128i *)(dst + 3 * x + 12 * lane), pixels);
+            uint32_t last = _mm_extract_epi32(pixels, 2);
+            memcpy(dst + 3 * x + 12 * lane + 8, &last, 4);
+        }
+    }
+    halve_row(top + 6 * x, bottom + 6 * x, dst + 3 * x, width - 2 * x);
+}
+
+// ________________________________________________________ AVX-512
+
+// GCC 12's AVX-512 headers trip -Wmaybe-uninitialized on their own _mm512_undefined_* values
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+
+template <int KIND>
+SIMD_TARGET_AVX512 inline __m512i map_pixels_avx512(__m512i pixels)
+{
+    __m512i sum = _mm512_madd_epi16(_mm512_maddubs_epi16(pixels, _mm512_set1_epi32(0x00010101)),
+                                    _mm512_set1_epi16(1));
+    if (KIND == PIXEL_GRAY)
+    {
+        __m512i gray = _mm512_srli_epi16(_mm512_mulhi_epu16(sum, _mm512_set1_epi16(DIV3_MULTIPLIER)), DIV3_SHIFT - 16);
+        return _mm512_or_si512(gray, _mm512_or_si512(_mm512_slli_epi32(gray, 8), _mm512_slli_epi32(gray, 16)));
+    }
+    if (KIND == PIXEL_CONTRAST)
+    {
+        return _mm512_maskz_mov_epi32(_mm512_cmpgt_epi32_mask(sum, _mm512_set1_epi32(383)), _mm512_set1_epi32(-1));
+    }
+    __m512i byte_mask = _mm512_set1_epi32(0xFF);
+    __m512i blue = _mm512_and_si512(pixels, byte_mask);
+    __m512i green = _mm512_and_si512(_mm512_srli_epi32(pixels, 8), byte_mask);
+    __m512i red = _mm512_srli_epi32(pixels, 16);
+
+    __m512i color = _mm512_mask_mov_epi32(_mm512_set1_epi32(0xFF00), _mm512_cmpgt_epi32_mask(blue, green),
+                                          _mm512_set1_epi32(0xFF));
+    __mmask16 is_red = _mm512_cmpge_epi32_mask(red, green) & _mm512_cmpge_epi32_mask(red, blue);
+    color = _mm512_mask_mov_epi32(color, is_red, _mm512_set1_epi32(0xFF0000));
+    color = _mm512_mask_mov_epi32(color, _mm512_cmplt_epi32_mask(sum, _mm512_set1_epi32(151)), _mm512_setzero_si512());
+    return _mm512_mask_mov_epi32(color, _mm512_cmpgt_epi32_mask(sum, _mm512_set1_epi32(549)), _mm512_set1_epi32(-1));
+}
+
+/**
+ * Description: Maps one row 16 pixels at a time with masked 48 byte loads and stores. The
+ * masks also cover the last partial block, so there is no scalar tail.
+ * @param pointer to the BGR source row
+ * @param pointer to the BGR destination row (may be the source row)
+ * @param int width in pixels
+ * @return nothing
+ */
+
+template <int KIND>
+SIMD_TARGET_AVX512 void pixel_kernel_avx512(const unsigned char *src, unsigned char *dst, int width)
+{
+    const __m512i split = _mm512_setr_epi32(0, 1, 2, 3, 3, 4, 5, 6, 6, 7, 8, 9, 9, 10, 11, 12);
+    const __m512i join = _mm512_setr_epi32(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, 15, 15, 15, 15);
+    // Same byte shuffles as the SSE4.1 kernel in every 128-bit lane, as little-endian dwords
+    const __m512i spread = _mm512_setr4_epi32(0xFF020100, 0xFF050403, 0xFF080706, 0xFF0B0A09);
+    const __m512i pack = _mm512_setr4_epi32(0x04020100, 0x09080605, 0x0E0D0C0A, 0xFFFFFFFF);
+
+    for (int col = 0; col < width; col += 16)
+    {
+        int count = min(16, width - col);
+        __mmask64 bytes = (~0ULL) >> (64 - count * 3);
+        __m512i pixels = _mm512_maskz_loadu_epi8(bytes, src + col * 3);
+        pixels = _mm512_shuffle_epi8(_mm512_permutexvar_epi32(split, pixels), spread);
+        __m512i out = _mm512_permutexvar_epi32(join, _mm512_shuffle_epi8(map_pixels_avx512<KIND>(pixels), pack));
+        _mm512_mask_storeu_epi8(dst + col * 3, bytes, out);
+    }
+}
+
+/**
+ * Description: Lightens or darkens up to 16 bytes through doubles, exactly as the scalar kernels
+ * @param 16 source bytes
+ * @param scaling factor in every lane
+ * @return the 16 result bytes
+ */
+
+template <bool LIGHTEN>
+SIMD_TARGET_AVX512 inline __m128i scale_16_avx512(__m128i bytes, __m512d factor)
+{
+    __m512i values = _mm512_cvtepu8_epi32(bytes);
+    if (LIGHTEN)
+    {
+        values = _mm512_sub_epi32(_mm512_set1_epi32(255), values);
+    }
+    __m512d low = _mm512_mul_pd(_mm512_cvtepi32_pd(_mm512_castsi512_si256(values)), factor);
+    __m512d high = _mm512_mul_pd(_mm512_cvtepi32_pd(_mm512_extracti64x4_epi64(values, 1)), factor);
+    if (LIGHTEN)
+    {
+#ifndef __FMA__
+        // The AVX-512 target enables FMA even where lighten_row is built without it; keep the
+        // products rounded on their own as lighten_row rounds them
+        __asm__("" : "+v"(low), "+v"(high));
+#endif
+        low = _mm512_sub_pd(_mm512_set1_pd(255), low);
+        high = _mm512_sub_pd(_mm512_set1_pd(255), high);
+    }
+    __m512i result = _mm512_inserti64x4(_mm512_castsi256_si512(_mm512_cvttpd_epi32(low)), _mm512_cvttpd_epi32(high), 1);
+    return _mm512_cvtepi32_epi8(result);
+}
+
+template <bool LIGHTEN>
+SIMD_TARGET_AVX512 void scale_row_avx512(const unsigned char *src, unsigned char *dst, int width,
+                                         double scaling_factor)
+{
+    __m512d factor = _mm512_set1_pd(scaling_factor);
+    int count = width * 3;
+
+    for (int i = 0; i < count; i += 16)
+    {
+        __mmask64 bytes = (~0ULL) >> (64 - min(16, count - i));
+        __m128i in = _mm512_castsi512_si128(_mm512_maskz_loadu_epi8(bytes, src + i));
+        _mm512_mask_storeu_epi8(dst + i, bytes, _mm512_castsi128_si512(scale_16_avx512<LIGHTEN>(in, factor)));
+    }
+}
+
+SIMD_TARGET_AVX512 void grayscale_row_avx512(const unsigned char *src, unsigned char *dst, int width)
+{
+    pixel_kernel_avx512<PIXEL_GRAY>(src, dst, width);
+}
+
+SIMD_TARGET_AVX512 void high_contrast_row_avx512(const unsigned char *src, unsigned char *dst, int width)
+{
+    pixel_kernel_avx512<PIXEL_CONTRAST>(src, dst, width);
+}
+
+SIMD_TARGET_AVX512 void quantize_row_avx512(const unsigned char *src, unsigned char *dst, int width)
+{
+    pixel_kernel_avx512<PIXEL_QUANTIZE>(src, dst, width);
+}
+
+SIMD_TARGET_AVX512 void lighten_row_avx512(const unsigned char *src, unsigned char *dst, int width,
+                                           double scaling_factor)
+{
+    scale_row_avx512<true>(src, dst, width, scaling_factor);
+}
+
+SIMD_TARGET_AVX512 void darken_row_avx512(const unsigned char *src, unsigned char *dst, int width,
+                                          double scaling_factor)
+{
+    scale_row_avx512<false>(src, dst, width, scaling_factor);
+}
+
+SIMD_TARGET_AVX512 void blend_row_avx512(const unsigned char *src_A, const unsigned char *src_B,
+                                         unsigned char *dst, int width)
+{
+    const __m512i one = _mm512_set1_epi8(1);
+    int count = width * 3;
+
+    for (int i = 0; i < count; i += 64)
+    {
+        __mmask64 bytes = (~0ULL) >> (64 - min(64, count - i));
+        __m512i a = _mm512_maskz_loadu_epi8(bytes, src_A + i);
+        __m512i b = _mm512_maskz_loadu_epi8(bytes, src_B + i);
+        __m512i odd = _mm512_and_si512(_mm512_xor_si512(a, b), one);
+        _mm512_mask_storeu_epi8(dst + i, bytes, _mm512_sub_epi8(_mm512_avg_epu8(a, b), odd));
+    }
+}
+
+#pragma GCC diagnostic pop
+
+#endif
+
+// ________________________________________________________ Selection
+
+/**
+ * Description: Finds the best SimdLevel this CPU and operating system support (CPUID)
+ * @return SimdLevel
+ */
+
+SimdLevel detect_simd_level()
+{
+#ifdef IMGPROC_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw"))
+    {
+        return SIMD_AVX512;
+    }
+    if (__builtin_cpu_supports("avx2"))
+    {
+        return SIMD_AVX2;
+    }
+    if (__builtin_cpu_supports("sse4.1"))
+    {
+        return SIMD_SSE41;
+    }
+#endif
+    return SIMD_SCALAR;
+}
+
+/**
+ * Description: Gets the name of a SimdLevel, as accepted by parse_simd_level
+ * @param SimdLevel
+ * @return name string
+ */
+
+string simd_level_name(SimdLevel level)
+{
+    switch (level)
+    {
+    case SIMD_SSE41:
+        return "sse4.1";
+    case SIMD_AVX2:
+        return "avx2";
+    case SIMD_AVX512:
+        return "avx512";
+    default:
+        return "scalar";
+    }
+}
+
+/**
+ * Description: Parses the name of a SimdLevel
+ * @param string name (scalar, sse4.1, avx2 or avx512)
+ * @param SimdLevel set when the name is known
+ * @return true if the name is known
+ */
+
+bool parse_simd_level(const string &name, SimdLevel &level)
+{
+    for (int i = SIMD_SCALAR; i <= SIMD_AVX512; i++)
+    {
+        if (name == simd_level_name(SimdLevel(i)))
+        {
+            level = SimdLevel(i);
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Description: Builds the kernel table for a SimdLevel. A level without its own version of a
+ * kernel uses the one from the level below.
+ * @param SimdLevel, lowered to what the CPU supports
+ * @return SimdKernels
+ */
+
+SimdKernels make_simd_kernels(SimdLevel level)
+{
+    level = min(level, detect_simd_level());
+    SimdKernels kernels = {SIMD_SCALAR,   grayscale_row, high_contrast_row, quantize_row,      mirror_row,
+                           lighten_row,   darken_row,    blend_row,         weighted_blend_row, transpose_tile,
+                           replicate_row, vignette_row,  accumulate_row,    min_row,            max_row,
+                           median_row,    halve_row};
+#ifdef IMGPROC_X86_SIMD
+    if (level >= SIMD_SSE41)
+    {
+        kernels.level = SIMD_SSE41;
+        kernels.grayscale = grayscale_row_sse41;
+        kernels.high_contrast = high_contrast_row_sse41;
+        kernels.quantize = quantize_row_sse41;
+        kernels.mirror = mirror_row_sse41;
+        kernels.lighten = lighten_row_sse41;
+        kernels.darken = darken_row_sse41;
+        kernels.blend = blend_row_sse41;
+        kernels.weighted_blend = weighted_blend_row_sse41;
+        kernels.transpose = transpose_tile_sse41;
+        kernels.replicate = replicate_row_sse41;
+        kernels.vignette = vignette_row_sse41;
+        kernels.accumulate = accumulate_row_sse41;
+        kernels.minimum = min_row_sse41;
+        kernels.maximum = max_row_sse41;
+        kernels.median = median_row_sse41;
+        kernels.halve = halve_row_sse41;
+    }
+    if (level >= SIMD_AVX2)
+    {
+        kernels.level = SIMD_AVX2;
+        kernels.grayscale = grayscale_row_avx2;
+        kernels.high_contrast = high_contrast_row_avx2;
+        kernels.quantize = quantize_row_avx2;
+        kernels.lighten = lighten_row_avx2;
+        kernels.darken = darken_row_avx2;
+        kernels.blend = blend_row_avx2;
+        kernels.weighted_blend = weighted_blend_row_avx2;
+        kernels.transpose = transpose_tile_avx2;
+        kernels.vignette = vignette_row_avx2;
+        kernels.accumulate = accumulate_row_avx2;
+        kernels.minimum = min_row_avx2;
+        kernels.maximum = max_row_avx2;
+        kernels.median = median_row_avx2;
+        kernels.halve = halve_row_avx2;
+    }
+    if (level >= SIMD_AVX512)
+    {
+        kernels.level = SIMD_AVX512;
+        kernels.grayscale = grayscale_row_avx512;
+        kernels.high_contrast = high_contrast_row_avx512;
+        kernels.quantize = quantize_row_avx512;
+        kernels.lighten = lighten_row_avx512;
+        kernels.darken = darken_row_avx512;
+        kernels.blend = blend_row_avx512;
+    }
+#endif
+    return kernels;
+}
+
+/**
+ * Description: Picks the starting SimdLevel: the best one the CPU supports, or the level named
+ * by the IMGPROC_SIMD environment variable (scalar, sse4.1, avx2, avx512) if that is lower.
+ * @return SimdLevel
+ */
+
+SimdLevel initial_simd_level()
+{
+    SimdLevel level = SIMD_AVX512;
+    const char *name = getenv("IMGPROC_SIMD");
+    if (name != NULL && !parse_simd_level(name, level))
+    {
+        cerr << "IMGPROC_SIMD: unknown level \"" << name << "\", using the best supported" << endl;
+    }
+    return level;
+}
+
+/**
+ * Description: Holds the active kernel table, built on first use
+ * @return reference to the active SimdKernels
+ */
+
+SimdKernels &active_simd_kernels()
+{
+    static SimdKernels kernels = make_simd_kernels(initial_simd_level());
+    return kernels;
+}
+
+/**
+ * Description: Gets the active row kernels
+ * @return reference to the active SimdKernels
+ */
+
+const SimdKernels &simd_kernels()
+{
+    return active_simd_kernels();
+}
+
+/**
+ * Description: Switches the active row kernels to a SimdLevel (lowered to what the CPU supports)
+ * @param SimdLevel wanted
+ * @return SimdLevel now active
+ */
+
+SimdLevel set_simd_level(SimdLevel level)
+{
+    SimdKernels &kernels = active_simd_kernels();
+    kernels = make_simd_kernels(level);
+    return kernels.level;
+}
+
+//***************************************************************************************************//
+// STREAMING POINT OPERATIONS
+//***************************************************************************************************//
+
+// ________________________________________________________ Scanline interfaces
+
+/**
+ * Description: Produces the rows of an image one at a time, in the order they are stored
+ */
+
+class ScanlineSource
+{
+public:
+    virtual ~ScanlineSource()
+    {
+    }
+
+    virtual int width() const = 0;
+    virtual int height() const = 0;
+
+    // True if the first row produced is the top row, false if it is the bottom row
+    virtual bool top_down() const = 0;
+
+    // Copies the next row into a BGR buffer of width() * 3 bytes and reports its row index
+    virtual bool read_row(unsigned char *bgr, int &row) = 0;
+};
+
+/**
+ * Description: Consumes rows in the order a ScanlineSource produced them
+ */
+
+class ScanlineSink
+{
+public:
+    virtual ~ScanlineSink()
+    {
+    }
+
+    virtual bool write_row(const unsigned char *bgr, int row) = 0;
+    virtual bool finish() = 0;
+};
+
+// Rows are read from and written to disk in blocks of about this many bytes
+const size_t STREAM_BLOCK_BYTES = 1 << 20;
+
+// ________________________________________________________ BMP scanline reader
+
+/**
+ * Description: Reads a BMP file of any depth read_bmp() takes, a block of rows at a time. Only one
+ * block is ever held in memory, so memory use depends on the width and not the height of the image.
+ * An uncompressed file can also be read last stored row first, to match another file's row order.
+ */
+
+class BmpScanlineReader : public ScanlineSource
+{
+public:
+    BmpScanlineReader()
+        : rows_per_block(0), rows_loaded(0), rows_in_block(0), next_in_block(0), reversed(false), window_pos(0),
+          window_end(0)
+    {
+    }
+
+    // block_bytes sets how much of the file is read at a time; reverse_rows reads the stored rows
+    // backwards, which run length files do not support
+    BmpStatus open(const string &filename, size_t block_bytes = STREAM_BLOCK_BYTES, bool reverse_rows = false)
+    {
+        reversed = reverse_rows;
+        stream.open(filename, ios::in | ios::binary);
+        if (!stream.is_open())
+        {
+            return BMP_OPEN_FAILED;
+        }
+        stream.seekg(0, ios::end);
+        uint64_t file_size = stream.tellg();
+        stream.seekg(0, ios::beg);
+
+        // Enough for the file header, any DIB header and a full colour table
+        unsigned char header[BMP_MAX_HEADER_BYTES] = {0};
+        stream.read((char *)header, min<uint64_t>(sizeof(header), file_size));
+        trace_bytes_read(stream.gcount());
+        BmpStatus status = parse_bmp_header(header, file_size, info);
+        if (status != BMP_OK)
+        {
+            return status;
+        }
+
+        stream.clear();
+        stream.seekg(info.pixel_offset);
+        if (is_rle(info) && reversed)
+        {
+            return BMP_UNSUPPORTED_FORMAT;
+        }
+        if (is_rle(info))
+        {
+            // The block is a window over the run length data; any sane row (at most two bytes a
+            // pixel) fits in it
+            block.resize(max<size_t>(block_bytes, size_t(info.width) * 4 + 1024));
+            indices.resize(info.width);
+            rle.reset(info.width, info.bits_per_pixel);
+            return BMP_OK;
+        }
+        rows_per_block = max<uint64_t>(1, block_bytes / info.row_bytes);
+        block.resize(rows_per_block * info.row_bytes);
+        return BMP_OK;
+    }
+
+    int width() const
+    {
+        return info.width;
+    }
+
+    int height() const
+    {
+        return info.height;
+    }
+
+    bool top_down() const
+    {
+        return info.top_down != reversed;
+    }
+
+    bool read_row(unsigned char *bgr, int &row)
+    {
+        if (is_rle(info))
+        {
+            return read_rle_row(bgr, row);
+        }
+        if (next_in_block == rows_in_block)
+        {
+            rows_in_block = min<uint64_t>(rows_per_block, info.height - rows_loaded);
+            if (rows_in_block == 0)
+            {
+                return false;
+            }
+            if (reversed)
+            {
+                // Blocks are taken from the end of the pixel array towards its start
+                stream.seekg(info.pixel_offset + (info.height - rows_loaded - rows_in_block) * info.row_bytes);
+            }
+            if (!stream.read((char *)block.data(), rows_in_block * info.row_bytes))
+            {
+                return false;
+            }
+            trace_bytes_read(rows_in_block * info.row_bytes);
+            rows_loaded += rows_in_block;
+            next_in_block = 0;
+        }
+
+        uint64_t in_block = reversed ? rows_in_block - 1 - next_in_block : next_in_block;
+        uint64_t block_start = reversed ? info.height - rows_loaded : rows_loaded - rows_in_block;
+        int stored_index = block_start + in_block;
+        row = info.top_down ? stored_index : info.height - 1 - stored_index;
+        decode_bmp_row(block.data() + in_block * info.row_bytes, bgr, info);
+        next_in_block++;
+        return true;
+    }
+
+private:
+    ifstream stream;
+    BmpInfo info;
+    vector<unsigned char> block;
+    uint64_t rows_per_block;
+    uint64_t rows_loaded;
+    uint64_t rows_in_block;
+    uint64_t next_in_block;
+    bool reversed;
+    // Run length files: unread data is block[window_pos, window_end)
+    RleDecoder rle;
+    vector<unsigned char> indices;
+    size_t window_pos;
+    size_t window_end;
+
+    // Expands the next row of a run length file, topping the window up from the file as needed
+    bool read_rle_row(unsigned char *bgr, int &row)
+    {
+        if (rows_loaded == uint64_t(info.height))
+        {
+            return false;
+        }
+        size_t consumed;
+        while (rle.next_row(block.data() + window_pos, window_end - window_pos, consumed, indices.data()) !=
+               RLE_ROW_DONE)
+        {
+            memmove(block.data(), block.data() + window_pos, window_end - window_pos);
+            window_end -= window_pos;
+            window_pos = 0;
+            if (window_end == block.size())
+            {
+                return false; // a row longer than the window: corrupt data
+            }
+            stream.read((char *)block.data() + window_end, block.size() - window_end);
+            size_t read_bytes = stream.gcount();
+            if (read_bytes == 0)
+            {
+                return false;
+            }
+            trace_bytes_read(read_bytes);
+            window_end += read_bytes;
+        }
+        window_pos += consumed;
+        row = info.height - 1 - int(rows_loaded);
+        rows_loaded++;
+        expand_palette_row(indices.data(), bgr, info);
+        return true;
+    }
+};
+
+// ________________________________________________________ BMP scanline writer
+
+/**
+ * Description: Writes a 24 bit BMP file a block of rows at a time. Rows must arrive in storage
+ * order: bottom row first for a normal file, top row first when opened as top_down.
+ */
+
+class BmpScanlineWriter : public ScanlineSink
+{
+public:
+    BmpScanlineWriter()
+        : width(0), height(0), top_down(false), row_bytes(0), padded_bytes(0), rows_in_block(0), rows_written(0)
+    {
+    }
+
+    bool open(const string &filename, int width_pixels, int height_pixels, bool top_down_rows)
+    {
+        width = width_pixels;
+        height = height_pixels;
+        top_down = top_down_rows;
+        row_bytes = size_t(width) * 3;
+        padded_bytes = (row_bytes + 3) / 4 * 4;
+        block.assign(max<size_t>(1, STREAM_BLOCK_BYTES / padded_bytes) * padded_bytes, 0);
+
+        if (!file.open(filename))
+        {
+            return false;
+        }
+        build_bmp_header(header, width, height, top_down);
+        file.append(header, BMP_HEADER_BYTES);
+        return file.flush();
+    }
+
+    bool write_row(const unsigned char *bgr, int row)
+    {
+        int expected = top_down ? rows_written : height - 1 - rows_written;
+        if (row != expected)
+        {
+            return false;
+        }
+
+        // Padding bytes in the block stay zero from assign()
+        memcpy(block.data() + rows_in_block * padded_bytes, bgr, row_bytes);
+        rows_in_block++;
+        rows_written++;
+        if (rows_in_block * padded_bytes == block.size())
+        {
+            return flush_block();
+        }
+        return true;
+    }
+
+    bool finish()
+    {
+        return flush_block() && rows_written == height && file.close();
+    }
+
+private:
+    OutputFile file;
+    unsigned char header[BMP_HEADER_BYTES];
+    vector<unsigned char> block;
+    int width;
+    int height;
+    bool top_down;
+    size_t row_bytes;
+    size_t padded_bytes;
+    size_t rows_in_block;
+    int rows_written;
+
+    bool flush_block()
+    {
+        file.append(block.data(), rows_in_block * padded_bytes);
+        rows_in_block = 0;
+        return file.flush();
+    }
+};
+
+// ________________________________________________________ In-memory scanlines
+
+/**
+ * Description: Produces the rows of an Image from top to bottom, or bottom to top as a BMP
+ * file stores them
+ */
+
+class ImageScanlineSource : public ScanlineSource
+{
+public:
+    explicit ImageScanlineSource(const Image &source_image, bool bottom_up_rows = false)
+        : image(as_bgr(source_image, scratch)), bottom_up(bottom_up_rows), next_row(0)
+    {
+    }
+
+    int width() const
+    {
+        return image.width;
+    }
+
+    int height() const
+    {
+        return image.height;
+    }
+
+    bool top_down() const
+    {
+        return !bottom_up;
+    }
+
+    bool read_row(unsigned char *bgr, int &row)
+    {
+        if (next_row == image.height)
+        {
+            return false;
+        }
+        row = bottom_up ? image.height - 1 - next_row : next_row;
+        next_row++;
+        memcpy(bgr, image.row(row), size_t(image.width) * 3);
+        return true;
+    }
+
+private:
+    Image scratch;
+    const Image &image;
+    bool bottom_up;
+    int next_row;
+};
+
+/**
+ * Description: Stores rows into a BGR Image of the source's size
+ */
+
+class ImageScanlineSink : public ScanlineSink
+{
+public:
+    ImageScanlineSink(int width, int height)
+        : image(width, height)
+    {
+    }
+
+    bool write_row(const unsigned char *bgr, int row)
+    {
+        if (row < 0 || row >= image.height)
+        {
+            return false;
+        }
+        memcpy(image.row(row), bgr, size_t(image.width) * 3);
+        return true;
+    }
+
+    bool finish()
+    {
+        return true;
+    }
+
+    Image image;
+};
+
+// ________________________________________________________ Point operations
+
+// A per-pixel process that can be applied to one row at a time
+struct PointOp
+{
+    int process;            // process number: 1, 2, 3, 7, 8, 9 or 10
+    double scaling_factor;  // used by processes 2, 8 and 9
+    VignetteShape vignette; // used by process 1
+
+    PointOp(int process_number, double factor = 1.0)
+        : process(process_number), scaling_factor(factor)
+    {
+    }
+};
+
+/**
+ * Description: Checks whether a process only needs the current pixel (and its position)
+ * @param int process number
+ * @return true if the process can run one row at a time
+ */
+
+bool is_point_op(int process)
+{
+    return process == 1 || process == 2 || process == 3 || process == 7 || process == 8 || process == 9 ||
+           process == 10;
+}
+
+/**
+ * Description: Applies a point operation to one row
+ * @param PointOp to apply
+ * @param pointer to the BGR source row
+ * @param pointer to the BGR destination row (may be the source row)
+ * @param int width in pixels
+ * @param int index of the row in the image
+ * @param int image height in pixels
+ * @return nothing
+ */
+
+void apply_point_op(const PointOp &op, const unsigned char *src, unsigned char *dst, int width, int row, int height)
+{
+    switch (op.process)
+    {
+    case 1:
+        apply_vignette_row(op.vignette, src, dst, width, row, height);
+        break;
+    case 2:
+        clarendon_row(src, dst, width, op.scaling_factor);
+        break;
+    case 3:
+        simd_kernels().grayscale(src, dst, width);
+        break;
+    case 7:
+        simd_kernels().high_contrast(src, dst, width);
+        break;
+    case 8:
+        simd_kernels().lighten(src, dst, width, op.scaling_factor);
+        break;
+    case 9:
+        simd_kernels().darken(src, dst, width, op.scaling_factor);
+        break;
+    case 10:
+        simd_kernels().quantize(src, dst, width);
+        break;
+    default:
+        if (src != dst)
+        {
+            memcpy(dst, src, size_t(width) * 3);
+        }
+        break;
+    }
+}
+
+// ________________________________________________________ Color lookup tables
+
+// How a ColorLut computes an output pixel
+enum LutKind
+{
+    LUT_CHANNEL, // each channel through its own 256 entry table
+    LUT_GRAY,    // channel sum -> one gray value -> per-channel table (grayscale, high contrast)
+    LUT_CLASS,   // channel sum picks one of 3 sets of per-channel tables (Clarendon)
+    LUT_QUANTIZE // channel sum picks white, black or the largest channel's color (process 10)
+};
+
+// Number of possible sums of three 8-bit channels
+const int LUT_SUM_ENTRIES = 766;
+
+/**
+ * Description: A chain of color operations compiled into table lookups. Every table is filled by
+ * running the reference row kernels, so results are bit-exact with the process functions.
+ * Kinds other than LUT_CHANNEL first pass each channel through `pre` when has_pre is set.
+ */
+
+struct ColorLut
+{
+    LutKind kind;
+    bool has_pre;
+    unsigned char pre[3][256];
+    unsigned char sum_table[LUT_SUM_ENTRIES]; // gray value (LUT_GRAY) or class index
+    unsigned char channel[3][3][256];         // [class][blue, green, red][value]
+    unsigned char palette[5][3];              // LUT_QUANTIZE: white, black, red, green, blue (BGR)
+};
+
+/**
+ * Description: Applies a compiled ColorLut to one row
+ * @param ColorLut to apply
+ * @param pointer to the BGR source row
+ * @param pointer to the BGR destination row (may be the source row)
+ * @param int width in pixels
+ * @return nothing
+ */
+
+void apply_color_lut(const ColorLut &lut, const unsigned char *this_pixel, unsigned char *new_pixel, int width)
+{
+    if (lut.kind == LUT_CHANNEL)
+    {
+        for (int col = 0; col < width; col++)
+        {
+            new_pixel[0] = lut.channel[0][0][this_pixel[0]];
+            new_pixel[1] = lut.channel[0][1][this_pixel[1]];
+            new_pixel[2] = lut.channel[0][2][this_pixel[2]];
+            this_pixel += 3;
+            new_pixel += 3;
+        }
+        return;
+    }
+
+    int blue;
+    int green;
+    int red;
+    int sum_color;
+
+    for (int col = 0; col < width; col++)
+    {
+        blue = this_pixel[0];
+        green = this_pixel[1];
+        red = this_pixel[2];
+        if (lut.has_pre)
+        {
+            blue = lut.pre[0][blue];
+            green = lut.pre[1][green];
+            red = lut.pre[2][red];
+        }
+        sum_color = blue + green + red;
+
+        if (lut.kind == LUT_GRAY)
+        {
+            int gray_val = lut.sum_table[sum_color];
+            new_pixel[0] = lut.channel[0][0][gray_val];
+            new_pixel[1] = lut.channel[0][1][gray_val];
+            new_pixel[2] = lut.channel[0][2][gray_val];
+        }
+        else if (lut.kind == LUT_CLASS)
+        {
+            const unsigned char(*tables)[256] = lut.channel[lut.sum_table[sum_color]];
+            new_pixel[0] = tables[0][blue];
+            new_pixel[1] = tables[1][green];
+            new_pixel[2] = tables[2][red];
+        }
+        else
+        {
+            int color = lut.sum_table[sum_color];
+            if (color == 2)
+            {
+                // Same tie-breaking order as process_10: red, then green, then blue
+                int max_color = rgb_max(red, green, blue);
+                color = max_color == red ? 2 : max_color == green ? 3 : 4;
+            }
+            new_pixel[0] = lut.palette[color][0];
+            new_pixel[1] = lut.palette[color][1];
+            new_pixel[2] = lut.palette[color][2];
+        }
+        this_pixel += 3;
+        new_pixel += 3;
+    }
+}
+
+/**
+ * Description: Fills a per-channel table set with the identity mapping
+ * @param table set to fill
+ * @return nothing
+ */
+
+void set_identity_tables(unsigned char tables[3][256])
+{
+    for (int c = 0; c < 3; c++)
+    {
+        for (int v = 0; v < 256; v++)
+        {
+            tables[c][v] = v;
+        }
+    }
+}
+
+/**
+ * Description: Fills a per-channel table set by running a point operation on every channel value
+ * @param table set to fill
+ * @param PointOp whose result depends on each channel alone (8 or 9)
+ * @return nothing
+ */
+
+void tabulate_channels(unsigned char tables[3][256], const PointOp &op)
+{
+    unsigned char values[256 * 3];
+    for (int v = 0; v < 256; v++)
+    {
+        values[v * 3] = values[v * 3 + 1] = values[v * 3 + 2] = v;
+    }
+    apply_point_op(op, values, values, 256, 0, 1);
+    for (int c = 0; c < 3; c++)
+    {
+        for (int v = 0; v < 256; v++)
+        {
+            tables[c][v] = values[v * 3 + c];
+        }
+    }
+}
+
+/**
+ * Description: Compiles a single point operation (any except vignette) into a ColorLut
+ * @param PointOp to compile
+ * @return the ColorLut equivalent to the operation
+ */
+
+ColorLut compile_color_lut(const PointOp &op)
+{
+    ColorLut lut;
+    memset(&lut, 0, sizeof(lut));
+    lut.kind = LUT_CHANNEL;
+    set_identity_tables(lut.pre);
+    set_identity_tables(lut.channel[0]);
+
+    if (op.process == 8 || op.process == 9)
+    {
+        tabulate_channels(lut.channel[0], op);
+    }
+    else if (op.process == 3 || op.process == 7)
+    {
+        // Split each sum over the channels and read the gray value the kernel produces
+        lut.kind = LUT_GRAY;
+        unsigned char pixel[3];
+        for (int sum_color = 0; sum_color < LUT_SUM_ENTRIES; sum_color++)
+        {
+            pixel[0] = min(sum_color, 255);
+            pixel[1] = min(max(sum_color - 255, 0), 255);
+            pixel[2] = max(sum_color - 510, 0);
+            apply_point_op(op, pixel, pixel, 1, 0, 1);
+            lut.sum_table[sum_color] = pixel[0];
+        }
+    }
+    else if (op.process == 2)
+    {
+        // Same thresholds as clarendon_row; its two branches are exactly lighten and darken
+        lut.kind = LUT_CLASS;
+        for (int sum_color = 0; sum_color < LUT_SUM_ENTRIES; sum_color++)
+        {
+            double avg_val = sum_color / 3;
+            lut.sum_table[sum_color] = avg_val > 169 ? 0 : avg_val < 90 ? 1 : 2;
+        }
+        tabulate_channels(lut.channel[0], PointOp(8, op.scaling_factor));
+        tabulate_channels(lut.channel[1], PointOp(9, op.scaling_factor));
+        set_identity_tables(lut.channel[2]);
+    }
+    else if (op.process == 10)
+    {
+        // Same thresholds as quantize_row
+        lut.kind = LUT_QUANTIZE;
+        for (int sum_color = 0; sum_color < LUT_SUM_ENTRIES; sum_color++)
+        {
+            lut.sum_table[sum_color] = sum_color > 549 ? 0 : sum_color < 151 ? 1 : 2;
+        }
+        const unsigned char palette[5][3] = {{255, 255, 255}, {0, 0, 0}, {0, 0, 255}, {0, 255, 0}, {255, 0, 0}};
+        memcpy(lut.palette, palette, sizeof(palette));
+    }
+    return lut;
+}
+
+/**
+ * Description: Folds `next` into `lut` so that one lookup applies both, when the kinds allow it.
+ * Anything after a per-channel table, gray table or 5 color palette can be folded; a non per-channel
+ * operation after Clarendon cannot.
+ * @param ColorLut applied first, updated in place
+ * @param ColorLut applied second
+ * @return true if `lut` now applies both, false if they must stay separate
+ */
+
+bool merge_color_lut(ColorLut &lut, const ColorLut &next)
+{
+    if (next.kind == LUT_CHANNEL)
+    {
+        // Pass every possible output of `lut` through next's tables
+        for (int k = 0; k < 3; k++)
+        {
+            for (int c = 0; c < 3; c++)
+            {
+                for (int v = 0; v < 256; v++)
+                {
+                    lut.channel[k][c][v] = next.channel[0][c][lut.channel[k][c][v]];
+                }
+            }
+        }
+        for (int i = 0; i < 5; i++)
+        {
+            for (int c = 0; c < 3; c++)
+            {
+                lut.palette[i][c] = next.channel[0][c][lut.palette[i][c]];
+            }
+        }
+        return true;
+    }
+
+    if (lut.kind == LUT_CHANNEL)
+    {
+        // Our tables become next's input tables
+        ColorLut merged = next;
+        for (int c = 0; c < 3; c++)
+        {
+            for (int v = 0; v < 256; v++)
+            {
+                merged.pre[c][v] = next.pre[c][lut.channel[0][c][v]];
+            }
+        }
+        merged.has_pre = true;
+        lut = merged;
+        return true;
+    }
+
+    if (lut.kind == LUT_GRAY)
+    {
+        // Only 256 different pixels can come out, so run next on each of them
+        unsigned char pixels[256 * 3];
+        for (int v = 0; v < 256; v++)
+        {
+            for (int c = 0; c < 3; c++)
+            {
+                pixels[v * 3 + c] = lut.channel[0][c][v];
+            }
+        }
+        apply_color_lut(next, pixels, pixels, 256);
+        for (int v = 0; v < 256; v++)
+        {
+            for (int c = 0; c < 3; c++)
+            {
+                lut.channel[0][c][v] = pixels[v * 3 + c];
+            }
+        }
+        return true;
+    }
+
+    if (lut.kind == LUT_QUANTIZE)
+    {
+        apply_color_lut(next, lut.palette[0], lut.palette[0], 5);
+        return true;
+    }
+    return false;
+}
+
+// ________________________________________________________ Compiled point operations
+
+// One step of a compiled chain: a ColorLut, or an operation that runs as a row kernel
+struct PointStep
+{
+    bool use_lut;
+    bool merged; // the ColorLut holds more than one operation
+    ColorLut lut;
+    PointOp op;
+
+    PointStep(const PointOp &point_op)
+        : use_lut(false), merged(false), op(point_op)
+    {
+    }
+};
+
+/**
+ * Description: Compiles a chain of point operations. Consecutive color operations collapse into
+ * as few ColorLuts as possible (usually one); vignette, and a lone operation with a SIMD kernel,
+ * stay row kernels.
+ * @param vector of PointOp, in order
+ * @return vector of PointStep that applies the same chain
+ */
+
+vector<PointStep> compile_point_ops(const vector<PointOp> &ops)
+{
+    vector<PointStep> steps;
+    for (size_t i = 0; i < ops.size(); i++)
+    {
+        if (ops[i].process == 1)
+        {
+            steps.push_back(PointStep(ops[i]));
+            continue;
+        }
+        ColorLut lut = compile_color_lut(ops[i]);
+        if (steps.empty() || !steps.back().use_lut || !merge_color_lut(steps.back().lut, lut))
+        {
+            steps.push_back(PointStep(ops[i]));
+            steps.back().use_lut = true;
+            steps.back().lut = lut;
+        }
+        else
+        {
+            steps.back().merged = true;
+        }
+    }
+
+    // A lone grayscale, high contrast or quantize runs faster through its SIMD kernel than
+    // through the table walk
+    for (size_t i = 0; i < steps.size(); i++)
+    {
+        int process = steps[i].op.process;
+        if (steps[i].use_lut && !steps[i].merged && simd_kernels().level != SIMD_SCALAR &&
+            (process == 3 || process == 7 || process == 10))
+        {
+            steps[i].use_lut = false;
+        }
+    }
+    return steps;
+}
+
+/**
+ * Description: Applies a compiled chain of point operations to one row
+ * @param vector of PointStep
+ * @param pointer to the BGR source row
+ * @param pointer to the BGR destination row (may be the source row)
+ * @param int width in pixels
+ * @param int index of the row in the image
+ * @param int image height in pixels
+ * @return nothing
+ */
+
+void apply_point_steps(const vector<PointStep> &steps, const unsigned char *src, unsigned char *dst, int width,
+                       int row, int height)
+{
+    if (steps.empty() && src != dst)
+    {
+        memcpy(dst, src, size_t(width) * 3);
+    }
+    for (size_t i = 0; i < steps.size(); i++)
+    {
+        const unsigned char *step_src = i == 0 ? src : dst;
+        if (steps[i].use_lut)
+        {
+            apply_color_lut(steps[i].lut, step_src, dst, width);
+        }
+        else
+        {
+            apply_point_op(steps[i].op, step_src, dst, width, row, height);
+        }
+    }
+}
+
+// ________________________________________________________ Streaming engine
+
+/**
+ * Description: Pulls every row from the source, applies the point operations to it (compiled
+ * into lookup tables) and pushes it to the sink. Only one row is held at a time.
+ * @param ScanlineSource to read
+ * @param ScanlineSink to write
+ * @param vector of PointOp to apply, in order
+ * @return BMP_OK, BMP_TRUNCATED if the source ran out of rows or BMP_WRITE_FAILED
+ */
+
+BmpStatus run_point_ops(ScanlineSource &source, ScanlineSink &sink, const vector<PointOp> &ops)
+{
+    int width = source.width();
+    int height = source.height();
+    vector<unsigned char> line(size_t(width) * 3);
+    vector<PointStep> steps = compile_point_ops(ops);
+    int row;
+
+    for (int i = 0; i < height; i++)
+    {
+        if (!source.read_row(line.data(), row))
+        {
+            return BMP_TRUNCATED;
+        }
+        apply_point_steps(steps, line.data(), line.data(), width, row, height);
+        if (!sink.write_row(line.data(), row))
+        {
+            return BMP_WRITE_FAILED;
+        }
+    }
+    return sink.finish() ? BMP_OK : BMP_WRITE_FAILED;
+}
+
+/**
+ * Description: Applies point operations from one BMP file to another without loading either
+ * image into memory. The output keeps the row order of the input file, and may be the input.
+ * @param string input BMP filename
+ * @param string output BMP filename
+ * @param vector of PointOp to apply, in order
+ * @return BMP_OK on success, otherwise the reason it failed
+ */
+
+BmpStatus stream_point_ops(const string &input, const string &output, const vector<PointOp> &ops)
+{
+    TraceSpan span("stream point ops", -1, true);
+    string target = staged_output_name(input, output);
+    BmpStatus status;
+    {
+        BmpScanlineReader reader;
+        status = reader.open(input);
+        BmpScanlineWriter writer;
+        if (status == BMP_OK)
+        {
+            status = writer.open(target, reader.width(), reader.height(), reader.top_down())
+                         ? run_point_ops(reader, writer, ops)
+                         : BMP_WRITE_FAILED;
+        }
+    }
+    return finish_staged_output(target, output, status);
+}
+
+// ________________________________________________________ Pyramids
+
+/**
+ * Description: Counts the 2x levels below an image, down to 1 x 1 or a limit
+ * @param int width in pixels
+ * @param int height in pixels
+ * @param int most levels wanted
+ * @return number of levels
+ */
+
+int pyramid_level_count(int width, int height, int limit)
+{
+    int levels = 0;
+    while (levels < limit && (width > 1 || height > 1))
+    {
+        width = (width + 1) / 2;
+        height = (height + 1) / 2;
+        levels++;
+    }
+    return levels;
+}
+
+/**
+ * Description: Names the file of a pyramid level: level k of "photo.bmp" is "photo_k.bmp"
+ * @param string file name of the full size image
+ * @param int level, 1 for half size
+ * @return file name of the level
+ */
+
+string pyramid_level_name(const string &output, int level)
+{
+    size_t dot = output.size() >= 4 ? output.size() - 4 : string::npos;
+    string extension = dot == string::npos ? "" : output.substr(dot);
+    for (size_t i = 0; i < extension.size(); i++)
+    {
+        extension[i] = tolower(extension[i]);
+    }
+    if (extension != ".bmp")
+    {
+        return output + "_" + to_string(level);
+    }
+    return output.substr(0, dot) + "_" + to_string(level) + output.substr(dot);
+}
+
+/**
+ * Description: Writes every 2x level of the image whose rows pass through it, each to its own
+ * 24 bit BMP, in the same single pass. Level k holds one row per pair of level k - 1 rows: the
+ * first row of a pair waits in a buffer, the second completes it through the halve kernel, and
+ * the result goes to the level's writer and on to level k + 1. Memory use is a few rows per
+ * level, however tall the image. Rows may also be forwarded to a sink for the full size image.
+ */
+
+class PyramidSink : public ScanlineSink
+{
+public:
+    PyramidSink()
+        : full(nullptr)
+    {
+    }
+
+    /**
+     * Description: Opens the level files
+     * @param ScanlineSink that also receives every row, or nullptr
+     * @param vector of file names, one per level from half size down
+     * @param int full width in pixels
+     * @param int full height in pixels
+     * @param bool true if rows arrive top row first
+     * @return true if every file could be created
+     */
+
+    bool open(ScanlineSink *full_sink, const vector<string> &filenames, int width, int full_height, bool top_down)
+    {
+        full = full_sink;
+        levels.clear();
+        for (size_t i = 0; i < filenames.size(); i++)
+        {
+            levels.push_back(unique_ptr<Level>(new Level()));
+            Level &level = *levels.back();
+            level.source_width = width;
+            level.source_height = i == 0 ? full_height : levels[i - 1]->height;
+            level.width = (width + 1) / 2;
+            level.height = (level.source_height + 1) / 2;
+            level.pending.resize(size_t(width) * 3);
+            level.waiting = false;
+            level.row.resize(size_t(level.width) * 3);
+            if (!level.writer.open(filenames[i], level.width, level.height, top_down))
+            {
+                return false;
+            }
+            width = level.width;
+        }
+        return true;
+    }
+
+    bool write_row(const unsigned char *bgr, int row)
+    {
+        if (full != nullptr && !full->write_row(bgr, row))
+        {
+            return false;
+        }
+        const HalveRowKernel halve = simd_kernels().halve;
+        for (size_t i = 0; i < levels.size(); i++)
+        {
+            Level &level = *levels[i];
+            // Rows 2y and 2y + 1 make level row y; an odd last row makes one on its own
+            bool alone = (row ^ 1) >= level.source_height;
+            if (!alone && !level.waiting)
+            {
+                memcpy(level.pending.data(), bgr, level.pending.size());
+                level.waiting = true;
+                return true;
+            }
+            halve(alone ? bgr : level.pending.data(), bgr, level.row.data(), level.source_width);
+            level.waiting = false;
+            row /= 2;
+            if (!level.writer.write_row(level.row.data(), row))
+            {
+                return false;
+            }
+            bgr = level.row.data();
+        }
+        return true;
+    }
+
+    bool finish()
+    {
+        bool ok = full == nullptr || full->finish();
+        for (size_t i = 0; i < levels.size(); i++)
+        {
+            ok = levels[i]->writer.finish() && ok;
+        }
+        return ok;
+    }
+
+private:
+    struct Level
+    {
+        int source_width;  // of the level above
+        int source_height;
+        int width;
+        int height;
+        vector<unsigned char> pending; // first row of a pair from the level above
+        bool waiting;
+        vector<unsigned char> row;     // the level's latest row
+        BmpScanlineWriter writer;
+    };
+
+    ScanlineSink *full;
+    vector<unique_ptr<Level>> levels;
+};
+
+/**
+ * Description: Pulls every row from the source, applies point operations and writes the 2x levels
+ * below it, each to its own BMP named by pyramid_level_name()
+ * @param ScanlineSource to read
+ * @param ScanlineSink that also receives the full size rows, or nullptr
+ * @param string output BMP filename of the full size image
+ * @param vector of PointOp to apply first, in order
+ * @param int most levels to write
+ * @return BMP_OK, BMP_TRUNCATED if the source ran out of rows or BMP_WRITE_FAILED
+ */
+
+BmpStatus run_pyramid(ScanlineSource &source, ScanlineSink *full, const string &output, const vector<PointOp> &ops,
+                      int levels)
+{
+    vector<string> filenames;
+    for (int k = 1; k <= pyramid_level_count(source.width(), source.height(), levels); k++)
+    {
+        filenames.push_back(pyramid_level_name(output, k));
+    }
+    PyramidSink pyramid;
+    if (!pyramid.open(full, filenames, source.width(), source.height(), source.top_down()))
+    {
+        return BMP_WRITE_FAILED;
+    }
+    return run_point_ops(source, pyramid, ops);
+}
+
+/**
+ * Description: Streams a BMP file into its pyramid: the full size image, with any point
+ * operations applied, and every 2x level below it, all from one decode. Only a few rows of each
+ * level are held in memory.
+ * @param string input BMP filename
+ * @param string output BMP filename for the full size image (which may be the input), or empty to
+ * write only the levels
+ * @param vector of PointOp to apply first, in order
+ * @param int most levels to write
+ * @param string name the levels are derived from, when it is not the output
+ * @return BMP_OK on success, otherwise the reason it failed
+ */
+
+BmpStatus stream_pyramid(const string &input, const string &output, const vector<PointOp> &ops, int levels,
+                         const string &level_base = string())
+{
+    TraceSpan span("stream pyramid", -1, true);
+    string target = output.empty() ? output : staged_output_name(input, output);
+    BmpStatus status;
+    {
+        BmpScanlineReader reader;
+        status = reader.open(input);
+        BmpScanlineWriter writer;
+        if (status == BMP_OK && !output.empty() &&
+            !writer.open(target, reader.width(), reader.height(), reader.top_down()))
+        {
+            status = BMP_WRITE_FAILED;
+        }
+        if (status == BMP_OK)
+        {
+            status = run_pyramid(reader, output.empty() ? nullptr : &writer, level_base.empty() ? output : level_base,
+                                 ops, levels);
+        }
+    }
+    return finish_staged_output(target, output, status);
+}
+
+/**
+ * Description: Writes every 2x level below an image, each made from the one above as the rows
+ * stream past, so no level is held whole
+ * @param Image full size
+ * @param string output BMP filename of the full size image; levels go to pyramid_level_name()
+ * @param int most levels to write
+ * @return BMP_OK on success, otherwise BMP_WRITE_FAILED
+ */
+
+BmpStatus write_pyramid(const Image &image, const string &output, int levels)
+{
+    TraceSpan span("write pyramid", -1, true);
+    // Bottom row first, so the level files store their rows the usual way
+    ImageScanlineSource source(image, true);
+    return run_pyramid(source, nullptr, output, vector<PointOp>(), levels);
+}
+
+//***************************************************************************************************//
+// FRAME BLENDING
+//***************************************************************************************************//
+
+// ________________________________________________________ Blend modes
+
+// How blend_frames() combines the frames into one image
+enum BlendMode
+{
+    BLEND_MEAN,     // rounded average
+    BLEND_WEIGHTED, // rounded weighted average, weights scaled to add up to 1
+    BLEND_MIN,      // darkest value of each channel
+    BLEND_MAX,      // lightest value of each channel
+    BLEND_MEDIAN    // middle value of each channel; the lower middle for an even count
+};
+
+// Most frames one blend takes: median counts are 16 bits
+const int BLEND_MAX_FRAMES = 65535;
+
+// Weights become integers adding up to exactly 1 << BLEND_WEIGHT_BITS, so a weighted sum of
+// 8-bit values needs 24 bits however many frames there are
+const int BLEND_WEIGHT_BITS = 16;
+
+// Bands are finished in chunks of this many pixels of a row
+const int BLEND_CHUNK_PIXELS = 1024;
+
+// Median bands hold every frame's rows; a band uses about this much memory, or one row of each frame
+const size_t BLEND_MEDIAN_BAND_BYTES = 16 << 20;
+
+// What blend_frames() computes
+struct BlendOptions
+{
+    BlendMode mode;
+    vector<double> weights; // BLEND_WEIGHTED: one non-negative weight per frame
+
+    BlendOptions()
+        : mode(BLEND_MEAN)
+    {
+    }
+};
+
+/**
+ * Description: Reads a blend mode name
+ * @param string name: mean, weighted, min, max or median
+ * @param BlendMode that receives the mode
+ * @return true if the name is known
+ */
+
+bool parse_blend_mode(const string &name, BlendMode &mode)
+{
+    const char *names[] = {"mean", "weighted", "min", "max", "median"};
+    for (int i = 0; i < 5; i++)
+    {
+        if (name == names[i])
+        {
+            mode = BlendMode(i);
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Description: Converts frame weights to fixed point. The running total is rounded rather than
+ * each weight, so the fixed point weights add up to exactly one.
+ * @param vector of non-negative weights with a positive total; missing weights count as 1
+ * @param int number of frames
+ * @return vector of weights in units of 2^-BLEND_WEIGHT_BITS
+ */
+
+vector<uint32_t> fixed_point_weights(const vector<double> &weights, int frames)
+{
+    const double one = 1 << BLEND_WEIGHT_BITS;
+    vector<double> running(frames + 1, 0.0);
+    for (int f = 0; f < frames; f++)
+    {
+        running[f + 1] = running[f] + (f < int(weights.size()) ? weights[f] : 1.0);
+    }
+
+    vector<uint32_t> fixed(frames);
+    for (int f = 0; f < frames; f++)
+    {
+        fixed[f] = uint32_t(floor(running[f + 1] / running[frames] * one + 0.5)) -
+                   uint32_t(floor(running[f] / running[frames] * one + 0.5));
+    }
+    return fixed;
+}
+
+// ________________________________________________________ Finishing rows
+
+// Rounded division of frame sums, as an add, a multiply and a shift
+struct FrameDivider
+{
+    uint32_t bias;
+    uint64_t multiplier;
+    int shift;
+};
+
+/**
+ * Description: Prepares the rounded division of sums below 255 * frames by the frame count.
+ * With 2^(l-1) < frames <= 2^l and shift = 8 + 2l, a biased sum times frames stays below
+ * 2^shift, which keeps the rounded up reciprocal exact, and times the multiplier below 2^64.
+ * @param int frame count, 1 to BLEND_MAX_FRAMES
+ * @return FrameDivider
+ */
+
+FrameDivider frame_divider(int frames)
+{
+    int l = 0;
+    while ((1 << l) < frames)
+    {
+        l++;
+    }
+    FrameDivider divider;
+    divider.bias = frames / 2;
+    divider.shift = 8 + 2 * l;
+    divider.multiplier = (uint64_t(1) << divider.shift) / frames + 1;
+    return divider;
+}
+
+/**
+ * Description: Prepares the rounding of weighted sums, whose weights add up to one
+ * @return FrameDivider
+ */
+
+FrameDivider weight_divider()
+{
+    FrameDivider divider;
+    divider.bias = 1u << (BLEND_WEIGHT_BITS - 1);
+    divider.multiplier = 1;
+    divider.shift = BLEND_WEIGHT_BITS;
+    return divider;
+}
+
+/**
+ * Description: Turns frame sums into channel values
+ * @param pointer to the sums
+ * @param pointer to the destination bytes
+ * @param int number of sums
+ * @param FrameDivider from frame_divider() or weight_divider()
+ * @return nothing
+ */
+
+void divide_sums(const uint32_t *sums, unsigned char *dst, int count, const FrameDivider &divider)
+{
+    for (int i = 0; i < count; i++)
+    {
+        dst[i] = (unsigned char)((sums[i] + divider.bias) * divider.multiplier >> divider.shift);
+    }
+}
+
+// ________________________________________________________ Blend engine
+
+/**
+ * Description: Blends frames of the same size into one image, streaming them a band of rows at a
+ * time. The frames are split into one group per pool thread; each group reads its frames' rows
+ * in parallel with the others and folds them into its own sums (or minimums, maximums) for the
+ * band, and the groups are combined when the band is finished. Memory depends on the width and
+ * the thread count, not on the number of frames or their height, except for the median, which
+ * has to hold one row of every frame. Integer sums make the result independent of the thread
+ * count.
+ * @param vector of 1 to BLEND_MAX_FRAMES ScanlineSource, all with the size and row order of the first
+ * @param ScanlineSink to write
+ * @param BlendOptions
+ * @param int that receives the index of the frame that failed, or -1
+ * @return BMP_OK, BMP_SIZE_MISMATCH, BMP_TRUNCATED if a frame ran out of rows or BMP_WRITE_FAILED
+ */
+
+BmpStatus blend_frames(const vector<ScanlineSource *> &frames, ScanlineSink &sink, const BlendOptions &options,
+                       int &failed_frame)
+{
+    TraceSpan span("blend frames", int(frames.size()), true);
+    int count = int(frames.size());
+    int width = frames[0]->width();
+    int height = frames[0]->height();
+    bool top_down = frames[0]->top_down();
+    failed_frame = -1;
+    for (int f = 1; f < count; f++)
+    {
+        if (frames[f]->width() != width || frames[f]->height() != height || frames[f]->top_down() != top_down)
+        {
+            failed_frame = f;
+            return BMP_SIZE_MISMATCH;
+        }
+    }
+
+    const SimdKernels &kernels = simd_kernels();
+    BlendMode mode = options.mode;
+    bool sums = mode == BLEND_MEAN || mode == BLEND_WEIGHTED;
+    size_t row_bytes = size_t(width) * 3;
+    int groups = min(count, thread_pool().size());
+    int rows = mode == BLEND_MEDIAN ? int(max<size_t>(1, BLEND_MEDIAN_BAND_BYTES / (row_bytes * count)))
+                                    : band_rows(sums ? row_bytes * sizeof(uint32_t) : row_bytes);
+    rows = min(rows, height);
+    int chunks = (width + BLEND_CHUNK_PIXELS - 1) / BLEND_CHUNK_PIXELS;
+
+    vector<uint32_t> weights(count, 1);
+    if (mode == BLEND_WEIGHTED)
+    {
+        weights = fixed_point_weights(options.weights, count);
+    }
+    FrameDivider divider = mode == BLEND_WEIGHTED ? weight_divider() : frame_divider(count);
+
+    // Each group's running values for the band: sums, or bytes for the other modes. A median band
+    // holds the rows of every frame instead, frame by frame within each row.
+    vector<uint32_t> partial_sums(sums ? groups * rows * row_bytes : 0);
+    vector<unsigned char> partial_bytes(sums ? 0 : mode == BLEND_MEDIAN ? rows * count * row_bytes
+                                                                        : groups * rows * row_bytes);
+    vector<unsigned char> lines(groups * row_bytes);
+    vector<unsigned char> out(rows * row_bytes);
+    vector<int> failed(groups);
+
+    for (int first = 0; first < height; first += rows)
+    {
+        int band = min(rows, height - first);
+        thread_pool().parallel_for(groups, 1, [&](int first_group, int last_group)
+        {
+            for (int g = first_group; g < last_group; g++)
+            {
+                uint32_t *group_sums = sums ? &partial_sums[g * rows * row_bytes] : NULL;
+                unsigned char *group_bytes = mode == BLEND_MIN || mode == BLEND_MAX
+                                                 ? &partial_bytes[g * rows * row_bytes]
+                                                 : NULL;
+                if (sums)
+                {
+                    fill(group_sums, group_sums + band * row_bytes, 0u);
+                }
+                else if (group_bytes != NULL)
+                {
+                    memset(group_bytes, mode == BLEND_MIN ? 255 : 0, band * row_bytes);
+                }
+
+                failed[g] = -1;
+                for (int f = g * count / groups; f < (g + 1) * count / groups && failed[g] < 0; f++)
+                {
+                    for (int r = 0; r < band; r++)
+                    {
+                        int stored_index = first + r;
+                        int expected = top_down ? stored_index : height - 1 - stored_index;
+                        unsigned char *line = mode == BLEND_MEDIAN ? &partial_bytes[(r * count + f) * row_bytes]
+                                                                   : &lines[g * row_bytes];
+                        int row;
+                        if (!frames[f]->read_row(line, row) || row != expected)
+                        {
+                            failed[g] = f;
+                            break;
+                        }
+                        if (sums)
+                        {
+                            kernels.accumulate(line, group_sums + r * row_bytes, width, weights[f]);
+                        }
+                        else if (mode == BLEND_MIN)
+                        {
+                            kernels.minimum(line, group_bytes + r * row_bytes, width);
+                        }
+                        else if (mode == BLEND_MAX)
+                        {
+                            kernels.maximum(line, group_bytes + r * row_bytes, width);
+                        }
+                    }
+                }
+            }
+        });
+        for (int g = 0; g < groups; g++)
+        {
+            if (failed[g] >= 0)
+            {
+                failed_frame = failed[g];
+                return BMP_TRUNCATED;
+            }
+        }
+
+        // Combine the groups, one chunk of one row at a time
+        thread_pool().parallel_for(band * chunks, 1, [&](int first_item, int last_item)
+        {
+            vector<const unsigned char *> frame_rows(mode == BLEND_MEDIAN ? count : 0);
+            for (int item = first_item; item < last_item; item++)
+            {
+                int r = item / chunks;
+                size_t begin = size_t(item % chunks) * BLEND_CHUNK_PIXELS * 3;
+                size_t end = min(row_bytes, begin + BLEND_CHUNK_PIXELS * 3);
+                unsigned char *dst = &out[r * row_bytes];
+                if (mode == BLEND_MEDIAN)
+                {
+                    for (int f = 0; f < count; f++)
+                    {
+                        frame_rows[f] = &partial_bytes[(r * count + f) * row_bytes];
+                    }
+                    kernels.median(frame_rows.data(), count, begin, dst + begin, int(end - begin) / 3);
+                    continue;
+                }
+                // The first group's values collect the others'
+                int pixels = int(end - begin) / 3;
+                if (sums)
+                {
+                    uint32_t *total = &partial_sums[r * row_bytes + begin];
+                    for (int g = 1; g < groups; g++)
+                    {
+                        const uint32_t *other = &partial_sums[(g * rows + r) * row_bytes + begin];
+                        for (int i = 0; i < pixels * 3; i++)
+                        {
+                            total[i] += other[i];
+                        }
+                    }
+                    divide_sums(total, dst + begin, pixels * 3, divider);
+                    continue;
+                }
+                unsigned char *extreme = &partial_bytes[r * row_bytes + begin];
+                for (int g = 1; g < groups; g++)
+                {
+                    const unsigned char *other = &partial_bytes[(g * rows + r) * row_bytes + begin];
+                    (mode == BLEND_MIN ? kernels.minimum : kernels.maximum)(other, extreme, pixels);
+                }
+                memcpy(dst + begin, extreme, pixels * 3);
+            }
+        });
+
+        for (int r = 0; r < band; r++)
+        {
+            int stored_index = first + r;
+            if (!sink.write_row(&out[r * row_bytes], top_down ? stored_index : height - 1 - stored_index))
+            {
+                return BMP_WRITE_FAILED;
+            }
+        }
+    }
+    return sink.finish() ? BMP_OK : BMP_WRITE_FAILED;
+}
+
+/**
+ * Description: Blends BMP files into a new 24 bit BMP without loading any of them into memory.
+ * Every input stays open; together they read about STREAM_BLOCK_BYTES at a time, at least 64 KiB
+ * each. Inputs may store their rows in either order: the output is top-down only when every input
+ * is, and uncompressed inputs in the other order are read backwards (run length files are always
+ * bottom-up, so they never need to be).
+ * @param vector of 1 to BLEND_MAX_FRAMES input BMP filenames
+ * @param string output BMP filename
+ * @param BlendOptions
+ * @param int that receives the index of the input that failed, or -1 when writing failed
+ * @return BMP_OK on success, otherwise the reason it failed
+ */
+
+BmpStatus blend_files(const vector<string> &inputs, const string &output, const BlendOptions &options,
+                      int &failed_input)
+{
+    size_t block_bytes = max<size_t>(64 * 1024, STREAM_BLOCK_BYTES / inputs.size());
+    vector<unique_ptr<BmpScanlineReader>> readers;
+    vector<ScanlineSource *> frames;
+    bool top_down = true;
+    for (size_t i = 0; i < inputs.size(); i++)
+    {
+        failed_input = int(i);
+        readers.push_back(unique_ptr<BmpScanlineReader>(new BmpScanlineReader()));
+        BmpStatus status = readers[i]->open(inputs[i], block_bytes);
+        if (status != BMP_OK)
+        {
+            return status;
+        }
+        if (readers[i]->width() != readers[0]->width() || readers[i]->height() != readers[0]->height())
+        {
+            return BMP_SIZE_MISMATCH;
+        }
+        top_down = top_down && readers[i]->top_down();
+    }
+    for (size_t i = 0; i < inputs.size(); i++)
+    {
+        if (readers[i]->top_down() != top_down)
+        {
+            failed_input = int(i);
+            readers[i].reset(new BmpScanlineReader());
+            BmpStatus status = readers[i]->open(inputs[i], block_bytes, true);
+            if (status != BMP_OK)
+            {
+                return status;
+            }
+        }
+        frames.push_back(readers[i].get());
+    }
+
+    failed_input = -1;
+    BmpScanlineWriter writer;
+    if (!writer.open(output, readers[0]->width(), readers[0]->height(), top_down))
+    {
+        return BMP_WRITE_FAILED;
+    }
+    return blend_frames(frames, writer, options, failed_input);
+}
+
+/**
+ * Description: Blends images in memory, as blend_files() does files
+ * @param vector of 1 to BLEND_MAX_FRAMES Images of the same size; an Image may appear more than once
+ * @param BlendOptions
+ * @return the blended Image, or an empty Image if the sizes differ
+ */
+
+Image blend_images(const vector<const Image *> &images, const BlendOptions &options)
+{
+    vector<unique_ptr<ImageScanlineSource>> sources;
+    vector<ScanlineSource *> frames;
+    for (size_t i = 0; i < images.size(); i++)
+    {
+        sources.push_back(unique_ptr<ImageScanlineSource>(new ImageScanlineSource(*images[i])));
+        frames.push_back(sources[i].get());
+    }
+    ImageScanlineSink sink(images[0]->width, images[0]->height);
+    int failed_frame;
+    if (blend_frames(frames, sink, options, failed_frame) != BMP_OK)
+    {
+        return Image();
+    }
+    return move(sink.image);
+}
+
+//***************************************************************************************************//
+// PIPELINES
+//***************************************************************************************************//
+
+// ________________________________________________________ Operations
+
+// One step of a pipeline: a process number and its parameters
+struct Operation
+{
+    int process;            // process number 1-12, or PROCESS_RESIZE
+    double scaling_factor;  // processes 2, 8 and 9
+    int num;                // process 5: number of 90 degree rotations
+    int x_scale;            // process 6
+    int y_scale;            // process 6
+    double x_factor;        // PROCESS_RESIZE
+    double y_factor;        // PROCESS_RESIZE
+    ResizeFilter filter;    // PROCESS_RESIZE
+    VignetteShape vignette; // process 1
+
+    Operation(int process_number = 0)
+        : process(process_number), scaling_factor(1.0), num(0), x_scale(1), y_scale(1), x_factor(1.0),
+          y_factor(1.0), filter(FILTER_BICUBIC)
+    {
+    }
+};
+
+// Pipeline-only operation: fractional resize through resize_image
+const int PROCESS_RESIZE = 15;
+
+// Pipeline spec names, the process they select and how many parameters follow them
+struct OperationName
+{
+    const char *name;
+    int process;
+    int parameters;
+};
+
+const OperationName OPERATION_NAMES[] = {
+    {"vignette", 1, 0}, {"vignette", 1, 3}, {"clarendon", 2, 1}, {"gray", 3, 0},     {"grayscale", 3, 0}, {"rot90", 4, 0},
+    {"rot", 5, 1},      {"rotate", 5, 1},    {"enlarge", 6, 2},  {"contrast", 7, 0},  {"lighten", 8, 1},
+    {"darken", 9, 1},   {"quantize", 10, 0}, {"mirror-h", 11, 0}, {"mirror-v", 12, 0}, {"resize", PROCESS_RESIZE, 3},
+};
+
+/**
+ * Description: Parses a pipeline spec such as "gray,lighten:0.8,rot:1". Each step is an operation
+ * name (or process number) followed by its parameters, separated by colons.
+ * @param string pipeline spec
+ * @param vector of Operation that receives the steps
+ * @param string that receives a message if the spec is invalid
+ * @return true if the spec was valid
+ */
+
+bool parse_pipeline(const string &spec, vector<Operation> &ops, string &error)
+{
+    ops.clear();
+    stringstream steps(spec);
+    string step;
+    while (getline(steps, step, ','))
+    {
+        vector<string> fields;
+        stringstream parts(step);
+        string field;
+        while (getline(parts, field, ':'))
+        {
+            fields.push_back(field);
+        }
+        if (fields.empty() || fields[0].empty())
+        {
+            error = "empty step in pipeline \"" + spec + "\"";
+            return false;
+        }
+
+        // A name may be listed more than once with different parameter counts
+        const OperationName *match = nullptr;
+        for (size_t i = 0; i < sizeof(OPERATION_NAMES) / sizeof(OPERATION_NAMES[0]); i++)
+        {
+            if (fields[0] == OPERATION_NAMES[i].name || fields[0] == to_string(OPERATION_NAMES[i].process))
+            {
+                if (match == nullptr || int(fields.size()) - 1 == OPERATION_NAMES[i].parameters)
+                {
+                    match = &OPERATION_NAMES[i];
+                }
+            }
+        }
+        if (match == nullptr)
+        {
+            error = "unknown operation \"" + fields[0] + "\"";
+            return false;
+        }
+        if (int(fields.size()) - 1 != match->parameters)
+        {
+            string counts;
+            for (size_t i = 0; i < sizeof(OPERATION_NAMES) / sizeof(OPERATION_NAMES[0]); i++)
+            {
+                if (string(OPERATION_NAMES[i].name) == match->name)
+                {
+                    counts += (counts.empty() ? "" : " or ") + to_string(OPERATION_NAMES[i].parameters);
+                }
+            }
+            error = "\"" + fields[0] + "\" takes " + counts + " parameter(s)";
+            return false;
+        }
+
+        Operation op(match->process);
+        try
+        {
+            if (op.process == 2 || op.process == 8 || op.process == 9)
+            {
+                op.scaling_factor = stod(fields[1]);
+            }
+            else if (op.process == 5)
+            {
+                op.num = stoi(fields[1]);
+            }
+            else if (op.process == 6)
+            {
+                op.x_scale = stoi(fields[1]);
+                op.y_scale = stoi(fields[2]);
+            }
+            else if (op.process == PROCESS_RESIZE)
+            {
+                op.x_factor = stod(fields[1]);
+                op.y_factor = stod(fields[2]);
+            }
+            else if (op.process == 1 && fields.size() == 4)
+            {
+                op.vignette = VignetteShape(stod(fields[2]), stod(fields[3]), stod(fields[1]));
+            }
+        }
+        catch (const exception &)
+        {
+            error = "bad parameter in \"" + step + "\"";
+            return false;
+        }
+        if (op.process == 6 && (op.x_scale < 1 || op.y_scale < 1))
+        {
+            error = "enlarge scales must be positive integers";
+            return false;
+        }
+        if (op.process == 1 && !(op.vignette.radius > 0 && op.vignette.centre_x >= 0 && op.vignette.centre_x <= 1 &&
+                                 op.vignette.centre_y >= 0 && op.vignette.centre_y <= 1))
+        {
+            error = "vignette radius must be above 0 and its centre between 0 and 1";
+            return false;
+        }
+        if (op.process == PROCESS_RESIZE)
+        {
+            if (!(op.x_factor > 0 && op.y_factor > 0))
+            {
+                error = "resize factors must be above 0";
+                return false;
+            }
+            if (!parse_resize_filter(fields[3], op.filter))
+            {
+                error = "unknown resize filter \"" + fields[3] + "\" (bilinear, bicubic, lanczos or box)";
+                return false;
+            }
+        }
+        ops.push_back(op);
+    }
+    if (ops.empty())
+    {
+        error = "empty pipeline";
+        return false;
+    }
+
+    // Enlarge scales multiply (across rotations, on the axis they end up on), so check here that
+    // their products cannot overflow whatever the image
+    double scales[2] = {1.0, 1.0};
+    for (size_t i = 0; i < ops.size(); i++)
+    {
+        if (ops[i].process == 6)
+        {
+            scales[0] *= ops[i].x_scale;
+            scales[1] *= ops[i].y_scale;
+        }
+        else if (ops[i].process == 4 || (ops[i].process == 5 && process_5_orientation(ops[i].num).transpose))
+        {
+            swap(scales[0], scales[1]);
+        }
+        if (scales[0] > INT_MAX || scales[1] > INT_MAX)
+        {
+            error = "enlarge scales multiply to more than " + to_string(INT_MAX);
+            return false;
+        }
+    }
+    return true;
+}
+
+// ________________________________________________________ Fused stages
+
+/**
+ * Description: A run of operations that execute in one pass. Every output pixel is fetched from
+ * the input through one index remap (orientation, then integer enlarge), and then the point
+ * operations are applied to the output row in place. A stage that starts with a fractional
+ * resize resamples its input first.
+ */
+
+struct PipelineStage
+{
+    bool resize;
+    double x_factor;
+    double y_factor;
+    ResizeFilter filter;
+    Orientation orientation;
+    int x_scale;
+    int y_scale;
+    vector<PointOp> point_ops;
+
+    PipelineStage()
+        : resize(false), x_factor(1.0), y_factor(1.0), filter(FILTER_BICUBIC), x_scale(1), y_scale(1)
+    {
+    }
+
+    bool is_point_only() const
+    {
+        return !resize && orientation.is_identity() && x_scale == 1 && y_scale == 1;
+    }
+
+    bool is_empty() const
+    {
+        return is_point_only() && point_ops.empty();
+    }
+
+    // Keeps the image size and needs no transpose, so the stage can overwrite its input
+    bool runs_in_place() const
+    {
+        return !resize && x_scale == 1 && y_scale == 1 && !orientation.transpose;
+    }
+
+    // Name of the stage's spans in a trace
+    const char *trace_name() const
+    {
+        return resize ? "resize stage" : is_point_only() ? "point stage" : "remap stage";
+    }
+};
+
+/**
+ * Description: Groups a list of operations into as few fused stages as possible. Point operations
+ * that only look at the pixel value commute with every remap, so geometric steps are folded into
+ * the current stage's remap. Only a geometric step after the position dependent vignette, or a
+ * filtered resize after anything at all, needs a new stage.
+ * @param vector of Operation
+ * @return vector of PipelineStage that together apply the operations in order
+ */
+
+vector<PipelineStage> plan_pipeline(const vector<Operation> &ops)
+{
+    vector<PipelineStage> stages(1);
+    bool position_dependent = false;
+
+    for (size_t i = 0; i < ops.size(); i++)
+    {
+        const Operation &op = ops[i];
+        if (is_point_op(op.process))
+        {
+            stages.back().point_ops.push_back(PointOp(op.process, op.scaling_factor));
+            stages.back().point_ops.back().vignette = op.vignette;
+            position_dependent = position_dependent || op.process == 1;
+            continue;
+        }
+
+        if (op.process == PROCESS_RESIZE)
+        {
+            // Filters mix neighbouring pixels, so nothing before a resize can move past it
+            if (!stages.back().is_empty())
+            {
+                stages.push_back(PipelineStage());
+            }
+            stages.back().resize = true;
+            stages.back().x_factor = op.x_factor;
+            stages.back().y_factor = op.y_factor;
+            stages.back().filter = op.filter;
+            position_dependent = false;
+            continue;
+        }
+
+        if (position_dependent)
+        {
+            stages.push_back(PipelineStage());
+            position_dependent = false;
+        }
+
+        PipelineStage &stage = stages.back();
+        Orientation step;
+        if (op.process == 4)
+        {
+            step = rotation_orientation(1);
+        }
+        else if (op.process == 5)
+        {
+            // Same turn as process_5, including its treatment of negative counts
+            step = process_5_orientation(op.num);
+        }
+        else if (op.process == 11)
+        {
+            step = Orientation(false, true, false);
+        }
+        else if (op.process == 12)
+        {
+            step = Orientation(false, false, true);
+        }
+        else if (op.process == 6)
+        {
+            // Nearest neighbour enlarge commutes with mirrors; a transpose swaps the scales
+            stage.x_scale *= op.x_scale;
+            stage.y_scale *= op.y_scale;
+            continue;
+        }
+
+        stage.orientation = compose_orientation(stage.orientation, step);
+        if (step.transpose)
+        {
+            swap(stage.x_scale, stage.y_scale);
+        }
+    }
+    return stages;
+}
+
+// Largest pixel array a pipeline may produce: the BMP header stores the file size in 32 bits
+const uint64_t MAX_BMP_ARRAY_BYTES = 0xFFFFFFFFULL - BMP_FILE_HEADER_SIZE - 40;
+
+/**
+ * Description: Checks, before any of it runs, that every stage of a pipeline makes an image whose
+ * width and height fit an int and whose 24 bit pixel array fits a BMP file. Sizes are worked out
+ * in floating point, so factors that would overflow stage_output_size() are caught.
+ * @param vector of PipelineStage
+ * @param int input width
+ * @param int input height
+ * @return true if every stage's output fits
+ */
+
+bool pipeline_size_fits(const vector<PipelineStage> &stages, int width, int height)
+{
+    double stage_width = width;
+    double stage_height = height;
+    for (size_t i = 0; i < stages.size(); i++)
+    {
+        if (stages[i].resize)
+        {
+            stage_width = max(1.0, floor(stage_width * stages[i].x_factor + 0.5));
+            stage_height = max(1.0, floor(stage_height * stages[i].y_factor + 0.5));
+        }
+        if (stages[i].orientation.transpose)
+        {
+            swap(stage_width, stage_height);
+        }
+        stage_width *= stages[i].x_scale;
+        stage_height *= stages[i].y_scale;
+        double row_bytes = ceil(stage_width * 3 / 4) * 4;
+        if (!(stage_width <= INT_MAX && stage_height <= INT_MAX && row_bytes * stage_height <= MAX_BMP_ARRAY_BYTES))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Description: Fetches one output row of a stage's remap from the source image
+ * @param BGR source Image
+ * @param PipelineStage whose orientation and scales to apply
+ * @param int output row index
+ * @param int output width in pixels
+ * @param pointer to the output row
+ * @return nothing
+ */
+
+void remap_row(const Image &src, const PipelineStage &stage, int row, int width, unsigned char *dst)
+{
+    const Orientation &orientation = stage.orientation;
+    // Size of the oriented image before enlarging
+    int oriented_width = orientation.transpose ? src.height : src.width;
+    int oriented_height = orientation.transpose ? src.width : src.height;
+
+    int y = row / stage.y_scale;
+    if (orientation.flip_y)
+    {
+        y = oriented_height - 1 - y;
+    }
+
+    for (int col = 0; col < width; col++)
+    {
+        int x = col / stage.x_scale;
+        if (orientation.flip_x)
+        {
+            x = oriented_width - 1 - x;
+        }
+        const unsigned char *pixel = orientation.transpose ? src.row(x) + y * 3 : src.row(y) + x * 3;
+        dst[0] = pixel[0];
+        dst[1] = pixel[1];
+        dst[2] = pixel[2];
+        dst += 3;
+    }
+}
+
+/**
+ * Description: Builds the vignette tables a list of point operations needs, across the pool,
+ * rather than leaving it to the first band that looks one up
+ * @param vector of PointOp
+ * @param int image width
+ * @param int image height
+ * @return nothing
+ */
+
+void prepare_vignettes(const vector<PointOp> &ops, int width, int height)
+{
+    for (size_t i = 0; i < ops.size(); i++)
+    {
+        if (ops[i].process == 1 && vignette_table_fits(width, height, ops[i].vignette))
+        {
+            vignette_falloff(width, height, ops[i].vignette);
+        }
+    }
+}
+
+/**
+ * Description: Runs a stage that keeps the image size and has no transpose directly on the
+ * image. Rows are handled in mirrored pairs (row r and row height - 1 - r), so a vertical flip
+ * swaps the pair through one spare row and the point operations run while both rows are in cache.
+ * @param Image to modify
+ * @param PipelineStage for which runs_in_place() is true
+ * @return nothing
+ */
+
+void run_stage_in_place(Image &image, const PipelineStage &stage)
+{
+    TraceSpan span(stage.trace_name(), image.height, true);
+    if (image.layout != LAYOUT_BGR)
+    {
+        image = convert_layout(image, LAYOUT_BGR);
+    }
+    int width = image.width;
+    int height = image.height;
+    size_t row_bytes = size_t(width) * 3;
+    vector<PointStep> steps = compile_point_ops(stage.point_ops);
+    prepare_vignettes(stage.point_ops, width, height);
+    const Orientation &orientation = stage.orientation;
+    const SimdKernels &kernels = simd_kernels();
+
+    parallel_rows((height + 1) / 2, row_bytes * 4, [&](int first, int last)
+    {
+        vector<unsigned char> spare(orientation.is_identity() ? 0 : row_bytes);
+        for (int top = first; top < last; top++)
+        {
+            int bottom = height - 1 - top;
+            unsigned char *top_row = image.row(top);
+            unsigned char *bottom_row = image.row(bottom);
+            if (orientation.flip_y && top != bottom)
+            {
+                memcpy(spare.data(), top_row, row_bytes);
+                if (orientation.flip_x)
+                {
+                    kernels.mirror(bottom_row, top_row, width);
+                    kernels.mirror(spare.data(), bottom_row, width);
+                }
+                else
+                {
+                    memcpy(top_row, bottom_row, row_bytes);
+                    memcpy(bottom_row, spare.data(), row_bytes);
+                }
+            }
+            else if (orientation.flip_x)
+            {
+                memcpy(spare.data(), top_row, row_bytes);
+                kernels.mirror(spare.data(), top_row, width);
+                if (top != bottom)
+                {
+                    memcpy(spare.data(), bottom_row, row_bytes);
+                    kernels.mirror(spare.data(), bottom_row, width);
+                }
+            }
+            apply_point_steps(steps, top_row, top_row, width, top, height);
+            if (top != bottom)
+            {
+                apply_point_steps(steps, bottom_row, bottom_row, width, bottom, height);
+            }
+        }
+    });
+}
+
+// ________________________________________________________ Running pipelines
+
+/**
+ * Description: Images a pipeline reuses between stages and between runs, so a batch allocates
+ * its buffers once rather than once per image and stage
+ */
+
+struct PipelineBuffers
+{
+    Image spare;   // output of a stage that cannot run in place, then swapped with the image
+    Image widened; // intermediate of a resize
+};
+
+/**
+ * Description: Runs one fused stage over a whole image into another
+ * @param Image to read
+ * @param PipelineStage to run
+ * @param Image that receives the result, reusing its buffer (must not be the source)
+ * @param PipelineBuffers; only the resize intermediate is used
+ * @return nothing
+ */
+
+void run_stage(const Image &image, const PipelineStage &stage, Image &new_img, PipelineBuffers &buffers)
+{
+    TraceSpan span(stage.trace_name(), image.height, true);
+    if (stage.resize)
+    {
+        scale_image(image, stage.x_factor, stage.y_factor, stage.filter, new_img, buffers.widened);
+        PipelineStage rest = stage;
+        rest.resize = false;
+        if (rest.runs_in_place())
+        {
+            run_stage_in_place(new_img, rest);
+        }
+        else
+        {
+            // The intermediate is free again, so it takes the rest of the stage
+            run_stage(new_img, rest, buffers.widened, buffers);
+            new_img.swap(buffers.widened);
+        }
+        return;
+    }
+
+    Image scratch;
+    const Image &src = as_bgr(image, scratch);
+    bool transpose = stage.orientation.transpose;
+    int width = (transpose ? src.height : src.width) * stage.x_scale;
+    int height = (transpose ? src.width : src.height) * stage.y_scale;
+    vector<PointStep> steps = compile_point_ops(stage.point_ops);
+    prepare_vignettes(stage.point_ops, width, height);
+
+    // A pure rotation, mirror or enlarge goes through its own engine instead of the remap
+    if (stage.orientation.is_identity() != (stage.x_scale == 1 && stage.y_scale == 1))
+    {
+        if (stage.orientation.is_identity())
+        {
+            enlarge_image(src, stage.x_scale, stage.y_scale, new_img);
+        }
+        else
+        {
+            transform_image(src, stage.orientation, new_img);
+        }
+        if (!steps.empty())
+        {
+            parallel_rows(height, size_t(width) * 3, [&](int first, int last)
+            {
+                for (int row = first; row < last; row++)
+                {
+                    apply_point_steps(steps, new_img.row(row), new_img.row(row), width, row, height);
+                }
+            });
+        }
+        return;
+    }
+
+    new_img.reshape(width, height);
+    parallel_rows(height, size_t(width) * 6, [&](int first, int last)
+    {
+        for (int row = first; row < last; row++)
+        {
+            unsigned char *new_row = new_img.row(row);
+            if (stage.is_point_only())
+            {
+                // No remap: the first point operation reads the source row directly
+                apply_point_steps(steps, src.row(row), new_row, width, row, height);
+            }
+            else
+            {
+                remap_row(src, stage, row, width, new_row);
+                apply_point_steps(steps, new_row, new_row, width, row, height);
+            }
+        }
+    });
+}
+
+/**
+ * Description: Runs planned stages on an image, in place where a stage allows it and through the
+ * spare buffer otherwise. Once the buffers have grown to the largest image of a batch, running
+ * the pipeline allocates no pixel buffers.
+ * @param Image to process, replaced by the result
+ * @param vector of PipelineStage from plan_pipeline
+ * @param PipelineBuffers to reuse
+ * @return nothing
+ */
+
+void run_pipeline(Image &image, const vector<PipelineStage> &stages, PipelineBuffers &buffers)
+{
+    for (size_t i = 0; i < stages.size(); i++)
+    {
+        if (stages[i].runs_in_place())
+        {
+            run_stage_in_place(image, stages[i]);
+        }
+        else
+        {
+            run_stage(image, stages[i], buffers.spare, buffers);
+            image.swap(buffers.spare);
+        }
+    }
+}
+
+/**
+ * Description: Runs planned stages like run_pipeline(), except that a final rotation or mirror is
+ * left to whoever consumes the image. Its point operations (as long as they do not depend on the
+ * pixel position) run first, in place, and the returned orientation applied to the image through
+ * an ImageView gives the result. The encoder then writes the view in one pass, which saves the
+ * copy a rotation would make.
+ * @param Image to process, replaced by the result before the returned orientation
+ * @param vector of PipelineStage from plan_pipeline
+ * @param PipelineBuffers to reuse
+ * @return Orientation still to apply
+ */
+
+Orientation run_pipeline_lazily(Image &image, const vector<PipelineStage> &stages, PipelineBuffers &buffers)
+{
+    if (stages.empty())
+    {
+        return Orientation();
+    }
+    PipelineStage last = stages.back();
+    bool position_dependent = false;
+    for (size_t i = 0; i < last.point_ops.size(); i++)
+    {
+        position_dependent = position_dependent || last.point_ops[i].process == 1;
+    }
+    if (last.resize || last.x_scale != 1 || last.y_scale != 1 || position_dependent)
+    {
+        run_pipeline(image, stages, buffers);
+        return Orientation();
+    }
+
+    vector<PipelineStage> eager(stages.begin(), stages.end() - 1);
+    Orientation orientation = last.orientation;
+    last.orientation = Orientation();
+    if (!last.is_empty())
+    {
+        eager.push_back(last);
+    }
+    run_pipeline(image, eager, buffers);
+    return orientation;
+}
+
+/**
+ * Description: Applies a list of operations to an image, fusing them into as few passes as possible
+ * @param Image to process
+ * @param vector of Operation to apply, in order
+ * @return a new Image with every operation applied
+ */
+
+Image run_pipeline(const Image &image, const vector<Operation> &ops)
+{
+    vector<PipelineStage> stages = plan_pipeline(ops);
+    PipelineBuffers buffers;
+    Image new_img;
+    // The first stage reads the caller's image; the rest work on the copy it produces
+    run_stage(image, stages[0], new_img, buffers);
+    stages.erase(stages.begin());
+    run_pipeline(new_img, stages, buffers);
+    return new_img;
+}
+
+/**
+ * Description: Picks the write options for a pipeline's output when indexed BMPs are wanted. The
+ * last point operation of the last stage fixes the output colours: gray leaves only grays, high
+ * contrast black and white, and quantize five colours, so those skip the encoder's colour scan.
+ * @param vector of PipelineStage from plan_pipeline
+ * @return BmpWriteOptions allowing indexed output
+ */
+
+BmpWriteOptions indexed_write_options(const vector<PipelineStage> &stages)
+{
+    BmpWriteOptions options;
+    options.indexing = BMP_INDEX_AUTO;
+    const vector<PointOp> &ops = stages.back().point_ops;
+    int last = ops.empty() ? 0 : ops.back().process;
+    if (last == 3)
+    {
+        options.indexing = BMP_INDEX_GRAY;
+    }
+    else if (last == 7 || last == 10)
+    {
+        options.indexing = BMP_INDEX_PALETTE;
+        options.palette.push_back(0x000000);
+        options.palette.push_back(0xFFFFFF);
+        if (last == 10)
+        {
+            options.palette.push_back(0xFF0000);
+            options.palette.push_back(0x00FF00);
+            options.palette.push_back(0x0000FF);
+        }
+    }
+    return options;
+}
+
+BmpStatus size_pipeline_file(const string &input, const vector<PipelineStage> &stages, uint64_t &bytes);
+bool needs_out_of_core(uint64_t bytes);
+BmpStatus run_pipeline_out_of_core(const string &input, const string &output, const vector<PipelineStage> &stages);
+
+/**
+ * Description: Tells whether run_pipeline_file() streams a pipeline a row at a time: when it is
+ * made only of point operations and the output cannot be indexed, which needs the whole image
+ * @param vector of PipelineStage from plan_pipeline
+ * @param BmpWriteOptions for the output
+ * @return true if the pipeline streams
+ */
+
+bool streams_rows(const vector<PipelineStage> &stages, const BmpWriteOptions &write_options)
+{
+    return stages.size() == 1 && stages[0].is_point_only() && write_options.indexing == BMP_INDEX_NEVER;
+}
+
+/**
+ * Description: Runs planned stages from one BMP file to another. Pipelines made only of point
+ * operations are streamed a row at a time (unless the output may be indexed, which needs the
+ * whole image). Other pipelines are sized from the input's header first: one whose images would
+ * not fit a BMP file fails, one that would need more than memory_budget() runs out of core, and
+ * anything else reads, runs and writes the image once, reusing the caller's image and buffers. A final
+ * rotation or mirror is applied by the encoder as it writes. With pyramid levels, every 2x level
+ * of the result is also written, as 24 bit BMPs named by pyramid_level_name(), from the same
+ * decode.
+ * @param string input BMP filename
+ * @param string output BMP filename
+ * @param vector of PipelineStage from plan_pipeline
+ * @param Image buffer for the decoded image
+ * @param PipelineBuffers to reuse
+ * @param BmpWriteOptions for the output
+ * @param int most pyramid levels to write, 0 for none
+ * @return BMP_OK on success, otherwise the reason it failed
+ */
+
+BmpStatus run_pipeline_file(const string &input, const string &output, const vector<PipelineStage> &stages,
+                            Image &image, PipelineBuffers &buffers,
+                            const BmpWriteOptions &write_options = BmpWriteOptions(), int pyramid_levels = 0)
+{
+    if (streams_rows(stages, write_options))
+    {
+        return pyramid_levels > 0 ? stream_pyramid(input, output, stages[0].point_ops, pyramid_levels)
+                                  : stream_point_ops(input, output, stages[0].point_ops);
+    }
+    uint64_t bytes;
+    BmpStatus status = size_pipeline_file(input, stages, bytes);
+    if (status != BMP_OK)
+    {
+        return status;
+    }
+    if (needs_out_of_core(bytes))
+    {
+        status = run_pipeline_out_of_core(input, output, stages);
+        if (status != BMP_OK || pyramid_levels == 0)
+        {
+            return status;
+        }
+        // The result is only on disk, so the levels stream from it
+        status = stream_pyramid(output, string(), vector<PointOp>(), pyramid_levels, output);
+        return status == BMP_OK ? BMP_OK : BMP_WRITE_FAILED;
+    }
+
+    status = read_bmp(input, image);
+    if (status != BMP_OK)
+    {
+        return status;
+    }
+    // The pyramid needs the pixels, so only a plain write leaves the last rotation to the encoder
+    Orientation orientation;
+    if (pyramid_levels > 0)
+    {
+        run_pipeline(image, stages, buffers);
+    }
+    else
+    {
+        orientation = run_pipeline_lazily(image, stages, buffers);
+    }
+    if (!write_bmp(output, ImageView(image, orientation), write_options))
+    {
+        return BMP_WRITE_FAILED;
+    }
+    return pyramid_levels > 0 ? write_pyramid(image, output, pyramid_levels) : BMP_OK;
+}
+
+/**
+ * Description: Runs a pipeline from one BMP file to another
+ * @param string input BMP filename
+ * @param string output BMP filename
+ * @param vector of Operation to apply, in order
+ * @return BMP_OK on success, otherwise the reason it failed
+ */
+
+BmpStatus run_pipeline_file(const string &input, const string &output, const vector<Operation> &ops)
+{
+    Image image;
+    PipelineBuffers buffers;
+    return run_pipeline_file(input, output, plan_pipeline(ops), image, buffers);
+}
+
+// ________________________________________________________ Overlapped batches
+
+// One file on its way through an overlapped batch. Its Image buffer is reused by later files.
+struct BatchItem
+{
+    size_t index;
+    BmpStatus status;
+    Image image;
+    Orientation orientation; // left for the writer to apply, see run_pipeline_lazily()
+};
+
+/**
+ * Description: Counts the memory the files of an overlapped batch hold. A reader reserves a
+ * file's in_memory_bytes() before decoding it and the writer gives them back once it is written,
+ * so the images in flight together stay within the limit. A file that alone exceeds the limit
+ * still runs, but only when nothing else is reserved.
+ */
+
+class MemoryReservations
+{
+public:
+    explicit MemoryReservations(uint64_t limit_bytes)
+        : limit(limit_bytes), reserved(0)
+    {
+    }
+
+    void acquire(uint64_t bytes)
+    {
+        unique_lock<mutex> lock(guard);
+        released.wait(lock, [&]() { return reserved == 0 || reserved + bytes <= limit; });
+        reserved += bytes;
+    }
+
+    void release(uint64_t bytes)
+    {
+        lock_guard<mutex> lock(guard);
+        reserved -= bytes;
+        released.notify_all();
+    }
+
+private:
+    uint64_t limit;
+    uint64_t reserved;
+    mutex guard;
+    condition_variable released;
+};
+
+/**
+ * Description: Runs planned stages over many files with reading, computing and writing
+ * overlapped. Reader threads decode the next files while the calling thread runs the pipeline
+ * (using the thread pool for row bands) and writer threads encode finished images. A fixed set
+ * of BatchItems circulates through bounded queues, free -> decoded -> computed -> free, which
+ * caps the images in memory and makes a stage that runs ahead wait for the slower one; their
+ * combined size is also kept within memory_budget(). Files that run_pipeline_file() would stream
+ * or run out of core go through it first, one at a time.
+ * @param vector of input file names
+ * @param vector of output file names, one per input
+ * @param vector of PipelineStage from plan_pipeline
+ * @param int number of reader threads, and of writer threads; 0 runs the files one at a time
+ * @param BmpWriteOptions for the outputs
+ * @param int most pyramid levels to write below each output, 0 for none
+ * @return vector of BmpStatus, one per file
+ */
+
+vector<BmpStatus> run_pipeline_files(const vector<string> &inputs, const vector<string> &outputs,
+                                     const vector<PipelineStage> &stages, int io_threads,
+                                     const BmpWriteOptions &write_options = BmpWriteOptions(),
+                                     int pyramid_levels = 0)
+{
+    vector<BmpStatus> statuses(inputs.size(), BMP_OK);
+    PipelineBuffers buffers;
+    if (io_threads <= 0 || inputs.size() < 2)
+    {
+        Image image;
+        for (size_t i = 0; i < inputs.size(); i++)
+        {
+            statuses[i] =
+                run_pipeline_file(inputs[i], outputs[i], stages, image, buffers, write_options, pyramid_levels);
+        }
+        return statuses;
+    }
+
+    vector<size_t> overlapped;
+    vector<uint64_t> bytes(inputs.size(), 0);
+    Image image;
+    for (size_t i = 0; i < inputs.size(); i++)
+    {
+        bool direct = streams_rows(stages, write_options);
+        if (!direct)
+        {
+            statuses[i] = size_pipeline_file(inputs[i], stages, bytes[i]);
+            direct = statuses[i] == BMP_OK && needs_out_of_core(bytes[i]);
+        }
+        if (direct)
+        {
+            statuses[i] =
+                run_pipeline_file(inputs[i], outputs[i], stages, image, buffers, write_options, pyramid_levels);
+        }
+        else if (statuses[i] == BMP_OK)
+        {
+            overlapped.push_back(i);
+        }
+    }
+    MemoryReservations reservations(memory_budget());
+
+    // One item for each reader and writer, one being computed and one waiting between stages
+    size_t item_count = size_t(io_threads) * 2 + 2;
+    vector<unique_ptr<BatchItem>> items;
+    BoundedQueue<BatchItem *> free_items(item_count);
+    BoundedQueue<BatchItem *> decoded(item_count);
+    BoundedQueue<BatchItem *> computed(item_count);
+    for (size_t i = 0; i < item_count; i++)
+    {
+        items.push_back(unique_ptr<BatchItem>(new BatchItem()));
+        free_items.push(items.back().get());
+    }
+
+    atomic<size_t> next_input(0);
+    atomic<int> readers_left(io_threads);
+    vector<thread> threads;
+    for (int t = 0; t < io_threads; t++)
+    {
+        threads.push_back(thread([&]()
+        {
+            trace_thread_name() = "reader";
+            BatchItem *item = nullptr;
+            for (size_t next = next_input++; next < overlapped.size(); next = next_input++)
+            {
+                size_t index = overlapped[next];
+                free_items.pop(item); // never closed: writers always return items
+                reservations.acquire(bytes[index]);
+                item->index = index;
+                item->status = read_bmp(inputs[index], item->image);
+                decoded.push(item);
+            }
+            if (--readers_left == 0)
+            {
+                decoded.close();
+            }
+        }));
+        threads.push_back(thread([&]()
+        {
+            trace_thread_name() = "writer";
+            BatchItem *item = nullptr;
+            while (computed.pop(item))
+            {
+                if (item->status == BMP_OK &&
+                    !write_bmp(outputs[item->index], ImageView(item->image, item->orientation), write_options))
+                {
+                    item->status = BMP_WRITE_FAILED;
+                }
+                if (item->status == BMP_OK && pyramid_levels > 0)
+                {
+                    item->status = write_pyramid(item->image, outputs[item->index], pyramid_levels);
+                }
+                statuses[item->index] = item->status;
+                reservations.release(bytes[item->index]);
+                free_items.push(item);
+            }
+        }));
+    }
+
+    BatchItem *item = nullptr;
+    while (decoded.pop(item))
+    {
+        if (item->status == BMP_OK)
+        {
+            if (pyramid_levels > 0)
+            {
+                run_pipeline(item->image, stages, buffers);
+                item->orientation = Orientation();
+            }
+            else
+            {
+                item->orientation = run_pipeline_lazily(item->image, stages, buffers);
+            }
+        }
+        computed.push(item);
+    }
+    computed.close();
+    for (size_t i = 0; i < threads.size(); i++)
+    {
+        threads[i].join();
+    }
+    return statuses;
+}
+
+//***************************************************************************************************//
+// OUT-OF-CORE PIPELINES
+//***************************************************************************************************//
+
+// ________________________________________________________ Memory budget
+
+/**
+ * Description: Picks the default memory budget: the IMGPROC_MEMORY_MB environment variable if it
+ * holds a positive number, otherwise half the physical memory
+ * @return size_t budget in bytes
+ */
+
+size_t default_memory_budget()
+{
+    const char *value = getenv("IMGPROC_MEMORY_MB");
+    if (value != NULL && atoi(value) > 0)
+    {
+        return size_t(atoi(value)) << 20;
+    }
+    long pages = 0;
+    long page_size = 0;
+#if defined(IMGPROC_POSIX) && defined(_SC_PHYS_PAGES)
+    pages = sysconf(_SC_PHYS_PAGES);
+    page_size = sysconf(_SC_PAGESIZE);
+#endif
+    return pages > 0 && page_size > 0 ? size_t(pages) * page_size / 2 : size_t(1) << 30;
+}
+
+/**
+ * Description: Holds the memory a pipeline may use. run_pipeline_file() processes images whose
+ * pipeline would need more out of core, and the out-of-core engine sizes its bands to fit.
+ * @return reference to the budget in bytes
+ */
+
+size_t &memory_budget()
+{
+    static size_t budget = default_memory_budget();
+    return budget;
+}
+
+// ________________________________________________________ Mapped BMP
+
+/**
+ * Description: A 24 bit BMP file mapped into memory, to read or to write. Rows are found through
+ * 64-bit offsets, so files far larger than RAM (and than 4 GiB) work. The kernel pages rows in
+ * as they are touched; release_rows() hands them back once a band is done, which keeps the
+ * resident set bounded however large the file is. Needs POSIX; elsewhere nothing opens.
+ */
+
+class MappedBmp
+{
+public:
+    MappedBmp()
+        : fd(-1), address(nullptr), size(0), pixel_offset(0), row_bytes(0), image_width(0), image_height(0),
+          top_down(false), writable(false), strips(false)
+    {
+    }
+
+    ~MappedBmp()
+    {
+        close();
+    }
+
+    // Maps an existing file for reading; BMP_UNSUPPORTED_FORMAT unless it is uncompressed 24 bit
+    BmpStatus open(const string &filename)
+    {
+        close();
+#ifdef IMGPROC_POSIX
+        fd = ::open(filename.c_str(), O_RDONLY);
+        struct stat file_stat;
+        if (fd < 0 || fstat(fd, &file_stat) != 0)
+        {
+            close();
+            return BMP_OPEN_FAILED;
+        }
+        size = file_stat.st_size;
+        unsigned char header[BMP_MAX_HEADER_BYTES] = {0};
+        BmpInfo info;
+        BmpStatus status = pread(fd, header, min<uint64_t>(sizeof(header), size), 0) < 0
+                               ? BMP_OPEN_FAILED
+                               : parse_bmp_header(header, size, info);
+        if (status == BMP_OK && (info.bits_per_pixel != 24 || info.compression != BMP_BI_RGB))
+        {
+            status = BMP_UNSUPPORTED_FORMAT;
+        }
+        void *mapping = status == BMP_OK ? mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+        if (mapping == MAP_FAILED)
+        {
+            close();
+            return status == BMP_OK ? BMP_OPEN_FAILED : status;
+        }
+        address = static_cast<unsigned char *>(mapping);
+        pixel_offset = info.pixel_offset;
+        row_bytes = info.row_bytes;
+        image_width = info.width;
+        image_height = info.height;
+        top_down = info.top_down;
+        return BMP_OK;
+#else
+        (void)filename;
+        return BMP_UNSUPPORTED_FORMAT;
+#endif
+    }
+
+    // Creates a bottom-up file of the given size, with its disk space reserved, and maps it for writing
+    bool create(const string &filename, int width_pixels, int height_pixels)
+    {
+        close();
+#ifdef IMGPROC_POSIX
+        unsigned char header[BMP_HEADER_BYTES];
+        size = build_bmp_header(header, width_pixels, height_pixels);
+        fd = ::open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        bool ok = fd >= 0 && ftruncate(fd, size) == 0;
+#ifdef __linux__
+        // Without the space a write through the mapping to a full disk would crash the process
+        ok = ok && posix_fallocate(fd, 0, size) == 0;
+#endif
+        void *mapping = ok ? mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+        if (mapping == MAP_FAILED)
+        {
+            close();
+            return false;
+        }
+        address = static_cast<unsigned char *>(mapping);
+        memcpy(address, header, BMP_HEADER_BYTES);
+        pixel_offset = BMP_HEADER_BYTES;
+        row_bytes = (uint64_t(width_pixels) * 3 + 3) / 4 * 4;
+        image_width = width_pixels;
+        image_height = height_pixels;
+        top_down = false;
+        writable = true;
+        return true;
+#else
+        (void)filename;
+        (void)width_pixels;
+        (void)height_pixels;
+        return false;
+#endif
+    }
+
+    int width() const
+    {
+        return image_width;
+    }
+
+    int height() const
+    {
+        return image_height;
+    }
+
+    // Row r counted from the top of the image
+    unsigned char *row(int r) const
+    {
+        uint64_t stored_index = top_down ? r : image_height - 1 - r;
+        return address + pixel_offset + stored_index * row_bytes;
+    }
+
+    // Bytes one stored row takes, padding included
+    uint64_t stored_row_bytes() const
+    {
+        return row_bytes;
+    }
+
+    /*
+     * Makes read_span() read through the file instead of the mapping, for stages that take a strip
+     * of columns out of every row. Faulting a few bytes of a row in through the mapping maps a
+     * whole block of pages around them, so such a strip would keep most of the file resident.
+     */
+    void read_strips()
+    {
+        strips = true;
+#ifdef IMGPROC_POSIX
+        if (address != nullptr)
+        {
+            madvise(address, size, MADV_RANDOM);
+        }
+#endif
+    }
+
+    // Copies pixels [x, x + count) of row r
+    void read_span(int r, int x, int count, unsigned char *dst) const
+    {
+        const unsigned char *src = row(r) + size_t(x) * 3;
+#ifdef IMGPROC_POSIX
+        if (strips && pread(fd, dst, size_t(count) * 3, src - address) == ssize_t(count) * 3)
+        {
+            return;
+        }
+#endif
+        memcpy(dst, src, size_t(count) * 3);
+    }
+
+    // Drops rows [first, last) from the resident set; written rows are queued for writeback first
+    void release_rows(int first, int last)
+    {
+#ifdef IMGPROC_POSIX
+        uint64_t stored_first = top_down ? first : image_height - last;
+        uint64_t page = sysconf(_SC_PAGESIZE);
+        // Only pages that lie entirely inside the rows
+        uint64_t begin = (pixel_offset + stored_first * row_bytes + page - 1) / page * page;
+        uint64_t end = (pixel_offset + (stored_first + last - first) * row_bytes) / page * page;
+        if (address == nullptr || begin >= end)
+        {
+            return;
+        }
+        if (writable)
+        {
+            msync(address + begin, end - begin, MS_ASYNC);
+        }
+        madvise(address + begin, end - begin, MADV_DONTNEED);
+#else
+        (void)first;
+        (void)last;
+#endif
+    }
+
+    bool close()
+    {
+        bool ok = true;
+#ifdef IMGPROC_POSIX
+        if (address != nullptr)
+        {
+            ok = munmap(address, size) == 0;
+            if (writable)
+            {
+                trace_bytes_written(size);
+            }
+            else
+            {
+                trace_bytes_read(size);
+            }
+        }
+        if (fd >= 0)
+        {
+            ok = ::close(fd) == 0 && ok;
+        }
+#endif
+        fd = -1;
+        address = nullptr;
+        size = 0;
+        writable = false;
+        strips = false;
+        return ok;
+    }
+
+private:
+    int fd;
+    unsigned char *address;
+    uint64_t size;
+    uint64_t pixel_offset;
+    uint64_t row_bytes;
+    int image_width;
+    int image_height;
+    bool top_down;
+    bool writable;
+    bool strips;
+
+    MappedBmp(const MappedBmp &);
+    MappedBmp &operator=(const MappedBmp &);
+};
+
+// ________________________________________________________ Tile footprints
+
+// Which input pixels an output tile of a stage reads
+enum TileFootprint
+{
+    FOOTPRINT_POINT,        // the same pixels; such stages run on whole rows
+    FOOTPRINT_GEOMETRIC,    // one rectangle, moved by the stage's orientation and scales
+    FOOTPRINT_NEIGHBOURHOOD // a rectangle grown by the taps of the resize filter
+};
+
+// Pixels [x0, x1) x [y0, y1)
+struct TileRect
+{
+    int x0;
+    int y0;
+    int x1;
+    int y1;
+
+    TileRect(int left, int top, int right, int bottom)
+        : x0(left), y0(top), x1(right), y1(bottom)
+    {
+    }
+
+    int width() const
+    {
+        return x1 - x0;
+    }
+
+    int height() const
+    {
+        return y1 - y0;
+    }
+};
+
+/**
+ * Description: Classifies what a stage's output tiles read
+ * @param PipelineStage
+ * @return TileFootprint
+ */
+
+TileFootprint stage_footprint(const PipelineStage &stage)
+{
+    return stage.resize ? FOOTPRINT_NEIGHBOURHOOD : stage.is_point_only() ? FOOTPRINT_POINT : FOOTPRINT_GEOMETRIC;
+}
+
+/**
+ * Description: Computes the size of a stage's output
+ * @param PipelineStage
+ * @param int input width
+ * @param int input height
+ * @param int that receives the output width
+ * @param int that receives the output height
+ * @return nothing
+ */
+
+void stage_output_size(const PipelineStage &stage, int width, int height, int &new_width, int &new_height)
+{
+    if (stage.resize)
+    {
+        width = max(1, int(lround(width * stage.x_factor)));
+        height = max(1, int(lround(height * stage.y_factor)));
+    }
+    bool transpose = stage.orientation.transpose;
+    new_width = (transpose ? height : width) * stage.x_scale;
+    new_height = (transpose ? width : height) * stage.y_scale;
+}
+
+/**
+ * Description: Finds the input rectangle an output rectangle of a geometric stage reads, by
+ * undoing the enlarge, then the flips, then the transpose, as remap_row() does for each pixel
+ * @param PipelineStage without a resize
+ * @param int input width
+ * @param int input height
+ * @param TileRect of the output
+ * @return TileRect of the input
+ */
+
+TileRect geometric_footprint(const PipelineStage &stage, int width, int height, const TileRect &out)
+{
+    const Orientation &orientation = stage.orientation;
+    int oriented_width = orientation.transpose ? height : width;
+    int oriented_height = orientation.transpose ? width : height;
+    int x0 = out.x0 / stage.x_scale;
+    int x1 = (out.x1 - 1) / stage.x_scale + 1;
+    int y0 = out.y0 / stage.y_scale;
+    int y1 = (out.y1 - 1) / stage.y_scale + 1;
+    if (orientation.flip_x)
+    {
+        swap(x0, x1);
+        x0 = oriented_width - x0;
+        x1 = oriented_width - x1;
+    }
+    if (orientation.flip_y)
+    {
+        swap(y0, y1);
+        y0 = oriented_height - y0;
+        y1 = oriented_height - y1;
+    }
+    return orientation.transpose ? TileRect(y0, x0, y1, x1) : TileRect(x0, y0, x1, y1);
+}
+
+/**
+ * Description: Finds the source positions a range of outputs of a resampled axis reads
+ * @param ResampleWeights of the axis, or NULL if the axis keeps its size
+ * @param int first output position
+ * @param int one past the last output position
+ * @param int that receives the first source position
+ * @param int that receives one past the last source position
+ * @return nothing
+ */
+
+void resample_footprint(const ResampleWeights *table, int first, int last, int &source_first, int &source_last)
+{
+    if (table == NULL)
+    {
+        source_first = first;
+        source_last = last;
+        return;
+    }
+    source_first = table->first[first];
+    source_last = source_first + 1;
+    for (int i = first; i < last; i++)
+    {
+        source_first = min(source_first, table->first[i]);
+        source_last = max(source_last, table->first[i] + table->count[i]);
+    }
+}
+
+/**
+ * Description: Copies the taps of a range of outputs out of a table, with source positions
+ * made relative to a window of the source
+ * @param ResampleWeights of the whole axis
+ * @param int first output position
+ * @param int one past the last output position
+ * @param int source position of the window's first pixel
+ * @return ResampleWeights for the outputs [first, last)
+ */
+
+ResampleWeights slice_resample_weights(const ResampleWeights &table, int first, int last, int origin)
+{
+    ResampleWeights slice;
+    slice.taps = table.taps;
+    slice.count.assign(table.count.begin() + first, table.count.begin() + last);
+    slice.weights.assign(table.weights.begin() + size_t(first) * table.taps,
+                         table.weights.begin() + size_t(last) * table.taps);
+    slice.first.resize(last - first);
+    for (int i = first; i < last; i++)
+    {
+        slice.first[i - first] = table.first[i] - origin;
+    }
+    return slice;
+}
+
+// ________________________________________________________ Tiles
+
+/**
+ * Description: Copies a rectangle of a mapped file into an Image
+ * @param MappedBmp to read
+ * @param TileRect to copy
+ * @param Image that receives the pixels, reusing its buffer
+ * @return nothing
+ */
+
+void load_tile(const MappedBmp &file, const TileRect &rect, Image &tile)
+{
+    tile.reshape(rect.width(), rect.height());
+    for (int r = 0; r < rect.height(); r++)
+    {
+        file.read_span(rect.y0 + r, rect.x0, rect.width(), tile.row(r));
+    }
+}
+
+/**
+ * Description: Copies an Image into a rectangle of a mapped file
+ * @param Image of the rectangle's size
+ * @param TileRect to fill
+ * @param MappedBmp to write
+ * @return nothing
+ */
+
+void store_tile(const Image &tile, const TileRect &rect, MappedBmp &file)
+{
+    for (int r = 0; r < rect.height(); r++)
+    {
+        memcpy(file.row(rect.y0 + r) + size_t(rect.x0) * 3, tile.row(r), size_t(rect.width()) * 3);
+    }
+}
+
+/**
+ * Description: Computes an output tile of a geometric stage from its footprint. A pure rotation or
+ * mirror maps the footprint onto the tile as a whole, so it goes through the D4 engine; anything
+ * with an enlarge fetches each pixel as remap_row() does.
+ * @param Image holding the input footprint
+ * @param TileRect of the footprint in the input
+ * @param PipelineStage without a resize
+ * @param int input width
+ * @param int input height
+ * @param TileRect of the output tile
+ * @param Image that receives the tile, reusing its buffer
+ * @return nothing
+ */
+
+void remap_tile(const Image &in, const TileRect &in_rect, const PipelineStage &stage, int width, int height,
+                const TileRect &out_rect, Image &out)
+{
+    if (stage.x_scale == 1 && stage.y_scale == 1)
+    {
+        transform_image(in, stage.orientation, out);
+        return;
+    }
+
+    const Orientation &orientation = stage.orientation;
+    int oriented_width = orientation.transpose ? height : width;
+    int oriented_height = orientation.transpose ? width : height;
+    out.reshape(out_rect.width(), out_rect.height());
+    for (int r = 0; r < out_rect.height(); r++)
+    {
+        int y = (out_rect.y0 + r) / stage.y_scale;
+        if (orientation.flip_y)
+        {
+            y = oriented_height - 1 - y;
+        }
+        unsigned char *dst = out.row(r);
+        for (int col = out_rect.x0; col < out_rect.x1; col++)
+        {
+            int x = col / stage.x_scale;
+            if (orientation.flip_x)
+            {
+                x = oriented_width - 1 - x;
+            }
+            const unsigned char *pixel = orientation.transpose
+                                             ? in.row(x - in_rect.y0) + (y - in_rect.x0) * 3
+                                             : in.row(y - in_rect.y0) + (x - in_rect.x0) * 3;
+            dst[0] = pixel[0];
+            dst[1] = pixel[1];
+            dst[2] = pixel[2];
+            dst += 3;
+        }
+    }
+}
+
+/**
+ * Description: Computes an output tile of a resize from its footprint, with the same passes and
+ * arithmetic as resize_image(), so tiles join up into exactly the in-memory result
+ * @param Image holding the input footprint
+ * @param TileRect of the footprint in the input
+ * @param ResampleWeights for the x axis, or NULL if the width is kept
+ * @param ResampleWeights for the y axis, or NULL if the height is kept
+ * @param TileRect of the output tile
+ * @param Image that receives the tile, reusing its buffer
+ * @param Image for the horizontal pass, reusing its buffer
+ * @return nothing
+ */
+
+void resample_tile(const Image &in, const TileRect &in_rect, const ResampleWeights *x_table,
+                   const ResampleWeights *y_table, const TileRect &out_rect, Image &out, Image &widened)
+{
+    if (x_table == NULL && y_table == NULL)
+    {
+        out = in;
+        return;
+    }
+
+    const Image *rows = &in;
+    if (x_table != NULL)
+    {
+        Image &target = y_table == NULL ? out : widened;
+        ResampleWeights slice = slice_resample_weights(*x_table, out_rect.x0, out_rect.x1, in_rect.x0);
+        target.reshape(out_rect.width(), in.height);
+        for (int r = 0; r < in.height; r++)
+        {
+            resample_row(in.row(r), target.row(r), slice);
+        }
+        rows = &target;
+    }
+    if (y_table != NULL)
+    {
+        ResampleWeights slice = slice_resample_weights(*y_table, out_rect.y0, out_rect.y1, in_rect.y0);
+        vector<int> sums(size_t(out_rect.width()) * 3);
+        out.reshape(out_rect.width(), out_rect.height());
+        for (int r = 0; r < out_rect.height(); r++)
+        {
+            resample_column_row(*rows, slice, r, out.row(r), sums);
+        }
+    }
+}
+
+// ________________________________________________________ Scheduler
+
+// Output tiles are squares whose side is a power of two between these
+const int OUT_OF_CORE_MIN_TILE = 64;
+const int OUT_OF_CORE_MAX_TILE = 4096;
+
+/**
+ * Description: Runs one stage from a mapped file into another, a band of output rows at a time.
+ * Point stages process the band's rows whole. Other stages split the band into square tiles,
+ * which the pool threads take left to right: each loads its footprint, computes the tile in
+ * memory and stores it. The band's point operations then run on its finished rows, and the pages
+ * of the band and of its footprint are released. The tile side is the largest whose band, with
+ * its footprint and the threads' tile buffers, fits the budget. For a transposing stage the
+ * footprint of a band is a strip of input columns, so the side also sets how much of every input
+ * row stays resident.
+ * @param MappedBmp to read
+ * @param PipelineStage to run; a resize stage must be a resize only
+ * @param MappedBmp to write, already of the output size
+ * @param size_t memory budget in bytes
+ * @return nothing
+ */
+
+void run_stage_out_of_core(MappedBmp &src, const PipelineStage &stage, MappedBmp &dst, size_t budget)
+{
+    TraceSpan span(stage.trace_name(), dst.height(), true);
+    int width = src.width();
+    int height = src.height();
+    int new_width = dst.width();
+    int new_height = dst.height();
+    TileFootprint footprint = stage_footprint(stage);
+
+    ResampleWeights x_table;
+    ResampleWeights y_table;
+    bool x_resampled = stage.resize && new_width != width;
+    bool y_resampled = stage.resize && new_height != height;
+    if (x_resampled)
+    {
+        x_table = compute_resample_weights(width, new_width, stage.filter);
+    }
+    if (y_resampled)
+    {
+        y_table = compute_resample_weights(height, new_height, stage.filter);
+    }
+    vector<PointStep> steps = compile_point_ops(stage.point_ops);
+    prepare_vignettes(stage.point_ops, new_width, new_height);
+
+    // Footprint of the output rows [y0, y1), all columns
+    auto band_footprint = [&](int y0, int y1)
+    {
+        TileRect out(0, y0, new_width, y1);
+        if (footprint == FOOTPRINT_POINT)
+        {
+            return out;
+        }
+        if (footprint == FOOTPRINT_GEOMETRIC)
+        {
+            return geometric_footprint(stage, width, height, out);
+        }
+        TileRect in(0, 0, 0, 0);
+        resample_footprint(x_resampled ? &x_table : NULL, 0, new_width, in.x0, in.x1);
+        resample_footprint(y_resampled ? &y_table : NULL, y0, y1, in.y0, in.y1);
+        return in;
+    };
+
+    if (footprint == FOOTPRINT_GEOMETRIC && stage.orientation.transpose)
+    {
+        src.read_strips();
+    }
+
+    const uint64_t page = 4096;
+    int tile = OUT_OF_CORE_MAX_TILE;
+    for (; tile > OUT_OF_CORE_MIN_TILE; tile /= 2)
+    {
+        TileRect in = band_footprint(0, min(tile, new_height));
+        // A partly read input row still keeps whole pages resident
+        uint64_t in_row_bytes = min<uint64_t>(src.stored_row_bytes(), uint64_t(in.width()) * 3 + 2 * page);
+        uint64_t tiles = uint64_t(thread_pool().size()) * 3 * tile * tile * 3;
+        if (in.height() * in_row_bytes + uint64_t(min(tile, new_height)) * dst.stored_row_bytes() + tiles <= budget)
+        {
+            break;
+        }
+    }
+
+    int columns = footprint == FOOTPRINT_POINT ? 1 : (new_width + tile - 1) / tile;
+    for (int y0 = 0; y0 < new_height; y0 += tile)
+    {
+        int y1 = min(new_height, y0 + tile);
+        if (footprint == FOOTPRINT_POINT)
+        {
+            parallel_rows(y1 - y0, size_t(new_width) * 6, [&](int first, int last)
+            {
+                for (int row = y0 + first; row < y0 + last; row++)
+                {
+                    apply_point_steps(steps, src.row(row), dst.row(row), new_width, row, new_height);
+                }
+            });
+        }
+        else
+        {
+            atomic<int> next_column(0);
+            thread_pool().parallel_for(min(columns, thread_pool().size()), 1, [&](int, int)
+            {
+                Image in;
+                Image out;
+                Image widened;
+                for (int column = next_column++; column < columns; column = next_column++)
+                {
+                    TileRect out_rect(column * tile, y0, min(new_width, (column + 1) * tile), y1);
+                    if (footprint == FOOTPRINT_GEOMETRIC)
+                    {
+                        TileRect in_rect = geometric_footprint(stage, width, height, out_rect);
+                        load_tile(src, in_rect, in);
+                        remap_tile(in, in_rect, stage, width, height, out_rect, out);
+                    }
+                    else
+                    {
+                        TileRect in_rect(0, 0, 0, 0);
+                        resample_footprint(x_resampled ? &x_table : NULL, out_rect.x0, out_rect.x1, in_rect.x0,
+                                           in_rect.x1);
+                        resample_footprint(y_resampled ? &y_table : NULL, y0, y1, in_rect.y0, in_rect.y1);
+                        load_tile(src, in_rect, in);
+                        resample_tile(in, in_rect, x_resampled ? &x_table : NULL, y_resampled ? &y_table : NULL,
+                                      out_rect, out, widened);
+                    }
+                    store_tile(out, out_rect, dst);
+                }
+            });
+            if (!steps.empty())
+            {
+                parallel_rows(y1 - y0, size_t(new_width) * 3, [&](int first, int last)
+                {
+                    for (int row = y0 + first; row < y0 + last; row++)
+                    {
+                        apply_point_steps(steps, dst.row(row), dst.row(row), new_width, row, new_height);
+                    }
+                });
+            }
+        }
+
+        TileRect in = band_footprint(y0, y1);
+        src.release_rows(in.y0, in.y1);
+        dst.release_rows(y0, y1);
+    }
+}
+
+/**
+ * Description: Splits every stage that starts with a resize into the resize and the rest, since
+ * the rest reads the resized image in a different pattern
+ * @param vector of PipelineStage from plan_pipeline
+ * @return vector of PipelineStage for run_stage_out_of_core()
+ */
+
+vector<PipelineStage> out_of_core_stages(const vector<PipelineStage> &stages)
+{
+    vector<PipelineStage> passes;
+    for (size_t i = 0; i < stages.size(); i++)
+    {
+        PipelineStage rest = stages[i];
+        if (rest.resize)
+        {
+            PipelineStage resize;
+            resize.resize = true;
+            resize.x_factor = rest.x_factor;
+            resize.y_factor = rest.y_factor;
+            resize.filter = rest.filter;
+            passes.push_back(resize);
+            rest.resize = false;
+            if (rest.is_empty())
+            {
+                continue;
+            }
+        }
+        passes.push_back(rest);
+    }
+    return passes;
+}
+
+// ________________________________________________________ Running out of core
+
+/**
+ * Description: Estimates the memory run_pipeline_file() needs to run stages in memory: the
+ * largest input and output of any one stage, plus a resize's intermediate
+ * @param int input width
+ * @param int input height
+ * @param vector of PipelineStage
+ * @return uint64_t bytes
+ */
+
+uint64_t in_memory_bytes(int width, int height, const vector<PipelineStage> &stages)
+{
+    uint64_t peak = 0;
+    for (size_t i = 0; i < stages.size(); i++)
+    {
+        int new_width;
+        int new_height;
+        stage_output_size(stages[i], width, height, new_width, new_height);
+        uint64_t bytes = 3 * (uint64_t(width) * height + uint64_t(new_width) * new_height);
+        if (stages[i].resize)
+        {
+            bytes += 3 * uint64_t(new_width) * height;
+        }
+        peak = max(peak, bytes);
+        width = new_width;
+        height = new_height;
+    }
+    return peak;
+}
+
+/**
+ * Description: Sizes a file's pipeline from the file's header, before any of it runs
+ * @param string input BMP filename
+ * @param vector of PipelineStage
+ * @param uint64_t that receives in_memory_bytes() for the file
+ * @return BMP_OK, BMP_RESULT_TOO_LARGE if pipeline_size_fits() fails, or why the header is invalid
+ */
+
+BmpStatus size_pipeline_file(const string &input, const vector<PipelineStage> &stages, uint64_t &bytes)
+{
+    bytes = 0;
+    BmpInfo info;
+    BmpStatus status = read_bmp_info(input, info);
+    if (status != BMP_OK)
+    {
+        return status;
+    }
+    if (!pipeline_size_fits(stages, info.width, info.height))
+    {
+        return BMP_RESULT_TOO_LARGE;
+    }
+    bytes = in_memory_bytes(info.width, info.height, stages);
+    return BMP_OK;
+}
+
+/**
+ * Description: Decides whether a file's pipeline should run out of core: when running it in
+ * memory would take more than memory_budget()
+ * @param uint64_t in_memory_bytes() of the file, from size_pipeline_file()
+ * @return true to use run_pipeline_out_of_core()
+ */
+
+bool needs_out_of_core(uint64_t bytes)
+{
+#ifdef IMGPROC_POSIX
+    return bytes > memory_budget();
+#else
+    (void)bytes;
+    return false;
+#endif
+}
+
+/**
+ * Description: Runs planned stages from one BMP file to another without holding either image in
+ * memory. Each stage maps its input and output files; stages in between write temporary 24 bit
+ * BMPs next to the output, and an input in another format is first streamed into one. The
+ * result always is a 24 bit BMP; when the output is the input, it replaces the input once done.
+ * @param string input BMP filename
+ * @param string output BMP filename
+ * @param vector of PipelineStage from plan_pipeline
+ * @return BMP_OK on success, otherwise the reason it failed
+ */
+
+BmpStatus run_pipeline_out_of_core(const string &input, const string &output, const vector<PipelineStage> &stages)
+{
+    TraceSpan span("out of core pipeline", -1, true);
+    vector<PipelineStage> passes = out_of_core_stages(stages);
+    string temp_files[2] = {output + ".part0.bmp", output + ".part1.bmp"};
+    int next_temp = 0;
+    // The input stays mapped while the last pass writes, so it cannot be that pass's file
+    string final_name = staged_output_name(input, output);
+
+    MappedBmp src;
+    BmpStatus status = src.open(input);
+    string source_name = input;
+    if (status == BMP_UNSUPPORTED_FORMAT)
+    {
+        source_name = temp_files[next_temp++];
+        status = stream_point_ops(input, source_name, vector<PointOp>());
+        status = status == BMP_OK ? src.open(source_name) : status;
+    }
+
+    for (size_t i = 0; i < passes.size() && status == BMP_OK; i++)
+    {
+        bool last = i + 1 == passes.size();
+        string target_name = last ? final_name : temp_files[next_temp++ % 2];
+        int new_width;
+        int new_height;
+        stage_output_size(passes[i], src.width(), src.height(), new_width, new_height);
+        MappedBmp dst;
+        if (!dst.create(target_name, new_width, new_height))
+        {
+            status = BMP_WRITE_FAILED;
+            break;
+        }
+        run_stage_out_of_core(src, passes[i], dst, memory_budget());
+        src.close();
+        if (source_name != input)
+        {
+            remove(source_name.c_str());
+        }
+        if (!dst.close())
+        {
+            status = BMP_WRITE_FAILED;
+            break;
+        }
+        source_name = target_name;
+        if (!last)
+        {
+            status = src.open(source_name);
+        }
+    }
+    src.close();
+    remove(temp_files[0].c_str());
+    remove(temp_files[1].c_str());
+    return finish_staged_output(final_name, output, status);
+}
+
+//***************************************************************************************************//
+// RESULT CACHE
+//***************************************************************************************************//
+
+// ________________________________________________________ Hashing
+
+const uint64_t XXH_PRIME64_1 = 0x9E3779B185EBCA87ULL;
+const uint64_t XXH_PRIME64_2 = 0xC2B2AE3D27D4EB4FULL;
+const uint64_t XXH_PRIME64_3 = 0x165667B19E3779F9ULL;
+const uint64_t XXH_PRIME64_4 = 0x85EBCA77C2B2AE63ULL;
+const uint64_t XXH_PRIME64_5 = 0x27D4EB2F165667C5ULL;
+
+inline uint64_t rotate_left64(uint64_t value, int bits)
+{
+    return (value << bits) | (value >> (64 - bits));
+}
+
+// Little endian loads; every target with a BMP decoder here is little endian
+inline uint64_t load_u64(const unsigned char *bytes)
+{
+    uint64_t value;
+    memcpy(&value, bytes, 8);
+    return value;
+}
+
+inline uint32_t load_u32(const unsigned char *bytes)
+{
+    uint32_t value;
+    memcpy(&value, bytes, 4);
+    return value;
+}
+
+inline uint64_t xxh64_round(uint64_t accumulator, uint64_t input)
+{
+    return rotate_left64(accumulator + input * XXH_PRIME64_2, 31) * XXH_PRIME64_1;
+}
+
+inline uint64_t xxh64_merge(uint64_t accumulator, uint64_t lane)
+{
+    return (accumulator ^ xxh64_round(0, lane)) * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+/**
+ * Description: Hashes bytes with XXH64, which runs at memory speed and gives the same values as
+ * the reference xxHash implementation
+ * @param pointer to the bytes
+ * @param size_t number of bytes
+ * @param uint64_t seed
+ * @return uint64_t hash
+ */
+
+uint64_t xxh64(const void *data, size_t length, uint64_t seed = 0)
+{
+    const unsigned char *bytes = static_cast<const unsigned char *>(data);
+    const unsigned char *end = bytes + length;
+    uint64_t hash;
+    if (length >= 32)
+    {
+        // Four independent lanes over 32 byte stripes
+        uint64_t lanes[4] = {seed + XXH_PRIME64_1 + XXH_PRIME64_2, seed + XXH_PRIME64_2, seed, seed - XXH_PRIME64_1};
+        for (; end - bytes >= 32; bytes += 32)
+        {
+            for (int i = 0; i < 4; i++)
+            {
+                lanes[i] = xxh64_round(lanes[i], load_u64(bytes + 8 * i));
+            }
+        }
+        hash = rotate_left64(lanes[0], 1) + rotate_left64(lanes[1], 7) + rotate_left64(lanes[2], 12) +
+               rotate_left64(lanes[3], 18);
+        for (int i = 0; i < 4; i++)
+        {
+            hash = xxh64_merge(hash, lanes[i]);
+        }
+    }
+    else
+    {
+        hash = seed + XXH_PRIME64_5;
+    }
+    hash += length;
+
+    for (; end - bytes >= 8; bytes += 8)
+    {
+        hash = rotate_left64(hash ^ xxh64_round(0, load_u64(bytes)), 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+    }
+    if (end - bytes >= 4)
+    {
+        hash = rotate_left64(hash ^ load_u32(bytes) * XXH_PRIME64_1, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+        bytes += 4;
+    }
+    for (; bytes < end; bytes++)
+    {
+        hash = rotate_left64(hash ^ *bytes * XXH_PRIME64_5, 11) * XXH_PRIME64_1;
+    }
+
+    hash ^= hash >> 33;
+    hash *= XXH_PRIME64_2;
+    hash ^= hash >> 29;
+    hash *= XXH_PRIME64_3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+// ________________________________________________________ Cache keys
+
+// Part of every key. Raise it when a change to a process changes its output, so older results
+// are no longer found.
+const int RESULT_CACHE_VERSION = 1;
+
+/**
+ * Description: Formats a double exactly, so parameters that differ in the last bit give
+ * different keys
+ * @param double value
+ * @return string in C99 hexadecimal floating point notation
+ */
+
+string exact_double(double value)
+{
+    char text[32];
+    snprintf(text, sizeof(text), "%a", value);
+    return text;
+}
+
+/**
+ * Description: Describes everything besides the input that decides a pipeline's output: the
+ * planned stages with their exact parameters and the output format. Operation lists that plan
+ * to the same stages (rot:4 and nothing, say) share their results.
+ * @param vector of PipelineStage from plan_pipeline
+ * @param BmpWriteOptions for the output
+ * @return string signature
+ */
+
+string pipeline_signature(const vector<PipelineStage> &stages, const BmpWriteOptions &options)
+{
+    stringstream signature;
+    signature << "imgproc " << RESULT_CACHE_VERSION;
+    for (size_t i = 0; i < stages.size(); i++)
+    {
+        const PipelineStage &stage = stages[i];
+        signature << ";";
+        if (stage.resize)
+        {
+            signature << "resize " << exact_double(stage.x_factor) << " " << exact_double(stage.y_factor) << " "
+                      << resize_filter_name(stage.filter) << ",";
+        }
+        signature << "remap " << stage.orientation.transpose << stage.orientation.flip_x << stage.orientation.flip_y
+                  << " " << stage.x_scale << " " << stage.y_scale;
+        for (size_t j = 0; j < stage.point_ops.size(); j++)
+        {
+            const PointOp &op = stage.point_ops[j];
+            signature << "," << op.process << " " << exact_double(op.scaling_factor);
+            if (op.process == 1)
+            {
+                signature << " " << exact_double(op.vignette.centre_x) << " " << exact_double(op.vignette.centre_y)
+                          << " " << exact_double(op.vignette.radius);
+            }
+        }
+    }
+    signature << ";indexing " << options.indexing << " rle " << options.rle;
+    for (size_t i = 0; i < options.palette.size(); i++)
+    {
+        signature << " " << options.palette[i];
+    }
+    return signature.str();
+}
+
+/**
+ * Description: Computes the cache key of running a pipeline on a file: the hash of the file's
+ * bytes, which hold its pixels, seeds the hash of the pipeline signature. A lookup reads the file
+ * once and decodes nothing.
+ * @param string input file name
+ * @param string signature from pipeline_signature
+ * @param uint64_t that receives the key
+ * @return true if the input could be read
+ */
+
+bool result_cache_key(const string &input, const string &signature, uint64_t &key)
+{
+    TraceSpan span("hash input", -1, true);
+    MappedFile file;
+    if (!file.open(input))
+    {
+        return false;
+    }
+    uint64_t content = xxh64(file.bytes(), file.length());
+    key = xxh64(signature.data(), signature.size(), content);
+    return true;
+}
+
+// ________________________________________________________ Cache directory
+
+// Size limit of the cache unless --cache-mb or IMGPROC_CACHE_MB says otherwise
+const uint64_t DEFAULT_CACHE_BYTES = uint64_t(1024) * 1024 * 1024;
+
+// Temporary files older than this were left by a process that died before renaming them
+const int CACHE_STALE_SECONDS = 3600;
+
+#if defined(__linux__) && !defined(FICLONE)
+#define FICLONE _IOW(0x94, 9, int)
+#endif
+
+// What a result cache has done: since the program started, or since the cache was created
+struct ResultCacheStats
+{
+    long long hits;      // results copied into place instead of computed
+    long long misses;    // lookups that found nothing
+    long long stores;    // results added
+    long long evictions; // results removed to stay under the size limit
+    long long bytes;     // size of the cached results
+
+    ResultCacheStats()
+        : hits(0), misses(0), stores(0), evictions(0), bytes(0)
+    {
+    }
+};
+
+#ifdef IMGPROC_POSIX
+/**
+ * Description: Copies everything from one file descriptor's current offset to another
+ * @param int descriptor to read
+ * @param int descriptor to write
+ * @return true if every byte was copied
+ */
+
+bool copy_file_bytes(int source, int target)
+{
+    vector<char> buffer(1 << 20);
+    ssize_t count = 0;
+    bool ok = true;
+    while (ok && (count = read(source, buffer.data(), buffer.size())) > 0)
+    {
+        for (ssize_t done = 0; ok && done < count;)
+        {
+            ssize_t written = write(target, buffer.data() + done, count - done);
+            ok = written > 0 || (written < 0 && errno == EINTR);
+            done += max<ssize_t>(written, 0);
+        }
+    }
+    return ok && count == 0;
+}
+
+/**
+ * Description: Copies a file, as a reflink (a copy on write clone that shares no later writes) where
+ * the file system allows it and byte by byte otherwise. Never a hard link: the cache and the outputs
+ * it serves must not share an inode, or overwriting one output would change the others.
+ * @param string existing file
+ * @param string new name, which must not exist
+ * @return true if the new name holds the file's bytes
+ */
+
+bool clone_file(const string &from, const string &to)
+{
+    int source = ::open(from.c_str(), O_RDONLY);
+    if (source < 0)
+    {
+        return false;
+    }
+    int target = ::open(to.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644);
+    bool ok = false;
+#ifdef __linux__
+    ok = target >= 0 && ioctl(target, FICLONE, source) == 0;
+#endif
+    if (!ok && target >= 0)
+    {
+        // No reflink support, or another file system
+        ok = copy_file_bytes(source, target);
+    }
+    if (target >= 0)
+    {
+        ok = ::close(target) == 0 && ok;
+    }
+    ::close(source);
+    if (!ok)
+    {
+        unlink(to.c_str());
+    }
+    return ok;
+}
+#endif
+
+/**
+ * Description: On-disk store of pipeline results, keyed by result_cache_key(). Results are BMP
+ * files named by their key (DIR/ab/ab12...ef.bmp); a hit clones the file to the output name and a
+ * finished result is cloned in, both through a temporary name and an atomic rename, so readers
+ * never see half a file. The file modification time records the last use, and once the results
+ * pass the size limit the least recently used ones are removed. Several processes can share one
+ * directory: DIR/stats holds the totals and its flock serializes updating them and evicting.
+ */
+
+class ResultCache
+{
+public:
+    ResultCache()
+        : limit(DEFAULT_CACHE_BYTES), stats_fd(-1)
+    {
+    }
+
+    ~ResultCache()
+    {
+        close();
+    }
+
+    // Opens (creating if needed) the cache in a directory
+    bool open(const string &directory, uint64_t limit_bytes)
+    {
+        close();
+#ifdef IMGPROC_POSIX
+        if (mkdir(directory.c_str(), 0777) != 0 && errno != EEXIST)
+        {
+            return false;
+        }
+        stats_fd = ::open((directory + "/stats").c_str(), O_RDWR | O_CREAT, 0644);
+        root = directory;
+        limit = limit_bytes;
+        return stats_fd >= 0;
+#else
+        (void)directory;
+        (void)limit_bytes;
+        return false;
+#endif
+    }
+
+    void close()
+    {
+#ifdef IMGPROC_POSIX
+        if (stats_fd >= 0)
+        {
+            ::close(stats_fd);
+        }
+#endif
+        stats_fd = -1;
+    }
+
+    bool is_open() const
+    {
+        return stats_fd >= 0;
+    }
+
+    // Puts the result stored under a key at the output name; false on a miss
+    bool fetch(uint64_t key, const string &output)
+    {
+        bool hit = false;
+#ifdef IMGPROC_POSIX
+        TraceSpan span("cache fetch", -1, true);
+        string entry = entry_path(key);
+        string temporary = output + ".cache-" + to_string(getpid());
+        unlink(temporary.c_str());
+        hit = clone_file(entry, temporary) && rename(temporary.c_str(), output.c_str()) == 0;
+        if (hit)
+        {
+            // Marks the result as just used for the eviction order
+            utimensat(AT_FDCWD, entry.c_str(), NULL, 0);
+        }
+        else
+        {
+            unlink(temporary.c_str());
+        }
+#else
+        (void)key;
+        (void)output;
+#endif
+        ResultCacheStats change;
+        (hit ? change.hits : change.misses) = 1;
+        update(change);
+        return hit;
+    }
+
+    // Adds a finished output under a key, then evicts down to the size limit if it was passed
+    void store(uint64_t key, const string &output)
+    {
+#ifdef IMGPROC_POSIX
+        TraceSpan span("cache store", -1, true);
+        struct stat file_stat;
+        if (stat(output.c_str(), &file_stat) != 0 || uint64_t(file_stat.st_size) > limit)
+        {
+            return;
+        }
+        string entry = entry_path(key);
+        struct stat entry_stat;
+        if (stat(entry.c_str(), &entry_stat) == 0)
+        {
+            // Another process stored the same result first
+            return;
+        }
+        mkdir(entry.substr(0, entry.find_last_of('/')).c_str(), 0777);
+        string temporary = root + "/tmp-" + to_string(getpid()) + "-" + entry.substr(entry.find_last_of('/') + 1);
+        unlink(temporary.c_str());
+        if (!clone_file(output, temporary) || rename(temporary.c_str(), entry.c_str()) != 0)
+        {
+            unlink(temporary.c_str());
+            return;
+        }
+        ResultCacheStats change;
+        change.stores = 1;
+        change.bytes = file_stat.st_size;
+        update(change);
+#else
+        (void)key;
+        (void)output;
+#endif
+    }
+
+    // What this process did with the cache
+    const ResultCacheStats &session_stats() const
+    {
+        return session;
+    }
+
+    // What every process did with the cache since it was created
+    ResultCacheStats total_stats()
+    {
+        ResultCacheStats totals;
+#ifdef IMGPROC_POSIX
+        if (is_open())
+        {
+            flock(stats_fd, LOCK_SH);
+            totals = read_totals();
+            flock(stats_fd, LOCK_UN);
+        }
+#endif
+        return totals;
+    }
+
+private:
+    string root;
+    uint64_t limit;
+    int stats_fd;
+    ResultCacheStats session;
+
+    string entry_path(uint64_t key) const
+    {
+        char name[17];
+        snprintf(name, sizeof(name), "%016llx", (unsigned long long)key);
+        return root + "/" + string(name, 2) + "/" + name + ".bmp";
+    }
+
+    // Adds a change to this process's counts and, under the lock, to the totals
+    void update(const ResultCacheStats &change)
+    {
+        session.hits += change.hits;
+        session.misses += change.misses;
+        session.stores += change.stores;
+#ifdef IMGPROC_POSIX
+        if (!is_open())
+        {
+            return;
+        }
+        flock(stats_fd, LOCK_EX);
+        ResultCacheStats totals = read_totals();
+        totals.hits += change.hits;
+        totals.misses += change.misses;
+        totals.stores += change.stores;
+        totals.bytes += change.bytes;
+        if (uint64_t(totals.bytes) > limit)
+        {
+            evict(totals);
+        }
+        write_totals(totals);
+        flock(stats_fd, LOCK_UN);
+#endif
+    }
+
+#ifdef IMGPROC_POSIX
+    ResultCacheStats read_totals()
+    {
+        ResultCacheStats totals;
+        char text[256];
+        ssize_t count = pread(stats_fd, text, sizeof(text) - 1, 0);
+        text[max<ssize_t>(count, 0)] = '\0';
+        sscanf(text, "hits %lld misses %lld stores %lld evictions %lld bytes %lld", &totals.hits, &totals.misses,
+               &totals.stores, &totals.evictions, &totals.bytes);
+        return totals;
+    }
+
+    bool write_totals(const ResultCacheStats &totals)
+    {
+        char text[256];
+        int count = snprintf(text, sizeof(text), "hits %lld\nmisses %lld\nstores %lld\nevictions %lld\nbytes %lld\n",
+                             totals.hits, totals.misses, totals.stores, totals.evictions, totals.bytes);
+        return ftruncate(stats_fd, 0) == 0 && pwrite(stats_fd, text, count, 0) == count;
+    }
+
+    // Measures the results again and removes the least recently used until they take 90% of the
+    // limit, which leaves room for a few more stores before the next scan. Called under the lock.
+    void evict(ResultCacheStats &totals)
+    {
+        TraceSpan span("cache evict", -1, true);
+        struct Entry
+        {
+            time_t used;
+            long long bytes;
+            string path;
+
+            bool operator<(const Entry &other) const
+            {
+                return used < other.used;
+            }
+        };
+        vector<Entry> entries;
+        long long bytes = 0;
+        DIR *top = opendir(root.c_str());
+        struct dirent *item;
+        while (top != NULL && (item = readdir(top)) != NULL)
+        {
+            string name = item->d_name;
+            string path = root + "/" + name;
+            struct stat file_stat;
+            // Only the two hex digit buckets hold results
+            if (name.size() != 2 || !isxdigit((unsigned char)name[0]) || !isxdigit((unsigned char)name[1]) ||
+                stat(path.c_str(), &file_stat) != 0 || !S_ISDIR(file_stat.st_mode))
+            {
+                continue;
+            }
+            DIR *bucket = opendir(path.c_str());
+            struct dirent *file;
+            while (bucket != NULL && (file = readdir(bucket)) != NULL)
+            {
+                Entry entry;
+                entry.path = path + "/" + file->d_name;
+                size_t length = strlen(file->d_name);
+                if (length > 4 && strcmp(file->d_name + length - 4, ".bmp") == 0 &&
+                    stat(entry.path.c_str(), &file_stat) == 0 && S_ISREG(file_stat.st_mode))
+                {
+                    entry.used = file_stat.st_mtime;
+                    entry.bytes = file_stat.st_size;
+                    entries.push_back(entry);
+                    bytes += entry.bytes;
+                }
+            }
+            if (bucket != NULL)
+            {
+                closedir(bucket);
+            }
+        }
+        if (top != NULL)
+        {
+            rewinddir(top);
+            while ((item = readdir(top)) != NULL)
+            {
+                string path = root + "/" + item->d_name;
+                struct stat file_stat;
+                if (strncmp(item->d_name, "tmp-", 4) == 0 && stat(path.c_str(), &file_stat) == 0 &&
+                    file_stat.st_mtime + CACHE_STALE_SECONDS < time(NULL))
+                {
+                    unlink(path.c_str());
+                }
+            }
+            closedir(top);
+        }
+
+        sort(entries.begin(), entries.end());
+        for (size_t i = 0; i < entries.size() && uint64_t(bytes) > limit / 10 * 9; i++)
+        {
+            if (unlink(entries[i].path.c_str()) == 0)
+            {
+                bytes -= entries[i].bytes;
+                totals.evictions++;
+                session.evictions++;
+            }
+        }
+        totals.bytes = bytes;
+    }
+#endif
+
+    ResultCache(const ResultCache &);
+    ResultCache &operator=(const ResultCache &);
+};
+
+// ________________________________________________________ Cached pipelines
+
+/**
+ * Description: Runs planned stages over files like run_pipeline_files(), answering from the
+ * result cache where it can. Each input is hashed first; outputs found in the cache are copied
+ * or reflinked into place (their pyramid levels are streamed from them), the rest run as one
+ * batch and their results are added to the cache.
+ * @param ResultCache, open
+ * @param vector of input file names
+ * @param vector of output file names, one per input
+ * @param vector of PipelineStage from plan_pipeline
+ * @param int number of reader threads, and of writer threads, for the files that run
+ * @param BmpWriteOptions for the outputs
+ * @param int most pyramid levels to write below each output, 0 for none
+ * @return vector of BmpStatus, one per file
+ */
+
+vector<BmpStatus> run_pipeline_files_cached(ResultCache &cache, const vector<string> &inputs,
+                                            const vector<string> &outputs, const vector<PipelineStage> &stages,
+                                            int io_threads, const BmpWriteOptions &write_options, int pyramid_levels)
+{
+    string signature = pipeline_signature(stages, write_options);
+    vector<BmpStatus> statuses(inputs.size(), BMP_OK);
+    vector<uint64_t> keys(inputs.size(), 0);
+    vector<char> keyed(inputs.size(), false);
+    vector<size_t> misses;
+    vector<string> miss_inputs;
+    vector<string> miss_outputs;
+    for (size_t i = 0; i < inputs.size(); i++)
+    {
+        // An input that cannot be hashed runs uncached, and reports why it cannot be read
+        keyed[i] = result_cache_key(inputs[i], signature, keys[i]);
+        if (keyed[i] && cache.fetch(keys[i], outputs[i]))
+        {
+            if (pyramid_levels > 0 &&
+                stream_pyramid(outputs[i], string(), vector<PointOp>(), pyramid_levels, outputs[i]) != BMP_OK)
+            {
+                statuses[i] = BMP_WRITE_FAILED;
+            }
+            continue;
+        }
+        misses.push_back(i);
+        miss_inputs.push_back(inputs[i]);
+        miss_outputs.push_back(outputs[i]);
+    }
+
+    vector<BmpStatus> computed =
+        run_pipeline_files(miss_inputs, miss_outputs, stages, io_threads, write_options, pyramid_levels);
+    for (size_t j = 0; j < misses.size(); j++)
+    {
+        size_t i = misses[j];
+        statuses[i] = computed[j];
+        if (keyed[i] && computed[j] == BMP_OK)
+        {
+            cache.store(keys[i], outputs[i]);
+        }
+    }
+    return statuses;
+}
+
+//***************************************************************************************************//
+// JSON
+//***************************************************************************************************//
+
+/**
+ * Description: Escapes a string for a JSON document or message
+ * @param string
+ * @return quoted JSON string
+ */
+
+string json_string(const string &text)
+{
+    string quoted = "\"";
+    for (size_t i = 0; i < text.size(); i++)
+    {
+        unsigned char c = text[i];
+        if (c == '"' || c == '\\')
+        {
+            quoted += '\\';
+            quoted += char(c);
+        }
+        else if (c < 0x20)
+        {
+            const char hex[] = "0123456789abcdef";
+            quoted += "\\u00";
+            quoted += hex[c >> 4];
+            quoted += hex[c & 15];
+        }
+        else
+        {
+            quoted += char(c);
+        }
+    }
+    return quoted + "\"";
+}
+
+//***************************************************************************************************//
+// SERVER
+//***************************************************************************************************//
+
+// ________________________________________________________ Messages
+
+// Requests and responses are one-line JSON objects with string, number and boolean values. A file
+// descriptor (an input image, or a result) travels with its message as SCM_RIGHTS ancillary data.
+
+// Longest request line the server accepts
+const size_t MAX_MESSAGE_BYTES = 64 * 1024;
+
+/**
+ * Description: Parses a flat JSON object such as {"input": "a.bmp", "indexed": true}. Strings are
+ * unescaped; numbers, booleans and null are kept as their literal text. Nested objects and arrays
+ * are not accepted.
+ * @param string message
+ * @param vector that receives the name and value of each member
+ * @return true if the message was such an object
+ */
+
+bool parse_json_object(const string &text, vector<pair<string, string>> &fields)
+{
+    fields.clear();
+    size_t at = 0;
+    auto skip_space = [&]()
+    {
+        while (at < text.size() && isspace((unsigned char)text[at]))
+        {
+            at++;
+        }
+    };
+    auto parse_string = [&](string &value) -> bool
+    {
+        value.clear();
+        if (at >= text.size() || text[at] != '"')
+        {
+            return false;
+        }
+        for (at++; at < text.size() && text[at] != '"'; at++)
+        {
+            if (text[at] != '\\')
+            {
+                value += text[at];
+                continue;
+            }
+            if (++at >= text.size())
+            {
+                return false;
+            }
+            const char *escapes = "\"\"\\\\//b\bf\fn\nr\rt\t";
+            const char *match = strchr(escapes, text[at]);
+            if (text[at] != 'u' && match != NULL && (match - escapes) % 2 == 0)
+            {
+                value += match[1];
+                continue;
+            }
+            unsigned code = 0;
+            if (text[at] != 'u' || at + 4 >= text.size() || sscanf(text.c_str() + at + 1, "%4x", &code) != 1)
+            {
+                return false;
+            }
+            at += 4;
+            // UTF-8; a surrogate pair's halves are encoded separately, which is enough for file names
+            if (code < 0x80)
+            {
+                value += char(code);
+            }
+            else if (code < 0x800)
+            {
+                value += char(0xC0 | code >> 6);
+                value += char(0x80 | (code & 0x3F));
+            }
+            else
+            {
+                value += char(0xE0 | code >> 12);
+                value += char(0x80 | (code >> 6 & 0x3F));
+                value += char(0x80 | (code & 0x3F));
+            }
+        }
+        at++;
+        return at <= text.size();
+    };
+
+    skip_space();
+    if (at >= text.size() || text[at++] != '{')
+    {
+        return false;
+    }
+    skip_space();
+    if (at < text.size() && text[at] == '}')
+    {
+        at++;
+    }
+    else
+    {
+        while (true)
+        {
+            string name;
+            string value;
+            skip_space();
+            if (!parse_string(name))
+            {
+                return false;
+            }
+            skip_space();
+            if (at >= text.size() || text[at++] != ':')
+            {
+                return false;
+            }
+            skip_space();
+            if (at < text.size() && text[at] == '"')
+            {
+                if (!parse_string(value))
+                {
+                    return false;
+                }
+            }
+            else
+            {
+                size_t end = text.find_first_of(",} \t\r\n", at);
+                value = text.substr(at, end == string::npos ? string::npos : end - at);
+                if (value.empty() || value[0] == '{' || value[0] == '[')
+                {
+                    return false;
+                }
+                at = end == string::npos ? text.size() : end;
+            }
+            fields.push_back(make_pair(name, value));
+            skip_space();
+            if (at < text.size() && text[at] == ',')
+            {
+                at++;
+                continue;
+            }
+            if (at >= text.size() || text[at++] != '}')
+            {
+                return false;
+            }
+            break;
+        }
+    }
+    skip_space();
+    return at == text.size();
+}
+
+/**
+ * Description: Looks up a member parsed by parse_json_object()
+ * @param vector of members
+ * @param string name
+ * @param string value to return when the member is missing
+ * @return string value
+ */
+
+string json_field(const vector<pair<string, string>> &fields, const string &name, const string &missing = string())
+{
+    for (size_t i = 0; i < fields.size(); i++)
+    {
+        if (fields[i].first == name)
+        {
+            return fields[i].second;
+        }
+    }
+    return missing;
+}
+
+#ifdef IMGPROC_POSIX
+// Descriptors received are closed on exec, where the system can do that as they arrive
+#ifdef MSG_CMSG_CLOEXEC
+const int RECEIVE_FLAGS = MSG_CMSG_CLOEXEC;
+#else
+const int RECEIVE_FLAGS = 0;
+#endif
+
+/**
+ * Description: Names an open file descriptor, so the decoder and encoders, which take file names,
+ * can read and write it
+ * @param int file descriptor
+ * @return string path of the descriptor
+ */
+
+string descriptor_path(int fd)
+{
+#ifdef __linux__
+    return "/proc/self/fd/" + to_string(fd);
+#else
+    return "/dev/fd/" + to_string(fd);
+#endif
+}
+
+/**
+ * Description: Creates an anonymous file in memory (a memfd on Linux, an unlinked temporary file
+ * elsewhere) to hand a result to a client without copying it through the socket
+ * @param string name for debugging
+ * @return file descriptor, or -1 on failure
+ */
+
+int create_memory_file(const string &name)
+{
+#ifdef __linux__
+    return memfd_create(name.c_str(), MFD_CLOEXEC);
+#else
+    string path;
+    int fd = create_temporary_file(name, path);
+    if (fd >= 0)
+    {
+        unlink(path.c_str());
+    }
+    return fd;
+#endif
+}
+
+/**
+ * Description: Sends one message, with a file descriptor attached to its first byte if given
+ * @param int connected socket
+ * @param string message, without the newline
+ * @param int descriptor to pass, or -1
+ * @return true if the whole message was sent
+ */
+
+bool send_message(int socket, const string &message, int fd = -1)
+{
+    string line = message + "\n";
+    size_t sent = 0;
+    while (sent < line.size())
+    {
+        struct iovec data;
+        data.iov_base = (void *)(line.data() + sent);
+        data.iov_len = line.size() - sent;
+        struct msghdr header;
+        memset(&header, 0, sizeof(header));
+        header.msg_iov = &data;
+        header.msg_iovlen = 1;
+        char control[CMSG_SPACE(sizeof(int))];
+        if (sent == 0 && fd >= 0)
+        {
+            memset(control, 0, sizeof(control));
+            header.msg_control = control;
+            header.msg_controllen = sizeof(control);
+            struct cmsghdr *attached = CMSG_FIRSTHDR(&header);
+            attached->cmsg_level = SOL_SOCKET;
+            attached->cmsg_type = SCM_RIGHTS;
+            attached->cmsg_len = CMSG_LEN(sizeof(int));
+            memcpy(CMSG_DATA(attached), &fd, sizeof(int));
+        }
+        ssize_t count = sendmsg(socket, &header, MSG_NOSIGNAL);
+        if (count < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (count <= 0)
+        {
+            return false;
+        }
+        sent += count;
+    }
+    return true;
+}
+
+/**
+ * Description: One end of a connection: bytes and descriptors received but not yet taken as
+ * messages. Closes descriptors nobody took.
+ */
+
+class MessageChannel
+{
+public:
+    explicit MessageChannel(int connected_socket)
+        : socket(connected_socket)
+    {
+    }
+
+    ~MessageChannel()
+    {
+        for (size_t i = 0; i < descriptors.size(); i++)
+        {
+            ::close(descriptors[i]);
+        }
+        ::close(socket);
+    }
+
+    int descriptor() const
+    {
+        return socket;
+    }
+
+    /**
+     * Description: Waits for the next message
+     * @param string that receives the message, without the newline
+     * @param int that receives the descriptor sent with it, or -1; the caller closes it
+     * @return false when the peer closed the connection or sent too long a message
+     */
+
+    bool receive(string &message, int &fd)
+    {
+        fd = -1;
+        size_t newline;
+        while ((newline = pending.find('\n')) == string::npos)
+        {
+            if (pending.size() > MAX_MESSAGE_BYTES)
+            {
+                return false;
+            }
+            char data[4096];
+            struct iovec buffer;
+            buffer.iov_base = data;
+            buffer.iov_len = sizeof(data);
+            char control[CMSG_SPACE(4 * sizeof(int))];
+            struct msghdr header;
+            memset(&header, 0, sizeof(header));
+            header.msg_iov = &buffer;
+            header.msg_iovlen = 1;
+            header.msg_control = control;
+            header.msg_controllen = sizeof(control);
+            ssize_t count = recvmsg(socket, &header, RECEIVE_FLAGS);
+            if (count < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (count <= 0)
+            {
+                return false;
+            }
+            for (struct cmsghdr *attached = CMSG_FIRSTHDR(&header); attached != NULL;
+                 attached = CMSG_NXTHDR(&header, attached))
+            {
+                if (attached->cmsg_level == SOL_SOCKET && attached->cmsg_type == SCM_RIGHTS)
+                {
+                    size_t count_fds = (attached->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+                    for (size_t i = 0; i < count_fds; i++)
+                    {
+                        int received;
+                        memcpy(&received, CMSG_DATA(attached) + i * sizeof(int), sizeof(int));
+                        descriptors.push_back(received);
+                    }
+                }
+            }
+            pending.append(data, count);
+        }
+        message = pending.substr(0, newline);
+        pending.erase(0, newline + 1);
+        // Descriptors arrive with the first byte of their message, so the oldest belongs to this one
+        if (!descriptors.empty())
+        {
+            fd = descriptors.front();
+            descriptors.erase(descriptors.begin());
+        }
+        return true;
+    }
+
+private:
+    int socket;
+    string pending;
+    vector<int> descriptors;
+
+    MessageChannel(const MessageChannel &);
+    MessageChannel &operator=(const MessageChannel &);
+};
+#endif
+
+// ________________________________________________________ Decoded image cache
+
+// Decoded images the server keeps unless --image-cache says otherwise: a quarter of memory_budget()
+const size_t IMAGE_CACHE_SHARE = 4;
+
+// What the decoded image cache has done since the server started
+struct ImageCacheStats
+{
+    long long hits;   // requests that found their source decoded
+    long long misses; // requests that decoded it
+    long long images; // images held
+    long long bytes;  // bytes they take
+};
+
+/**
+ * Description: Least recently used set of decoded source images, so rendering several effects of
+ * one image decodes it once. Keys name the file and its version (see image_cache_key). Servers
+ * hold tens of images, so entries are a vector searched from the front; the images themselves
+ * are shared, and one evicted while a request still uses it lives until that request ends.
+ */
+
+class DecodedImageCache
+{
+public:
+    explicit DecodedImageCache(size_t limit_bytes)
+        : limit(limit_bytes), clock(0)
+    {
+        memset(&counts, 0, sizeof(counts));
+    }
+
+    // Returns the image for a key, or null when it is not cached
+    shared_ptr<const Image> find(const string &key)
+    {
+        for (size_t i = 0; i < entries.size(); i++)
+        {
+            if (entries[i].key == key)
+            {
+                entries[i].used = ++clock;
+                counts.hits++;
+                return entries[i].image;
+            }
+        }
+        counts.misses++;
+        return shared_ptr<const Image>();
+    }
+
+    // Adds an image, evicting the least recently used ones to stay under the limit
+    void insert(const string &key, const shared_ptr<const Image> &image)
+    {
+        size_t bytes = image_bytes(*image);
+        if (bytes > limit)
+        {
+            return;
+        }
+        while (!entries.empty() && size_t(counts.bytes) + bytes > limit)
+        {
+            size_t oldest = 0;
+            for (size_t i = 1; i < entries.size(); i++)
+            {
+                oldest = entries[i].used < entries[oldest].used ? i : oldest;
+            }
+            counts.bytes -= image_bytes(*entries[oldest].image);
+            entries.erase(entries.begin() + oldest);
+        }
+        Entry entry;
+        entry.key = key;
+        entry.image = image;
+        entry.used = ++clock;
+        entries.push_back(entry);
+        counts.bytes += bytes;
+        counts.images = entries.size();
+    }
+
+    ImageCacheStats stats() const
+    {
+        ImageCacheStats result = counts;
+        result.images = entries.size();
+        return result;
+    }
+
+private:
+    struct Entry
+    {
+        string key;
+        shared_ptr<const Image> image;
+        unsigned long long used;
+    };
+
+    size_t limit;
+    unsigned long long clock;
+    vector<Entry> entries;
+    ImageCacheStats counts;
+
+    static size_t image_bytes(const Image &image)
+    {
+        return image.stride * image.height * (image.layout == LAYOUT_BGR ? 1 : 3);
+    }
+};
+
+#ifdef IMGPROC_POSIX
+/**
+ * Description: Builds the decoded image cache key of an input. A named file is known by its path
+ * and the identity, size and modification time of the file, so an edited file is decoded again
+ * without reading it to find out; a passed descriptor is known by the hash of its bytes.
+ * @param string input path, empty for a descriptor
+ * @param int input descriptor, used when the path is empty
+ * @param string that receives the key
+ * @return true if the input exists
+ */
+
+bool image_cache_key(const string &path, int fd, string &key)
+{
+    struct stat file_stat;
+    if (!path.empty())
+    {
+        if (stat(path.c_str(), &file_stat) != 0)
+        {
+            return false;
+        }
+        stringstream text;
+        text << "file " << file_stat.st_dev << ":" << file_stat.st_ino << " " << file_stat.st_size << " "
+             << file_stat.st_mtime << "." << file_stat.st_mtim.tv_nsec << " " << path;
+        key = text.str();
+        return true;
+    }
+    MappedFile file;
+    if (!file.open(descriptor_path(fd)))
+    {
+        return false;
+    }
+    char text[32];
+    snprintf(text, sizeof(text), "bytes %016llx %llu", (unsigned long long)xxh64(file.bytes(), file.length()),
+             (unsigned long long)file.length());
+    key = text;
+    return true;
+}
+#endif
+
+// ________________________________________________________ Server
+
+// Clients the server lets wait for a connection
+const int SERVER_BACKLOG = 64;
+
+#ifdef IMGPROC_POSIX
+/**
+ * Description: State shared by a server's connections. Requests run one at a time under the lock:
+ * each one already uses every thread of the pool, and the cache and buffers are reused between
+ * them.
+ */
+
+struct ServerState
+{
+    mutex lock;
+    DecodedImageCache images;
+    Image result;
+    PipelineBuffers buffers;
+    long long requests;
+
+    explicit ServerState(size_t image_cache_bytes)
+        : images(image_cache_bytes), requests(0)
+    {
+    }
+};
+
+// Set by SIGINT and SIGTERM to stop accepting connections
+volatile sig_atomic_t server_stopping = 0;
+
+void stop_server(int)
+{
+    server_stopping = 1;
+}
+
+/**
+ * Description: Runs one render request: finds or decodes the source, runs the pipeline and writes
+ * the result to the requested output file, or to a memory file whose descriptor goes back with
+ * the response. A pipeline that ends in a rotation or mirror of an unchanged source is written
+ * straight from the cached image.
+ * @param ServerState
+ * @param vector of request members
+ * @param int input descriptor sent with the request, or -1
+ * @param int that receives the result descriptor to send, or -1
+ * @return string response message
+ */
+
+string serve_render(ServerState &state, const vector<pair<string, string>> &request, int input_fd, int &result_fd)
+{
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    result_fd = -1;
+    string input = json_field(request, "input");
+    string output = json_field(request, "output");
+    if (input.empty() == (input_fd < 0))
+    {
+        return "{\"status\": \"error\", \"message\": \"give either an input path or an input descriptor\"}";
+    }
+    vector<Operation> ops;
+    string error;
+    string spec = json_field(request, "pipeline");
+    if (!spec.empty() && !parse_pipeline(spec, ops, error))
+    {
+        return "{\"status\": \"error\", \"message\": " + json_string(error) + "}";
+    }
+    vector<PipelineStage> stages = plan_pipeline(ops);
+    BmpWriteOptions write_options;
+    if (json_field(request, "indexed") == "true" || json_field(request, "rle") == "true")
+    {
+        write_options = indexed_write_options(stages);
+        write_options.rle = json_field(request, "rle") == "true";
+    }
+
+    lock_guard<mutex> guard(state.lock);
+    state.requests++;
+    string key;
+    if (!image_cache_key(input, input_fd, key))
+    {
+        return "{\"status\": \"error\", \"message\": " + json_string("cannot open " + input) + "}";
+    }
+    shared_ptr<const Image> source = state.images.find(key);
+    bool decoded = !source;
+    if (decoded)
+    {
+        // Any client can send any file, so the size is checked before a buffer is allocated
+        string source_name = input.empty() ? descriptor_path(input_fd) : input;
+        BmpInfo info;
+        BmpStatus status = read_bmp_info(source_name, info);
+        if (status == BMP_OK && uint64_t(info.width) * info.height * 3 > memory_budget())
+        {
+            status = BMP_TOO_LARGE;
+        }
+        shared_ptr<Image> image(new Image());
+        status = status == BMP_OK ? read_bmp(source_name, *image) : status;
+        if (status != BMP_OK)
+        {
+            return "{\"status\": \"error\", \"message\": " + json_string(bmp_status_message(status)) + "}";
+        }
+        source = image;
+        state.images.insert(key, source);
+    }
+    if (!pipeline_size_fits(stages, source->width, source->height))
+    {
+        return "{\"status\": \"error\", \"message\": " + json_string(bmp_status_message(BMP_RESULT_TOO_LARGE)) + "}";
+    }
+    if (in_memory_bytes(source->width, source->height, stages) > memory_budget())
+    {
+        return "{\"status\": \"error\", \"message\": " + json_string(bmp_status_message(BMP_TOO_LARGE)) + "}";
+    }
+
+    // A lone rotation or mirror needs no pixels of its own
+    const PipelineStage &first = stages[0];
+    bool view_only = stages.size() == 1 && !first.resize && first.x_scale == 1 && first.y_scale == 1 &&
+                     first.point_ops.empty();
+    Orientation orientation = view_only ? first.orientation : Orientation();
+    if (!view_only)
+    {
+        run_stage(*source, first, state.result, state.buffers);
+        orientation = run_pipeline_lazily(state.result, vector<PipelineStage>(stages.begin() + 1, stages.end()),
+                                          state.buffers);
+    }
+    ImageView view(view_only ? *source : state.result, orientation);
+
+    string target = output;
+    if (output.empty())
+    {
+        result_fd = create_memory_file("imgproc-result");
+        if (result_fd < 0)
+        {
+            return "{\"status\": \"error\", \"message\": " + json_string(strerror(errno)) + "}";
+        }
+        target = descriptor_path(result_fd);
+    }
+    struct stat result_stat;
+    if (!write_bmp(target, view, write_options) || stat(target.c_str(), &result_stat) != 0)
+    {
+        if (result_fd >= 0)
+        {
+            ::close(result_fd);
+            result_fd = -1;
+        }
+        return "{\"status\": \"error\", \"message\": " + json_string(bmp_status_message(BMP_WRITE_FAILED)) + "}";
+    }
+    double milliseconds = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    stringstream response;
+    response << "{\"status\": \"ok\", \"width\": " << view.width() << ", \"height\": " << view.height()
+             << ", \"bytes\": " << result_stat.st_size << ", \"source\": \"" << (decoded ? "decoded" : "cached")
+             << "\", \"milliseconds\": " << fixed << setprecision(3) << milliseconds << "}";
+    return response.str();
+}
+
+/**
+ * Description: Answers one client's requests until it disconnects. A request with "command":
+ * "stats" gets the server's counters; anything else is a render (see serve_render).
+ * @param int connected socket, closed on return
+ * @param ServerState, shared so it outlives the accept loop while connections finish
+ * @return nothing
+ */
+
+void serve_connection(int socket, shared_ptr<ServerState> shared_state)
+{
+    ServerState &state = *shared_state;
+    trace_thread_name() = "connection";
+    MessageChannel channel(socket);
+    string message;
+    int input_fd;
+    while (channel.receive(message, input_fd))
+    {
+        vector<pair<string, string>> request;
+        string response;
+        int result_fd = -1;
+        if (!parse_json_object(message, request))
+        {
+            response = "{\"status\": \"error\", \"message\": \"requests are one-line JSON objects\"}";
+        }
+        else if (json_field(request, "command") == "stats")
+        {
+            lock_guard<mutex> guard(state.lock);
+            ImageCacheStats images = state.images.stats();
+            stringstream text;
+            text << "{\"status\": \"ok\", \"requests\": " << state.requests << ", \"image_hits\": " << images.hits
+                 << ", \"image_misses\": " << images.misses << ", \"images\": " << images.images
+                 << ", \"image_bytes\": " << images.bytes << "}";
+            response = text.str();
+        }
+        else
+        {
+            response = serve_render(state, request, input_fd, result_fd);
+        }
+        if (input_fd >= 0)
+        {
+            ::close(input_fd);
+        }
+        bool sent = send_message(channel.descriptor(), response, result_fd);
+        if (result_fd >= 0)
+        {
+            ::close(result_fd);
+        }
+        if (!sent)
+        {
+            break;
+        }
+    }
+}
+#endif
+
+/**
+ * Description: Serves render requests on a Unix domain socket until SIGINT or SIGTERM. Each
+ * connection gets a thread; decoded sources stay in a DecodedImageCache between requests. A
+ * socket file left by a server that died is replaced; one that still answers is an error.
+ * @param string program name for messages
+ * @param string socket path
+ * @param size_t bytes of decoded images to keep
+ * @return process exit code: 0 after a signal, 1 if the socket could not be set up
+ */
+
+int run_server(const string &program, const string &socket_path, size_t image_cache_bytes)
+{
+#ifdef IMGPROC_POSIX
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (socket_path.size() >= sizeof(address.sun_path))
+    {
+        cerr << program << ": socket path too long: " << socket_path << endl;
+        return 1;
+    }
+    strcpy(address.sun_path, socket_path.c_str());
+
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener >= 0 && connect(listener, (struct sockaddr *)&address, sizeof(address)) == 0)
+    {
+        cerr << program << ": a server is already listening on " << socket_path << endl;
+        ::close(listener);
+        return 1;
+    }
+    if (listener >= 0)
+    {
+        ::close(listener);
+    }
+    unlink(socket_path.c_str());
+    listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0 || ::bind(listener, (struct sockaddr *)&address, sizeof(address)) != 0 ||
+        listen(listener, SERVER_BACKLOG) != 0)
+    {
+        cerr << program << ": cannot listen on " << socket_path << ": " << strerror(errno) << endl;
+        if (listener >= 0)
+        {
+            ::close(listener);
+        }
+        return 1;
+    }
+
+    // No SA_RESTART, so a signal interrupts accept() and the loop sees server_stopping
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = stop_server;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    shared_ptr<ServerState> state(new ServerState(image_cache_bytes));
+    cerr << program << ": serving on " << socket_path << endl;
+    while (!server_stopping)
+    {
+        int connection = accept(listener, NULL, NULL);
+        if (connection < 0)
+        {
+            if (errno != EINTR && errno != ECONNABORTED)
+            {
+                cerr << program << ": accept failed: " << strerror(errno) << endl;
+            }
+            continue;
+        }
+        thread(serve_connection, connection, state).detach();
+    }
+    ::close(listener);
+    unlink(socket_path.c_str());
+    return 0;
+#else
+    cerr << program << ": --serve needs Unix domain sockets" << endl;
+    (void)socket_path;
+    (void)image_cache_bytes;
+    return 1;
+#endif
+}
+
+// ________________________________________________________ Client
+
+/**
+ * Description: Renders one image through a running server. The input is sent as its absolute
+ * path, or, for "-", as a memory file filled from standard input. The result comes back as a
+ * descriptor and is copied to OUTPUT, or to standard output for "-".
+ * @param string program name for messages
+ * @param string socket path
+ * @param string pipeline spec, empty to copy
+ * @param bool request indexed output
+ * @param bool request run length encoded output
+ * @param string input file name or "-"
+ * @param string output file name or "-"
+ * @return process exit code: 0 on success, 1 otherwise
+ */
+
+int run_client(const string &program, const string &socket_path, const string &spec, bool indexed, bool rle,
+               const string &input, const string &output)
+{
+#ifdef IMGPROC_POSIX
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, socket_path.c_str(), sizeof(address.sun_path) - 1);
+    int connection = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (connection < 0 || connect(connection, (struct sockaddr *)&address, sizeof(address)) != 0)
+    {
+        cerr << program << ": cannot connect to " << socket_path << ": " << strerror(errno) << endl;
+        if (connection >= 0)
+        {
+            ::close(connection);
+        }
+        return 1;
+    }
+    MessageChannel channel(connection);
+
+    string request = "{\"pipeline\": " + json_string(spec);
+    request += indexed ? ", \"indexed\": true" : "";
+    request += rle ? ", \"rle\": true" : "";
+    int input_fd = -1;
+    if (input == "-")
+    {
+        input_fd = create_memory_file("imgproc-input");
+        if (input_fd < 0 || !copy_file_bytes(STDIN_FILENO, input_fd))
+        {
+            cerr << program << ": cannot read standard input" << endl;
+            return 1;
+        }
+    }
+    else
+    {
+        char *resolved = realpath(input.c_str(), NULL);
+        if (resolved == NULL)
+        {
+            cerr << program << ": " << input << ": " << strerror(errno) << endl;
+            return 1;
+        }
+        request += ", \"input\": " + json_string(resolved);
+        free(resolved);
+    }
+    request += "}";
+
+    string response;
+    int result_fd = -1;
+    bool answered = send_message(connection, request, input_fd) && channel.receive(response, result_fd);
+    if (input_fd >= 0)
+    {
+        ::close(input_fd);
+    }
+    vector<pair<string, string>> fields;
+    if (!answered || !parse_json_object(response, fields) || json_field(fields, "status") != "ok" || result_fd < 0)
+    {
+        string message = answered ? json_field(fields, "message", response) : "no answer from " + socket_path;
+        cerr << program << ": " << input << ": " << message << endl;
+        if (result_fd >= 0)
+        {
+            ::close(result_fd);
+        }
+        return 1;
+    }
+
+    int target = output == "-" ? STDOUT_FILENO : ::open(output.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    bool ok = target >= 0 && lseek(result_fd, 0, SEEK_SET) == 0 && copy_file_bytes(result_fd, target);
+    if (target >= 0 && target != STDOUT_FILENO)
+    {
+        ok = ::close(target) == 0 && ok;
+    }
+    ::close(result_fd);
+    if (!ok)
+    {
+        cerr << program << ": " << output << ": " << bmp_status_message(BMP_WRITE_FAILED) << endl;
+        return 1;
+    }
+    return 0;
+#else
+    cerr << program << ": --connect needs Unix domain sockets" << endl;
+    (void)socket_path;
+    (void)spec;
+    (void)indexed;
+    (void)rle;
+    (void)input;
+    (void)output;
+    return 1;
+#endif
+}
+
+//***************************************************************************************************//
+// VECTOR OF VECTORS API
+//***************************************************************************************************//
+
+// Each of these keeps the original 2d vector interface working by converting to an Image,
+// running the Image version and converting the result back.
+
+vector<vector<Pixel>> process_1(const vector<vector<Pixel>> &image)
+{
+    return to_pixels(process_1(to_image(image)));
+}
+
+vector<vector<Pixel>> process_2(const vector<vector<Pixel>> &image, double scaling_factor)
+{
+    return to_pixels(process_2(to_image(image), scaling_factor));
+}
+
+vector<vector<Pixel>> process_3(const vector<vector<Pixel>> &image)
+{
+    return to_pixels(process_3(to_image(image)));
+}
+
+vector<vector<Pixel>> process_4(const vector<vector<Pixel>> &image)
+{
+    return to_pixels(process_4(to_image(image)));
+}
+
+vector<vector<Pixel>> rotate_by_90(const vector<vector<Pixel>> &image)
+{
+    return to_pixels(rotate_by_90(to_image(image)));
+}
+
+vector<vector<Pixel>> process_5(const vector<vector<Pixel>> &image, int num)
+{
+    return to_pixels(process_5(to_image(image), num));
+}
+
+vector<vector<Pixel>> process_6(const vector<vector<Pixel>> &image, int x_scale, int y_scale)
+{
+    return to_pixels(process_6(to_image(image), x_scale, y_scale));
+}
+
+vector<vector<Pixel>> process_7(const vector<vector<Pixel>> &image)
+{
+    return to_pixels(process_7(to_image(image)));
+}
+
+vector<vector<Pixel>> process_8(const vector<vector<Pixel>> &image, double scaling_factor)
+{
+    return to_pixels(process_8(to_image(image), scaling_factor));
+}
+
+vector<vector<Pixel>> process_9(const vector<vector<Pixel>> &image, double scaling_factor)
+{
+    return to_pixels(process_9(to_image(image), scaling_factor));
+}
+
+vector<vector<Pixel>> process_10(const vector<vector<Pixel>> &image)
+{
+    return to_pixels(process_10(to_image(image)));
+}
+
+vector<vector<Pixel>> process_11(const vector<vector<Pixel>> &image)
+{
+    return to_pixels(process_11(to_image(image)));
+}
+
+vector<vector<Pixel>> process_12(const vector<vector<Pixel>> &image)
+{
+    return to_pixels(process_12(to_image(image)));
+}
+
+vector<vector<Pixel>> process_13(const vector<vector<Pixel>> &image, const vector<vector<Pixel>> &image_B)
+{
+    return to_pixels(process_13(to_image(image), to_image(image_B)));
+}
+
+vector<vector<Pixel>> process_14(const vector<vector<Pixel>> &image, const vector<vector<Pixel>> &image_B, double weight_A, double weight_B)
+{
+    return to_pixels(process_14(to_image(image), to_image(image_B), weight_A, weight_B));
+}
+
+//***************************************************************************************************//
+// HELPER FUNCTIONS FOR APPLICATION
+//***************************************************************************************************//
+
+// ________________________________________________________ Selection -> Process Image Function
+
+/**
+ * Description: Takes user selection and processes image.  Prompts user if additional info needed.
+ * Point operations and mirrors change the image in place; the others build a new image.
+ * @param Image, moved in
+ * @param int number for selecting process
+ * @return the modified Image
+ */
+
+Image process_image(Image &&image, int name_idx)
+{
+    PipelineStage in_place;
+    if (name_idx == 1 || name_idx == 3 || name_idx == 7 || name_idx == 10)
+    {
+        in_place.point_ops.push_back(PointOp(name_idx));
+    }
+    else if (name_idx == 2 || name_idx == 8 || name_idx == 9)
+    {
+        double scaling_factor;
+        cout << "Enter Scaling Factor: ";
+        cin >> scaling_factor;
+        in_place.point_ops.push_back(PointOp(name_idx, scaling_factor));
+    }
+    else if (name_idx == 4)
+    {
+        return process_4(image);
+    }
+    else if (name_idx == 5)
+    {
+        int num_rotations;
+        cout << "Enter integer of 90 degree rotations: ";
+        cin >> num_rotations;
+        if (num_rotations % 4 == 0)
+        {
+            return move(image);
+        }
+        return process_5(image, num_rotations);
+    }
+    else if (name_idx == 6)
+    {
+        double x_scale;
+        double y_scale;
+        cout << "Enter X Scale: ";
+        cin >> x_scale;
+        cout << "Enter Y Scale: ";
+        cin >> y_scale;
+        if (!(x_scale > 0 && y_scale > 0))
+        {
+            cout << "Scales must be above 0, image left unchanged" << endl;
+            return move(image);
+        }
+        if (x_scale == floor(x_scale) && y_scale == floor(y_scale))
+        {
+            return process_6(image, int(x_scale), int(y_scale));
+        }
+        // Fractional scales resample instead of repeating pixels
+        return scale_image(image, x_scale, y_scale, FILTER_BICUBIC);
+    }
+    else if (name_idx == 11)
+    {
+        in_place.orientation = Orientation(false, true, false);
+    }
+    else if (name_idx == 12)
+    {
+        in_place.orientation = Orientation(false, false, true);
+    }
+    else
+    {
+        return Image();
+    }
+    run_stage_in_place(image, in_place);
+    return move(image);
+}
+
+/**
+ * Description: Applies a rotation or mirror selection to a view, prompting for the number of
+ * rotations if it needs one. No pixels are copied; the encoder applies the result as it writes.
+ * @param ImageView
+ * @param int number for selecting process: 4, 5, 11 or 12
+ * @return the transformed ImageView
+ */
+
+ImageView process_view(const ImageView &view, int name_idx)
+{
+    if (name_idx == 4)
+    {
+        return process_4(view);
+    }
+    if (name_idx == 5)
+    {
+        int num_rotations;
+        cout << "Enter integer of 90 degree rotations: ";
+        cin >> num_rotations;
+        return process_5(view, num_rotations);
+    }
+    return name_idx == 11 ? process_11(view) : process_12(view);
+}
+
+// ________________________________________________________ Load image
+
+/**
+ * Description: Reads a BMP for the application, printing the reason if it cannot be read
+ * @param string filename
+ * @param Image that receives the pixels
+ * @return true if the image was read, false otherwise
+ */
+
+bool load_image(const string &filename, Image &image)
+{
+    BmpStatus status = read_bmp(filename, image);
+    if (status != BMP_OK)
+    {
+        cout << "Could not read " << filename << ": " << bmp_status_message(status) << endl;
+        return false;
+    }
+    return true;
+}
+
+// ________________________________________________________ Point operation prompt
+
+/**
+ * Description: Builds the PointOp for a selection, prompting for a scaling factor if it needs one
+ * @param int number for selecting process
+ * @return PointOp for the process
+ */
+
+PointOp prompt_point_op(int name_idx)
+{
+    double scaling_factor = 1.0;
+    if (name_idx == 2 || name_idx == 8 || name_idx == 9)
+    {
+        cout << "Enter Scaling Factor: ";
+        cin >> scaling_factor;
+    }
+    return PointOp(name_idx, scaling_factor);
+}
+
+// ________________________________________________________ Check Valid Input
+
+/**
+ * Description: Checks if the user's selection is valid
+ * @param string, user's selection
+ * @return true if valid selection, false if invalid.
+ */
+
+bool check_valid_input(string input)
+{
+    string valid_inputs[] = {"0", "1", "2", "3", "4", "5", "6", "7", "8", "9", "10", "11", "12", "13", "14"};
+    for (int i = 0; i < 15; i++)
+    {
+        if (input == valid_inputs[i])
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+// ________________________________________________________ Get filename
+
+/**
+ * Description: get's name of image for processing and returns it
+ * @param
+ * @return string, filename
+ */
+
+string get_filename()
+{
+    string filename;
+    cout << "input BMP filename: ";
+    cin >> filename;
+    return filename;
+}
+
+// ________________________________________________________ Print Menu Options
+
+/**
+ * Description: Prints out menu options for user
+ * @param string filename to insert in the first selection
+ * @return
+ */
+
+void menu_options(string filename)
+{
+    cout << "" << endl;
+    cout << "IMAGE PROCESSING MENU" << endl;
+    cout << "0) Change image (current: " << filename << ")" << endl;
+    cout << "1) Vignette" << endl;
+    cout << "2) Clarendon" << endl;
+    cout << "3) Grayscale" << endl;
+    cout << "4) Rotate 90 degrees" << endl;
+    cout << "5) Rotate multiple 90 degrees" << endl;
+    cout << "6) Enlarge" << endl;
+    cout << "7) High contrast" << endl;
+    cout << "8) Lighten" << endl;
+    cout << "9) Darken" << endl;
+    cout << "10) Black, white, red, green, blue" << endl;
+    cout << "11) Mirror Horizontally" << endl;
+    cout << "12) Mirror Vertically" << endl;
+    cout << "13) Blend 2 images" << endl;
+    cout << "14) Weighted Blend of 2 images" << endl;
+    cout << "" << endl;
+    cout << "Enter menu selection (Q to quit): ";
+}
+//***************************************************************************************************//
+// Application
+//***************************************************************************************************//
+
+/**
+ * Description: Handles important variables, control flow for implementing application with helper
+ * function calls and reading/writing image.
+ * @param
+ * @return string with success or failure message
+ */
+
+string application()
+{
+    string process_names[] = {"rename file", "Vignette", "Clarendon", "Grayscale", "Rotate 90 degrees", "Rotate multiple 90 degrees", "Enlarge", "High contrast", "Lighten", "Darken", "Black, white, red, green, blue", "Mirror Horizontally", "Mirror Vertically", "Blend 2 images", "Weighted blend of images"};
+
+    // Invalid input, a change of image and mismatched images start the menu over
+    while (true)
+    {
+        string filename;
+        string selection;
+        int name_idx;
+        string output_name;
+
+        filename = get_filename();
+
+        menu_options(filename);
+
+        cin >> selection;
+
+        if (!cin)
+        {
+            return "\nEnd of input\nQuitting... \n\n";
+        }
+        if (selection == "Q")
+        {
+            return "\nThank you for using my program!\nQuitting... \n\n";
+        }
+        if (check_valid_input(selection) == false)
+        {
+            cout << "Please provide valid input!" << endl;
+            continue;
+        }
+
+        if (selection == "0")
+        {
+            cout << "Change image Selected!";
+            continue;
+        }
+
+        name_idx = stoi(selection);
+        cout << process_names[name_idx] << " selected" << endl;
+        // ________________________________________________________________ optional stuff starts here
+        if (name_idx == 13)
+        {
+            string filename_B;
+            cout << "input BMP filename for 2nd image, must match size! ";
+            cin >> filename_B;
+            cout << "Enter output BMP filename: ";
+            cin >> output_name;
+            Image image;
+            Image image_B;
+            if (!load_image(filename, image) || !load_image(filename_B, image_B))
+            {
+                return "Could not apply " + process_names[name_idx] + "!\n";
+            }
+            if (image.height != image_B.height || image.width != image_B.width)
+            {
+                cout << "image sizes do not match!!!" << endl;
+                continue;
+            }
+            Image new_image = process_13(image, image_B);
+            write_bmp(output_name, new_image);
+            return "Successfully applied " + process_names[name_idx] + "!";
+        }
+        if (name_idx == 14)
+        {
+            double weight_A;
+            cout << "input weight for first image, weights must add to 1: ";
+            cin >> weight_A;
+            string filename_B;
+            cout << "input BMP filename for 2nd image, must match size! ";
+            cin >> filename_B;
+            double weight_B;
+            cout << "input weight for second image, weights must add to 1: ";
+            cin >> weight_B;
+
+            if (weight_A + weight_B != 1.0)
+            {
+                cout << "weights do not equal 1!\n\n";
+                continue;
+            }
+
+            cout << "Enter output BMP filename: ";
+            cin >> output_name;
+            Image image;
+            Image image_B;
+            if (!load_image(filename, image) || !load_image(filename_B, image_B))
+            {
+                return "Could not apply " + process_names[name_idx] + "!\n";
+            }
+            if (image.height != image_B.height || image.width != image_B.width)
+            {
+                cout << "image sizes do not match!!!" << endl;
+                continue;
+            }
+            Image new_image = process_14(image, image_B, weight_A, weight_B);
+            write_bmp(output_name, new_image);
+            return "Successfully applied " + process_names[name_idx] + "!";
+        }
+        // ________________________________________________________________ optional stuff ends here
+
+        cout << "Enter output BMP filename: ";
+        cin >> output_name;
+
+        if (is_point_op(name_idx))
+        {
+            // Point operations stream rows from file to file without loading the whole image
+            vector<PointOp> ops(1, prompt_point_op(name_idx));
+            BmpStatus status = stream_point_ops(filename, output_name, ops);
+            if (status != BMP_OK)
+            {
+                cout << "Could not process " << filename << ": " << bmp_status_message(status) << endl;
+                return "Could not apply " + process_names[name_idx] + "!\n";
+            }
+            return "Successfully applied " + process_names[name_idx] + "!";
+        }
+
+        Image image;
+        if (!load_image(filename, image))
+        {
+            return "Could not apply " + process_names[name_idx] + "!\n";
+        }
+
+        if (name_idx == 4 || name_idx == 5 || name_idx == 11 || name_idx == 12)
+        {
+            // Rotations and mirrors are written straight from the loaded image
+            write_bmp(output_name, process_view(ImageView(image), name_idx));
+            return "Successfully applied " + process_names[name_idx] + "!";
+        }
+
+        Image new_image = process_image(move(image), name_idx);
+
+        write_bmp(output_name, new_image);
+
+        return "Successfully applied " + process_names[name_idx] + "!";
+    }
+}
+
+//***************************************************************************************************//
+// BENCHMARKS
+//***************************************************************************************************//
+
+// ________________________________________________________ Workloads
+
+// Pseudo process numbers of the benchmark operations that time the BMP codec, frame blending and
+// the box downscale
+const int BENCH_READ = -1;
+const int BENCH_WRITE = -2;
+const int BENCH_BLEND_MEAN = -3;
+const int BENCH_BLEND_MEDIAN = -4;
+const int BENCH_HALVE = -5;
+const int BENCH_WRITE_MMAP = -6;        // write_bmp with BmpWriteOptions::use_mmap
+const int BENCH_WRITE_PREALLOCATE = -7; // write_bmp with BmpWriteOptions::preallocate
+
+// Frames the blend benchmarks combine: the input, the second input and the input again
+const int BENCH_BLEND_FRAMES = 3;
+
+// One operation the benchmark times
+struct BenchOp
+{
+    const char *name;
+    int process; // process number, or one of the BENCH_ pseudo processes
+};
+
+const BenchOp BENCH_OPS[] = {{"read_bmp", BENCH_READ},    {"write_bmp", BENCH_WRITE}, {"process_1", 1},
+                             {"process_2", 2},            {"process_3", 3},           {"process_4", 4},
+                             {"process_5", 5},            {"process_6", 6},           {"process_7", 7},
+                             {"process_8", 8},            {"process_9", 9},           {"process_10", 10},
+                             {"process_11", 11},          {"process_12", 12},         {"process_13", 13},
+                             {"process_14", 14},          {"blend_mean", BENCH_BLEND_MEAN},
+                             {"blend_median", BENCH_BLEND_MEDIAN}, {"halve", BENCH_HALVE},
+                             {"write_bmp_mmap", BENCH_WRITE_MMAP}, {"write_bmp_preallocate", BENCH_WRITE_PREALLOCATE}};
+const int BENCH_OP_COUNT = sizeof(BENCH_OPS) / sizeof(BENCH_OPS[0]);
+
+// What to run: every operation over every image, thread count and SIMD level
+struct BenchOptions
+{
+    vector<int> sizes;         // square synthetic images, width = height
+    vector<int> thread_counts; // empty for 1 and the default thread count
+    vector<SimdLevel> simd_levels; // empty for every level the CPU supports
+    int repeat;                // the best of this many runs is reported
+    string json_file;          // empty to skip the JSON report
+    vector<string> images;     // BMP files benchmarked besides the synthetic images
+
+    BenchOptions()
+        : repeat(3)
+    {
+        sizes.push_back(256);
+        sizes.push_back(1024);
+        sizes.push_back(4096);
+    }
+};
+
+// One timed configuration
+struct BenchResult
+{
+    string op;
+    string image;
+    int width;
+    int height;
+    int threads;
+    SimdLevel simd;
+    double seconds;               // best run
+    double mp_per_s;              // input megapixels per second
+    double bytes_per_pixel;       // image and file bytes read and written per input pixel
+    double alloc_bytes_per_pixel; // buffer bytes allocated per input pixel, in the best run
+    bool exact;                   // output identical to the scalar, single threaded run
+};
+
+/**
+ * Description: Makes a reproducible noise image, so every byte value reaches the kernels
+ * @param int width
+ * @param int height
+ * @param uint32_t seed, non-zero
+ * @return Image
  */
 
-int rgb_max(int red, int green, int blue)
+Image synthetic_image(int width, int height, uint32_t seed)
 {
-    if (red >= green && red >= blue)
+    Image image(width, height);
+    uint32_t state = seed;
+    for (int r = 0; r < height; r++)
     {
-        return red;
+        unsigned char *row = image.row(r);
+        for (int i = 0; i < width * 3; i++)
+        {
+            state ^= state << 13;
+            state ^= state >> 17;
+            state ^= state << 5;
+            row[i] = (unsigned char)(state >> 24);
+        }
     }
-    else if (green >= red && green >= blue)
+    return image;
+}
+
+/**
+ * Description: Compares the pixels of two images, whatever their layout and padding
+ * @param Image a
+ * @param Image b
+ * @return true if both have the same size and pixels
+ */
+
+bool same_pixels(const Image &a, const Image &b)
+{
+    if (a.width != b.width || a.height != b.height)
     {
-        return green;
+        return false;
     }
-    else if (blue >= red && blue >= green)
+    Image scratch_a, scratch_b;
+    const Image &bgr_a = as_bgr(a, scratch_a);
+    const Image &bgr_b = as_bgr(b, scratch_b);
+    for (int r = 0; r < a.height; r++)
     {
-        return blue;
+        if (memcmp(bgr_a.row(r), bgr_b.row(r), size_t(a.width) * 3) != 0)
+        {
+            return false;
+        }
     }
-    else if (red == green && green == blue)
+    return true;
+}
+
+/**
+ * Description: Runs one benchmark operation with the parameters the menu suggests
+ * @param int process number, or one of the BENCH_ pseudo processes
+ * @param Image input
+ * @param Image second input of the blends, same size
+ * @param string BMP file that BENCH_READ reads and the BENCH_WRITE operations write
+ * @param Image that receives the result (for a write, the input again when the write worked)
+ * @return true if the operation worked
+ */
+
+bool run_bench_op(int process, const Image &image, const Image &image_B, const string &temp_file, Image &out)
+{
+    switch (process)
     {
-        return red;
+    case BENCH_READ:
+        return read_bmp(temp_file, out) == BMP_OK;
+    case BENCH_WRITE:
+    case BENCH_WRITE_MMAP:
+    case BENCH_WRITE_PREALLOCATE:
+    {
+        BmpWriteOptions options;
+        options.use_mmap = process == BENCH_WRITE_MMAP;
+        options.preallocate = process == BENCH_WRITE_PREALLOCATE;
+        if (!write_bmp(temp_file, image, options))
+        {
+            return false;
+        }
+        out = image;
+        return true;
     }
-    return 0;
+    case BENCH_BLEND_MEAN:
+    case BENCH_BLEND_MEDIAN:
+    {
+        const Image *frames[BENCH_BLEND_FRAMES] = {&image, &image_B, &image};
+        BlendOptions options;
+        options.mode = process == BENCH_BLEND_MEAN ? BLEND_MEAN : BLEND_MEDIAN;
+        out = blend_images(vector<const Image *>(frames, frames + BENCH_BLEND_FRAMES), options);
+        break;
+    }
+    case BENCH_HALVE:
+        out = halve_image(image);
+        break;
+    case 1:
+        out = process_1(image);
+        break;
+    case 2:
+        out = process_2(image, 0.3);
+        break;
+    case 3:
+        out = process_3(image);
+        break;
+    case 4:
+        out = process_4(image);
+        break;
+    case 5:
+        out = process_5(image, 1);
+        break;
+    case 6:
+        out = process_6(image, 2, 2);
+        break;
+    case 7:
+        out = process_7(image);
+        break;
+    case 8:
+        out = process_8(image, 0.5);
+        break;
+    case 9:
+        out = process_9(image, 0.5);
+        break;
+    case 10:
+        out = process_10(image);
+        break;
+    case 11:
+        out = process_11(image);
+        break;
+    case 12:
+        out = process_12(image);
+        break;
+    case 13:
+        out = process_13(image, image_B);
+        break;
+    case 14:
+        out = process_14(image, image_B, 0.3, 0.7);
+        break;
+    default:
+        return false;
+    }
+    return !out.empty();
 }
 
 /**
- * Description: Converts image to only black, white, red, blue, and green
- * @param 2d vector of type Pixel
- * @return a new 2d vector of type pixel modified
+ * Description: Counts the image and file bytes an operation reads and writes
+ * @param int process number, or one of the BENCH_ pseudo processes
+ * @param Image input
+ * @param Image result
+ * @return bytes moved, per input pixel
  */
 
-vector<vector<Pixel>> process_10(const vector<vector<Pixel>> &image)
+double bench_bytes_per_pixel(int process, const Image &image, const Image &result)
 {
-    int height = image.size();
-    int width = image[0].size();
-    vector<vector<Pixel>> new_img(height, vector<Pixel>(width));
-    Pixel this_pixel;
+    double in_pixels = double(image.width) * image.height;
+    double out_pixels = double(result.width) * result.height;
+    int inputs = process == 13 || process == 14 ? 2 : 1;
+    if (process == BENCH_BLEND_MEAN || process == BENCH_BLEND_MEDIAN)
+    {
+        inputs = BENCH_BLEND_FRAMES;
+    }
+    // Reading decodes a file into an image and writing encodes one into a file, both 3 bytes a pixel
+    return (3.0 * inputs * in_pixels + 3.0 * out_pixels) / in_pixels;
+}
 
-    int red;
-    int green;
-    int blue;
-    int max_color;
-    int sum_color;
-    int new_red;
-    int new_green;
-    int new_blue;
+// ________________________________________________________ Sweep
 
-    for (int row = 0; row < height; row++)
+/**
+ * Description: Writes the benchmark results as JSON
+ * @param string file name
+ * @param vector of BenchResult
+ * @return true if the file was written
+ */
+
+bool write_bench_json(const string &filename, const vector<BenchResult> &results)
+{
+    ofstream out(filename.c_str());
+    out << "{\n  \"version\": 1,\n";
+    out << "  \"simd_supported\": " << json_string(simd_level_name(detect_simd_level())) << ",\n";
+    out << "  \"hardware_threads\": " << thread::hardware_concurrency() << ",\n";
+    out << "  \"results\": [";
+    for (size_t i = 0; i < results.size(); i++)
     {
-        for (int col = 0; col < width; col++)
+        const BenchResult &result = results[i];
+        out << (i == 0 ? "\n" : ",\n") << "    {\"op\": " << json_string(result.op)
+            << ", \"image\": " << json_string(result.image) << ", \"width\": " << result.width
+            << ", \"height\": " << result.height << ", \"threads\": " << result.threads
+            << ", \"simd\": " << json_string(simd_level_name(result.simd)) << ", \"seconds\": " << result.seconds
+            << ", \"mp_per_s\": " << result.mp_per_s << ", \"bytes_per_pixel\": " << result.bytes_per_pixel
+            << ", \"alloc_bytes_per_pixel\": " << result.alloc_bytes_per_pixel
+            << ", \"exact\": " << (result.exact ? "true" : "false") << "}";
+    }
+    out << "\n  ]\n}\n";
+    out.close();
+    return bool(out);
+}
+
+/**
+ * Description: Prints one benchmark result as a table row
+ * @param BenchResult
+ * @return nothing
+ */
+
+void print_bench_result(const BenchResult &result)
+{
+    ostringstream size;
+    size << result.width << "x" << result.height;
+    cout << left << setw(23) << result.op << setw(14) << result.image.substr(0, 13) << setw(12) << size.str()
+         << right << setw(4) << result.threads << "  " << left << setw(7) << simd_level_name(result.simd)
+         << right << fixed << setprecision(2) << setw(10) << result.mp_per_s << setw(8) << result.bytes_per_pixel
+         << setw(8) << result.alloc_bytes_per_pixel << "  " << (result.exact ? "exact" : "MISMATCH") << endl;
+    cout.unsetf(ios::floatfield);
+    cout << setprecision(6);
+}
+
+/**
+ * Description: Times one operation on one image in every thread count and SIMD level, and checks
+ * each output against the scalar, single threaded one
+ * @param BenchOp operation
+ * @param string image label
+ * @param Image input
+ * @param Image second input of the blends
+ * @param string temporary BMP file, holding the input for BENCH_READ
+ * @param vector of thread counts
+ * @param vector of SIMD levels
+ * @param int runs per configuration
+ * @param vector of BenchResult the results are added to
+ * @return false if the operation failed
+ */
+
+bool bench_operation(const BenchOp &op, const string &label, const Image &image, const Image &image_B,
+                     const string &temp_file, const vector<int> &thread_counts, const vector<SimdLevel> &simd_levels,
+                     int repeat, vector<BenchResult> &results)
+{
+    Image reference, out;
+    set_thread_count(1);
+    set_simd_level(SIMD_SCALAR);
+    if (!run_bench_op(op.process, image, image_B, temp_file, reference))
+    {
+        return false;
+    }
+    if (op.process == BENCH_READ)
+    {
+        // A decode is only exact if it gives back the image that was encoded
+        reference = image;
+    }
+
+    double pixels = double(image.width) * image.height;
+    for (size_t t = 0; t < thread_counts.size(); t++)
+    {
+        set_thread_count(thread_counts[t]);
+        for (size_t s = 0; s < simd_levels.size(); s++)
+        {
+            set_simd_level(simd_levels[s]);
+            BenchResult result = {op.name, label, image.width, image.height, thread_counts[t], simd_levels[s],
+                                  0.0, 0.0, 0.0, 0.0, true};
+            for (int run = 0; run < repeat; run++)
+            {
+                Image run_out;
+                long long allocated = image_allocations().bytes;
+                chrono::steady_clock::time_point start = chrono::steady_clock::now();
+                bool ok = run_bench_op(op.process, image, image_B, temp_file, run_out);
+                double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+                allocated = image_allocations().bytes - allocated;
+                if (!ok)
+                {
+                    return false;
+                }
+                if (run == 0 || seconds < result.seconds)
+                {
+                    result.seconds = seconds;
+                    result.alloc_bytes_per_pixel = allocated / pixels;
+                }
+                out.swap(run_out);
+            }
+            // A write is only exact if the file decodes to the image that was written
+            bool write = op.process == BENCH_WRITE || op.process == BENCH_WRITE_MMAP ||
+                         op.process == BENCH_WRITE_PREALLOCATE;
+            if (write && read_bmp(temp_file, out) != BMP_OK)
+            {
+                out = Image();
+            }
+            result.mp_per_s = pixels / 1e6 / max(result.seconds, 1e-9);
+            result.bytes_per_pixel = bench_bytes_per_pixel(op.process, image, out);
+            result.exact = same_pixels(out, reference);
+            print_bench_result(result);
+            results.push_back(result);
+        }
+    }
+    return true;
+}
+
+/**
+ * Description: Runs the benchmark suite: every operation over every image, thread count and SIMD
+ * level. Prints a table, optionally writes JSON, and fails if any output differs from the scalar,
+ * single threaded reference.
+ * @param string program name for messages
+ * @param BenchOptions
+ * @return process exit code, 0 if every output was exact and 1 otherwise
+ */
+
+int run_benchmarks(const string &program, const BenchOptions &options)
+{
+    vector<int> thread_counts = options.thread_counts;
+    if (thread_counts.empty())
+    {
+        thread_counts.push_back(1);
+        if (default_thread_count() > 1)
+        {
+            thread_counts.push_back(default_thread_count());
+        }
+    }
+    vector<SimdLevel> simd_levels;
+    SimdLevel supported = detect_simd_level();
+    for (size_t i = 0; i < options.simd_levels.size(); i++)
+    {
+        if (options.simd_levels[i] > supported)
+        {
+            cerr << program << ": " << simd_level_name(options.simd_levels[i]) << " is not supported here, skipped"
+                 << endl;
+            continue;
+        }
+        simd_levels.push_back(options.simd_levels[i]);
+    }
+    if (options.simd_levels.empty())
+    {
+        for (int level = SIMD_SCALAR; level <= supported; level++)
+        {
+            simd_levels.push_back(SimdLevel(level));
+        }
+    }
+
+    // The codec benchmarks write and read this file
+#ifdef IMGPROC_POSIX
+    string temp_file;
+    int temp_fd = create_temporary_file("imgproc_bench", temp_file);
+    if (temp_fd < 0)
+    {
+        cerr << program << ": cannot create a temporary file: " << strerror(errno) << endl;
+        return 1;
+    }
+    ::close(temp_fd);
+#else
+    string temp_file = "imgproc_bench.bmp";
+#endif
+
+    cout << left << setw(23) << "op" << setw(14) << "image" << setw(12) << "size" << right << setw(4) << "thr"
+         << "  " << left << setw(7) << "simd" << right << setw(10) << "MP/s" << setw(8) << "B/px" << setw(8)
+         << "alloc" << endl;
+
+    vector<BenchResult> results;
+    size_t workloads = options.sizes.size() + options.images.size();
+    int exit_code = 0;
+    for (size_t w = 0; w < workloads; w++)
+    {
+        Image image;
+        string label;
+        if (w < options.sizes.size())
+        {
+            image = synthetic_image(options.sizes[w], options.sizes[w], 0x9e3779b9u);
+            label = "synthetic";
+        }
+        else
         {
-            this_pixel = image[row][col];
-            red = this_pixel.red;
-            green = this_pixel.green;
-            blue = this_pixel.blue;
+            label = options.images[w - options.sizes.size()];
+            BmpStatus status = read_bmp(label, image);
+            if (status != BMP_OK)
+            {
+                cerr << program << ": " << label << ": " << bmp_status_message(status) << endl;
+                exit_code = 1;
+                continue;
+            }
+            size_t slash = label.find_last_of('/');
+            label = slash == string::npos ? label : label.substr(slash + 1);
+        }
+        Image image_B = synthetic_image(image.width, image.height, 0x2545f491u);
+        if (!write_bmp(temp_file, image))
+        {
+            cerr << program << ": cannot write " << temp_file << endl;
+            return 1;
+        }
+        for (int i = 0; i < BENCH_OP_COUNT; i++)
+        {
+            if (!bench_operation(BENCH_OPS[i], label, image, image_B, temp_file, thread_counts, simd_levels,
+                                 max(1, options.repeat), results))
+            {
+                cerr << program << ": " << BENCH_OPS[i].name << " failed on " << label << endl;
+                exit_code = 1;
+            }
+        }
+    }
+    remove(temp_file.c_str());
+    set_thread_count(default_thread_count());
+    set_simd_level(initial_simd_level());
+
+    size_t mismatches = 0;
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        mismatches += results[i].exact ? 0 : 1;
+    }
+    if (mismatches > 0)
+    {
+        cerr << program << ": " << mismatches << " of " << results.size() << " outputs differ from the reference"
+             << endl;
+        exit_code = 1;
+    }
+    if (!options.json_file.empty() && !write_bench_json(options.json_file, results))
+    {
+        cerr << program << ": cannot write " << options.json_file << endl;
+        exit_code = 1;
+    }
+    return exit_code;
+}
+
+//***************************************************************************************************//
+// Command line
+//***************************************************************************************************//
+
+/**
+ * Description: Prints how to run the application from the command line
+ * @param string program name
+ * @return
+ */
+
+void print_usage(const string &program)
+{
+    cout << "Usage: " << program << "                                  (interactive menu)" << endl;
+    cout << "       " << program << " [--threads N] [--memory MB] [--stats] [--pyramid N] --pipeline SPEC" << endl;
+    cout << "       " << string(program.size(), ' ') << " [--cache DIR] INPUT.bmp OUTPUT.bmp" << endl;
+    cout << "       " << program << " [--threads N] [--io-threads N] [--stats] --pipeline SPEC -o OUTPUT_DIR" << endl;
+    cout << "       " << string(program.size(), ' ') << " [--pyramid N] [--cache DIR] INPUT.bmp..." << endl;
+    cout << "       " << program << " --bench [--sizes LIST] [--thread-counts LIST] [--simd-levels LIST]" << endl;
+    cout << "       " << string(program.size(), ' ') << " [--repeat N] [--json FILE] [IMAGE.bmp...]" << endl;
+    cout << "       " << program << " [--threads N] --blend MODE [--weights LIST] INPUT.bmp... OUTPUT.bmp" << endl;
+    cout << "       " << program << " [--threads N] [--memory MB] [--image-cache MB] --serve SOCKET" << endl;
+    cout << "       " << program << " --connect SOCKET [--pipeline SPEC] [--indexed] [--rle]" << endl;
+    cout << "       " << string(program.size(), ' ') << " INPUT.bmp|- OUTPUT.bmp|-" << endl;
+    cout << "" << endl;
+    cout << "With -o every input is written to OUTPUT_DIR under its own file name; an input whose output" << endl;
+    cout << "(or --pyramid level) name an earlier input already writes fails. Inputs may be wildcard" << endl;
+    cout << "patterns such as \"in/*.bmp\", expanded here when the shell did not. The exit code is 0 when" << endl;
+    cout << "every image succeeded, 1 when any failed and 2 for usage errors." << endl;
+    cout << "--io-threads N sets the threads that read and the threads that write a batch while it is" << endl;
+    cout << "processed (default 2 each; 0 handles one file at a time)." << endl;
+    cout << "--threads N sets how many threads run each process (default: IMGPROC_THREADS, or one" << endl;
+    cout << "per hardware thread). --stats reports the image buffers allocated and how often the" << endl;
+    cout << "buffer pool reused one (IMGPROC_POOL_MB caps the free memory it keeps, default 512)." << endl;
+    cout << "--indexed writes 1, 4 or 8 bit colour table BMPs when the result has at most 256 colours" << endl;
+    cout << "(gray, contrast and quantize results always do); --rle also run length encodes them" << endl;
+    cout << "(BI_RLE4 / BI_RLE8) when that is smaller." << endl;
+    cout << "--preallocate reserves the full size of each output before writing it (fallocate), and" << endl;
+    cout << "--mmap-output writes 24 bit outputs through a shared mapping of the file. Both apply to" << endl;
+    cout << "results written from a whole image, not to streamed or out-of-core ones." << endl;
+    cout << "--pyramid N also writes the first N 2x smaller levels of every result (\"all\" goes down to" << endl;
+    cout << "1 x 1), from the same decode, as OUTPUT_1.bmp (half size), OUTPUT_2.bmp and so on. Levels" << endl;
+    cout << "average 2 x 2 blocks; they are 24 bit. Without --pipeline the input itself is copied." << endl;
+    cout << "--memory MB caps the memory a pipeline may use (default: IMGPROC_MEMORY_MB, or half the" << endl;
+    cout << "physical memory). Larger images are processed out of core, in tiles of memory-mapped" << endl;
+    cout << "24 bit BMP files, with temporary files next to the output." << endl;
+    cout << "--cache DIR keeps pipeline results in DIR (default: IMGPROC_CACHE), keyed by a hash of the" << endl;
+    cout << "input file, the pipeline with its exact parameters and the output options. A repeated job" << endl;
+    cout << "copies (reflinks where the file system can) the cached result into place instead of running." << endl;
+    cout << "Processes may share DIR. --cache-mb MB caps its size (default: IMGPROC_CACHE_MB, or 1024);" << endl;
+    cout << "the least recently used results go first. --stats also reports hits and misses." << endl;
+    cout << "--trace FILE records how long reading, each stage, each row band and writing took, as a" << endl;
+    cout << "Chrome trace for chrome://tracing or Perfetto; --trace-summary prints the totals instead." << endl;
+    cout << "SPEC is a comma separated list of steps, for example \"gray,lighten:0.8,rot:1\"." << endl;
+    cout << "Steps: vignette[:R:CX:CY], clarendon:F, gray, rot90, rot:N, enlarge:X:Y, contrast, lighten:F," << endl;
+    cout << "       darken:F, quantize, mirror-h, mirror-v (or the process number, e.g. 8:0.5)," << endl;
+    cout << "       resize:FX:FY:FILTER (fractional scale factors; FILTER is bilinear, bicubic, lanczos or" << endl;
+    cout << "       box, an area average for downscaling)" << endl;
+    cout << "--bench times reading, writing and every process on square noise images of each size in" << endl;
+    cout << "--sizes (default 256,1024,4096) and on the given images, for each thread count and SIMD" << endl;
+    cout << "level (default 1 and all threads; every supported level), and checks every output against" << endl;
+    cout << "the scalar, single threaded one. LISTs are comma separated; --repeat runs (default 3)." << endl;
+    cout << "--blend combines same-sized images a few rows at a time, so any number of them fit in" << endl;
+    cout << "memory. MODE is mean, weighted (one --weights entry per input), min, max or median." << endl;
+    cout << "--serve renders requests arriving on the Unix domain socket SOCKET until interrupted, keeping" << endl;
+    cout << "decoded sources for the next request (--image-cache MB, default a quarter of --memory)." << endl;
+    cout << "Requests are one-line JSON objects: \"input\" (a path, or omitted when an open file is passed" << endl;
+    cout << "with the request), \"pipeline\", optional \"output\" path, \"indexed\" and \"rle\". Without" << endl;
+    cout << "an output the result comes back as a memory file descriptor; {\"command\": \"stats\"} reports" << endl;
+    cout << "counters. --connect sends one request to such a server; \"-\" reads the input from standard" << endl;
+    cout << "input or writes the result to standard output." << endl;
+}
+
+/**
+ * Description: Prints how many pixel buffers the run allocated and how well the buffer pool
+ * reused them, to standard error
+ * @return nothing
+ */
+
+void print_allocation_stats()
+{
+    const AllocationCounters &counters = image_allocations();
+    BufferPoolStats pool = buffer_pool().stats();
+    const long long MIB = 1024 * 1024;
+    cerr << "image buffers allocated: " << counters.buffers << " (" << counters.bytes / MIB << " MiB)" << endl;
+    cerr << "buffer pool: " << pool.hits << " of " << pool.requests << " reused ("
+         << (pool.requests > 0 ? 100 * pool.hits / pool.requests : 0) << "%), peak " << pool.peak_live_bytes / MIB
+         << " MiB in use, " << pool.system_bytes / MIB << " MiB from the system, " << pool.cached_bytes / MIB
+         << " MiB cached" << endl;
+}
+
+/**
+ * Description: Prints what the result cache did in this run and in total, to standard error
+ * @param ResultCache, open
+ * @return nothing
+ */
+
+void print_cache_stats(ResultCache &cache)
+{
+    const ResultCacheStats &run = cache.session_stats();
+    ResultCacheStats total = cache.total_stats();
+    const long long MIB = 1024 * 1024;
+    long long run_lookups = run.hits + run.misses;
+    long long total_lookups = total.hits + total.misses;
+    cerr << "result cache: " << run.hits << " of " << run_lookups << " hits ("
+         << (run_lookups > 0 ? 100 * run.hits / run_lookups : 0) << "%), " << run.stores << " stored, "
+         << run.evictions << " evicted" << endl;
+    cerr << "result cache totals: " << total.hits << " of " << total_lookups << " hits ("
+         << (total_lookups > 0 ? 100 * total.hits / total_lookups : 0) << "%), " << total.stores << " stored, "
+         << total.evictions << " evicted, " << total.bytes / MIB << " MiB cached" << endl;
+}
+
+// ________________________________________________________ Arguments
+
+// Reader and writer threads of a batch unless --io-threads says otherwise
+const int DEFAULT_IO_THREADS = 2;
+
+// Options and files given on the command line
+struct CommandLine
+{
+    bool help;
+    bool show_stats;
+    bool bench;
+    bool trace_summary;
+    bool indexed; // --indexed: write 1, 4 or 8 bit BMPs when the result has few colours
+    bool rle;     // --rle: as --indexed, run length encoded where that is smaller
+    bool preallocate; // --preallocate: reserve each output's full size before writing it
+    bool mmap_output; // --mmap-output: write outputs through a shared mapping of the file
+    int threads;       // 0 keeps the default
+    int io_threads;    // readers and writers of a batch; 0 reads, runs and writes one file at a time
+    int memory_mb;     // --memory, 0 keeps the default
+    int pyramid;       // --pyramid levels, 0 for none
+    int cache_mb;      // --cache-mb, 0 keeps the default
+    int image_cache_mb; // --image-cache, 0 keeps the default
+    string spec;       // --pipeline
+    string cache_dir;  // --cache, empty keeps the default
+    string serve;      // --serve socket, empty when not serving
+    string connect;    // --connect socket, empty when not a client
+    string output_dir; // -o, empty for the single file form
+    string trace_file; // --trace, empty for no trace file
+    string blend;      // --blend mode, empty when not blending
+    vector<double> weights; // --weights
+    vector<string> files;
+    BenchOptions bench_options; // --sizes, --thread-counts, --simd-levels, --repeat, --json
+
+    CommandLine()
+        : help(false), show_stats(false), bench(false), trace_summary(false), indexed(false), rle(false),
+          preallocate(false), mmap_output(false), threads(0), io_threads(DEFAULT_IO_THREADS), memory_mb(0), pyramid(0), cache_mb(0),
+          image_cache_mb(0)
+    {
+    }
+};
+
+/**
+ * Description: Parses a comma separated list of positive numbers
+ * @param string list
+ * @param vector that receives the numbers
+ * @return true if every entry was a positive number
+ */
+
+bool parse_number_list(const string &list, vector<int> &numbers)
+{
+    numbers.clear();
+    stringstream stream(list);
+    string entry;
+    while (getline(stream, entry, ','))
+    {
+        if (entry.empty() || entry.find_first_not_of("0123456789") != string::npos || atoi(entry.c_str()) < 1)
+        {
+            return false;
+        }
+        numbers.push_back(atoi(entry.c_str()));
+    }
+    return !numbers.empty();
+}
+
+/**
+ * Description: Parses a comma separated list of non-negative numbers
+ * @param string list
+ * @param vector that receives the numbers
+ * @return true if every entry was a non-negative number
+ */
+
+bool parse_weight_list(const string &list, vector<double> &weights)
+{
+    weights.clear();
+    stringstream stream(list);
+    string entry;
+    while (getline(stream, entry, ','))
+    {
+        char *end;
+        double weight = strtod(entry.c_str(), &end);
+        if (entry.empty() || *end != '\0' || !(weight >= 0))
+        {
+            return false;
+        }
+        weights.push_back(weight);
+    }
+    return !weights.empty();
+}
+
+/**
+ * Description: Parses a comma separated list of SIMD level names
+ * @param string list
+ * @param vector that receives the levels
+ * @return true if every entry was a known level
+ */
+
+bool parse_simd_level_list(const string &list, vector<SimdLevel> &levels)
+{
+    levels.clear();
+    stringstream stream(list);
+    string entry;
+    while (getline(stream, entry, ','))
+    {
+        SimdLevel level;
+        if (!parse_simd_level(entry, level))
+        {
+            return false;
+        }
+        levels.push_back(level);
+    }
+    return !levels.empty();
+}
 
-            max_color = rgb_max(red, green, blue);
-            sum_color = red + green + blue;
+/**
+ * Description: Reads the command line options. Options may come in any order; everything that is
+ * not an option is a file.
+ * @param vector of argument strings, without the program name
+ * @param CommandLine that receives the options
+ * @param string that receives a message if the arguments are invalid
+ * @return true if the arguments were valid
+ */
 
-            if (sum_color > 549)
+bool parse_command_line(const vector<string> &args, CommandLine &command, string &error)
+{
+    for (size_t i = 0; i < args.size(); i++)
+    {
+        const string &arg = args[i];
+        if (arg == "--help" || arg == "-h")
+        {
+            command.help = true;
+        }
+        else if (arg == "--stats")
+        {
+            command.show_stats = true;
+        }
+        else if (arg == "--bench")
+        {
+            command.bench = true;
+        }
+        else if (arg == "--trace-summary")
+        {
+            command.trace_summary = true;
+        }
+        else if (arg == "--indexed")
+        {
+            command.indexed = true;
+        }
+        else if (arg == "--rle")
+        {
+            command.rle = true;
+        }
+        else if (arg == "--preallocate")
+        {
+            command.preallocate = true;
+        }
+        else if (arg == "--mmap-output")
+        {
+            command.mmap_output = true;
+        }
+        else if (arg == "--threads" || arg == "--io-threads" || arg == "--pipeline" || arg == "-o" ||
+                 arg == "--sizes" || arg == "--thread-counts" || arg == "--simd-levels" || arg == "--repeat" ||
+                 arg == "--json" || arg == "--trace" || arg == "--blend" || arg == "--weights" ||
+                 arg == "--memory" || arg == "--pyramid" || arg == "--cache" || arg == "--cache-mb" ||
+                 arg == "--serve" || arg == "--connect" || arg == "--image-cache")
+        {
+            if (i + 1 == args.size())
+            {
+                error = arg + " needs a value";
+                return false;
+            }
+            const string &value = args[++i];
+            if (arg == "--threads")
+            {
+                command.threads = atoi(value.c_str());
+                if (command.threads < 1)
+                {
+                    error = "--threads needs a positive number, got \"" + value + "\"";
+                    return false;
+                }
+            }
+            else if (arg == "--io-threads")
+            {
+                command.io_threads = atoi(value.c_str());
+                if (command.io_threads < 0 || value.find_first_not_of("0123456789") != string::npos)
+                {
+                    error = "--io-threads needs a number, got \"" + value + "\"";
+                    return false;
+                }
+            }
+            else if (arg == "--memory")
+            {
+                command.memory_mb = atoi(value.c_str());
+                if (command.memory_mb < 1)
+                {
+                    error = "--memory needs a positive number of MiB, got \"" + value + "\"";
+                    return false;
+                }
+            }
+            else if (arg == "--pyramid")
+            {
+                command.pyramid = value == "all" ? INT_MAX : atoi(value.c_str());
+                if (command.pyramid < 1)
+                {
+                    error = "--pyramid needs a positive number of levels or \"all\", got \"" + value + "\"";
+                    return false;
+                }
+            }
+            else if (arg == "--cache-mb" || arg == "--image-cache")
+            {
+                int &megabytes = arg == "--cache-mb" ? command.cache_mb : command.image_cache_mb;
+                megabytes = atoi(value.c_str());
+                if (megabytes < 1)
+                {
+                    error = arg + " needs a positive number of MiB, got \"" + value + "\"";
+                    return false;
+                }
+            }
+            else if (arg == "--serve")
+            {
+                command.serve = value;
+            }
+            else if (arg == "--connect")
+            {
+                command.connect = value;
+            }
+            else if (arg == "--cache")
+            {
+                command.cache_dir = value;
+            }
+            else if (arg == "--pipeline")
+            {
+                command.spec = value;
+            }
+            else if (arg == "--sizes" || arg == "--thread-counts")
+            {
+                vector<int> &numbers =
+                    arg == "--sizes" ? command.bench_options.sizes : command.bench_options.thread_counts;
+                if (!parse_number_list(value, numbers))
+                {
+                    error = arg + " needs a list of positive numbers, got \"" + value + "\"";
+                    return false;
+                }
+            }
+            else if (arg == "--simd-levels")
+            {
+                if (!parse_simd_level_list(value, command.bench_options.simd_levels))
+                {
+                    error = "--simd-levels needs a list of scalar, sse4.1, avx2 or avx512, got \"" + value + "\"";
+                    return false;
+                }
+            }
+            else if (arg == "--repeat")
+            {
+                command.bench_options.repeat = atoi(value.c_str());
+                if (command.bench_options.repeat < 1)
+                {
+                    error = "--repeat needs a positive number, got \"" + value + "\"";
+                    return false;
+                }
+            }
+            else if (arg == "--json")
             {
-                new_red = 255;
-                new_green = 255;
-                new_blue = 255;
+                command.bench_options.json_file = value;
             }
-            else if (sum_color < 151)
+            else if (arg == "--trace")
             {
-                new_red = 0;
-                new_green = 0;
-                new_blue = 0;
+                command.trace_file = value;
             }
-            else if (max_color == red)
+            else if (arg == "--blend")
             {
-                new_red = 255;
-                new_green = 0;
-                new_blue = 0;
+                command.blend = value;
             }
-            else if (max_color == green)
+            else if (arg == "--weights")
             {
-                new_red = 0;
-                new_green = 255;
-                new_blue = 0;
+                if (!parse_weight_list(value, command.weights))
+                {
+                    error = "--weights needs a list of non-negative numbers, got \"" + value + "\"";
+                    return false;
+                }
             }
-            else if (max_color == blue)
+            else
             {
-                new_red = 0;
-                new_green = 0;
-                new_blue = 255;
+                command.output_dir = value;
             }
-            new_img[row][col].red = new_red;
-            new_img[row][col].green = new_green;
-            new_img[row][col].blue = new_blue;
+        }
+        else if (arg.size() > 1 && arg[0] == '-')
+        {
+            error = "unknown option \"" + arg + "\"";
+            return false;
+        }
+        else
+        {
+            command.files.push_back(arg);
         }
     }
-    return new_img;
+    return true;
 }
 
-// ________________________________________________________ Process 11 Mirror Horizontally
-
 /**
- * Description: Flips the image horizontally to make a mirrored image
- * @param 2d vector of type Pixel
- * @return a new 2d vector of type pixel modified
+ * Description: Expands wildcard patterns among the input files, for job runners that pass
+ * arguments without a shell. Other names, and patterns that match nothing, are kept as they are
+ * so the error names them.
+ * @param vector of file names and patterns
+ * @return vector of file names
  */
 
-vector<vector<Pixel>> process_11(const vector<vector<Pixel>> &image)
+vector<string> expand_inputs(const vector<string> &patterns)
 {
-    int height = image.size();
-    int width = image[0].size();
-    vector<vector<Pixel>> new_img(height, vector<Pixel>(width));
-
-    for (int row = 0; row < height; row++)
+    vector<string> files;
+    for (size_t i = 0; i < patterns.size(); i++)
     {
-        for (int col = 0; col < width; col++)
+#ifdef IMGPROC_POSIX
+        glob_t matches;
+        if (patterns[i].find_first_of("*?[") != string::npos && glob(patterns[i].c_str(), 0, NULL, &matches) == 0)
         {
-            new_img[row][width - col - 1] = image[row][col];
+            files.insert(files.end(), matches.gl_pathv, matches.gl_pathv + matches.gl_pathc);
+            globfree(&matches);
+            continue;
         }
+#endif
+        files.push_back(patterns[i]);
     }
-    return new_img;
+    return files;
 }
 
-// ________________________________________________________ Process 12 Mirror Vertically
-
 /**
- * Description: Flips the image vertically to make a mirrored image
- * @param 2d vector of type Pixel
- * @return a new 2d vector of type pixel modified
+ * Description: Builds the output name of an input in batch mode
+ * @param string output directory
+ * @param string input file name
+ * @return string, the directory joined with the input's file name
  */
 
-vector<vector<Pixel>> process_12(const vector<vector<Pixel>> &image)
+string batch_output_path(const string &output_dir, const string &input)
 {
-    int height = image.size();
-    int width = image[0].size();
-    vector<vector<Pixel>> new_img(height, vector<Pixel>(width));
-
-    for (int row = 0; row < height; row++)
+    size_t slash = input.find_last_of('/');
+    string name = slash == string::npos ? input : input.substr(slash + 1);
+    if (output_dir.empty() || output_dir[output_dir.size() - 1] == '/')
     {
-        for (int col = 0; col < width; col++)
-        {
-            new_img[height - row - 1][col] = image[row][col];
-        }
+        return output_dir + name;
     }
-    return new_img;
+    return output_dir + "/" + name;
 }
 
-// ________________________________________________________ Process 13 Mix 2 images
+// ________________________________________________________ Batch
 
 /**
- * Description: Blends two images together by averaging the pixels
- * @param 2d vector of type Pixel
- * @param 2d vector of type Pixel for image B
- * @return a new 2d vector of type pixel modified
+ * Description: Lists the files a batch writes for one input: its output and, with pyramid levels,
+ * the level files beside it. How many levels there are depends on the size of the result, which
+ * is worked out from the input's header; an input whose header is unreadable claims only its
+ * output (it fails before writing anything else).
+ * @param string input BMP filename
+ * @param string output BMP filename
+ * @param vector of PipelineStage from plan_pipeline
+ * @param int most pyramid levels to write, 0 for none
+ * @return vector of file names, the output first
  */
 
-vector<vector<Pixel>> process_13(const vector<vector<Pixel>> &image, const vector<vector<Pixel>> &image_B)
+vector<string> batch_output_names(const string &input, const string &output, const vector<PipelineStage> &stages,
+                                  int pyramid_levels)
 {
-    int height = image.size();
-    int width = image[0].size();
-    int height_B = image_B.size();
-    int width_B = image_B[0].size();
-    vector<vector<Pixel>> new_img(height, vector<Pixel>(width));
-
-    if (height != height_B || width != width_B)
+    vector<string> names(1, output);
+    BmpInfo info;
+    if (pyramid_levels == 0 || read_bmp_info(input, info) != BMP_OK ||
+        !pipeline_size_fits(stages, info.width, info.height))
     {
-        return new_img;
+        return names;
     }
-
-    int red_A;
-    int green_A;
-    int blue_A;
-    int red_B;
-    int green_B;
-    int blue_B;
-
-    for (int row = 0; row < height; row++)
+    int width = info.width;
+    int height = info.height;
+    for (size_t i = 0; i < stages.size(); i++)
     {
-        for (int col = 0; col < width; col++)
-        {
-            red_A = image[row][col].red;
-            green_A = image[row][col].green;
-            blue_A = image[row][col].blue;
-            red_B = image_B[row][col].red;
-            green_B = image_B[row][col].green;
-            blue_B = image_B[row][col].blue;
-
-            new_img[row][col].red = (red_A + red_B) / 2;
-            new_img[row][col].green = (green_A + green_B) / 2;
-            new_img[row][col].blue = (blue_A + blue_B) / 2;
-        }
+        stage_output_size(stages[i], width, height, width, height);
     }
-    return new_img;
+    int levels = pyramid_level_count(width, height, pyramid_levels);
+    for (int level = 1; level <= levels; level++)
+    {
+        names.push_back(pyramid_level_name(output, level));
+    }
+    return names;
 }
 
-// ________________________________________________________ Process 14 Weighted Mix 2 images
-
 /**
- * Description: Blends two images together by computing weights and averaging the pixels
- * @param 2d vector of type Pixel
- * @param 2d vector of type Pixel for image B
- * @param floating point weight, between 0 and 1.
- * @param floating point weight, between 0 and 1.
- * @return a new 2d vector of type pixel modified
+ * Description: Runs one pipeline over many files. The plan, the thread pool and the image
+ * buffers are shared by the whole batch, and reading and writing overlap the processing. A file
+ * that fails is reported and the batch goes on. An input that would write a file an earlier input
+ * writes (its output, or a pyramid level) fails without running, since it would replace that one.
+ * @param string program name for messages
+ * @param vector of PipelineStage from plan_pipeline
+ * @param vector of input file names
+ * @param string output directory, created if missing
+ * @param int reader and writer threads, 0 for one file at a time
+ * @param BmpWriteOptions for the outputs
+ * @param int most pyramid levels to write below each output, 0 for none
+ * @param ResultCache to answer from and add to when it is open
+ * @return process exit code, 0 if every file succeeded and 1 otherwise
  */
 
-vector<vector<Pixel>> process_14(const vector<vector<Pixel>> &image, const vector<vector<Pixel>> &image_B, double weight_A, double weight_B)
+int run_batch(const string &program, const vector<PipelineStage> &stages, const vector<string> &inputs,
+              const string &output_dir, int io_threads, const BmpWriteOptions &write_options, int pyramid_levels,
+              ResultCache &cache)
 {
-    int height = image.size();
-    int width = image[0].size();
-    int height_B = image_B.size();
-    int width_B = image_B[0].size();
-    vector<vector<Pixel>> new_img(height, vector<Pixel>(width));
-
-    if (height != height_B || width != width_B)
+#ifdef IMGPROC_POSIX
+    if (mkdir(output_dir.c_str(), 0777) != 0 && errno != EEXIST)
     {
-        return new_img;
+        cerr << program << ": cannot create " << output_dir << ": " << strerror(errno) << endl;
+        return 1;
     }
+#endif
 
-    int red_A;
-    int green_A;
-    int blue_A;
-    int red_B;
-    int green_B;
-    int blue_B;
+    vector<string> outputs;
+    for (size_t i = 0; i < inputs.size(); i++)
+    {
+        outputs.push_back(batch_output_path(output_dir, inputs[i]));
+    }
 
-    for (int row = 0; row < height; row++)
+    // Inputs whose files have the same names would overwrite each other's, possibly from two writer
+    // threads at once, so only the first of them runs. claimed holds the running inputs' files,
+    // sorted by name.
+    vector<pair<string, size_t>> claimed;
+    vector<size_t> first_with_output(inputs.size());
+    vector<string> collision(inputs.size());
+    for (size_t i = 0; i < inputs.size(); i++)
     {
-        for (int col = 0; col < width; col++)
+        vector<string> names = batch_output_names(inputs[i], outputs[i], stages, pyramid_levels);
+        first_with_output[i] = i;
+        for (size_t n = 0; n < names.size() && first_with_output[i] == i; n++)
+        {
+            vector<pair<string, size_t>>::iterator at =
+                lower_bound(claimed.begin(), claimed.end(), make_pair(names[n], size_t(0)));
+            if (at != claimed.end() && at->first == names[n])
+            {
+                first_with_output[i] = at->second;
+                collision[i] = names[n];
+            }
+        }
+        for (size_t n = 0; n < names.size() && first_with_output[i] == i; n++)
+        {
+            pair<string, size_t> name(names[n], i);
+            claimed.insert(lower_bound(claimed.begin(), claimed.end(), name), name);
+        }
+    }
+    vector<size_t> runs;
+    vector<string> run_inputs;
+    vector<string> run_outputs;
+    for (size_t i = 0; i < inputs.size(); i++)
+    {
+        if (first_with_output[i] == i)
         {
-            red_A = image[row][col].red * weight_A;
-            green_A = image[row][col].green * weight_A;
-            blue_A = image[row][col].blue * weight_A;
-            red_B = image_B[row][col].red * weight_B;
-            green_B = image_B[row][col].green * weight_B;
-            blue_B = image_B[row][col].blue * weight_B;
+            runs.push_back(i);
+            run_inputs.push_back(inputs[i]);
+            run_outputs.push_back(outputs[i]);
+        }
+    }
+    vector<BmpStatus> run_statuses =
+        cache.is_open() ? run_pipeline_files_cached(cache, run_inputs, run_outputs, stages, io_threads, write_options,
+                                                    pyramid_levels)
+                        : run_pipeline_files(run_inputs, run_outputs, stages, io_threads, write_options, pyramid_levels);
+    vector<BmpStatus> statuses(inputs.size(), BMP_OK);
+    for (size_t j = 0; j < runs.size(); j++)
+    {
+        statuses[runs[j]] = run_statuses[j];
+    }
 
-            new_img[row][col].red = (red_A + red_B) / 2;
-            new_img[row][col].green = (green_A + green_B) / 2;
-            new_img[row][col].blue = (blue_A + blue_B) / 2;
+    size_t failed = 0;
+    for (size_t i = 0; i < inputs.size(); i++)
+    {
+        if (first_with_output[i] != i)
+        {
+            cerr << program << ": " << inputs[i] << ": output " << collision[i] << " would replace the one for "
+                 << inputs[first_with_output[i]] << endl;
+            failed++;
+        }
+        else if (statuses[i] != BMP_OK)
+        {
+            const string &name = statuses[i] == BMP_WRITE_FAILED ? outputs[i] : inputs[i];
+            cerr << program << ": " << name << ": " << bmp_status_message(statuses[i]) << endl;
+            failed++;
         }
     }
-    return new_img;
+    if (failed > 0)
+    {
+        cerr << program << ": " << failed << " of " << inputs.size() << " images failed" << endl;
+    }
+    return failed == 0 ? 0 : 1;
 }
 
-//***************************************************************************************************//
-// HELPER FUNCTIONS FOR APPLICATION
-//***************************************************************************************************//
-
-// ________________________________________________________ Selection -> Process Image Function
-
 /**
- * Description: Takes user selection and processes image.  Prompts user if additional info needed.
- * @param 2d vector of type Pixel
- * @param int number for selecting process
- * @return a new 2d vector of type pixel modified
+ * Description: Runs the non-interactive command line mode
+ * @param int argument count from main
+ * @param array of argument strings from main
+ * @return process exit code: 0 on success, 1 if an image failed, 2 for usage errors
  */
 
-vector<vector<Pixel>> process_image(vector<vector<Pixel>> image, int name_idx)
+int run_command_line(int argc, char *argv[])
 {
-    vector<vector<Pixel>> new_image;
-    if (name_idx == 1)
-    {
-        new_image = process_1(image);
-    }
-    else if (name_idx == 2)
+    string program = argv[0];
+    CommandLine command;
+    string error;
+    if (!parse_command_line(vector<string>(argv + 1, argv + argc), command, error))
     {
-        double scaling_factor;
-        cout << "Enter Scaling Factor: ";
-        cin >> scaling_factor;
-        new_image = process_2(image, scaling_factor);
-    }
-    else if (name_idx == 3)
-    {
-        new_image = process_3(image);
+        cerr << program << ": " << error << endl;
+        return 2;
     }
-    else if (name_idx == 4)
+
+    bool batch = !command.output_dir.empty();
+    bool blend = !command.blend.empty();
+    bool serve = !command.serve.empty();
+    bool client = !command.connect.empty();
+    bool pipeline = !command.spec.empty() || command.pyramid > 0;
+    bool standalone = !batch && !blend && command.pyramid == 0;
+    bool usable = command.bench;
+    if (serve || client)
     {
-        new_image = process_4(image);
+        usable = usable || (standalone && (serve ? command.files.empty() && !client : command.files.size() == 2));
     }
-    else if (name_idx == 5)
+    else
     {
-        int num_rotations;
-        cout << "Enter integer of 90 degree rotations: ";
-        cin >> num_rotations;
-        new_image = process_5(image, num_rotations);
+        usable = usable || (blend ? !pipeline && !batch && command.files.size() >= 2
+                                  : pipeline && (batch ? !command.files.empty() : command.files.size() == 2));
     }
-    else if (name_idx == 6)
+    if (command.help || !usable)
     {
-        double x_scale;
-        double y_scale;
-        cout << "Enter X Scale: ";
-        cin >> x_scale;
-        cout << "Enter Y Scale: ";
-        cin >> y_scale;
-        new_image = process_6(image, x_scale, y_scale);
+        print_usage(program);
+        return command.help ? 0 : 2;
     }
-    else if (name_idx == 7)
+
+    vector<PipelineStage> stages;
+    BmpWriteOptions write_options;
+    BlendOptions blend_options;
+    vector<string> blend_inputs;
+    if (blend)
     {
-        new_image = process_7(image);
+        if (!parse_blend_mode(command.blend, blend_options.mode))
+        {
+            cerr << program << ": unknown blend mode \"" << command.blend << "\"" << endl;
+            return 2;
+        }
+        blend_inputs = expand_inputs(vector<string>(command.files.begin(), command.files.end() - 1));
+        blend_options.weights = command.weights;
+        double total_weight = 0;
+        for (size_t i = 0; i < command.weights.size(); i++)
+        {
+            total_weight += command.weights[i];
+        }
+        if (int(blend_inputs.size()) > BLEND_MAX_FRAMES)
+        {
+            cerr << program << ": --blend takes at most " << BLEND_MAX_FRAMES << " inputs" << endl;
+            return 2;
+        }
+        if (blend_options.mode == BLEND_WEIGHTED &&
+            (command.weights.size() != blend_inputs.size() || total_weight <= 0))
+        {
+            cerr << program << ": --blend weighted needs one --weights entry per input, with a positive total" << endl;
+            return 2;
+        }
     }
-    else if (name_idx == 8)
+    else if (!command.bench && !serve && !client)
     {
-        double scaling_factor;
-        cout << "Enter Scaling Factor: ";
-        cin >> scaling_factor;
-        new_image = process_8(image, scaling_factor);
+        vector<Operation> ops;
+        // --pyramid on its own copies the input and writes its levels
+        if (!command.spec.empty() && !parse_pipeline(command.spec, ops, error))
+        {
+            cerr << program << ": " << error << endl;
+            return 2;
+        }
+        stages = plan_pipeline(ops);
+        if (command.indexed || command.rle)
+        {
+            write_options = indexed_write_options(stages);
+            write_options.rle = command.rle;
+        }
+        write_options.preallocate = command.preallocate;
+        write_options.use_mmap = command.mmap_output;
     }
-    else if (name_idx == 9)
+    if (command.threads > 0)
     {
-        double scaling_factor;
-        cout << "Enter Scaling Factor: ";
-        cin >> scaling_factor;
-        new_image = process_9(image, scaling_factor);
+        set_thread_count(command.threads);
     }
-    else if (name_idx == 10)
+    if (command.memory_mb > 0)
     {
-        new_image = process_10(image);
+        memory_budget() = size_t(command.memory_mb) << 20;
     }
-    else if (name_idx == 11)
+    ResultCache cache;
+    const char *cache_variable = getenv("IMGPROC_CACHE");
+    string cache_dir = !command.cache_dir.empty() || cache_variable == NULL ? command.cache_dir : cache_variable;
+    if (pipeline && !blend && !command.bench && !cache_dir.empty())
     {
-        new_image = process_11(image);
+        const char *limit_variable = getenv("IMGPROC_CACHE_MB");
+        uint64_t limit = command.cache_mb > 0                                  ? uint64_t(command.cache_mb) << 20
+                         : limit_variable != NULL && atoi(limit_variable) > 0 ? uint64_t(atoi(limit_variable)) << 20
+                                                                               : DEFAULT_CACHE_BYTES;
+        if (!cache.open(cache_dir, limit))
+        {
+            // The results are still right without the cache, so the run goes on
+            cerr << program << ": cannot open result cache " << cache_dir << ": " << strerror(errno) << endl;
+        }
     }
-    else if (name_idx == 12)
+    bool traced = !command.trace_file.empty() || command.trace_summary;
+    if (traced)
     {
-        new_image = process_12(image);
+        trace_thread_name() = "main";
+        start_tracing();
     }
-    return new_image;
-}
-
-// ________________________________________________________ Check Valid Input
-
-/**
- * Description: Checks if the user's selection is valid
- * @param string, user's selection
- * @return true if valid selection, false if invalid.
- */
 
-bool check_valid_input(string input)
-{
-    string valid_inputs[] = {"0", "1", "2", "3", "4", "5", "6", "7", "8", "9", "10", "11", "12", "13", "14"};
-    for (int i = 0; i < 15; i++)
+    int exit_code = 0;
+    if (command.bench)
     {
-        if (input == valid_inputs[i])
-        {
-            return true;
-        }
+        command.bench_options.images = expand_inputs(command.files);
+        exit_code = run_benchmarks(program, command.bench_options);
     }
-    return false;
-}
-
-// ________________________________________________________ Get filename
-
-/**
- * Description: get's name of image for processing and returns it
- * @param
- * @return string, filename
- */
-
-string get_filename()
-{
-    string filename;
-    cout << "input BMP filename: ";
-    cin >> filename;
-    return filename;
-}
-
-// ________________________________________________________ Print Menu Options
-
-/**
- * Description: Prints out menu options for user
- * @param string filename to insert in the first selection
- * @return
- */
-
-void menu_options(string filename)
-{
-    cout << "" << endl;
-    cout << "IMAGE PROCESSING MENU" << endl;
-    cout << "0) Change image (current: " << filename << ")" << endl;
-    cout << "1) Vignette" << endl;
-    cout << "2) Clarendon" << endl;
-    cout << "3) Grayscale" << endl;
-    cout << "4) Rotate 90 degrees" << endl;
-    cout << "5) Rotate multiple 90 degrees" << endl;
-    cout << "6) Enlarge" << endl;
-    cout << "7) High contrast" << endl;
-    cout << "8) Lighten" << endl;
-    cout << "9) Darken" << endl;
-    cout << "10) Black, white, red, green, blue" << endl;
-    cout << "11) Mirror Horizontally" << endl;
-    cout << "12) Mirror Vertically" << endl;
-    cout << "13) Blend 2 images" << endl;
-    cout << "14) Weighted Blend of 2 images" << endl;
-    cout << "" << endl;
-    cout << "Enter menu selection (Q to quit): ";
-}
-//***************************************************************************************************//
-// Application
-//***************************************************************************************************//
-
-/**
- * Description: Handles important variables, control flow for implementing application with helper
- * function calls and reading/writing image.
- * @param
- * @return string with success or failure message
- */
-
-string application()
-{
-
-    string filename;
-    string selection;
-    int name_idx;
-    string output_name;
-
-    string process_names[] = {"rename file", "Vignette", "Clarendon", "Grayscale", "Rotate 90 degrees", "Rotate multiple 90 degrees", "Enlarge", "High contrast", "Lighten", "Darken", "Black, white, red, green, blue", "Mirror Horizontally", "Mirror Vertically", "Blend 2 images", "Weighted blend of images"};
-
-    filename = get_filename();
-
-    menu_options(filename);
-
-    cin >> selection;
-
-    if (selection == "Q")
+    else if (serve)
     {
-        return "\nThank you for using my program!\nQuitting... \n\n";
+        size_t image_cache_bytes = command.image_cache_mb > 0 ? size_t(command.image_cache_mb) << 20
+                                                              : memory_budget() / IMAGE_CACHE_SHARE;
+        exit_code = run_server(program, command.serve, image_cache_bytes);
     }
-    if (check_valid_input(selection) == false)
+    else if (client)
     {
-        cout << "Please provide valid input!" << endl;
-        return application();
+        exit_code = run_client(program, command.connect, command.spec, command.indexed, command.rle, command.files[0],
+                               command.files[1]);
     }
-
-    if (selection == "0")
+    else if (blend)
     {
-        cout << "Change image Selected!";
-        return application();
+        int failed_input;
+        BmpStatus status = blend_files(blend_inputs, command.files.back(), blend_options, failed_input);
+        if (status != BMP_OK)
+        {
+            const string &name = failed_input >= 0 ? blend_inputs[failed_input] : command.files.back();
+            cerr << program << ": " << name << ": " << bmp_status_message(status) << endl;
+            exit_code = 1;
+        }
     }
-
-    if (check_valid_input(selection))
+    else if (batch)
     {
-        name_idx = stoi(selection);
-        cout << process_names[name_idx] << " selected" << endl;
+        exit_code = run_batch(program, stages, expand_inputs(command.files), command.output_dir, command.io_threads,
+                              write_options, command.pyramid, cache);
     }
-    // ________________________________________________________________ optional stuff starts here
-    if (name_idx == 13)
+    else
     {
-        string filename_B;
-        cout << "input BMP filename for 2nd image, must match size! ";
-        cin >> filename_B;
-        cout << "Enter output BMP filename: ";
-        cin >> output_name;
-        vector<vector<Pixel>> image = read_image(filename);
-        vector<vector<Pixel>> image_B = read_image(filename_B);
-        if (image.size() != image_B.size() || image[0].size() != image_B[0].size())
+        Image image;
+        PipelineBuffers buffers;
+        BmpStatus status;
+        if (cache.is_open())
         {
-            cout << "image sizes do not match!!!";
-            application();
+            vector<string> input(1, command.files[0]);
+            vector<string> output(1, command.files[1]);
+            status = run_pipeline_files_cached(cache, input, output, stages, 0, write_options, command.pyramid)[0];
+        }
+        else
+        {
+            status = run_pipeline_file(command.files[0], command.files[1], stages, image, buffers, write_options,
+                                       command.pyramid);
+        }
+        if (status != BMP_OK)
+        {
+            cerr << program << ": " << command.files[0] << ": " << bmp_status_message(status) << endl;
+            exit_code = 1;
         }
-        vector<vector<Pixel>> new_image = process_13(image, image_B);
-        write_image(output_name, new_image);
-        return "Successfully applied " + process_names[name_idx] + "!";
     }
-    if (name_idx == 14)
-    {
-        double weight_A;
-        cout << "input weight for first image, weights must add to 1: ";
-        cin >> weight_A;
-        string filename_B;
-        cout << "input BMP filename for 2nd image, must match size! ";
-        cin >> filename_B;
-        double weight_B;
-        cout << "input weight for second image, weights must add to 1: ";
-        cin >> weight_B;
 
-        if (weight_A + weight_B != 1.0)
+    if (traced)
+    {
+        stop_tracing();
+        if (!command.trace_file.empty() && !write_chrome_trace(command.trace_file))
         {
-            cout << "weights do not equal 1!\n\n";
-            return application();
+            cerr << program << ": cannot write " << command.trace_file << endl;
+            exit_code = 1;
         }
-
-        cout << "Enter output BMP filename: ";
-        cin >> output_name;
-        vector<vector<Pixel>> image = read_image(filename);
-        vector<vector<Pixel>> image_B = read_image(filename_B);
-        if (image.size() != image_B.size() || image[0].size() != image_B[0].size())
+        if (command.trace_summary)
         {
-            cout << "image sizes do not match!!!";
-            application();
+            print_trace_summary(cerr);
         }
-        vector<vector<Pixel>> new_image = process_14(image, image_B, weight_A, weight_B);
-        write_image(output_name, new_image);
-        return "Successfully applied " + process_names[name_idx] + "!";
     }
-    // ________________________________________________________________ optional stuff ends here
-
-    cout << "Enter output BMP filename: ";
-    cin >> output_name;
-
-    vector<vector<Pixel>> image = read_image(filename);
-
-    vector<vector<Pixel>> new_image = process_image(image, name_idx);
-
-    write_image(output_name, new_image);
-
-    return "Successfully applied " + process_names[name_idx] + "!";
+    if (command.show_stats)
+    {
+        print_allocation_stats();
+        if (cache.is_open())
+        {
+            print_cache_stats(cache);
+        }
+    }
+    return exit_code;
 }
 
 // ________________________________________________________ MAIN FUNCTION
 
-int main()
+int main(int argc, char *argv[])
 {
+    if (argc > 1)
+    {
+        return run_command_line(argc, argv);
+    }
 
     cout << "CSPB 1300 Image Processing Application" << endl;
     string message = application();